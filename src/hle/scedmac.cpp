@@ -20,7 +20,11 @@ static int sceDmacMemcpy(uint32_t dst_addr, uint32_t src_addr, uint32_t size) {
 		return SCE_ERROR_INVALID_POINTER;
 	}
 
+	auto renderer = psp->GetRenderer();
+	renderer->SyncMemory(src_addr, size);
+	renderer->SyncMemory(dst_addr, size);
 	memcpy(dst, src, size);
+	renderer->ClearTextureCache(dst_addr, size);
 
 	if (size >= 272) {
 		int delay = size / 236;
@@ -50,7 +54,11 @@ static int sceDmacTryMemcpy(uint32_t dst_addr, uint32_t src_addr, uint32_t size)
 		return SCE_ERROR_BUSY;
 	}
 
+	auto renderer = psp->GetRenderer();
+	renderer->SyncMemory(src_addr, size);
+	renderer->SyncMemory(dst_addr, size);
 	memcpy(dst, src, size);
+	renderer->ClearTextureCache(dst_addr, size);
 
 	if (size >= 272) {
 		int delay = size / 236;
@@ -64,6 +64,7 @@ static int sceKernelDcacheInvalidateRange(uint32_t addr, uint32_t size) {
 		}
 
 		if (addr != 0) {
+			psp->GetRenderer()->SyncMemory(addr, size);
 			psp->GetRenderer()->ClearTextureCache(addr, size);
 		}
 	}
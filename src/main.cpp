@@ -43,15 +43,51 @@ int main(int argc, char* argv[]) {
     bool nearest_filtering = false;
     app.add_flag("-n,--nearest", nearest_filtering, "Enables nearest screen filtering instead of linear");
 
+    std::string cache_path = (std::filesystem::current_path().parent_path() / "cache").string();
+    app.add_option("-c,--cache", cache_path, "Path to the pipeline cache folder");
+
+    bool prewarm = false;
+    app.add_flag("-w,--prewarm", prewarm, "Compiles every cached pipeline before starting and reports how long each one took");
+
+    bool serial_rendering = false;
+    app.add_flag("-s,--serial", serial_rendering, "Rasterizes on the emulation thread instead of in parallel tiles (software renderer)");
+
+    uint64_t texture_budget = DEFAULT_TEXTURE_BUDGET / (1024 * 1024);
+    app.add_option("-t,--texture-budget", texture_budget, "Megabytes of texture memory kept resident before the least recently used textures are evicted (compute renderer)");
+
+    bool headless = false;
+    app.add_flag("--headless", headless, "Runs without a window or frame limiter, the compute renderer falls back to a CPU adapter without a GPU");
+
+    int capture_frames = 0;
+    auto frames_option = app.add_option("--frames", capture_frames, "Exits after this many frames")->check(CLI::PositiveNumber);
+
+    std::string dump_frame_path;
+    app.add_option("--dump-frame", dump_frame_path, "Saves the last frame as a BMP (compute renderer needs --headless)")->needs(frames_option);
+
+    bool frame_hash = false;
+    app.add_flag("--frame-hash", frame_hash, "Prints a hash of the last frame (compute renderer needs --headless)")->needs(frames_option);
+
     CLI11_PARSE(app, argc, argv);
 
     spdlog::set_level(level);
     
-    PSP psp(renderer_type, nearest_filtering);
+    PSP psp(renderer_type, nearest_filtering, !serial_rendering, texture_budget * 1024 * 1024, headless);
     if (!psp.LoadExec(elf_path)) {
         return 1;
     }
 
+    // Games share file names like EBOOT.PBP, so the disc ID or at least the folder tells them apart
+    auto game_name = psp.GetDiscID();
+    if (game_name.empty()) {
+        std::filesystem::path game_path(elf_path);
+        game_name = (game_path.has_filename() ? game_path.parent_path().filename() / game_path.filename() : game_path.parent_path().filename()).string();
+    }
+    psp.GetRenderer()->LoadPipelineCache(std::filesystem::path(cache_path) / game_name, prewarm);
+
+    if (capture_frames > 0) {
+        psp.GetRenderer()->CaptureFrame(capture_frames, dump_frame_path, frame_hash);
+    }
+
     if (!psp.LoadMemStick(memstick_path)) {
         return 1;
     }
@@ -23,7 +23,7 @@ std::vector<std::string> MEMORY_STICK_REQUIRED_FOLDERS = {
 	"PSP/SAVEDATA",
 };
 
-PSP::PSP(RendererType renderer_type, bool nearest_filtering) {
+PSP::PSP(RendererType renderer_type, bool nearest_filtering, bool tiled_rendering, uint64_t texture_budget, bool headless) {
 	instance = this;
 
 	if constexpr (!FASTMEM) {
@@ -65,6 +65,11 @@ PSP::PSP(RendererType renderer_type, bool nearest_filtering) {
 	kernel = std::make_unique<Kernel>();
 	cpu = std::make_unique<CPU>();
 
+	// The offscreen driver works without a display, the software renderer still gets a window to draw into
+	if (headless) {
+		SDL_SetHint(SDL_HINT_VIDEO_DRIVER, "offscreen");
+	}
+
 	if (!SDL_Init(SDL_INIT_VIDEO | SDL_INIT_GAMEPAD | SDL_INIT_AUDIO)) {
 		spdlog::error("PSP: SDL init error {}", SDL_GetError());
 		return;
@@ -93,10 +98,10 @@ PSP::PSP(RendererType renderer_type, bool nearest_filtering) {
 
 	switch (renderer_type) {
 	case RendererType::SOFTWARE:
-		renderer = std::make_unique<SoftwareRenderer>();
+		renderer = std::make_unique<SoftwareRenderer>(tiled_rendering, headless);
 		break;
 	case RendererType::COMPUTE:
-		renderer = std::make_unique<ComputeRenderer>(nearest_filtering);
+		renderer = std::make_unique<ComputeRenderer>(nearest_filtering, texture_budget, headless);
 		break;
 	}
 	RegisterHLE();
@@ -147,7 +152,6 @@ void PSP::Step() {
 }
 
 bool PSP::LoadExec(std::string path) {
-	std::string executable_path{};
 	std::filesystem::path fs_path(path);
 	if (!std::filesystem::exists(fs_path)) {
 		return false;
@@ -186,6 +190,58 @@ bool PSP::LoadExec(std::string path) {
 	return true;
 }
 
+// Reads DISC_ID from the disc's PARAM.SFO or the one embedded in a PBP, empty when there's none
+std::string PSP::GetDiscID() {
+	uint32_t sfo_offset = 0;
+	int fid = kernel->OpenFile("disc0:/PSP_GAME/PARAM.SFO", SCE_FREAD);
+	if (fid < 0) {
+		fid = kernel->OpenFile(executable_path, SCE_FREAD);
+		if (fid < 0) {
+			return {};
+		}
+
+		// PBP headers start with the magic, a version and the offset of PARAM.SFO
+		uint32_t header[3]{};
+		auto file = kernel->GetKernelObject<File>(fid);
+		if (file->Read(header, sizeof(header)) != sizeof(header) || header[0] != 0x50425000) {
+			kernel->RemoveKernelObject(fid);
+			return {};
+		}
+		sfo_offset = header[2];
+	}
+
+	auto file = kernel->GetKernelObject<File>(fid);
+	uint32_t header[5]{};
+	file->Seek(sfo_offset, SCE_SEEK_SET);
+	if (file->Read(header, sizeof(header)) != sizeof(header) || header[0] != 0x46535000) {
+		kernel->RemoveKernelObject(fid);
+		return {};
+	}
+
+	// Entries are a key offset and format (16 bit each), data length, maximum length and data offset
+	std::string disc_id{};
+	uint32_t key_table = header[2];
+	uint32_t data_table = header[3];
+	for (uint32_t i = 0; i < header[4] && disc_id.empty(); i++) {
+		uint32_t entry[4]{};
+		file->Seek(sfo_offset + sizeof(header) + i * sizeof(entry), SCE_SEEK_SET);
+		file->Read(entry, sizeof(entry));
+
+		char key[8]{};
+		file->Seek(sfo_offset + key_table + (entry[0] & 0xFFFF), SCE_SEEK_SET);
+		file->Read(key, sizeof(key));
+		if (memcmp(key, "DISC_ID", sizeof(key)) == 0 && entry[1] < 64) {
+			std::string value(entry[1], '\0');
+			file->Seek(sfo_offset + data_table + entry[3], SCE_SEEK_SET);
+			file->Read(value.data(), value.size());
+			disc_id = value.c_str();
+		}
+	}
+
+	kernel->RemoveKernelObject(fid);
+	return disc_id;
+}
+
 bool PSP::LoadMemStick(std::string path) {
 	memstick_path = path;
 	if (std::filesystem::is_regular_file(memstick_path)) {
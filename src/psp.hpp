@@ -39,7 +39,7 @@ struct ScheduledEvent {
 
 class PSP {
 public:
-	PSP(RendererType renderer_type, bool nearest_filtering);
+	PSP(RendererType renderer_type, bool nearest_filtering, bool tiled_rendering, uint64_t texture_budget, bool headless);
 	~PSP();
 
 	void Run();
@@ -47,6 +47,7 @@ public:
 
 	bool LoadExec(std::string path);
 	bool LoadMemStick(std::string path);
+	std::string GetDiscID();
 
 	SDL_Gamepad* GetController() { return controller; }
 	SDL_AudioStream* GetAudioStream() { return audio_stream; }
@@ -112,6 +113,7 @@ private:
 	std::unique_ptr<CPU> cpu;
 
 	std::filesystem::path memstick_path{};
+	std::string executable_path{};
 
 	SDL_Gamepad* controller{};
 	SDL_AudioStream* audio_stream{};
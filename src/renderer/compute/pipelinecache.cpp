@@ -0,0 +1,127 @@
+#include "pipelinecache.hpp"
+
+#include <cstring>
+#include <spdlog/spdlog.h>
+
+static bool ReadHeader(std::ifstream& file, uint64_t version) {
+	uint64_t header[2]{};
+	return file.read(reinterpret_cast<char*>(header), sizeof(header)) && header[0] == PIPELINE_CACHE_MAGIC && header[1] == version;
+}
+
+bool PipelineCache::Open(const std::filesystem::path& path, uint64_t version) {
+	std::lock_guard lock(mutex);
+
+	std::error_code error{};
+	std::filesystem::create_directories(path.parent_path(), error);
+	if (error) {
+		spdlog::error("PipelineCache: cannot create {}", path.parent_path().string());
+		return false;
+	}
+
+	auto pipeline_path = path;
+	pipeline_path += ".pipelines";
+	auto blob_path = path;
+	blob_path += ".blobs";
+
+	// Pipelines built before the cache was opened already handed their blobs over, they are written once the file is open
+	auto pending_blobs = std::move(blobs);
+	blobs.clear();
+
+	std::ifstream pipelines(pipeline_path, std::ios::binary);
+	std::ifstream blob_records(blob_path, std::ios::binary);
+	bool valid = ReadHeader(pipelines, version) && ReadHeader(blob_records, version);
+	if (!valid && (pipelines.is_open() || blob_records.is_open())) {
+		spdlog::info("PipelineCache: discarding {} written by another version", path.string());
+	}
+
+	uint64_t id = 0;
+	while (valid && pipelines.read(reinterpret_cast<char*>(&id), sizeof(id))) {
+		pipeline_ids.push_back(id);
+	}
+
+	// Blobs are stored as key size, value size, key and value, a torn record at the end is dropped
+	uint32_t sizes[2]{};
+	while (valid && blob_records.read(reinterpret_cast<char*>(sizes), sizeof(sizes))) {
+		std::string key(sizes[0], '\0');
+		std::vector<uint8_t> value(sizes[1]);
+		if (!blob_records.read(key.data(), key.size()) || !blob_records.read(reinterpret_cast<char*>(value.data()), value.size())) {
+			break;
+		}
+		blobs[std::move(key)] = std::move(value);
+	}
+
+	auto mode = std::ios::binary | (valid ? std::ios::app : std::ios::trunc);
+	pipeline_file.open(pipeline_path, mode);
+	blob_file.open(blob_path, mode);
+	if (!pipeline_file.is_open() || !blob_file.is_open()) {
+		spdlog::error("PipelineCache: cannot open {}", path.string());
+		blobs.merge(pending_blobs);
+		return false;
+	}
+
+	if (!valid) {
+		uint64_t header[2]{ PIPELINE_CACHE_MAGIC, version };
+		pipeline_file.write(reinterpret_cast<const char*>(header), sizeof(header));
+		blob_file.write(reinterpret_cast<const char*>(header), sizeof(header));
+		pipeline_file.flush();
+		blob_file.flush();
+	}
+
+	for (auto& [key, value] : pending_blobs) {
+		auto it = blobs.find(key);
+		if (it == blobs.end() || it->second != value) {
+			WriteBlob(key, value);
+			blobs[key] = std::move(value);
+		}
+	}
+
+	spdlog::info("PipelineCache: loaded {} pipelines and {} blobs", pipeline_ids.size(), blobs.size());
+	return true;
+}
+
+void PipelineCache::AddPipeline(uint64_t id) {
+	std::lock_guard lock(mutex);
+	if (pipeline_file.is_open()) {
+		pipeline_file.write(reinterpret_cast<const char*>(&id), sizeof(id));
+		pipeline_file.flush();
+	}
+}
+
+size_t PipelineCache::LoadData(const void* key, size_t key_size, void* value, size_t value_size, void* userdata) {
+	auto cache = reinterpret_cast<PipelineCache*>(userdata);
+	std::lock_guard lock(cache->mutex);
+
+	auto it = cache->blobs.find(std::string(reinterpret_cast<const char*>(key), key_size));
+	if (it == cache->blobs.end()) {
+		return 0;
+	}
+
+	// Dawn asks for the size first and then for the data
+	if (value && value_size >= it->second.size()) {
+		memcpy(value, it->second.data(), it->second.size());
+	}
+	return it->second.size();
+}
+
+void PipelineCache::StoreData(const void* key, size_t key_size, const void* value, size_t value_size, void* userdata) {
+	auto cache = reinterpret_cast<PipelineCache*>(userdata);
+	std::lock_guard lock(cache->mutex);
+
+	std::string blob_key(reinterpret_cast<const char*>(key), key_size);
+	auto data = reinterpret_cast<const uint8_t*>(value);
+	auto& blob = cache->blobs[blob_key];
+	blob.assign(data, data + value_size);
+	cache->WriteBlob(blob_key, blob);
+}
+
+void PipelineCache::WriteBlob(const std::string& key, const std::vector<uint8_t>& value) {
+	if (!blob_file.is_open()) {
+		return;
+	}
+
+	uint32_t sizes[2]{ static_cast<uint32_t>(key.size()), static_cast<uint32_t>(value.size()) };
+	blob_file.write(reinterpret_cast<const char*>(sizes), sizeof(sizes));
+	blob_file.write(key.data(), key.size());
+	blob_file.write(reinterpret_cast<const char*>(value.data()), value.size());
+	blob_file.flush();
+}
@@ -0,0 +1,34 @@
+#pragma once
+
+#include <cstdint>
+#include <filesystem>
+#include <fstream>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+// Leads both files, caches written for other shaders or ShaderID layouts are thrown away
+constexpr uint64_t PIPELINE_CACHE_MAGIC = 0x4548434150495050; // "PPIPACHE"
+
+// Remembers the pipelines a game used and the compiled blobs Dawn hands out, so later runs can build everything up front
+class PipelineCache {
+public:
+	bool Open(const std::filesystem::path& path, uint64_t version);
+	bool IsOpen() const { return pipeline_file.is_open(); }
+
+	const std::vector<uint64_t>& GetPipelineIDs() const { return pipeline_ids; }
+	void AddPipeline(uint64_t id);
+
+	// Dawn blob cache callbacks, these can be called from Dawn's worker threads
+	static size_t LoadData(const void* key, size_t key_size, void* value, size_t value_size, void* userdata);
+	static void StoreData(const void* key, size_t key_size, const void* value, size_t value_size, void* userdata);
+private:
+	void WriteBlob(const std::string& key, const std::vector<uint8_t>& value);
+
+	std::mutex mutex;
+	std::vector<uint64_t> pipeline_ids;
+	std::unordered_map<std::string, std::vector<uint8_t>> blobs;
+	std::ofstream pipeline_file;
+	std::ofstream blob_file;
+};
@@ -21,7 +21,57 @@ uint16_t QUAD_INDICES[]{
 	2, 1, 3
 };
 
-ComputeRenderer::ComputeRenderer(bool nearest_filtering) : Renderer() {
+static const char* PIPELINE_CONSTANT_NAMES[PIPELINE_CONSTANT_COUNT]{
+	"FRAMEBUFFER_FORMAT", "TEXTURE_FORMAT", "BILINEAR", "U_CLAMP",
+	"V_CLAMP", "CLUT_FORMAT", "BLEND_OPERATION", "BLEND_SOURCE",
+	"BLEND_DESTINATION", "ALPHA_FUNC", "USE_TEXTURE_ALPHA", "FRAGMENT_DOUBLE",
+	"TEXTURE_FUNCTION", "DEPTH_FUNC", "DEPTH_WRITE", "GOURAUD_SHADING"
+};
+
+static bool IsVRAM(uint32_t addr) {
+	addr &= 0x0FFFFFFF;
+	return addr >= VRAM_START && addr < VRAM_END;
+}
+
+// Rows of a surface that share bytes with [addr, addr_end)
+static bool GetSurfaceRows(uint64_t surface_addr, uint32_t pitch, uint64_t addr, uint64_t addr_end, uint32_t& first_row, uint32_t& last_row) {
+	uint64_t surface_end = surface_addr + static_cast<uint64_t>(pitch) * RENDER_SURFACE_HEIGHT;
+	if (pitch == 0 || addr >= surface_end || addr_end <= surface_addr) {
+		return false;
+	}
+
+	first_row = addr > surface_addr ? (addr - surface_addr) / pitch : 0;
+	last_row = addr_end < surface_end ? (addr_end - surface_addr + pitch - 1) / pitch : RENDER_SURFACE_HEIGHT;
+	return true;
+}
+
+static std::bitset<RENDER_SURFACE_HEIGHT> GetRowMask(uint32_t first_row, uint32_t last_row) {
+	std::bitset<RENDER_SURFACE_HEIGHT> mask{};
+	mask.set();
+	mask >>= RENDER_SURFACE_HEIGHT - (last_row - first_row);
+	mask <<= first_row;
+	return mask;
+}
+
+// Calls func(first_row, row_count) for every run of consecutive set rows
+template <typename Func>
+static void ForEachRowRun(const std::bitset<RENDER_SURFACE_HEIGHT>& rows, Func func) {
+	for (uint32_t row = 0; row < RENDER_SURFACE_HEIGHT;) {
+		if (!rows[row]) {
+			row++;
+			continue;
+		}
+
+		uint32_t run_end = row + 1;
+		while (run_end < RENDER_SURFACE_HEIGHT && rows[run_end]) {
+			run_end++;
+		}
+		func(row, run_end - row);
+		row = run_end;
+	}
+}
+
+ComputeRenderer::ComputeRenderer(bool nearest_filtering, uint64_t texture_budget, bool headless) : Renderer(headless), texture_budget(texture_budget) {
 	wgpu::InstanceFeatureName instance_features[]{
 		wgpu::InstanceFeatureName::TimedWaitAny
 	};
@@ -32,7 +82,10 @@ ComputeRenderer::ComputeRenderer(bool nearest_filtering) : Renderer() {
 
 	instance = wgpu::CreateInstance(&instance_descriptor);
 
-	surface = wgpu::Surface::Acquire(SDL_GetWGPUSurface(instance.Get(), window));
+	// Headless runs draw into a plain texture, there's no window to get a surface from
+	if (!headless) {
+		surface = wgpu::Surface::Acquire(SDL_GetWGPUSurface(instance.Get(), window));
+	}
 
 	wgpu::RequestAdapterOptions adapter_options{};
 	adapter_options.compatibleSurface = surface;
@@ -45,6 +98,18 @@ ComputeRenderer::ComputeRenderer(bool nearest_filtering) : Renderer() {
 	});
 	instance.WaitAny(adapter_future, UINT64_MAX);
 
+	// Machines without a GPU still get the CPU adapter (SwiftShader)
+	if (!adapter && headless) {
+		adapter_options.forceFallbackAdapter = true;
+		adapter_future = instance.RequestAdapter(&adapter_options, wgpu::CallbackMode::WaitAnyOnly, [&](wgpu::RequestAdapterStatus status, wgpu::Adapter a, wgpu::StringView message) {
+			if (status != wgpu::RequestAdapterStatus::Success) {
+				spdlog::error("ComputeRenderer: {}", std::string(message));
+			}
+			adapter = std::move(a);
+		});
+		instance.WaitAny(adapter_future, UINT64_MAX);
+	}
+
 	wgpu::AdapterInfo adapter_info{};
 	if (adapter.GetInfo(&adapter_info) != wgpu::Status::Success) {
 		spdlog::error("ComputeRenderer: error when accessing adapter info");
@@ -63,6 +128,13 @@ ComputeRenderer::ComputeRenderer(bool nearest_filtering) : Renderer() {
 	deviceTogglesDesc.enabledToggles = toggles.data();
 	deviceTogglesDesc.enabledToggleCount = toggles.size();
 
+	// Compiled pipelines are kept on disk next to the list of pipelines the game used
+	wgpu::DawnCacheDeviceDescriptor cache_desc{};
+	cache_desc.loadDataFunction = PipelineCache::LoadData;
+	cache_desc.storeDataFunction = PipelineCache::StoreData;
+	cache_desc.functionUserdata = &pipeline_cache;
+	deviceTogglesDesc.nextInChain = &cache_desc;
+
 	wgpu::FeatureName features[]{
 		wgpu::FeatureName::TextureFormatsTier2
 	};
@@ -95,7 +167,7 @@ ComputeRenderer::ComputeRenderer(bool nearest_filtering) : Renderer() {
 	if (device.GetLimits(&limits) != wgpu::Status::Success) {
 		spdlog::error("ComputeRenderer: error when accessing adapter info");
 	} else {
-		buffer_alignment = limits.minUniformBufferOffsetAlignment;
+		buffer_alignment = std::max(limits.minUniformBufferOffsetAlignment, limits.minStorageBufferOffsetAlignment);
 	}
 
 	queue = device.GetQueue();
@@ -159,7 +231,7 @@ ComputeRenderer::ComputeRenderer(bool nearest_filtering) : Renderer() {
 	compute_buffer_bind_group_layout_desc.label = "compute_buffer_bind_group_layout";
 	compute_buffer_bind_group_layout = device.CreateBindGroupLayout(&compute_buffer_bind_group_layout_desc);
 
-	wgpu::BindGroupLayoutEntry compute_render_data_binding_layouts[2]{};
+	wgpu::BindGroupLayoutEntry compute_render_data_binding_layouts[4]{};
 	compute_render_data_binding_layouts[0].binding = 0;
 	compute_render_data_binding_layouts[0].visibility = wgpu::ShaderStage::Compute;
 	compute_render_data_binding_layouts[0].buffer.type = wgpu::BufferBindingType::Uniform;
@@ -172,8 +244,18 @@ ComputeRenderer::ComputeRenderer(bool nearest_filtering) : Renderer() {
 	compute_render_data_binding_layouts[1].buffer.hasDynamicOffset = true;
 	compute_render_data_binding_layouts[1].buffer.minBindingSize = sizeof(ComputeVertex) * 4;
 
+	compute_render_data_binding_layouts[2].binding = 2;
+	compute_render_data_binding_layouts[2].visibility = wgpu::ShaderStage::Compute;
+	compute_render_data_binding_layouts[2].buffer.type = wgpu::BufferBindingType::ReadOnlyStorage;
+	compute_render_data_binding_layouts[2].buffer.hasDynamicOffset = true;
+	compute_render_data_binding_layouts[2].buffer.minBindingSize = sizeof(ComputeVertex) * 4;
+
+	compute_render_data_binding_layouts[3].binding = 3;
+	compute_render_data_binding_layouts[3].visibility = wgpu::ShaderStage::Compute;
+	compute_render_data_binding_layouts[3].buffer.type = wgpu::BufferBindingType::Storage;
+
 	wgpu::BindGroupLayoutDescriptor compute_render_data_bind_group_layout_desc{};
-	compute_render_data_bind_group_layout_desc.entryCount = 2;
+	compute_render_data_bind_group_layout_desc.entryCount = 4;
 	compute_render_data_bind_group_layout_desc.entries = compute_render_data_binding_layouts;
 	compute_render_data_bind_group_layout_desc.label = "compute_render_data_bind_group_layout";
 	compute_render_data_bind_group_layout = device.CreateBindGroupLayout(&compute_render_data_bind_group_layout_desc);
@@ -181,12 +263,11 @@ ComputeRenderer::ComputeRenderer(bool nearest_filtering) : Renderer() {
 	wgpu::BindGroupLayout compute_bind_group_layouts[] = {
 		compute_buffer_bind_group_layout,
 		compute_render_data_bind_group_layout,
-		compute_texture_bind_group_layout,
-		compute_clut_bind_group_layout
+		compute_texture_bind_group_layout
 	};
 
 	wgpu::PipelineLayoutDescriptor compute_texture_layout_desc{};
-	compute_texture_layout_desc.bindGroupLayoutCount = 4;
+	compute_texture_layout_desc.bindGroupLayoutCount = 3;
 	compute_texture_layout_desc.bindGroupLayouts = compute_bind_group_layouts;
 	compute_texture_layout_desc.label = "compute_texture_layout";
 	compute_texture_layout = device.CreatePipelineLayout(&compute_texture_layout_desc);
@@ -197,57 +278,78 @@ ComputeRenderer::ComputeRenderer(bool nearest_filtering) : Renderer() {
 	compute_texture_layout_desc.label = "compute_layout";
 	compute_layout = device.CreatePipelineLayout(&compute_layout_desc);
 
-	compute_render_data_buffer = CreateBuffer("compute_render_data_buffer", sizeof(RenderData) * MAX_BUFFER_RENDER_DATA_COUNT, wgpu::BufferUsage::CopyDst | wgpu::BufferUsage::Uniform);
-	compute_render_data = operator new(sizeof(RenderData) * MAX_BUFFER_RENDER_DATA_COUNT);
-	compute_vertex_buffer = CreateBuffer("compute_vertex_buffer", sizeof(ComputeVertex) * MAX_BUFFER_VERTEX_COUNT, wgpu::BufferUsage::CopyDst | wgpu::BufferUsage::Uniform);
-	compute_vertices = operator new(sizeof(ComputeVertex) * MAX_BUFFER_VERTEX_COUNT);
+	tile_bin_buffer = CreateBuffer("tile_bin_buffer", TILE_COLUMNS * TILE_ROWS * (MAX_TILED_TRIANGLES / 32) * sizeof(uint32_t), wgpu::BufferUsage::Storage);
 
-	wgpu::BindGroupEntry compute_render_data_bindings[2]{};
-	compute_render_data_bindings[0].binding = 0;
-	compute_render_data_bindings[0].buffer = compute_render_data_buffer;
-	compute_render_data_bindings[0].size = sizeof(RenderData);
+	std::string bin_code = common_shader;
+	bin_code += bin_shader;
 
-	compute_render_data_bindings[1].binding = 1;
-	compute_render_data_bindings[1].buffer = compute_vertex_buffer;
-	compute_render_data_bindings[1].size = sizeof(ComputeVertex) * 4;
+	wgpu::ComputePipelineDescriptor tile_bin_pipeline_desc{};
+	tile_bin_pipeline_desc.compute.entryPoint = wgpu::StringView("binTriangles");
+	tile_bin_pipeline_desc.compute.module = CreateShaderModule(wgpu::StringView(bin_code));
+	tile_bin_pipeline_desc.layout = compute_layout;
+	tile_bin_pipeline = device.CreateComputePipeline(&tile_bin_pipeline_desc);
 
-	wgpu::BindGroupDescriptor compute_render_data_bind_group_desc{};
-	compute_render_data_bind_group_desc.layout = compute_render_data_bind_group_layout;
-	compute_render_data_bind_group_desc.entryCount = 2;
-	compute_render_data_bind_group_desc.entries = compute_render_data_bindings;
-	compute_render_data_bind_group = device.CreateBindGroup(&compute_render_data_bind_group_desc);
+	// Fill the framebuffer slots the current target doesn't use
+	dummy_texture = CreateRenderTexture(1, wgpu::TextureFormat::RGBA8Uint);
+	dummy_16bit_texture = CreateRenderTexture(1, wgpu::TextureFormat::R16Uint);
+	dummy_depth_texture = CreateRenderTexture(1, wgpu::TextureFormat::R16Uint);
 
-	compute_transitional_buffer = CreateBuffer("compute_transitional_buffer", 512 * 512 * 4, wgpu::BufferUsage::CopyDst | wgpu::BufferUsage::MapRead);
-	compute_depth_transitional_buffer = CreateBuffer("compute_depth_transitional_buffer", 512 * 512 * 2, wgpu::BufferUsage::CopyDst | wgpu::BufferUsage::MapRead);
+	std::array<uint8_t, 1024> empty_clut{};
+	dummy_clut = CreateClut(empty_clut.data());
+	SetupTextureDecode();
+	CreateUploadBuffers();
+	AcquireUploadFrame();
+	CreateUbershaders();
 
-	Resize(BASE_WINDOW_WIDTH, BASE_WINDOW_HEIGHT);
+	if (headless) {
+		Resize(BASE_WIDTH, BASE_HEIGHT);
+	} else {
+		Resize(BASE_WINDOW_WIDTH, BASE_WINDOW_HEIGHT);
+	}
 
 	compute_encoder = device.CreateCommandEncoder();
 	compute_pass_encoder = compute_encoder.BeginComputePass();
 }
 
 ComputeRenderer::~ComputeRenderer() {
-	delete[] compute_vertices;
-	delete[] compute_render_data;
+	std::vector<wgpu::Future> futures{};
+	for (auto& [_, future] : pending_pipelines) {
+		futures.push_back(future);
+	}
+	for (auto& [_, future] : pending_ubershaders) {
+		futures.push_back(future);
+	}
+	for (auto future : futures) {
+		instance.WaitAny(future, UINT64_MAX);
+	}
+	for (auto& frame : upload_frames) {
+		if (frame.pending) {
+			instance.WaitAny(frame.future, UINT64_MAX);
+		}
+	}
 }
 
 void ComputeRenderer::Frame() {
-	wgpu::SurfaceTexture surface_texture{};
-	surface.GetCurrentTexture(&surface_texture);
-
-	if (surface_texture.status != wgpu::SurfaceGetCurrentTextureStatus::SuccessOptimal && surface_texture.status != wgpu::SurfaceGetCurrentTextureStatus::SuccessSuboptimal) {
-		spdlog::error("ComputeRenderer: failed obtaining surface texture");
-		return;
+	wgpu::Texture target_texture = offscreen_texture;
+	if (surface) {
+		wgpu::SurfaceTexture surface_texture{};
+		surface.GetCurrentTexture(&surface_texture);
+
+		if (surface_texture.status != wgpu::SurfaceGetCurrentTextureStatus::SuccessOptimal && surface_texture.status != wgpu::SurfaceGetCurrentTextureStatus::SuccessSuboptimal) {
+			spdlog::error("ComputeRenderer: failed obtaining surface texture");
+			return;
+		}
+		target_texture = surface_texture.texture;
 	}
 
 	wgpu::TextureViewDescriptor view_descriptor{};
-	view_descriptor.format = surface_texture.texture.GetFormat();
+	view_descriptor.format = target_texture.GetFormat();
 	view_descriptor.dimension = wgpu::TextureViewDimension::e2D;
 	view_descriptor.mipLevelCount = 1;
 	view_descriptor.arrayLayerCount = 1;
 	view_descriptor.aspect = wgpu::TextureAspect::All;
 	view_descriptor.label = "view_descriptor";
-	wgpu::TextureView target_view = surface_texture.texture.CreateView(&view_descriptor);
+	wgpu::TextureView target_view = target_texture.CreateView(&view_descriptor);
 
 	auto encoder = device.CreateCommandEncoder();
 
@@ -262,45 +364,10 @@ void ComputeRenderer::Frame() {
 	render_pass_desc.colorAttachments = &render_pass_color_attachment;
 	render_pass_desc.label = "render_pass_desc";
 
+	FlushPrimitives();
 	FlushRender();
 	if (frame_buffer) {
-		void* framebuffer = PSP::GetInstance()->VirtualToPhysical(frame_buffer);
-
-		wgpu::Extent3D texture_size{};
-		texture_size.width = std::min<uint32_t>(BASE_WIDTH, frame_width);
-		texture_size.height = BASE_HEIGHT;
-
-		if (pixel_format == SCE_DISPLAY_PIXEL_RGBA8888) {
-			wgpu::TexelCopyTextureInfo destination{};
-			destination.texture = framebuffer_texture;
-
-			wgpu::TexelCopyBufferLayout data_layout{};
-			data_layout.bytesPerRow = frame_width * 4;
-			data_layout.rowsPerImage = BASE_HEIGHT;
-
-			queue.WriteTexture(&destination, framebuffer, frame_width * BASE_HEIGHT * 4, &data_layout, &texture_size);
-		} else {
-			wgpu::TexelCopyTextureInfo destination{};
-			destination.texture = framebuffer_conversion_texture;
-
-			wgpu::TexelCopyBufferLayout data_layout{};
-			data_layout.bytesPerRow = frame_width * 2;
-			data_layout.rowsPerImage = BASE_HEIGHT;
-
-			queue.WriteTexture(&destination, framebuffer, frame_width * BASE_HEIGHT * 2, &data_layout, &texture_size);
-
-			auto compute_pass = encoder.BeginComputePass();
-
-			compute_pass.SetPipeline(framebuffer_conversion_pipelines[pixel_format]);
-			compute_pass.SetBindGroup(0, framebuffer_conversion_bind_group, 0, nullptr);
-
-			uint32_t workgroup_count_x = (BASE_WIDTH + 7) / 8;
-			uint32_t workgroup_count_y = (BASE_HEIGHT + 7) / 8;
-
-			compute_pass.DispatchWorkgroups(workgroup_count_x, workgroup_count_y, 1);
-
-			compute_pass.End();
-		}
+		UpdateFramebufferTexture(encoder);
 	}
 
 	auto render_pass = encoder.BeginRenderPass(&render_pass_desc);
@@ -317,30 +384,152 @@ void ComputeRenderer::Frame() {
 
 	auto command = encoder.Finish();
 	queue.Submit(1, &command);
-	surface.Present();
-
-	for (auto it = texture_cache.begin(); it != texture_cache.end();) {
-		it->second.unused_frames++;
-		if (it->second.unused_frames >= TEXTURE_CACHE_CLEAR_FRAMES) {
-			deleted_textures.push_back(it->second);
-			it = texture_cache.erase(it);
-		} else {
-			it++;
+	if (surface) {
+		surface.Present();
+	}
+	CollectPipelines();
+
+	std::vector<uint64_t> unused_textures{};
+	for (auto& entry : texture_lru) {
+		if (++entry.unused_frames >= TEXTURE_CACHE_CLEAR_FRAMES) {
+			unused_textures.push_back(entry.key);
+		}
+	}
+
+	for (auto key : unused_textures) {
+		EvictTexture(key);
+	}
+
+	// Pooled textures nobody asked for in a while are given back as well
+	for (auto it = texture_pool.begin(); it != texture_pool.end();) {
+		auto& pooled = it->second;
+		for (auto entry = pooled.begin(); entry != pooled.end();) {
+			if (++entry->unused_frames >= TEXTURE_CACHE_CLEAR_FRAMES) {
+				texture_pool_size -= entry->memory_size;
+				entry->texture.Destroy();
+				entry->decoded.Destroy();
+				entry = pooled.erase(entry);
+			} else {
+				entry++;
+			}
 		}
+		it = pooled.empty() ? texture_pool.erase(it) : std::next(it);
+	}
+
+	if (++statistics_frames >= TEXTURE_STATISTICS_FRAMES) {
+		LogTextureStatistics();
+		statistics_frames = 0;
+	}
+
+	std::vector<RenderSurface*> unused_surfaces{};
+	for (auto& [_, surface] : render_surfaces) {
+		surface.unused_frames++;
+		if (surface.unused_frames >= TEXTURE_CACHE_CLEAR_FRAMES && &surface != color_surface && &surface != depth_surface) {
+			unused_surfaces.push_back(&surface);
+		}
+	}
+
+	for (auto surface : unused_surfaces) {
+		EvictRenderSurface(*surface);
 	}
 
 	Renderer::Frame();
 }
 
+void ComputeRenderer::UpdateFramebufferTexture(const wgpu::CommandEncoder& encoder) {
+	uint32_t bpp = pixel_format == SCE_DISPLAY_PIXEL_RGBA8888 ? 4 : 2;
+	uint32_t width = std::min<uint32_t>(BASE_WIDTH, frame_width);
+	uint32_t size = frame_width * BASE_HEIGHT * bpp;
+	uint64_t state[5] = { frame_buffer, static_cast<uint64_t>(frame_width), static_cast<uint64_t>(pixel_format), 0, 0 };
+
+	auto psp = PSP::GetInstance();
+	void* framebuffer = psp->VirtualToPhysical(frame_buffer);
+	if (!framebuffer) {
+		return;
+	}
+
+	// A displayed render target is presented straight from its texture, the draw sequence tells if it changed
+	auto surface = FindRenderSurface(frame_buffer, frame_width * bpp, width * bpp, BASE_HEIGHT);
+	if (surface && surface->bpp != bpp) {
+		surface = nullptr;
+	}
+
+	uint32_t offset = 0;
+	if (surface) {
+		offset = (frame_buffer & 0x0FFFFFFF) - surface->addr;
+
+		// CPU writes don't show up in the draw sequence, movies and loading screens are only noticed in guest memory
+		uint32_t first_row = offset / surface->pitch;
+		InvalidateWrittenRows(*surface, first_row, first_row + BASE_HEIGHT);
+		AcquireRows(*surface, offset / surface->pitch, offset / surface->pitch + BASE_HEIGHT, false);
+		state[3] = reinterpret_cast<uintptr_t>(surface->texture.Get());
+		state[4] = surface->draw_sequence;
+	} else {
+		SyncMemory(frame_buffer, size);
+		state[4] = HashMemory(framebuffer, size);
+	}
+
+	// Menus and static screens keep what was uploaded for the last present
+	uint64_t present_state = HashMemory(state, sizeof(state));
+	if (present_state == framebuffer_state) {
+		return;
+	}
+	framebuffer_state = present_state;
+
+	wgpu::Extent3D texture_size{};
+	texture_size.width = width;
+	texture_size.height = BASE_HEIGHT;
+
+	auto destination_texture = pixel_format == SCE_DISPLAY_PIXEL_RGBA8888 ? framebuffer_texture : framebuffer_conversion_texture;
+	if (surface) {
+		CopyTextureRect(surface->texture, bpp, offset % surface->pitch, offset / surface->pitch, destination_texture, bpp, 0, 0, width * bpp, BASE_HEIGHT);
+	} else {
+		wgpu::TexelCopyTextureInfo destination{};
+		destination.texture = destination_texture;
+
+		wgpu::TexelCopyBufferLayout data_layout{};
+		data_layout.bytesPerRow = frame_width * bpp;
+		data_layout.rowsPerImage = BASE_HEIGHT;
+
+		queue.WriteTexture(&destination, framebuffer, size, &data_layout, &texture_size);
+	}
+
+	if (pixel_format != SCE_DISPLAY_PIXEL_RGBA8888) {
+		auto compute_pass = encoder.BeginComputePass();
+
+		compute_pass.SetPipeline(framebuffer_conversion_pipelines[pixel_format]);
+		compute_pass.SetBindGroup(0, framebuffer_conversion_bind_group, 0, nullptr);
+
+		uint32_t workgroup_count_x = (BASE_WIDTH + 7) / 8;
+		uint32_t workgroup_count_y = (BASE_HEIGHT + 7) / 8;
+
+		compute_pass.DispatchWorkgroups(workgroup_count_x, workgroup_count_y, 1);
+
+		compute_pass.End();
+	}
+}
+
 void ComputeRenderer::Resize(int width, int height) {
-	wgpu::SurfaceConfiguration surface_config{};
-	surface_config.width = width;
-	surface_config.height = height;
-	surface_config.usage = wgpu::TextureUsage::RenderAttachment;
-	surface_config.device = device;
-	surface_config.format = wgpu::TextureFormat::RGBA8Unorm;
-	surface_config.presentMode = wgpu::PresentMode::Immediate;
-	surface.Configure(&surface_config);
+	if (surface) {
+		wgpu::SurfaceConfiguration surface_config{};
+		surface_config.width = width;
+		surface_config.height = height;
+		surface_config.usage = wgpu::TextureUsage::RenderAttachment;
+		surface_config.device = device;
+		surface_config.format = wgpu::TextureFormat::RGBA8Unorm;
+		surface_config.presentMode = wgpu::PresentMode::Immediate;
+		surface.Configure(&surface_config);
+	} else {
+		wgpu::TextureDescriptor texture_desc{};
+		texture_desc.dimension = wgpu::TextureDimension::e2D;
+		texture_desc.format = wgpu::TextureFormat::RGBA8Unorm;
+		texture_desc.size = { static_cast<uint32_t>(width), static_cast<uint32_t>(height), 1 };
+		texture_desc.sampleCount = 1;
+		texture_desc.mipLevelCount = 1;
+		texture_desc.usage = wgpu::TextureUsage::RenderAttachment | wgpu::TextureUsage::CopySrc;
+		texture_desc.label = "offscreen_texture";
+		offscreen_texture = device.CreateTexture(&texture_desc);
+	}
 
 	float scaleX = static_cast<float>(width) / BASE_WIDTH;
 	float scaleY = static_cast<float>(height) / BASE_HEIGHT;
@@ -353,6 +542,57 @@ void ComputeRenderer::Resize(int width, int height) {
 	viewport_y = (height - viewport_height) / 2;
 }
 
+bool ComputeRenderer::ReadFrame(std::vector<uint8_t>& pixels, uint32_t& width, uint32_t& height) {
+	if (!offscreen_texture) {
+		return false;
+	}
+
+	width = offscreen_texture.GetWidth();
+	height = offscreen_texture.GetHeight();
+	uint32_t bytes_per_row = ALIGN(width * 4, 256);
+	uint64_t buffer_size = static_cast<uint64_t>(bytes_per_row) * height;
+	if (!readback_buffer || readback_buffer.GetSize() < buffer_size) {
+		readback_buffer = CreateBuffer("readback_buffer", ALIGN(buffer_size, 65536), wgpu::BufferUsage::CopyDst | wgpu::BufferUsage::MapRead);
+	}
+
+	wgpu::TexelCopyTextureInfo source{};
+	source.texture = offscreen_texture;
+
+	wgpu::TexelCopyBufferInfo destination{};
+	destination.buffer = readback_buffer;
+	destination.layout.bytesPerRow = bytes_per_row;
+	destination.layout.rowsPerImage = height;
+
+	wgpu::Extent3D copy_size{};
+	copy_size.width = width;
+	copy_size.height = height;
+
+	auto encoder = device.CreateCommandEncoder();
+	encoder.CopyTextureToBuffer(&source, &destination, &copy_size);
+	auto command = encoder.Finish();
+	queue.Submit(1, &command);
+
+	auto callback = [](wgpu::MapAsyncStatus status, wgpu::StringView message) {
+		if (status != wgpu::MapAsyncStatus::Success) {
+			spdlog::error("ComputeRenderer: {}", std::string(message));
+		}
+	};
+
+	wgpu::FutureWaitInfo future{ readback_buffer.MapAsync(wgpu::MapMode::Read, 0, buffer_size, wgpu::CallbackMode::WaitAnyOnly, callback) };
+	if (instance.WaitAny(1, &future, UINT64_MAX) != wgpu::WaitStatus::Success) {
+		spdlog::error("ComputeRenderer: failed mapping readback buffer");
+		return false;
+	}
+
+	auto mapped = reinterpret_cast<const uint8_t*>(readback_buffer.GetConstMappedRange(0, buffer_size));
+	pixels.resize(static_cast<size_t>(width) * height * 4);
+	for (uint32_t row = 0; row < height; row++) {
+		memcpy(pixels.data() + row * width * 4, mapped + row * bytes_per_row, width * 4);
+	}
+	readback_buffer.Unmap();
+	return true;
+}
+
 void ComputeRenderer::SetFrameBuffer(uint32_t frame_buffer, int frame_width, int pixel_format) {
 	Renderer::SetFrameBuffer(frame_buffer, frame_width, pixel_format);
 
@@ -367,11 +607,17 @@ void ComputeRenderer::SetFrameBuffer(uint32_t frame_buffer, int frame_width, int
 	}
 }
 
-void ComputeRenderer::DrawPoint(Vertex point) {
+void ComputeRenderer::DrawBatch(const PrimitiveBatch& batch) {
 	if (!compute_texture_valid) {
 		UpdateRenderTexture();
 	}
 
+	BindBatchState();
+	Renderer::DrawBatch(batch);
+	FlushTriangles();
+}
+
+void ComputeRenderer::DrawPoint(Vertex point) {
 	// Vertices are invalid, probably because it's clipped
 	if (std::isnan(point.pos.w)) {
 		return;
@@ -380,32 +626,10 @@ void ComputeRenderer::DrawPoint(Vertex point) {
 	point.pos = glm::round(point.pos);
 
 	auto filter = GetFilter(0, 0);
-	auto pipeline = GetShader(SCEGU_PRIM_POINTS, filter);
-
-	auto vertex_offset = PushVertices({ point });
-	auto render_data_offset = PushRenderData();
-	uint32_t offsets[] = { vertex_offset, render_data_offset };
-
-	compute_pass_encoder.SetPipeline(pipeline);
-	compute_pass_encoder.SetBindGroup(0, compute_buffer_bind_group, 0, nullptr);
-	compute_pass_encoder.SetBindGroup(1, compute_render_data_bind_group, 2, offsets);
-
-	if (!clear_mode && textures_enabled) {
-		auto texture_bind_group = GetTexture();
-		compute_pass_encoder.SetBindGroup(2, texture_bind_group, 0, nullptr);
-		compute_pass_encoder.SetBindGroup(3, clut_cache[current_clut].bind_group, 0, nullptr);
-	}
-
-	compute_pass_encoder.DispatchWorkgroups(1, 1, 1);
-
-	queue_empty = false;
+	DispatchPrimitive(SCEGU_PRIM_POINTS, filter, { point }, 1, 1);
 }
 
 void ComputeRenderer::DrawLine(Vertex start, Vertex end) {
-	if (!compute_texture_valid) {
-		UpdateRenderTexture();
-	}
-
 	// Vertices are invalid, probably because it's clipped
 	if (std::isnan(start.pos.w) || std::isnan(end.pos.w)) {
 		return;
@@ -425,42 +649,14 @@ void ComputeRenderer::DrawLine(Vertex start, Vertex end) {
 	}
 
 	auto filter = GetFilter((end.uv.x - start.uv.x) / size.x, (end.uv.y - start.uv.y) / size.y);
-	auto pipeline = GetShader(SCEGU_PRIM_LINES, filter);
-
-	auto vertex_offset = PushVertices({ start, end });
-	auto render_data_offset = PushRenderData();
-	uint32_t offsets[] = { vertex_offset, render_data_offset };
-
-	compute_pass_encoder.SetPipeline(pipeline);
-	compute_pass_encoder.SetBindGroup(0, compute_buffer_bind_group, 0, nullptr);
-	compute_pass_encoder.SetBindGroup(1, compute_render_data_bind_group, 2, offsets);
-
-	if (!clear_mode && textures_enabled) {
-		auto texture_bind_group = GetTexture();
-		compute_pass_encoder.SetBindGroup(2, texture_bind_group, 0, nullptr);
-		compute_pass_encoder.SetBindGroup(3, clut_cache[current_clut].bind_group, 0, nullptr);
-	}
 
 	int len = ceil(glm::length(size));
 	uint32_t workgroup_count_x = (len + 7) / 8;
 
-	compute_pass_encoder.DispatchWorkgroups(workgroup_count_x, 1, 1);
-
-	queue_empty = false;
-}
-
-void ComputeRenderer::DrawLineStrip(std::vector<Vertex> vertices) {
-	for (int i = 0; i < vertices.size() - 1; i++) {
-		DrawLine(vertices[i], vertices[i + 1]);
-	}
+	DispatchPrimitive(SCEGU_PRIM_LINES, filter, { start, end }, workgroup_count_x, 1);
 }
 
-
 void ComputeRenderer::DrawRectangle(Vertex start, Vertex end) {
-	if (!compute_texture_valid) {
-		UpdateRenderTexture();
-	}
-
 	// Vertices are invalid, probably because it's clipped
 	if (std::isnan(start.pos.w) || std::isnan(end.pos.w)) {
 		return;
@@ -487,35 +683,14 @@ void ComputeRenderer::DrawRectangle(Vertex start, Vertex end) {
 	}
 
 	auto filter = GetFilter((end.uv.x - start.uv.x) / width, (end.uv.y - start.uv.y) / height);
-	auto pipeline = GetShader(SCEGU_PRIM_RECTANGLES, filter);
-
-	auto vertex_offset = PushVertices({ start, end });
-	auto render_data_offset = PushRenderData();
-	uint32_t offsets[] = { vertex_offset, render_data_offset };
-
-	compute_pass_encoder.SetPipeline(pipeline);
-	compute_pass_encoder.SetBindGroup(0, compute_buffer_bind_group, 0, nullptr);
-	compute_pass_encoder.SetBindGroup(1, compute_render_data_bind_group, 2, offsets);
-
-	if (!clear_mode && textures_enabled) {
-		auto texture_bind_group = GetTexture();
-		compute_pass_encoder.SetBindGroup(2, texture_bind_group, 0, nullptr);
-		compute_pass_encoder.SetBindGroup(3, clut_cache[current_clut].bind_group, 0, nullptr);
-	}
 
 	uint32_t workgroup_count_x = (width + 7) / 8;
 	uint32_t workgroup_count_y = (height + 7) / 8;
 
-	compute_pass_encoder.DispatchWorkgroups(workgroup_count_x, workgroup_count_y, 1);
-
-	queue_empty = false;
+	DispatchPrimitive(SCEGU_PRIM_RECTANGLES, filter, { start, end }, workgroup_count_x, workgroup_count_y);
 }
 
 void ComputeRenderer::DrawTriangle(Vertex v0, Vertex v1, Vertex v2) {
-	if (!compute_texture_valid) {
-		UpdateRenderTexture();
-	}
-
 	// Vertices are invalid, probably because it's clipped
 	if (std::isnan(v0.pos.w) || std::isnan(v1.pos.w) || std::isnan(v2.pos.w)) {
 		return;
@@ -555,67 +730,105 @@ void ComputeRenderer::DrawTriangle(Vertex v0, Vertex v1, Vertex v2) {
 
 	// This is the most ghetto code I have ever written, but it does the job and makes everything simple
 	Vertex bounding{};
-	bounding.pos = glm::vec4(min_x, min_y, 0.0, 0.0);
+	bounding.pos = glm::vec4(min_x, min_y, max_x, max_y);
 
 	auto filter = GetFilter(v1.uv.x - v0.uv.x, v2.uv.y - v0.uv.y);
-	auto pipeline = GetShader(SCEGU_PRIM_TRIANGLES, filter);
-
-	auto vertex_offset = PushVertices({ v0, v1, v2, bounding });
-	auto render_data_offset = PushRenderData();
-	uint32_t offsets[] = { vertex_offset, render_data_offset };
-
-	compute_pass_encoder.SetPipeline(pipeline);
-	compute_pass_encoder.SetBindGroup(0, compute_buffer_bind_group, 0, nullptr);
-	compute_pass_encoder.SetBindGroup(1, compute_render_data_bind_group, 2, offsets);
+	QueueTriangle(filter, { v0, v1, v2, bounding }, glm::ivec2(min_x, min_y), glm::ivec2(max_x, max_y));
+}
 
-	if (!clear_mode && textures_enabled) {
-		auto texture_bind_group = GetTexture();
-		compute_pass_encoder.SetBindGroup(2, texture_bind_group, 0, nullptr);
-		compute_pass_encoder.SetBindGroup(3, clut_cache[current_clut].bind_group, 0, nullptr);
+void ComputeRenderer::ClearTextureCache() {
+	for (auto& entry : texture_lru) {
+		entry.dirty = true;
 	}
 
-	uint32_t workgroup_count_x = (max_x - min_x + 7) / 8;
-	uint32_t workgroup_count_y = (max_y - min_y + 7) / 8;
-
-	compute_pass_encoder.DispatchWorkgroups(workgroup_count_x, workgroup_count_y, 1);
+	// Games flush the whole cache every frame, only surface rows whose guest memory changed are reloaded
+	for (auto& [_, surface] : render_surfaces) {
+		InvalidateWrittenRows(surface, 0, RENDER_SURFACE_HEIGHT);
+	}
+}
 
-	queue_empty = false;
+void ComputeRenderer::ClearTextureCache(uint32_t addr, uint32_t size) {
+	MarkTexturesDirty(addr, size);
+
+	uint64_t begin = addr & 0x0FFFFFFF;
+	if (OverlapsRenderSurface(begin, begin + size)) {
+		// The written bytes are newer than any surface, everything else the GPU drew in those rows is kept
+		FlushPrimitives();
+		ReadbackSurfaces(begin, begin + size, nullptr, begin, begin + size);
+		InvalidateSurfaces(begin, begin + size);
+	}
 }
 
-void ComputeRenderer::DrawTriangleStrip(std::vector<Vertex> vertices) {
-	for (int i = 0; i < vertices.size() - 2; i++) {
-		if (i % 2 == 0) {
-			DrawTriangle(vertices[i], vertices[i + 1], vertices[i + 2]);
-		} else {
-			DrawTriangle(vertices[i + 1], vertices[i], vertices[i + 2]);
+void ComputeRenderer::MarkTexturesDirty(uint32_t addr, uint32_t size) {
+	addr &= 0x3FFFFFFF;
+	uint32_t addr_end = addr + size;
+	for (auto& entry : texture_lru) {
+		uint32_t texture_end = entry.addr + entry.size;
+		if (addr < texture_end && addr_end > entry.addr) {
+			entry.dirty = true;
 		}
 	}
 }
 
-void ComputeRenderer::DrawTriangleFan(std::vector<Vertex> vertices) {
-	for (int i = 1; i < vertices.size() - 1; i++) {
-		DrawTriangle(vertices[0], vertices[i], vertices[i + 1]);
+void ComputeRenderer::SyncMemory(uint32_t addr, uint32_t size) {
+	if (IsVRAM(addr) || IsVRAM(addr + size - 1)) {
+		uint64_t begin = addr & 0x0FFFFFFF;
+		FlushPrimitives();
+		ReadbackSurfaces(begin, begin + size);
 	}
 }
 
-void ComputeRenderer::ClearTextureCache() {
-	for (auto& [_, entry] : texture_cache) {
-		entry.dirty = true;
+bool ComputeRenderer::TransferBlock(uint32_t src_addr, uint32_t src_pitch, uint32_t dst_addr, uint32_t dst_pitch, uint32_t width, uint32_t height) {
+	auto destination = FindRenderSurface(dst_addr, dst_pitch, width, height);
+	if (!destination) {
+		return false;
 	}
-}
 
-void ComputeRenderer::ClearTextureCache(uint32_t addr, uint32_t size) {
-	addr &= 0x3FFFFFFF;
-	uint32_t addr_end = addr + size;
-	for (auto& [addr, entry] : texture_cache) {
-		uint32_t texture_end = addr + entry.size / 2;
-		if (addr <= texture_end && addr_end >= addr) {
-			entry.dirty = true;
-		}
+	auto source = FindRenderSurface(src_addr, src_pitch, width, height);
+	uint32_t dst_offset = (dst_addr & 0x0FFFFFFF) - destination->addr;
+	uint32_t dst_row = dst_offset / dst_pitch;
+
+	// The source is read before the destination takes over the rows, in case both share memory
+	if (source) {
+		uint32_t src_row = ((src_addr & 0x0FFFFFFF) - source->addr) / src_pitch;
+		AcquireRows(*source, src_row, src_row + height, false);
+	} else {
+		uint64_t begin = src_addr & 0x0FFFFFFF;
+		ReadbackSurfaces(begin, begin + (height - 1) * src_pitch + width);
+	}
+	AcquireRows(*destination, dst_row, dst_row + height, true);
+
+	if (!queue_empty) {
+		FlushRender();
+	}
+
+	if (source) {
+		uint32_t src_offset = (src_addr & 0x0FFFFFFF) - source->addr;
+		CopyTextureRect(source->texture, source->bpp, src_offset % src_pitch, src_offset / src_pitch, destination->texture, destination->bpp, dst_offset % dst_pitch, dst_row, width, height);
+	} else {
+		wgpu::TexelCopyTextureInfo texture_destination{};
+		texture_destination.texture = destination->texture;
+		texture_destination.origin = { dst_offset % dst_pitch / destination->bpp, dst_row, 0 };
+
+		wgpu::TexelCopyBufferLayout data_layout{};
+		data_layout.bytesPerRow = src_pitch;
+		data_layout.rowsPerImage = height;
+
+		wgpu::Extent3D size{};
+		size.width = width / destination->bpp;
+		size.height = height;
+
+		auto memory = PSP::GetInstance()->VirtualToPhysical(src_addr);
+		queue.WriteTexture(&texture_destination, memory, (height - 1) * src_pitch + width, &data_layout, &size);
 	}
+
+	MarkTexturesDirty(dst_addr, (height - 1) * dst_pitch + width);
+	return true;
 }
 
 void ComputeRenderer::CLoad(uint32_t opcode) {
+	uint64_t clut_begin = clut_addr & 0x0FFFFFFF;
+	ReadbackSurfaces(clut_begin, clut_begin + 1024);
 	Renderer::CLoad(opcode);
 
 	uint64_t checksum = 14695981039346656037ULL;
@@ -629,6 +842,10 @@ void ComputeRenderer::CLoad(uint32_t opcode) {
 		return;
 	}
 
+	clut_cache[checksum] = CreateClut(clut.data());
+}
+
+ComputeRenderer::ClutCacheEntry ComputeRenderer::CreateClut(const void* data) {
 	ClutCacheEntry cache{};
 
 	wgpu::TextureDescriptor texture_desc{};
@@ -650,7 +867,7 @@ void ComputeRenderer::CLoad(uint32_t opcode) {
 	wgpu::Extent3D size{};
 	size.width = 256;
 
-	queue.WriteTexture(&destination, clut.data(), 1024, &data_layout, &size);
+	queue.WriteTexture(&destination, data, 1024, &data_layout, &size);
 
 	wgpu::BindGroupEntry texture_binding{};
 	texture_binding.binding = 0;
@@ -662,7 +879,7 @@ void ComputeRenderer::CLoad(uint32_t opcode) {
 	texture_bind_group_desc.entries = &texture_binding;
 	cache.bind_group = device.CreateBindGroup(&texture_bind_group_desc);
 
-	clut_cache[checksum] = cache;
+	return cache;
 }
 
 wgpu::ShaderModule ComputeRenderer::CreateShaderModule(wgpu::StringView code) {
@@ -854,24 +1071,112 @@ void ComputeRenderer::SetupFramebufferConversion(wgpu::ShaderModule shader_modul
 	framebuffer_conversion_bind_group = device.CreateBindGroup(&framebuffer_conversion_bind_group_desc);
 }
 
-wgpu::ComputePipeline ComputeRenderer::GetShader(uint8_t primitive_type, uint8_t filter) {
+void ComputeRenderer::SetupTextureDecode() {
+	wgpu::BindGroupLayoutEntry decode_data_binding_layout{};
+	decode_data_binding_layout.binding = 0;
+	decode_data_binding_layout.visibility = wgpu::ShaderStage::Compute;
+	decode_data_binding_layout.buffer.type = wgpu::BufferBindingType::Uniform;
+	decode_data_binding_layout.buffer.hasDynamicOffset = true;
+	decode_data_binding_layout.buffer.minBindingSize = sizeof(DecodeData);
+
+	wgpu::BindGroupLayoutDescriptor decode_data_bind_group_layout_desc{};
+	decode_data_bind_group_layout_desc.entryCount = 1;
+	decode_data_bind_group_layout_desc.entries = &decode_data_binding_layout;
+	decode_data_bind_group_layout_desc.label = "decode_data_bind_group_layout";
+	decode_data_bind_group_layout = device.CreateBindGroupLayout(&decode_data_bind_group_layout_desc);
+
+	wgpu::BindGroupLayoutEntry texture_decode_binding_layouts[2]{};
+	texture_decode_binding_layouts[0].binding = 0;
+	texture_decode_binding_layouts[0].visibility = wgpu::ShaderStage::Compute;
+	texture_decode_binding_layouts[0].texture.sampleType = wgpu::TextureSampleType::Uint;
+	texture_decode_binding_layouts[0].texture.viewDimension = wgpu::TextureViewDimension::e2D;
+
+	texture_decode_binding_layouts[1].binding = 1;
+	texture_decode_binding_layouts[1].visibility = wgpu::ShaderStage::Compute;
+	texture_decode_binding_layouts[1].storageTexture.access = wgpu::StorageTextureAccess::WriteOnly;
+	texture_decode_binding_layouts[1].storageTexture.format = wgpu::TextureFormat::RGBA8Uint;
+	texture_decode_binding_layouts[1].storageTexture.viewDimension = wgpu::TextureViewDimension::e2D;
+
+	wgpu::BindGroupLayoutDescriptor texture_decode_bind_group_layout_desc{};
+	texture_decode_bind_group_layout_desc.entryCount = 2;
+	texture_decode_bind_group_layout_desc.entries = texture_decode_binding_layouts;
+	texture_decode_bind_group_layout_desc.label = "texture_decode_bind_group_layout";
+	texture_decode_bind_group_layout = device.CreateBindGroupLayout(&texture_decode_bind_group_layout_desc);
+
+	wgpu::BindGroupLayout texture_decode_bind_group_layouts[] = {
+		decode_data_bind_group_layout,
+		compute_clut_bind_group_layout,
+		texture_decode_bind_group_layout
+	};
+
+	wgpu::PipelineLayoutDescriptor texture_decode_layout_desc{};
+	texture_decode_layout_desc.bindGroupLayoutCount = 3;
+	texture_decode_layout_desc.bindGroupLayouts = texture_decode_bind_group_layouts;
+	texture_decode_layout_desc.label = "texture_decode_layout";
+	texture_decode_layout = device.CreatePipelineLayout(&texture_decode_layout_desc);
+
+	wgpu::ComputePipelineDescriptor texture_decode_pipeline_desc{};
+	texture_decode_pipeline_desc.compute.entryPoint = wgpu::StringView("decode");
+	texture_decode_pipeline_desc.compute.module = CreateShaderModule(wgpu::StringView(decode_shader));
+	texture_decode_pipeline_desc.layout = texture_decode_layout;
+	texture_decode_pipeline = device.CreateComputePipeline(&texture_decode_pipeline_desc);
+}
+
+void ComputeRenderer::CreateUploadBuffers() {
+	compute_render_data_buffer = CreateBuffer("compute_render_data_buffer", render_data_buffer_size, wgpu::BufferUsage::CopyDst | wgpu::BufferUsage::Uniform);
+	// Triangle groups are bound as a whole, so the binding may reach past the last vertex
+	compute_vertex_buffer = CreateBuffer("compute_vertex_buffer", vertex_buffer_size + sizeof(ComputeVertex) * MAX_TILED_TRIANGLES * 4, wgpu::BufferUsage::CopyDst | wgpu::BufferUsage::Uniform | wgpu::BufferUsage::Storage);
+
+	wgpu::BindGroupEntry compute_render_data_bindings[4]{};
+	compute_render_data_bindings[0].binding = 0;
+	compute_render_data_bindings[0].buffer = compute_render_data_buffer;
+	compute_render_data_bindings[0].size = sizeof(RenderData);
+
+	compute_render_data_bindings[1].binding = 1;
+	compute_render_data_bindings[1].buffer = compute_vertex_buffer;
+	compute_render_data_bindings[1].size = sizeof(ComputeVertex) * 4;
+
+	compute_render_data_bindings[2].binding = 2;
+	compute_render_data_bindings[2].buffer = compute_vertex_buffer;
+	compute_render_data_bindings[2].size = sizeof(ComputeVertex) * 4 * MAX_TILED_TRIANGLES;
+
+	compute_render_data_bindings[3].binding = 3;
+	compute_render_data_bindings[3].buffer = tile_bin_buffer;
+
+	wgpu::BindGroupDescriptor compute_render_data_bind_group_desc{};
+	compute_render_data_bind_group_desc.layout = compute_render_data_bind_group_layout;
+	compute_render_data_bind_group_desc.entryCount = 4;
+	compute_render_data_bind_group_desc.entries = compute_render_data_bindings;
+	compute_render_data_bind_group = device.CreateBindGroup(&compute_render_data_bind_group_desc);
+
+	// Decode parameters share the render data ring
+	wgpu::BindGroupEntry decode_data_binding{};
+	decode_data_binding.binding = 0;
+	decode_data_binding.buffer = compute_render_data_buffer;
+	decode_data_binding.size = sizeof(DecodeData);
+
+	wgpu::BindGroupDescriptor decode_data_bind_group_desc{};
+	decode_data_bind_group_desc.layout = decode_data_bind_group_layout;
+	decode_data_bind_group_desc.entryCount = 1;
+	decode_data_bind_group_desc.entries = &decode_data_binding;
+	decode_data_bind_group = device.CreateBindGroup(&decode_data_bind_group_desc);
+}
+
+ComputeRenderer::ShaderID ComputeRenderer::GetShaderID(uint8_t primitive_type, uint8_t filter) {
 	ShaderID id{};
 
 	id.primitive_type = primitive_type;
 	id.framebuffer_format = fpf;
 	if (!clear_mode) {
+		// Texture formats are expanded by the decode pass, so they don't need pipelines of their own
 		id.textures_enabled = textures_enabled;
 		if (textures_enabled) {
 			id.bilinear = (filter & 1) != 0;
-			id.texture_format = texture_format;
 			id.u_clamp = u_clamp;
 			id.v_clamp = v_clamp;
 			id.fragment_double = fragment_double;
 			id.texture_alpha = texture_alpha;
 			id.texture_function = texture_function;
-			if (texture_format >= SCEGU_PFIDX4 && texture_format <= SCEGU_PFIDX32) {
-				id.clut_format = clut_format;
-			}
 		}
 
 		id.blend_enabled = blend;
@@ -897,40 +1202,107 @@ wgpu::ComputePipeline ComputeRenderer::GetShader(uint8_t primitive_type, uint8_t
 		id.depth_write = clear_mode_depth;
 	}
 
-	if (compute_pipelines.contains(id.full)) {
-		return compute_pipelines[id.full];
-	}
-
-	wgpu::ConstantEntry constants[] {
-		{ .key = "FRAMEBUFFER_FORMAT", .value = static_cast<double>(fpf) },
-		{ .key = "TEXTURE_FORMAT", .value = id.textures_enabled ? texture_format : 100.0f },
-		{ .key = "BILINEAR", .value = id.bilinear ? 1.0f : 0.0f },
-		{ .key = "U_CLAMP", .value = id.u_clamp ? 1.0f : 0.0f },
-		{ .key = "V_CLAMP", .value = id.v_clamp ? 1.0f : 0.0f },
-		{ .key = "CLUT_FORMAT", .value = static_cast<double>(clut_format) },
-		{ .key = "BLEND_OPERATION", .value = id.blend_enabled ? blend_operation : 100.0f },
-		{ .key = "BLEND_SOURCE", .value = static_cast<double>(blend_source) },
-		{ .key = "BLEND_DESTINATION", .value = static_cast<double>(blend_destination) },
-		{ .key = "ALPHA_FUNC", .value = id.alpha_test ? alpha_test_func : 100.0f },
-		{ .key = "USE_TEXTURE_ALPHA", .value = id.texture_alpha ? 1.0f : 0.0f },
-		{ .key = "FRAGMENT_DOUBLE", .value = id.fragment_double ? 1.0f : 0.0f },
-		{ .key = "TEXTURE_FUNCTION", .value = static_cast<double>(texture_function) },
-		{ .key = "DEPTH_FUNC", .value = id.depth_test ? depth_test_func : 100.0f },
-		{ .key = "DEPTH_WRITE", .value = id.depth_write ? 1.0f : 0.0f },
-		{ .key = "GOURAUD_SHADING", .value = id.gouraud_shading ? 1.0f : 0.0f },
-	};
+	return id;
+}
 
-	std::string code = common_shader;
-	if (id.textures_enabled) {
-		code += texture_shader;
-	} else {
-		code += "fn filterTexture(uv: vec2f, color: vec4u) -> vec4u { return vec4u(0, 0, 0, 0); }";
+wgpu::ComputePipeline ComputeRenderer::GetShader(ShaderID id) {
+	auto it = compute_pipelines.find(id.full);
+	if (it != compute_pipelines.end()) {
+		return it->second;
 	}
 
-	code += pixel_shader;
+	// The ubershader draws until the specialized pipeline comes back from Dawn's workers
+	if (!pending_pipelines.contains(id.full)) {
+		CompilePipeline(id, true);
+		pipeline_cache.AddPipeline(id.full);
+	}
+	return GetUbershader(id);
+}
 
-	switch (primitive_type) {
-	case SCEGU_PRIM_POINTS:
+wgpu::ComputePipeline ComputeRenderer::GetUbershader(ShaderID id) {
+	ShaderID key{};
+	key.primitive_type = id.primitive_type;
+	key.textures_enabled = id.textures_enabled;
+
+	auto it = ubershaders.find(key.full);
+	if (it != ubershaders.end()) {
+		return it->second;
+	}
+
+	if (!pending_ubershaders.contains(key.full)) {
+		CompileUbershader(key);
+	}
+
+	// Only blocks when drawing starts before the startup compile is done
+	wgpu::Future future = pending_ubershaders[key.full];
+	instance.WaitAny(future, UINT64_MAX);
+	return ubershaders[key.full];
+}
+
+void ComputeRenderer::CompileUbershader(ShaderID key) {
+	auto shader_module = CreateShaderModule(wgpu::StringView(GetShaderCode(key, true)));
+
+	wgpu::ComputePipelineDescriptor compute_pipeline_desc{};
+	compute_pipeline_desc.compute.entryPoint = wgpu::StringView("draw");
+	compute_pipeline_desc.compute.module = shader_module;
+	compute_pipeline_desc.layout = key.textures_enabled ? compute_texture_layout : compute_layout;
+
+	pending_ubershaders[key.full] = device.CreateComputePipelineAsync(&compute_pipeline_desc, wgpu::CallbackMode::WaitAnyOnly, [this, key](wgpu::CreatePipelineAsyncStatus status, wgpu::ComputePipeline pipeline, wgpu::StringView message) {
+		pending_ubershaders.erase(key.full);
+		if (status != wgpu::CreatePipelineAsyncStatus::Success) {
+			spdlog::error("ComputeRenderer: {}", std::string(message));
+		}
+		ubershaders[key.full] = std::move(pipeline);
+	});
+}
+
+// Every fallback is compiled on Dawn's workers at startup, the first new effect must not wait for the largest shader
+void ComputeRenderer::CreateUbershaders() {
+	for (uint8_t primitive_type : { SCEGU_PRIM_POINTS, SCEGU_PRIM_LINES, SCEGU_PRIM_TRIANGLES, SCEGU_PRIM_RECTANGLES }) {
+		for (bool textures_enabled : { false, true }) {
+			ShaderID key{};
+			key.primitive_type = primitive_type;
+			key.textures_enabled = textures_enabled;
+			CompileUbershader(key);
+		}
+	}
+}
+
+std::array<uint32_t, PIPELINE_CONSTANT_COUNT> ComputeRenderer::GetPipelineConstants(ShaderID id) {
+	// 100 disables the stage, in the same order as PIPELINE_CONSTANT_NAMES
+	return {
+		id.framebuffer_format,
+		id.textures_enabled ? id.texture_format : 100u,
+		id.bilinear,
+		id.u_clamp,
+		id.v_clamp,
+		id.clut_format,
+		id.blend_enabled ? id.blend_operation : 100u,
+		id.blend_source,
+		id.blend_destination,
+		id.alpha_test ? id.alpha_func : 100u,
+		id.texture_alpha,
+		id.fragment_double,
+		id.texture_function,
+		id.depth_test ? id.depth_func : 100u,
+		id.depth_write,
+		id.gouraud_shading,
+	};
+}
+
+std::string ComputeRenderer::GetShaderCode(ShaderID id, bool ubershader) {
+	std::string code = common_shader;
+	code += ubershader ? ubershader_shader : specialized_shader;
+	if (id.textures_enabled) {
+		code += texture_shader;
+	} else {
+		code += "fn filterTexture(uv: vec2f, color: vec4u) -> vec4u { return vec4u(0, 0, 0, 0); }";
+	}
+
+	code += pixel_shader;
+
+	switch (id.primitive_type) {
+	case SCEGU_PRIM_POINTS:
 		code += point_shader;
 		break;
 	case SCEGU_PRIM_LINES:
@@ -944,72 +1316,137 @@ wgpu::ComputePipeline ComputeRenderer::GetShader(uint8_t primitive_type, uint8_t
 		break;
 	}
 
-	auto shader_module = CreateShaderModule(wgpu::StringView(code));
+	return code;
+}
+
+wgpu::ComputePipeline ComputeRenderer::CompilePipeline(ShaderID id, bool async) {
+	// Everything comes from the ID, so pipelines restored from the cache match the ones built while drawing
+	auto values = GetPipelineConstants(id);
+	wgpu::ConstantEntry constants[PIPELINE_CONSTANT_COUNT]{};
+	for (int i = 0; i < PIPELINE_CONSTANT_COUNT; i++) {
+		constants[i].key = PIPELINE_CONSTANT_NAMES[i];
+		constants[i].value = values[i];
+	}
+
+	auto shader_module = CreateShaderModule(wgpu::StringView(GetShaderCode(id, false)));
 
 	wgpu::ComputePipelineDescriptor compute_pipeline_desc{};
 	compute_pipeline_desc.compute.entryPoint = wgpu::StringView("draw");
 	compute_pipeline_desc.compute.module = shader_module;
 	compute_pipeline_desc.compute.constants = constants;
-	compute_pipeline_desc.compute.constantCount = 15;
+	compute_pipeline_desc.compute.constantCount = PIPELINE_CONSTANT_COUNT;
 	compute_pipeline_desc.layout = id.textures_enabled ? compute_texture_layout : compute_layout;
-	auto compute_pipeline = device.CreateComputePipeline(&compute_pipeline_desc);
 
-	compute_pipelines[id.full] = compute_pipeline;
+	if (!async) {
+		return device.CreateComputePipeline(&compute_pipeline_desc);
+	}
 
-	return compute_pipeline;
+	pending_pipelines[id.full] = device.CreateComputePipelineAsync(&compute_pipeline_desc, wgpu::CallbackMode::WaitAnyOnly, [this, id](wgpu::CreatePipelineAsyncStatus status, wgpu::ComputePipeline pipeline, wgpu::StringView message) {
+		pending_pipelines.erase(id.full);
+		if (status != wgpu::CreatePipelineAsyncStatus::Success) {
+			// Keeps drawing with the ubershader instead of compiling again on every primitive
+			spdlog::error("ComputeRenderer: {}", std::string(message));
+			compute_pipelines[id.full] = GetUbershader(id);
+			return;
+		}
+		compute_pipelines[id.full] = std::move(pipeline);
+	});
+	return nullptr;
 }
 
-void ComputeRenderer::UpdateRenderTexture() {
-	bool create_texture = true;
-	if (compute_texture && compute_16bit_texture && compute_depth_texture) {
-		FlushRender();
+void ComputeRenderer::CollectPipelines() {
+	if (pending_pipelines.empty() && pending_ubershaders.empty()) {
+		return;
+	}
 
-		if (compute_texture.GetWidth() == fbw && compute_16bit_texture.GetWidth() == fbw
-			&& (compute_depth_texture.GetWidth() == zbw || zbw == 0)) {
-			create_texture = false;
+	// Only picks up what has finished, the callbacks move the pipelines over
+	std::vector<wgpu::FutureWaitInfo> futures{};
+	for (auto& [_, future] : pending_pipelines) {
+		futures.push_back({ future });
+	}
+	for (auto& [_, future] : pending_ubershaders) {
+		futures.push_back({ future });
+	}
+	instance.WaitAny(futures.size(), futures.data(), 0);
+}
+
+void ComputeRenderer::LoadPipelineCache(const std::filesystem::path& path, bool report) {
+	// Bump PIPELINE_CACHE_VERSION when ShaderID fields change meaning, layout and shader changes are picked up on their own
+	uint64_t version = PIPELINE_CACHE_VERSION;
+	for (int bit = 0; bit < 64; bit++) {
+		ShaderID id{};
+		id.full = 1ull << bit;
+		auto constants = GetPipelineConstants(id);
+		version = HashMemory(constants.data(), sizeof(constants), version);
+	}
+	for (auto shader : { common_shader, specialized_shader, ubershader_shader, texture_shader, pixel_shader, point_shader, line_shader, triangle_shader, rectangle_shader }) {
+		version = HashMemory(shader, strlen(shader), version);
+	}
+
+	if (!pipeline_cache.Open(path, version)) {
+		return;
+	}
+
+	// Pipelines are built on Dawn's workers unless every compile time should be reported
+	auto start = std::chrono::steady_clock::now();
+	for (auto full : pipeline_cache.GetPipelineIDs()) {
+		if (compute_pipelines.contains(full) || pending_pipelines.contains(full)) {
+			continue;
 		}
+
+		ShaderID id{};
+		id.full = full;
+		if (!report) {
+			CompilePipeline(id, true);
+			continue;
+		}
+
+		auto pipeline_start = std::chrono::steady_clock::now();
+		compute_pipelines[full] = CompilePipeline(id, false);
+		std::chrono::duration<double, std::milli> pipeline_time = std::chrono::steady_clock::now() - pipeline_start;
+		spdlog::info("ComputeRenderer: pipeline {:016x} compiled in {:.2f} ms", full, pipeline_time.count());
 	}
-	
-	current_fpf = fpf;
-	current_fbp = GetFrameBufferAddress();
-	current_zbp = GetDepthBufferAddress();
-	if (create_texture) {
-		wgpu::TextureDescriptor texture_desc{};
-		texture_desc.dimension = wgpu::TextureDimension::e2D;
-		texture_desc.format = wgpu::TextureFormat::RGBA8Uint;
-		texture_desc.size = { fbw, 512, 1 };
-		texture_desc.sampleCount = 1;
-		texture_desc.mipLevelCount = 1;
-		texture_desc.usage = wgpu::TextureUsage::CopyDst | wgpu::TextureUsage::CopySrc | wgpu::TextureUsage::StorageBinding;
-		compute_texture = device.CreateTexture(&texture_desc);
-
-		wgpu::TextureDescriptor texture_16bit_desc{};
-		texture_16bit_desc.dimension = wgpu::TextureDimension::e2D;
-		texture_16bit_desc.format = wgpu::TextureFormat::R16Uint;
-		texture_16bit_desc.size = { fbw, 512, 1 };
-		texture_16bit_desc.sampleCount = 1;
-		texture_16bit_desc.mipLevelCount = 1;
-		texture_16bit_desc.usage = wgpu::TextureUsage::CopyDst | wgpu::TextureUsage::CopySrc | wgpu::TextureUsage::StorageBinding;
-		compute_16bit_texture = device.CreateTexture(&texture_16bit_desc);
-
-		wgpu::TextureDescriptor depth_buffer_texture_desc{};
-		depth_buffer_texture_desc.dimension = wgpu::TextureDimension::e2D;
-		depth_buffer_texture_desc.format = wgpu::TextureFormat::R16Uint;
-		depth_buffer_texture_desc.size = { std::max<uint32_t>(zbw, 1), 512, 1 };
-		depth_buffer_texture_desc.sampleCount = 1;
-		depth_buffer_texture_desc.mipLevelCount = 1;
-		depth_buffer_texture_desc.usage = wgpu::TextureUsage::CopyDst | wgpu::TextureUsage::CopySrc | wgpu::TextureUsage::StorageBinding;
-		compute_depth_texture = device.CreateTexture(&depth_buffer_texture_desc);
+
+	if (report) {
+		std::chrono::duration<double, std::milli> total_time = std::chrono::steady_clock::now() - start;
+		spdlog::info("ComputeRenderer: prewarmed {} pipelines in {:.2f} ms", compute_pipelines.size(), total_time.count());
+	}
+}
+
+wgpu::Texture ComputeRenderer::CreateRenderTexture(uint32_t width, wgpu::TextureFormat format) {
+	wgpu::TextureDescriptor texture_desc{};
+	texture_desc.dimension = wgpu::TextureDimension::e2D;
+	texture_desc.format = format;
+	texture_desc.size = { std::max<uint32_t>(width, 1), RENDER_SURFACE_HEIGHT, 1 };
+	texture_desc.sampleCount = 1;
+	texture_desc.mipLevelCount = 1;
+	texture_desc.usage = wgpu::TextureUsage::CopyDst | wgpu::TextureUsage::CopySrc | wgpu::TextureUsage::StorageBinding;
+	return device.CreateTexture(&texture_desc);
+}
+
+void ComputeRenderer::UpdateRenderTexture() {
+	uint32_t bpp = fpf == SCE_DISPLAY_PIXEL_RGBA8888 ? 4 : 2;
+	uint32_t color_addr = GetFrameBufferAddress() & 0x0FFFFFFF;
+	uint32_t depth_addr = GetDepthBufferAddress() & 0x0FFFFFFF;
+
+	// A depth buffer aliasing the color buffer would evict it or be bound twice, it's left out instead
+	auto color = &GetRenderSurface(color_addr, fbw * bpp, bpp);
+	auto depth = zbw != 0 && depth_addr != color_addr ? &GetRenderSurface(depth_addr, zbw * 2, 2) : nullptr;
+
+	// Switching between resident surfaces only needs a new bind group, rows are uploaded once they are drawn
+	if (color != color_surface || depth != depth_surface || !compute_buffer_bind_group) {
+		color_surface = color;
+		depth_surface = depth;
 
 		wgpu::BindGroupEntry compute_buffer_bindings[3]{};
 		compute_buffer_bindings[0].binding = 0;
-		compute_buffer_bindings[0].textureView = compute_texture.CreateView();
+		compute_buffer_bindings[0].textureView = (bpp == 4 ? color->texture : dummy_texture).CreateView();
 
 		compute_buffer_bindings[1].binding = 1;
-		compute_buffer_bindings[1].textureView = compute_16bit_texture.CreateView();
+		compute_buffer_bindings[1].textureView = (bpp == 2 ? color->texture : dummy_16bit_texture).CreateView();
 
 		compute_buffer_bindings[2].binding = 2;
-		compute_buffer_bindings[2].textureView = compute_depth_texture.CreateView();
+		compute_buffer_bindings[2].textureView = (depth ? depth->texture : dummy_depth_texture).CreateView();
 
 		wgpu::BindGroupDescriptor compute_bind_group_desc{};
 		compute_bind_group_desc.layout = compute_buffer_bind_group_layout;
@@ -1018,55 +1455,448 @@ void ComputeRenderer::UpdateRenderTexture() {
 		compute_buffer_bind_group = device.CreateBindGroup(&compute_bind_group_desc);
 	}
 
-	int bpp = current_fpf == SCE_DISPLAY_PIXEL_RGBA8888 ? 4 : 2;
-	wgpu::TexelCopyTextureInfo destination{};
-	destination.texture = current_fpf == SCE_DISPLAY_PIXEL_RGBA8888 ? compute_texture : compute_16bit_texture;
+	compute_texture_valid = true;
+}
 
-	wgpu::TexelCopyBufferLayout data_layout{};
-	data_layout.bytesPerRow = fbw * bpp;
-	data_layout.rowsPerImage = 512;
+ComputeRenderer::RenderSurface& ComputeRenderer::GetRenderSurface(uint32_t addr, uint32_t pitch, uint32_t bpp) {
+	addr &= 0x0FFFFFFF;
+	auto it = render_surfaces.find(addr);
+	if (it != render_surfaces.end()) {
+		if (it->second.pitch == pitch && it->second.bpp == bpp) {
+			it->second.unused_frames = 0;
+			return it->second;
+		}
+		EvictRenderSurface(it->second);
+	}
 
-	wgpu::Extent3D framebuffer_size{};
-	framebuffer_size.width = fbw;
-	framebuffer_size.height = 512;
+	// Every row starts out stale, so only rows that get drawn or sampled are ever uploaded
+	RenderSurface surface{};
+	surface.addr = addr;
+	surface.pitch = pitch;
+	surface.bpp = bpp;
+	surface.stale.set();
+	surface.texture = CreateRenderTexture(pitch / bpp, bpp == 4 ? wgpu::TextureFormat::RGBA8Uint : wgpu::TextureFormat::R16Uint);
+	return render_surfaces[addr] = surface;
+}
 
-	auto framebuffer = PSP::GetInstance()->VirtualToPhysical(current_fbp);
+ComputeRenderer::RenderSurface* ComputeRenderer::FindRenderSurface(uint32_t addr, uint32_t pitch, uint32_t width, uint32_t height) {
+	addr &= 0x0FFFFFFF;
+	for (auto& [_, surface] : render_surfaces) {
+		if (addr < surface.addr || surface.pitch != pitch) {
+			continue;
+		}
 
-	queue.WriteTexture(&destination, framebuffer, fbw * 512 * bpp, &data_layout, &framebuffer_size);
+		// Copies work on whole texels of the surface
+		uint32_t offset = addr - surface.addr;
+		uint32_t x = offset % pitch;
+		if (x % surface.bpp == 0 && width % surface.bpp == 0 && x + width <= pitch && offset / pitch + height <= RENDER_SURFACE_HEIGHT) {
+			surface.unused_frames = 0;
+			return &surface;
+		}
+	}
+	return nullptr;
+}
 
-	if (zbw != 0) {
-		wgpu::TexelCopyTextureInfo depth_destination{};
-		depth_destination.texture = compute_depth_texture;
+bool ComputeRenderer::OverlapsRenderSurface(uint64_t addr, uint64_t addr_end) const {
+	for (auto& [_, surface] : render_surfaces) {
+		if (addr < surface.addr + static_cast<uint64_t>(surface.pitch) * RENDER_SURFACE_HEIGHT && addr_end > surface.addr) {
+			return true;
+		}
+	}
+	return false;
+}
 
-		wgpu::TexelCopyBufferLayout depth_data_layout{};
-		depth_data_layout.bytesPerRow = zbw * 2;
-		depth_data_layout.rowsPerImage = 512;
+void ComputeRenderer::AcquireRows(RenderSurface& surface, uint32_t first_row, uint32_t last_row, bool write) {
+	uint64_t addr = surface.addr + static_cast<uint64_t>(first_row) * surface.pitch;
+	uint64_t addr_end = surface.addr + static_cast<uint64_t>(last_row) * surface.pitch;
+	surface.unused_frames = 0;
 
-		wgpu::Extent3D depth_size{};
-		depth_size.width = zbw;
-		depth_size.height = 512;
+	// Whatever other surfaces drew into these rows has to go through guest memory first
+	ReadbackSurfaces(addr, addr_end, &surface);
+	UploadStaleRows(surface, first_row, last_row);
 
-		auto depth_buffer = PSP::GetInstance()->VirtualToPhysical(current_zbp);
-		queue.WriteTexture(&depth_destination, depth_buffer, zbw * 512 * 2, &depth_data_layout, &depth_size);
+	if (write) {
+		InvalidateSurfaces(addr, addr_end, &surface);
+		surface.dirty |= GetRowMask(first_row, last_row);
+		surface.draw_sequence++;
 	}
+}
 
-	compute_texture_valid = true;
+void ComputeRenderer::ReadbackSurfaces(uint64_t addr, uint64_t addr_end, const RenderSurface* exclude, uint64_t keep_addr, uint64_t keep_end) {
+	for (auto& [_, surface] : render_surfaces) {
+		if (&surface != exclude) {
+			ReadbackSurface(surface, addr, addr_end, keep_addr, keep_end);
+		}
+	}
+}
+
+void ComputeRenderer::ReadbackSurface(RenderSurface& surface, uint64_t addr, uint64_t addr_end, uint64_t keep_addr, uint64_t keep_end) {
+	uint32_t first_row = 0;
+	uint32_t last_row = 0;
+	if (!GetSurfaceRows(surface.addr, surface.pitch, addr, addr_end, first_row, last_row)) {
+		return;
+	}
+
+	// Only the dirty rows touched by the access are copied out
+	auto rows = surface.dirty & GetRowMask(first_row, last_row);
+	if (rows.none()) {
+		return;
+	}
+
+	if (!queue_empty) {
+		FlushRender();
+	}
+
+	uint32_t aligned_pitch = ALIGN(surface.pitch, 256);
+	uint64_t buffer_size = rows.count() * aligned_pitch;
+	if (!readback_buffer || readback_buffer.GetSize() < buffer_size) {
+		readback_buffer = CreateBuffer("readback_buffer", ALIGN(buffer_size, 65536), wgpu::BufferUsage::CopyDst | wgpu::BufferUsage::MapRead);
+	}
+
+	auto encoder = device.CreateCommandEncoder();
+	uint32_t buffer_row = 0;
+	ForEachRowRun(rows, [&](uint32_t row, uint32_t row_count) {
+		wgpu::TexelCopyTextureInfo source{};
+		source.texture = surface.texture;
+		source.origin = { 0, row, 0 };
+
+		wgpu::TexelCopyBufferInfo destination{};
+		destination.buffer = readback_buffer;
+		destination.layout.offset = static_cast<uint64_t>(buffer_row) * aligned_pitch;
+		destination.layout.bytesPerRow = aligned_pitch;
+		destination.layout.rowsPerImage = row_count;
+
+		wgpu::Extent3D copy_size{};
+		copy_size.width = surface.pitch / surface.bpp;
+		copy_size.height = row_count;
+
+		encoder.CopyTextureToBuffer(&source, &destination, &copy_size);
+		buffer_row += row_count;
+	});
+
+	auto command = encoder.Finish();
+	queue.Submit(1, &command);
+
+	auto callback = [](wgpu::MapAsyncStatus status, wgpu::StringView message) {
+		if (status != wgpu::MapAsyncStatus::Success) {
+			spdlog::error("ComputeRenderer: {}", std::string(message));
+		}
+	};
+
+	wgpu::FutureWaitInfo future{ readback_buffer.MapAsync(wgpu::MapMode::Read, 0, buffer_size, wgpu::CallbackMode::WaitAnyOnly, callback) };
+	if (instance.WaitAny(1, &future, UINT64_MAX) != wgpu::WaitStatus::Success) {
+		spdlog::error("ComputeRenderer: failed mapping readback buffer");
+		return;
+	}
+
+	auto mapped = reinterpret_cast<const uint8_t*>(readback_buffer.GetConstMappedRange(0, buffer_size));
+	auto guest = reinterpret_cast<uint8_t*>(PSP::GetInstance()->VirtualToPhysical(surface.addr));
+	buffer_row = 0;
+	ForEachRowRun(rows, [&](uint32_t first, uint32_t row_count) {
+		for (uint32_t row = first; row < first + row_count; row++, buffer_row++) {
+			// Bytes the CPU has just written are newer than the GPU copy
+			uint64_t row_addr = surface.addr + static_cast<uint64_t>(row) * surface.pitch;
+			uint64_t row_addr_end = row_addr + surface.pitch;
+			const uint8_t* src = mapped + static_cast<uint64_t>(buffer_row) * aligned_pitch;
+
+			uint64_t head_end = std::min(row_addr_end, std::max(row_addr, keep_addr));
+			uint64_t tail_begin = std::max(row_addr, std::min(row_addr_end, keep_end));
+			if (keep_addr >= keep_end) {
+				head_end = tail_begin = row_addr_end;
+			}
+
+			memcpy(guest + (row_addr - surface.addr), src, head_end - row_addr);
+			memcpy(guest + (tail_begin - surface.addr), src + (tail_begin - row_addr), row_addr_end - tail_begin);
+		}
+	});
+	readback_buffer.Unmap();
+
+	surface.dirty &= ~rows;
+	StoreRowHashes(surface, rows);
+}
+
+void ComputeRenderer::InvalidateSurfaces(uint64_t addr, uint64_t addr_end, const RenderSurface* exclude) {
+	for (auto& [_, surface] : render_surfaces) {
+		uint32_t first_row = 0;
+		uint32_t last_row = 0;
+		if (&surface != exclude && GetSurfaceRows(surface.addr, surface.pitch, addr, addr_end, first_row, last_row)) {
+			auto rows = GetRowMask(first_row, last_row);
+			surface.stale |= rows;
+			surface.dirty &= ~rows;
+			surface.draw_sequence++;
+		}
+	}
+}
+
+void ComputeRenderer::UploadStaleRows(RenderSurface& surface, uint32_t first_row, uint32_t last_row) {
+	auto rows = surface.stale & GetRowMask(first_row, last_row);
+	if (rows.none()) {
+		return;
+	}
+
+	// Queue writes land before anything still recorded in the encoder
+	if (!queue_empty) {
+		FlushRender();
+	}
+
+	auto memory = reinterpret_cast<const uint8_t*>(PSP::GetInstance()->VirtualToPhysical(surface.addr));
+	ForEachRowRun(rows, [&](uint32_t row, uint32_t row_count) {
+		wgpu::TexelCopyTextureInfo destination{};
+		destination.texture = surface.texture;
+		destination.origin = { 0, row, 0 };
+
+		wgpu::TexelCopyBufferLayout data_layout{};
+		data_layout.bytesPerRow = surface.pitch;
+		data_layout.rowsPerImage = row_count;
+
+		wgpu::Extent3D size{};
+		size.width = surface.pitch / surface.bpp;
+		size.height = row_count;
+
+		queue.WriteTexture(&destination, memory + row * surface.pitch, row_count * surface.pitch, &data_layout, &size);
+	});
+
+	surface.stale &= ~rows;
+	StoreRowHashes(surface, rows);
+}
+
+void ComputeRenderer::StoreRowHashes(RenderSurface& surface, const std::bitset<RENDER_SURFACE_HEIGHT>& rows) {
+	auto memory = reinterpret_cast<const uint8_t*>(PSP::GetInstance()->VirtualToPhysical(surface.addr));
+	for (uint32_t row = 0; row < RENDER_SURFACE_HEIGHT; row++) {
+		if (rows[row]) {
+			surface.row_hashes[row] = HashMemory(memory + row * surface.pitch, surface.pitch);
+		}
+	}
+}
+
+// Rows whose guest memory no longer matches are reloaded from it, the CPU wrote them after the GPU
+bool ComputeRenderer::InvalidateWrittenRows(RenderSurface& surface, uint32_t first_row, uint32_t last_row) {
+	auto memory = reinterpret_cast<const uint8_t*>(PSP::GetInstance()->VirtualToPhysical(surface.addr));
+	auto rows = ~surface.stale & GetRowMask(first_row, last_row);
+
+	std::bitset<RENDER_SURFACE_HEIGHT> written{};
+	for (uint32_t row = first_row; row < last_row; row++) {
+		if (rows[row] && HashMemory(memory + row * surface.pitch, surface.pitch) != surface.row_hashes[row]) {
+			written.set(row);
+		}
+	}
+
+	if (written.none()) {
+		return false;
+	}
+
+	// Primitives batched so far were issued before the write
+	FlushPrimitives();
+	surface.stale |= written;
+	surface.dirty &= ~written;
+	surface.draw_sequence++;
+	return true;
+}
+
+void ComputeRenderer::EvictRenderSurface(RenderSurface& surface) {
+	ReadbackSurface(surface, surface.addr, surface.addr + static_cast<uint64_t>(surface.pitch) * RENDER_SURFACE_HEIGHT, 0, 0);
+
+	if (color_surface == &surface) {
+		color_surface = nullptr;
+		compute_texture_valid = false;
+	}
+	if (depth_surface == &surface) {
+		depth_surface = nullptr;
+		compute_texture_valid = false;
+	}
+
+	TextureCacheEntry entry{};
+	entry.texture = surface.texture;
+	deleted_textures.push_back(entry);
+
+	uint32_t addr = surface.addr;
+	render_surfaces.erase(addr);
 }
 
-uint32_t ComputeRenderer::PushRenderData() {
+void ComputeRenderer::CopyTextureRect(const wgpu::Texture& source, uint32_t source_bpp, uint32_t source_x, uint32_t source_y, const wgpu::Texture& destination, uint32_t destination_bpp, uint32_t destination_x, uint32_t destination_y, uint32_t width, uint32_t height) {
+	// The formats don't have to match, so the bytes take a detour through a buffer
+	uint32_t aligned_width = ALIGN(width, 256);
+	uint64_t buffer_size = static_cast<uint64_t>(aligned_width) * height;
+	if (!copy_buffer || copy_buffer.GetSize() < buffer_size) {
+		copy_buffer = CreateBuffer("copy_buffer", ALIGN(buffer_size, 65536), wgpu::BufferUsage::CopySrc | wgpu::BufferUsage::CopyDst);
+	}
+
+	wgpu::TexelCopyTextureInfo texture_source{};
+	texture_source.texture = source;
+	texture_source.origin = { source_x / source_bpp, source_y, 0 };
+
+	wgpu::TexelCopyBufferInfo buffer{};
+	buffer.buffer = copy_buffer;
+	buffer.layout.bytesPerRow = aligned_width;
+	buffer.layout.rowsPerImage = height;
+
+	wgpu::TexelCopyTextureInfo texture_destination{};
+	texture_destination.texture = destination;
+	texture_destination.origin = { destination_x / destination_bpp, destination_y, 0 };
+
+	wgpu::Extent3D source_size{};
+	source_size.width = width / source_bpp;
+	source_size.height = height;
+
+	wgpu::Extent3D destination_size{};
+	destination_size.width = width / destination_bpp;
+	destination_size.height = height;
+
+	auto encoder = device.CreateCommandEncoder();
+	encoder.CopyTextureToBuffer(&texture_source, &buffer, &source_size);
+	encoder.CopyBufferToTexture(&buffer, &texture_destination, &destination_size);
+	auto command = encoder.Finish();
+	queue.Submit(1, &command);
+}
+
+void ComputeRenderer::BindBatchState() {
+	// Syncing textures and surfaces can flush the pass, so it has to happen before anything is bound
+	wgpu::BindGroup texture_bind_group = nullptr;
+	if (!clear_mode && textures_enabled) {
+		texture_bind_group = GetTexture();
+	}
+
+	// Drawing takes over the scissored rows, the depth buffer only when the batch can write it
+	uint32_t first_row = std::min<uint32_t>(scissor_start.y, RENDER_SURFACE_HEIGHT);
+	uint32_t last_row = std::clamp<uint32_t>(scissor_end.y + 1, first_row, RENDER_SURFACE_HEIGHT);
+	AcquireRows(*color_surface, first_row, last_row, true);
+	if (depth_surface) {
+		AcquireRows(*depth_surface, first_row, last_row, clear_mode ? clear_mode_depth : depth_write);
+	}
+
+	// Every primitive of a batch shares the same textures, render data is only pushed again when the filter changes
+	batch_state = UINT64_MAX;
+	batch_pipeline = nullptr;
+
+	compute_pass_encoder.SetBindGroup(0, compute_buffer_bind_group, 0, nullptr);
+	if (texture_bind_group) {
+		compute_pass_encoder.SetBindGroup(2, texture_bind_group, 0, nullptr);
+	}
+}
+
+void ComputeRenderer::DispatchPrimitive(uint8_t primitive_type, uint8_t filter, std::initializer_list<Vertex> vertices, uint32_t workgroup_count_x, uint32_t workgroup_count_y) {
+	// Anything drawn after the queued triangles has to land on top of them
+	FlushTriangles();
+
+	uint32_t vertices_size = ALIGN(sizeof(ComputeVertex) * vertices.size(), buffer_alignment);
+	uint32_t render_data_size = ALIGN(sizeof(RenderData), buffer_alignment);
+	if (!FitsUpload(vertices_size, render_data_size)) {
+		FlushRender();
+		BindBatchState();
+	}
+
+	auto id = GetShaderID(primitive_type, filter);
+	auto pipeline = GetShader(id);
+	if (pipeline.Get() != batch_pipeline.Get()) {
+		compute_pass_encoder.SetPipeline(pipeline);
+		batch_pipeline = pipeline;
+	}
+
+	// The ubershader reads its state from the render data, which is the same for every primitive type
+	ShaderID state = id;
+	state.primitive_type = 0;
+	if (state.full != batch_state) {
+		batch_render_data_offset = PushRenderData(state);
+		batch_state = state.full;
+	}
+
+	auto vertex_offset = PushVertices(vertices);
+	uint32_t offsets[] = { batch_render_data_offset, vertex_offset, 0 };
+	compute_pass_encoder.SetBindGroup(1, compute_render_data_bind_group, 3, offsets);
+
+	compute_pass_encoder.DispatchWorkgroups(workgroup_count_x, workgroup_count_y, 1);
+
+	queue_empty = false;
+}
+
+void ComputeRenderer::QueueTriangle(uint8_t filter, std::initializer_list<Vertex> vertices, glm::ivec2 min, glm::ivec2 max) {
+	// Only tiles inside the scissor are binned, the bin shader clips the same way
+	glm::ivec2 limit = glm::ivec2(TILE_COLUMNS, TILE_ROWS) * TILE_SIZE - 1;
+	glm::ivec2 first = glm::max(min, glm::ivec2(scissor_start));
+	glm::ivec2 last = glm::min(glm::min(max, glm::ivec2(scissor_end)), limit);
+	if (first.x > last.x || first.y > last.y) {
+		return;
+	}
+
+	auto id = GetShaderID(SCEGU_PRIM_TRIANGLES, filter);
+	if (triangle_count == MAX_TILED_TRIANGLES || (triangle_count && id.full != triangle_group_id.full)) {
+		FlushTriangles();
+	}
+
+	uint32_t vertices_size = sizeof(ComputeVertex) * vertices.size();
+	uint32_t render_data_size = ALIGN(sizeof(RenderData), buffer_alignment);
+	if (!FitsUpload(vertices_size, triangle_count ? 0 : render_data_size)) {
+		FlushTriangles();
+		FlushRender();
+		BindBatchState();
+	}
+
+	glm::uvec2 first_tile = glm::uvec2(first / TILE_SIZE);
+	glm::uvec2 last_tile = glm::uvec2(last / TILE_SIZE);
+	if (!triangle_count) {
+		triangle_offset = compute_vertex_buffer_offset;
+		triangle_group_id = id;
+		triangle_tile_min = first_tile;
+		triangle_tile_max = last_tile;
+	} else {
+		triangle_tile_min = glm::min(triangle_tile_min, first_tile);
+		triangle_tile_max = glm::max(triangle_tile_max, last_tile);
+	}
+
+	// Triangles of a group are packed back to back so the shaders can index them
+	PushVertices(vertices, false);
+	triangle_count++;
+}
+
+void ComputeRenderer::FlushTriangles() {
+	if (!triangle_count) {
+		return;
+	}
+
+	ShaderID state = triangle_group_id;
+	state.primitive_type = 0;
+	uint32_t render_data_offset = PushRenderData(state);
+	auto data = reinterpret_cast<RenderData*>(reinterpret_cast<uintptr_t>(compute_render_data) + render_data_offset);
+	data->tile_start = triangle_tile_min;
+	data->triangle_count = triangle_count;
+
+	uint32_t offsets[] = { render_data_offset, 0, triangle_offset };
+	compute_pass_encoder.SetBindGroup(1, compute_render_data_bind_group, 3, offsets);
+
+	// Binning sets one bit per triangle in every tile it touches, then each tile draws its triangles in order
+	compute_pass_encoder.SetPipeline(tile_bin_pipeline);
+	compute_pass_encoder.DispatchWorkgroups((triangle_count + 63) / 64, 1, 1);
+
+	auto pipeline = GetShader(triangle_group_id);
+	compute_pass_encoder.SetPipeline(pipeline);
+	batch_pipeline = pipeline;
+
+	glm::uvec2 tile_count = triangle_tile_max - triangle_tile_min + 1u;
+	compute_pass_encoder.DispatchWorkgroups(tile_count.x, tile_count.y, 1);
+
+	queue_empty = false;
+	triangle_count = 0;
+	compute_vertex_buffer_offset = ALIGN(compute_vertex_buffer_offset, buffer_alignment);
+}
+
+uint32_t ComputeRenderer::PushRenderData(ShaderID state) {
 	uint32_t offset = compute_render_data_offset;
 
 	auto data = reinterpret_cast<RenderData*>(reinterpret_cast<uintptr_t>(compute_render_data) + compute_render_data_offset);
 	data->scissor_start = scissor_start;
 	data->scissor_end = scissor_end;
-	data->clut_shift = clut_shift;
-	data->clut_mask = clut_mask;
-	data->clut_offset = clut_offset;
 	data->blend_afix = blend_afix;
 	data->blend_bfix = blend_bfix;
 	data->alpha_mask = alpha_test_mask;
 	data->alpha_ref = alpha_test_ref & alpha_test_mask;
 	data->environment_texture = environment_texture;
+	data->tile_start = glm::uvec2(0);
+	data->triangle_count = 0;
+
+	auto constants = GetPipelineConstants(state);
+	for (int i = 0; i < PIPELINE_CONSTANT_COUNT; i++) {
+		data->pipeline_state[i / 4][i % 4] = constants[i];
+	}
 	compute_render_data_offset += sizeof(RenderData);
 
 	compute_render_data_offset = ALIGN(compute_render_data_offset, buffer_alignment);
@@ -1074,57 +1904,26 @@ uint32_t ComputeRenderer::PushRenderData() {
 }
 
 void ComputeRenderer::FlushRender() {
+	FlushTriangles();
+
 	if (queue_empty) {
+		compute_vertex_buffer_offset = 0;
+		compute_render_data_offset = 0;
 		return;
 	}
 
 	compute_pass_encoder.End();
 
-	auto framebuffer_width = compute_texture.GetWidth();
-	int bpp = current_fpf = fpf == SCE_DISPLAY_PIXEL_RGBA8888 ? 4 : 2;
-	auto framebuffer_size = 512 * framebuffer_width * bpp;
+	// The copies out of the staging memory run ahead of the pass, which is then free to record the next frame
+	auto& frame = upload_frames[upload_frame];
+	frame.buffer.Unmap();
 
-	wgpu::TexelCopyTextureInfo source{};
-	source.texture = fpf == SCE_DISPLAY_PIXEL_RGBA8888 ? compute_texture : compute_16bit_texture;
-
-	wgpu::TexelCopyBufferInfo destination{};
-	destination.buffer = compute_transitional_buffer;
-	destination.layout.bytesPerRow = framebuffer_width * bpp;
-	destination.layout.rowsPerImage = 512;
-
-	wgpu::Extent3D framebuffer_texture_size{};
-	framebuffer_texture_size.width = framebuffer_width;
-	framebuffer_texture_size.height = 512;
-
-	compute_encoder.CopyTextureToBuffer(&source, &destination, &framebuffer_texture_size);
-
-	auto depth_buffer_width = compute_depth_texture.GetWidth();
-	auto depth_buffer_size = 512 * depth_buffer_width * 2;
+	auto upload_encoder = device.CreateCommandEncoder();
+	upload_encoder.CopyBufferToBuffer(frame.buffer, vertex_buffer_size, compute_render_data_buffer, 0, compute_render_data_offset);
+	upload_encoder.CopyBufferToBuffer(frame.buffer, 0, compute_vertex_buffer, 0, compute_vertex_buffer_offset);
 
-	if (zbw != 0) {
-		wgpu::TexelCopyTextureInfo depth_buffer_source{};
-		depth_buffer_source.texture = compute_depth_texture;
-
-		wgpu::TexelCopyBufferInfo depth_buffer_destination{};
-		depth_buffer_destination.buffer = compute_depth_transitional_buffer;
-		depth_buffer_destination.layout.bytesPerRow = depth_buffer_width * 2;
-		depth_buffer_destination.layout.rowsPerImage = 512;
-
-		wgpu::Extent3D depth_buffer_texture_size{};
-		depth_buffer_texture_size.width = depth_buffer_width;
-		depth_buffer_texture_size.height = 512;
-
-		compute_encoder.CopyTextureToBuffer(&depth_buffer_source, &depth_buffer_destination, &depth_buffer_texture_size);
-	}
-
-	auto command = compute_encoder.Finish();
-
-	queue.WriteBuffer(compute_render_data_buffer, 0, compute_render_data, compute_render_data_offset);
-	queue.WriteBuffer(compute_vertex_buffer, 0, compute_vertices, compute_vertex_buffer_offset);
-	queue.Submit(1, &command);
-
-	compute_encoder = device.CreateCommandEncoder();
-	compute_pass_encoder = compute_encoder.BeginComputePass();
+	wgpu::CommandBuffer commands[] = { upload_encoder.Finish(), compute_encoder.Finish() };
+	queue.Submit(2, commands);
 
 	auto callback = [](wgpu::MapAsyncStatus status, wgpu::StringView message) {
 		if (status != wgpu::MapAsyncStatus::Success) {
@@ -1132,40 +1931,79 @@ void ComputeRenderer::FlushRender() {
 		}
 	};
 
+	// Mapping completes once the GPU is done with this frame's copies
+	frame.future = frame.buffer.MapAsync(wgpu::MapMode::Write, 0, frame.buffer.GetSize(), wgpu::CallbackMode::WaitAnyOnly, callback);
+	frame.pending = true;
 
-	auto framebuffer_future = compute_transitional_buffer.MapAsync(wgpu::MapMode::Read, 0, framebuffer_size, wgpu::CallbackMode::WaitAnyOnly, callback);
-
-	std::vector<wgpu::FutureWaitInfo> futures{ { framebuffer_future } };
-	if (zbw != 0) {
-		auto depth_buffer_future = compute_depth_transitional_buffer.MapAsync(wgpu::MapMode::Read, 0, depth_buffer_size, wgpu::CallbackMode::WaitAnyOnly, callback);
-		futures.push_back({ depth_buffer_future });
-	}
-	
-	if (instance.WaitAny(futures.size(), futures.data(), UINT64_MAX) != wgpu::WaitStatus::Success) {
-		spdlog::error("ComputeRenderer: failed mapping buffers");
+	if (grow_vertex_buffer || grow_render_data_buffer) {
+		if (grow_vertex_buffer) {
+			vertex_buffer_size = std::min<uint32_t>(vertex_buffer_size * 2, MAX_UPLOAD_BUFFER_SIZE);
+		}
+		if (grow_render_data_buffer) {
+			render_data_buffer_size = std::min<uint32_t>(render_data_buffer_size * 2, MAX_UPLOAD_BUFFER_SIZE);
+		}
+		grow_vertex_buffer = false;
+		grow_render_data_buffer = false;
+		CreateUploadBuffers();
 	}
+	AcquireUploadFrame();
 
-	auto framebuffer = PSP::GetInstance()->VirtualToPhysical(current_fbp);
-	memcpy(framebuffer, compute_transitional_buffer.GetConstMappedRange(0, framebuffer_size), framebuffer_size);
-	compute_transitional_buffer.Unmap();
-
-	if (zbw != 0) {
-		auto depth_buffer = PSP::GetInstance()->VirtualToPhysical(current_zbp);
-		memcpy(depth_buffer, compute_depth_transitional_buffer.GetConstMappedRange(0, depth_buffer_size), depth_buffer_size);
-		compute_depth_transitional_buffer.Unmap();
-	}
+	compute_encoder = device.CreateCommandEncoder();
+	compute_pass_encoder = compute_encoder.BeginComputePass();
 
 	queue_empty = true;
+	submit_count++;
 	compute_vertex_buffer_offset = 0;
 	compute_render_data_offset = 0;
 
+	// Nothing recorded from here on can see what the freed textures held before
 	for (auto& entry : deleted_textures) {
-		entry.texture.Destroy();
+		RecycleTexture(entry);
 	}
 	deleted_textures.clear();
+	TrimTextureMemory();
+}
+
+bool ComputeRenderer::FitsUpload(uint32_t vertices_size, uint32_t render_data_size) {
+	bool vertices_fit = compute_vertex_buffer_offset + vertices_size <= vertex_buffer_size;
+	bool render_data_fit = compute_render_data_offset + render_data_size <= render_data_buffer_size;
+
+	// The caller flushes, the buffers that ran full are doubled for the next frame
+	grow_vertex_buffer |= !vertices_fit;
+	grow_render_data_buffer |= !render_data_fit;
+	return vertices_fit && render_data_fit;
 }
 
-uint32_t ComputeRenderer::PushVertices(std::vector<Vertex> vertices) {
+void ComputeRenderer::AcquireUploadFrame() {
+	upload_frame = (upload_frame + 1) % UPLOAD_FRAME_COUNT;
+	auto& frame = upload_frames[upload_frame];
+
+	// Only blocks when the GPU is still behind by the whole ring
+	if (frame.pending) {
+		instance.WaitAny(frame.future, UINT64_MAX);
+		frame.pending = false;
+	}
+
+	uint64_t size = vertex_buffer_size + render_data_buffer_size;
+	if (frame.buffer && (frame.buffer.GetSize() != size || frame.buffer.GetMapState() != wgpu::BufferMapState::Mapped)) {
+		frame.buffer.Destroy();
+		frame.buffer = nullptr;
+	}
+
+	if (!frame.buffer) {
+		wgpu::BufferDescriptor buffer_desc{};
+		buffer_desc.size = size;
+		buffer_desc.usage = wgpu::BufferUsage::MapWrite | wgpu::BufferUsage::CopySrc;
+		buffer_desc.mappedAtCreation = true;
+		buffer_desc.label = "upload_buffer";
+		frame.buffer = device.CreateBuffer(&buffer_desc);
+	}
+
+	compute_vertices = frame.buffer.GetMappedRange(0, vertex_buffer_size);
+	compute_render_data = frame.buffer.GetMappedRange(vertex_buffer_size, render_data_buffer_size);
+}
+
+uint32_t ComputeRenderer::PushVertices(std::initializer_list<Vertex> vertices, bool aligned) {
 	auto offset = compute_vertex_buffer_offset;
 	for (auto& vertex : vertices) {
 		auto compute_vertex = reinterpret_cast<ComputeVertex*>(reinterpret_cast<uintptr_t>(compute_vertices) + compute_vertex_buffer_offset);
@@ -1175,130 +2013,307 @@ uint32_t ComputeRenderer::PushVertices(std::vector<Vertex> vertices) {
 		compute_vertex_buffer_offset += sizeof(ComputeVertex);
 	}
 
-	compute_vertex_buffer_offset = ALIGN(compute_vertex_buffer_offset, buffer_alignment);
+	if (aligned) {
+		compute_vertex_buffer_offset = ALIGN(compute_vertex_buffer_offset, buffer_alignment);
+	}
 	return offset;
 }
 
-wgpu::BindGroup ComputeRenderer::GetTexture() {
-	auto& texture = textures[0];
-
-	auto psp = PSP::GetInstance();
-	float bpp{};
-
-
-	switch (texture_format) {
+static float GetBytesPerPixel(uint8_t format) {
+	switch (format) {
 	case SCEGU_PFIDX4:
-		bpp = 0.5;
-		break;
+		return 0.5;
 	case SCEGU_PFIDX8:
-		bpp = 1.0;
-		break;
+		return 1.0;
 	case SCEGU_PFDXT1:
+	case SCEGU_PFIDX16:
 	case SCEGU_PF5650:
 	case SCEGU_PF5551:
 	case SCEGU_PF4444:
-		bpp = 2.0;
-		break;
+		return 2.0;
 	case SCEGU_PFDXT3:
 	case SCEGU_PFDXT5:
 	case SCEGU_PFIDX32:
 	case SCEGU_PF8888:
-		bpp = 4.0;
-		break;
+		return 4.0;
 	default:
+		return 0.0;
+	}
+}
+
+wgpu::BindGroup ComputeRenderer::GetTexture() {
+	auto& texture = textures[0];
+
+	auto psp = PSP::GetInstance();
+	float bpp = GetBytesPerPixel(texture_format);
+	if (!bpp) {
 		spdlog::error("ComputeRenderer: unknown texture format {}", texture_format);
 		return nullptr;
 	}
 
-	uint32_t clamped_width = std::min(texture.width, 512u) * bpp;
-	uint32_t clamped_height = std::min(texture.height, 512u);
+	// textures larger than 512x512 will have issues with UV interpolation, let's just hope this doesn't happen
+	uint32_t decoded_width = std::min(texture.width, 512u);
+	uint32_t decoded_height = std::min(texture.height, 512u);
+	uint32_t clamped_width = decoded_width * bpp;
+	uint32_t clamped_height = decoded_height;
 	if (texture_format >= SCEGU_PFDXT1) {
 		clamped_height /= 4;
 	}
 
-	bool recreate_texture = true;
-	TextureCacheEntry cache{};
-	if (texture_cache.contains(texture.buffer)) {
-		cache = texture_cache[texture.buffer];
-		cache.unused_frames = 0;
+	// Render targets are copied on the GPU instead of going through guest memory
+	uint32_t pitch = texture.pitch * bpp;
+	RenderSurface* surface = nullptr;
+	if (!texture_swizzling && texture_format < SCEGU_PFDXT1) {
+		surface = FindRenderSurface(texture.buffer, pitch, clamped_width, clamped_height);
+	}
 
-		if (!cache.dirty) {
-			return cache.bind_group;
+	// Source rows are uploaded in whole swizzle blocks
+	uint32_t source_width = std::max(pitch, 1u);
+	uint32_t source_height = texture_swizzling ? ALIGN(clamped_height, 8) : std::max(clamped_height, 1u);
+
+	// Indexed textures are decoded again whenever the CLUT they were expanded with changes
+	uint64_t decode_key[] = { static_cast<uint64_t>(texture_format | texture_swizzling << 4), 0, 0 };
+	if (texture_format >= SCEGU_PFIDX4 && texture_format <= SCEGU_PFIDX32) {
+		decode_key[1] = current_clut;
+		decode_key[2] = clut_format | clut_shift << 8 | clut_mask << 16 | static_cast<uint64_t>(clut_offset) << 24;
+	}
+	uint64_t decode_state = HashMemory(decode_key, sizeof(decode_key));
+
+	// Every interpretation of the same bytes gets an entry of its own, so switching between them doesn't recreate textures
+	uint64_t key_data[] = { texture.buffer, static_cast<uint64_t>(texture_format | texture_swizzling << 4), texture.pitch, static_cast<uint64_t>(texture.width | texture.height << 16) };
+	uint64_t key = HashMemory(key_data, sizeof(key_data));
+
+	TextureCacheEntry* cache = nullptr;
+	auto it = texture_cache.find(key);
+	if (it != texture_cache.end()) {
+		texture_lru.splice(texture_lru.begin(), texture_lru, it->second);
+		cache = &*it->second;
+		cache->unused_frames = 0;
+
+		bool source_valid = !cache->dirty && (!surface || cache->draw_sequence == surface->draw_sequence);
+		if (source_valid) {
+			texture_statistics.hits++;
+
+			// The source bytes are still current, at most the expansion changed
+			if (cache->decode_state != decode_state) {
+				DecodeTexture(*cache, decode_state);
+			}
+			return cache->bind_group;
 		}
 
-		if (cache.texture.GetWidth() == clamped_width && cache.texture.GetHeight() == clamped_height) {
-			recreate_texture = false;
-		} else {
-			deleted_textures.push_back(cache);
+		if (cache->decode_submit == submit_count && !queue_empty) {
+			// A decode still waiting in the pass reads the old bytes, queue writes would land before it
+			FlushRender();
 		}
+	} else {
+		texture_statistics.misses++;
+		cache = &InsertTexture(key, source_width, source_height, decoded_width, decoded_height);
 	}
 
-	cache.size = texture.pitch * texture.height * bpp;
+	cache->addr = texture.buffer;
+	cache->size = texture.pitch * texture.height * bpp;
+	cache->dirty = false;
 
-	uint32_t pitch = texture.pitch * bpp;
-	if (recreate_texture) {
-		// textures larger than 512x512 will have issues with UV interpolation, let's just hope this doesn't happen
-		wgpu::TextureDescriptor texture_desc{};
-		texture_desc.dimension = wgpu::TextureDimension::e2D;
-		texture_desc.format = wgpu::TextureFormat::R8Uint;
-		texture_desc.size = { clamped_width, clamped_height, 1 };
-		texture_desc.sampleCount = 1;
-		texture_desc.mipLevelCount = 1;
-		texture_desc.usage = wgpu::TextureUsage::CopyDst | wgpu::TextureUsage::TextureBinding;
-		cache.texture = device.CreateTexture(&texture_desc);
-
-		wgpu::BindGroupEntry texture_binding{};
-		texture_binding.binding = 0;
-		texture_binding.textureView = cache.texture.CreateView();
-
-		wgpu::BindGroupDescriptor texture_bind_group_desc{};
-		texture_bind_group_desc.layout = compute_texture_bind_group_layout;
-		texture_bind_group_desc.entryCount = 1;
-		texture_bind_group_desc.entries = &texture_binding;
-		cache.bind_group = device.CreateBindGroup(&texture_bind_group_desc);
-	}
-
-	uint32_t* buffer = reinterpret_cast<uint32_t*>(psp->VirtualToPhysical(texture.buffer));
-
-	std::vector<uint32_t> unswizzled_texture{};
-	if (texture_swizzling) {
-		unswizzled_texture.resize(texture.width * texture.height);
-
-		// Shamelessly stolen from ppsspp
-		int bxc = pitch / 16;
-		int byc = (texture.height + 7) / 8;
-
-		uint32_t* ydest = unswizzled_texture.data();
-		for (int by = 0; by < byc; by++) {
-			uint32_t* xdest = ydest;
-			for (int bx = 0; bx < bxc; bx++) {
-				uint32_t* dest = xdest;
-				for (int n = 0; n < 8; n++) {
-					memcpy(dest, buffer, 16);
-					dest += (pitch >> 2);
-					buffer += 4;
-				}
-				xdest += 4;
-			}
-			ydest += (pitch >> 2) * 8;
+	if (surface) {
+		uint32_t offset = (texture.buffer & 0x0FFFFFFF) - surface->addr;
+		AcquireRows(*surface, offset / pitch, offset / pitch + clamped_height, false);
+		if (!queue_empty) {
+			FlushRender();
+		}
+
+		CopyTextureRect(surface->texture, surface->bpp, offset % pitch, offset / pitch, cache->texture, 1, 0, 0, clamped_width, clamped_height);
+		cache->draw_sequence = surface->draw_sequence;
+	} else {
+		uint64_t texture_begin = texture.buffer & 0x0FFFFFFF;
+		ReadbackSurfaces(texture_begin, texture_begin + cache->size);
+
+		// The guest bytes go up untouched, unswizzling and expansion happen in the decode pass
+		wgpu::TexelCopyTextureInfo destination{};
+		destination.texture = cache->texture;
+
+		wgpu::TexelCopyBufferLayout data_layout{};
+		data_layout.bytesPerRow = source_width;
+		data_layout.rowsPerImage = source_height;
+
+		// Rows past the end of the memory region are left as they are
+		wgpu::Extent3D texture_size{};
+		texture_size.width = source_width;
+		texture_size.height = std::min(source_height, psp->GetMaxSize(texture.buffer) / source_width);
+
+		auto buffer = psp->VirtualToPhysical(texture.buffer);
+		if (buffer && texture_size.height) {
+			queue.WriteTexture(&destination, buffer, source_width * texture_size.height, &data_layout, &texture_size);
+			texture_statistics.uploaded_bytes += source_width * texture_size.height;
 		}
-		buffer = unswizzled_texture.data();
 	}
 
-	wgpu::TexelCopyTextureInfo destination{};
-	destination.texture = cache.texture;
+	DecodeTexture(*cache, decode_state);
+	return cache->bind_group;
+}
 
-	wgpu::TexelCopyBufferLayout data_layout{};
-	data_layout.bytesPerRow = pitch;
-	data_layout.rowsPerImage = texture.height;
+ComputeRenderer::TextureCacheEntry& ComputeRenderer::InsertTexture(uint64_t key, uint32_t source_width, uint32_t source_height, uint32_t decoded_width, uint32_t decoded_height) {
+	// Freed textures of the same size come with their views and bind groups, only the contents are replaced
+	uint64_t pool_key = source_width | static_cast<uint64_t>(source_height) << 16 | static_cast<uint64_t>(decoded_width) << 32 | static_cast<uint64_t>(decoded_height) << 48;
+	TextureCacheEntry entry{};
+	auto pooled = texture_pool.find(pool_key);
+	if (pooled != texture_pool.end()) {
+		entry = pooled->second.back();
+		pooled->second.pop_back();
+		if (pooled->second.empty()) {
+			texture_pool.erase(pooled);
+		}
+		texture_pool_size -= entry.memory_size;
+		texture_statistics.pool_reuses++;
+	} else {
+		entry = CreateTexture(source_width, source_height, decoded_width, decoded_height);
+	}
 
-	wgpu::Extent3D texture_size{};
-	texture_size.width = std::min(pitch, clamped_width);
-	texture_size.height = clamped_height;
+	entry.key = key;
+	entry.unused_frames = 0;
+	entry.draw_sequence = 0;
+	entry.decode_state = 0;
+	entry.decode_submit = 0;
+	texture_cache_size += entry.memory_size;
+	texture_lru.push_front(entry);
+	texture_cache[key] = texture_lru.begin();
+
+	TrimTextureMemory();
+	return texture_lru.front();
+}
+
+ComputeRenderer::TextureCacheEntry ComputeRenderer::CreateTexture(uint32_t source_width, uint32_t source_height, uint32_t decoded_width, uint32_t decoded_height) {
+	TextureCacheEntry entry{};
+	entry.memory_size = source_width * source_height + decoded_width * decoded_height * 4;
+
+	wgpu::TextureDescriptor texture_desc{};
+	texture_desc.dimension = wgpu::TextureDimension::e2D;
+	texture_desc.format = wgpu::TextureFormat::R8Uint;
+	texture_desc.size = { source_width, source_height, 1 };
+	texture_desc.sampleCount = 1;
+	texture_desc.mipLevelCount = 1;
+	texture_desc.usage = wgpu::TextureUsage::CopyDst | wgpu::TextureUsage::TextureBinding;
+	entry.texture = device.CreateTexture(&texture_desc);
 
-	queue.WriteTexture(&destination, buffer, cache.size, &data_layout, &texture_size);
+	texture_desc.format = wgpu::TextureFormat::RGBA8Uint;
+	texture_desc.size = { decoded_width, decoded_height, 1 };
+	texture_desc.usage = wgpu::TextureUsage::StorageBinding | wgpu::TextureUsage::TextureBinding;
+	entry.decoded = device.CreateTexture(&texture_desc);
+
+	wgpu::BindGroupEntry texture_binding{};
+	texture_binding.binding = 0;
+	texture_binding.textureView = entry.decoded.CreateView();
+
+	wgpu::BindGroupDescriptor texture_bind_group_desc{};
+	texture_bind_group_desc.layout = compute_texture_bind_group_layout;
+	texture_bind_group_desc.entryCount = 1;
+	texture_bind_group_desc.entries = &texture_binding;
+	entry.bind_group = device.CreateBindGroup(&texture_bind_group_desc);
+
+	wgpu::BindGroupEntry decode_bindings[2]{};
+	decode_bindings[0].binding = 0;
+	decode_bindings[0].textureView = entry.texture.CreateView();
+
+	decode_bindings[1].binding = 1;
+	decode_bindings[1].textureView = entry.decoded.CreateView();
+
+	wgpu::BindGroupDescriptor decode_bind_group_desc{};
+	decode_bind_group_desc.layout = texture_decode_bind_group_layout;
+	decode_bind_group_desc.entryCount = 2;
+	decode_bind_group_desc.entries = decode_bindings;
+	entry.decode_bind_group = device.CreateBindGroup(&decode_bind_group_desc);
+	return entry;
+}
+
+void ComputeRenderer::EvictTexture(uint64_t key) {
+	auto it = texture_cache.find(key);
+	if (it == texture_cache.end()) {
+		return;
+	}
+
+	// The pass may still sample it, so it's only recycled once the pass is submitted
+	texture_cache_size -= it->second->memory_size;
+	deleted_textures.push_back(*it->second);
+	texture_lru.erase(it->second);
+	texture_cache.erase(it);
+	texture_statistics.evictions++;
+}
+
+void ComputeRenderer::RecycleTexture(TextureCacheEntry& entry) {
+	// Render surfaces come through here too, those don't have a decoded texture
+	if (!entry.decoded) {
+		entry.texture.Destroy();
+		return;
+	}
+
+	uint64_t pool_key = entry.texture.GetWidth() | static_cast<uint64_t>(entry.texture.GetHeight()) << 16 |
+		static_cast<uint64_t>(entry.decoded.GetWidth()) << 32 | static_cast<uint64_t>(entry.decoded.GetHeight()) << 48;
+	entry.unused_frames = 0;
+	texture_pool_size += entry.memory_size;
+	texture_pool[pool_key].push_back(entry);
+}
 
-	texture_cache[texture.buffer] = cache;
+void ComputeRenderer::TrimTextureMemory() {
+	// Pooled textures go first, they don't hold anything that would have to be uploaded again
+	while (texture_cache_size + texture_pool_size > texture_budget && !texture_pool.empty()) {
+		auto it = texture_pool.begin();
+		auto& entry = it->second.back();
+		texture_pool_size -= entry.memory_size;
+		entry.texture.Destroy();
+		entry.decoded.Destroy();
+
+		it->second.pop_back();
+		if (it->second.empty()) {
+			texture_pool.erase(it);
+		}
+	}
+
+	while (texture_cache_size > texture_budget && texture_lru.size() > 1) {
+		EvictTexture(texture_lru.back().key);
+	}
+}
+
+void ComputeRenderer::LogTextureStatistics() {
+	auto& stats = texture_statistics;
+	uint64_t lookups = stats.hits + stats.misses;
+	spdlog::debug("ComputeRenderer: texture cache hit rate {:.1f}%, {} KiB uploaded per frame, {} evictions, {} pool reuses, {} MiB resident, {} MiB pooled",
+		lookups ? stats.hits * 100.0 / lookups : 100.0, stats.uploaded_bytes / TEXTURE_STATISTICS_FRAMES / 1024, stats.evictions, stats.pool_reuses,
+		texture_cache_size / (1024 * 1024), texture_pool_size / (1024 * 1024));
+	texture_statistics = {};
+}
+
+void ComputeRenderer::DecodeTexture(TextureCacheEntry& cache, uint64_t decode_state) {
+	uint32_t decode_data_size = ALIGN(sizeof(DecodeData), buffer_alignment);
+	if (!FitsUpload(0, decode_data_size)) {
+		FlushRender();
+	}
 
-	return cache.bind_group;
+	// Recorded into the draw pass, so it runs after earlier draws sampled the previous contents
+	auto clut = clut_cache.find(current_clut);
+	uint32_t offset = PushDecodeData();
+	compute_pass_encoder.SetPipeline(texture_decode_pipeline);
+	compute_pass_encoder.SetBindGroup(0, decode_data_bind_group, 1, &offset);
+	compute_pass_encoder.SetBindGroup(1, clut != clut_cache.end() ? clut->second.bind_group : dummy_clut.bind_group, 0, nullptr);
+	compute_pass_encoder.SetBindGroup(2, cache.decode_bind_group, 0, nullptr);
+	compute_pass_encoder.DispatchWorkgroups((cache.decoded.GetWidth() + 7) / 8, (cache.decoded.GetHeight() + 7) / 8, 1);
+
+	queue_empty = false;
+	cache.decode_state = decode_state;
+	cache.decode_submit = submit_count;
+}
+
+uint32_t ComputeRenderer::PushDecodeData() {
+	uint32_t offset = compute_render_data_offset;
+
+	auto data = reinterpret_cast<DecodeData*>(reinterpret_cast<uintptr_t>(compute_render_data) + compute_render_data_offset);
+	data->format = texture_format;
+	data->swizzled = texture_swizzling;
+	data->pitch = std::max<uint32_t>(textures[0].pitch * GetBytesPerPixel(texture_format), 1);
+	data->clut_format = clut_format;
+	data->clut_shift = clut_shift;
+	data->clut_mask = clut_mask;
+	data->clut_offset = clut_offset & (clut_format == SCEGU_PF8888 ? 0xFF : 0x1FF);
+	compute_render_data_offset += sizeof(DecodeData);
+
+	compute_render_data_offset = ALIGN(compute_render_data_offset, buffer_alignment);
+	return offset;
 }
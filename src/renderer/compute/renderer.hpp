@@ -1,33 +1,52 @@
 #pragma once
 
 #include "../renderer.hpp"
+#include "pipelinecache.hpp"
 
+#include <array>
+#include <bitset>
+#include <list>
 #include <unordered_map>
 #include <webgpu/webgpu_cpp.h>
 
-constexpr auto MAX_BUFFER_VERTEX_COUNT = 65536;
-constexpr auto MAX_BUFFER_RENDER_DATA_COUNT = 16384;
+constexpr auto INITIAL_BUFFER_VERTEX_COUNT = 65536;
+constexpr auto INITIAL_BUFFER_RENDER_DATA_COUNT = 16384;
+constexpr auto MAX_UPLOAD_BUFFER_SIZE = 64 * 1024 * 1024;
+constexpr auto UPLOAD_FRAME_COUNT = 3;
+constexpr auto RENDER_SURFACE_HEIGHT = 512;
+constexpr auto PIPELINE_CONSTANT_COUNT = 16;
+constexpr uint64_t PIPELINE_CACHE_VERSION = 1;
+
+constexpr auto TEXTURE_STATISTICS_FRAMES = 600;
+
+// Has to match common.wgsl, every tile has one bit per triangle of a group
+constexpr auto TILE_SIZE = 8;
+constexpr auto TILE_COLUMNS = 128;
+constexpr auto TILE_ROWS = RENDER_SURFACE_HEIGHT / TILE_SIZE;
+constexpr auto MAX_TILED_TRIANGLES = 2048;
 
 class ComputeRenderer : public Renderer {
 public:
-	ComputeRenderer(bool nearest_filtering);
+	ComputeRenderer(bool nearest_filtering, uint64_t texture_budget = DEFAULT_TEXTURE_BUDGET, bool headless = false);
 	~ComputeRenderer();
 
 	void Frame();
 	void Resize(int width, int height);
 	void RenderFramebufferChange() { compute_texture_valid = false; }
 	void SetFrameBuffer(uint32_t frame_buffer, int frame_width, int pixel_format);
+	void DrawBatch(const PrimitiveBatch& batch);
 	void DrawPoint(Vertex point);
 	void DrawLine(Vertex start, Vertex end);
-	void DrawLineStrip(std::vector<Vertex> vertices);
 	void DrawRectangle(Vertex start, Vertex end);
 	void DrawTriangle(Vertex v0, Vertex v1, Vertex v2);
-	void DrawTriangleStrip(std::vector<Vertex> vertices);
-	void DrawTriangleFan(std::vector<Vertex> vertices);
 	void ClearTextureCache();
 	void ClearTextureCache(uint32_t addr, uint32_t size);
+	void SyncMemory(uint32_t addr, uint32_t size);
+	bool TransferBlock(uint32_t src_addr, uint32_t src_pitch, uint32_t dst_addr, uint32_t dst_pitch, uint32_t width, uint32_t height);
 	void FlushRender();
 	void CLoad(uint32_t opcode);
+	void LoadPipelineCache(const std::filesystem::path& path, bool report);
+	bool ReadFrame(std::vector<uint8_t>& pixels, uint32_t& width, uint32_t& height);
 private:
 	struct ComputeVertex {
         alignas(16) glm::vec4 pos;
@@ -38,22 +57,70 @@ private:
 	struct RenderData {
 		alignas(8) glm::uvec2 scissor_start;
 		alignas(8) glm::uvec2 scissor_end;
-		alignas(4) uint32_t clut_shift;
-		alignas(4) uint32_t clut_mask;
-		alignas(4) uint32_t clut_offset;
 		alignas(16) glm::ivec4 blend_afix;
 		alignas(16) glm::ivec4 blend_bfix;
 		alignas(4) uint32_t alpha_mask;
 		alignas(4) uint32_t alpha_ref;
 		alignas(16) glm::ivec4 environment_texture;
+		alignas(16) glm::uvec4 pipeline_state[PIPELINE_CONSTANT_COUNT / 4];
+		alignas(8) glm::uvec2 tile_start;
+		alignas(4) uint32_t triangle_count;
 	};
 
+	struct DecodeData {
+		alignas(4) uint32_t format;
+		alignas(4) uint32_t swizzled;
+		alignas(4) uint32_t pitch;
+		alignas(4) uint32_t clut_format;
+		alignas(4) uint32_t clut_shift;
+		alignas(4) uint32_t clut_mask;
+		alignas(4) uint32_t clut_offset;
+	};
+
+	// The guest bytes are kept as they are in texture, decoded holds the RGBA8 texels drawing samples from
 	struct TextureCacheEntry {
+		uint64_t key;
+		uint32_t addr;
+		uint32_t memory_size;
 		int unused_frames;
 		bool dirty;
 		uint32_t size;
+		uint64_t draw_sequence;
+		uint64_t decode_state;
+		uint64_t decode_submit;
 		wgpu::Texture texture;
+		wgpu::Texture decoded;
 		wgpu::BindGroup bind_group;
+		wgpu::BindGroup decode_bind_group;
+	};
+
+	// Guest memory mirrored by a GPU texture. Dirty rows were only drawn on the GPU so far, stale rows were written outside of it
+	struct RenderSurface {
+		uint32_t addr;
+		uint32_t pitch;
+		uint32_t bpp;
+		int unused_frames;
+		uint64_t draw_sequence;
+		std::bitset<RENDER_SURFACE_HEIGHT> dirty;
+		std::bitset<RENDER_SURFACE_HEIGHT> stale;
+		// Guest memory of each row as of the last upload or readback, a mismatch means the CPU wrote it since
+		std::array<uint64_t, RENDER_SURFACE_HEIGHT> row_hashes;
+		wgpu::Texture texture;
+	};
+
+	// Staging memory recorded into while the GPU still runs earlier submits, mapped again once it's done with it
+	struct UploadFrame {
+		wgpu::Buffer buffer;
+		wgpu::Future future;
+		bool pending;
+	};
+
+	struct TextureStatistics {
+		uint64_t hits;
+		uint64_t misses;
+		uint64_t pool_reuses;
+		uint64_t evictions;
+		uint64_t uploaded_bytes;
 	};
 
 	struct ClutCacheEntry {
@@ -94,15 +161,59 @@ private:
 	void SetupRenderPipeline(wgpu::ShaderModule shader_module);
 	void SetupRenderBindGroup(bool nearest_filtering);
 	void SetupFramebufferConversion(wgpu::ShaderModule shader_module);
+	void SetupTextureDecode();
+	void CreateUploadBuffers();
+	void AcquireUploadFrame();
+	bool FitsUpload(uint32_t vertices_size, uint32_t render_data_size);
 
-	wgpu::ComputePipeline GetShader(uint8_t primitive_type, uint8_t filter);
+	ShaderID GetShaderID(uint8_t primitive_type, uint8_t filter);
+	wgpu::ComputePipeline GetShader(ShaderID id);
+	wgpu::ComputePipeline GetUbershader(ShaderID id);
+	void CompileUbershader(ShaderID key);
+	void CreateUbershaders();
+	static std::array<uint32_t, PIPELINE_CONSTANT_COUNT> GetPipelineConstants(ShaderID id);
+	static std::string GetShaderCode(ShaderID id, bool ubershader);
+	wgpu::ComputePipeline CompilePipeline(ShaderID id, bool async);
+	void CollectPipelines();
+	wgpu::Texture CreateRenderTexture(uint32_t width, wgpu::TextureFormat format);
 	void UpdateRenderTexture();
-	uint32_t PushRenderData();
-	uint32_t PushVertices(std::vector<Vertex> vertices);
+	void UpdateFramebufferTexture(const wgpu::CommandEncoder& encoder);
+	RenderSurface& GetRenderSurface(uint32_t addr, uint32_t pitch, uint32_t bpp);
+	RenderSurface* FindRenderSurface(uint32_t addr, uint32_t pitch, uint32_t width, uint32_t height);
+	bool OverlapsRenderSurface(uint64_t addr, uint64_t addr_end) const;
+	void AcquireRows(RenderSurface& surface, uint32_t first_row, uint32_t last_row, bool write);
+	void ReadbackSurfaces(uint64_t addr, uint64_t addr_end, const RenderSurface* exclude = nullptr, uint64_t keep_addr = 0, uint64_t keep_end = 0);
+	void ReadbackSurface(RenderSurface& surface, uint64_t addr, uint64_t addr_end, uint64_t keep_addr, uint64_t keep_end);
+	void InvalidateSurfaces(uint64_t addr, uint64_t addr_end, const RenderSurface* exclude = nullptr);
+	void UploadStaleRows(RenderSurface& surface, uint32_t first_row, uint32_t last_row);
+	void StoreRowHashes(RenderSurface& surface, const std::bitset<RENDER_SURFACE_HEIGHT>& rows);
+	bool InvalidateWrittenRows(RenderSurface& surface, uint32_t first_row, uint32_t last_row);
+	void EvictRenderSurface(RenderSurface& surface);
+	void CopyTextureRect(const wgpu::Texture& source, uint32_t source_bpp, uint32_t source_x, uint32_t source_y, const wgpu::Texture& destination, uint32_t destination_bpp, uint32_t destination_x, uint32_t destination_y, uint32_t width, uint32_t height);
+	void MarkTexturesDirty(uint32_t addr, uint32_t size);
+	void BindBatchState();
+	void DispatchPrimitive(uint8_t primitive_type, uint8_t filter, std::initializer_list<Vertex> vertices, uint32_t workgroup_count_x, uint32_t workgroup_count_y);
+	uint32_t PushRenderData(ShaderID state);
+	void QueueTriangle(uint8_t filter, std::initializer_list<Vertex> vertices, glm::ivec2 min, glm::ivec2 max);
+	void FlushTriangles();
+	uint32_t PushVertices(std::initializer_list<Vertex> vertices, bool aligned = true);
+	uint32_t PushDecodeData();
 	wgpu::BindGroup GetTexture();
+	TextureCacheEntry& InsertTexture(uint64_t key, uint32_t source_width, uint32_t source_height, uint32_t decoded_width, uint32_t decoded_height);
+	TextureCacheEntry CreateTexture(uint32_t source_width, uint32_t source_height, uint32_t decoded_width, uint32_t decoded_height);
+	void EvictTexture(uint64_t key);
+	void RecycleTexture(TextureCacheEntry& entry);
+	void TrimTextureMemory();
+	void LogTextureStatistics();
+	void DecodeTexture(TextureCacheEntry& cache, uint64_t decode_state);
+	ClutCacheEntry CreateClut(const void* data);
+
+	// Dawn can still store blobs while the device goes away, so the cache has to outlive it
+	PipelineCache pipeline_cache{};
 
 	wgpu::Instance instance;
 	wgpu::Surface surface;
+	wgpu::Texture offscreen_texture;
 	wgpu::Adapter adapter;
 	wgpu::Device device;
 	wgpu::Queue queue;
@@ -120,8 +231,18 @@ private:
 	wgpu::BindGroup framebuffer_conversion_bind_group;
 	wgpu::ComputePipeline framebuffer_conversion_pipelines[3];
 
+	wgpu::BindGroupLayout texture_decode_bind_group_layout;
+	wgpu::BindGroupLayout decode_data_bind_group_layout;
+	wgpu::BindGroup decode_data_bind_group;
+	wgpu::PipelineLayout texture_decode_layout;
+	wgpu::ComputePipeline texture_decode_pipeline;
+
 	std::unordered_map<uint64_t, wgpu::ComputePipeline> compute_pipelines{};
+	std::unordered_map<uint64_t, wgpu::Future> pending_pipelines{};
+	std::unordered_map<uint64_t, wgpu::ComputePipeline> ubershaders{};
+	std::unordered_map<uint64_t, wgpu::Future> pending_ubershaders{};
 	bool queue_empty = true;
+	uint64_t submit_count = 0;
 	wgpu::CommandEncoder compute_encoder;
 	wgpu::ComputePassEncoder compute_pass_encoder;
 	wgpu::BindGroupLayout compute_texture_bind_group_layout;
@@ -133,29 +254,56 @@ private:
 	wgpu::PipelineLayout compute_layout;
 	wgpu::PipelineLayout compute_texture_layout;
 	bool compute_texture_valid = false;
-	wgpu::Texture compute_texture;
-	wgpu::Texture compute_16bit_texture;
-	wgpu::Texture compute_depth_texture;
-	void* compute_vertices;
+	wgpu::Texture dummy_texture;
+	wgpu::Texture dummy_16bit_texture;
+	wgpu::Texture dummy_depth_texture;
+	std::array<UploadFrame, UPLOAD_FRAME_COUNT> upload_frames{};
+	size_t upload_frame = 0;
+	bool grow_vertex_buffer = false;
+	bool grow_render_data_buffer = false;
+	void* compute_vertices = nullptr;
 	uint32_t compute_vertex_buffer_offset = 0;
+	uint32_t vertex_buffer_size = sizeof(ComputeVertex) * INITIAL_BUFFER_VERTEX_COUNT;
 	wgpu::Buffer compute_vertex_buffer;
-	void* compute_render_data;
+	void* compute_render_data = nullptr;
 	uint32_t compute_render_data_offset = 0;
+	uint32_t render_data_buffer_size = sizeof(RenderData) * INITIAL_BUFFER_RENDER_DATA_COUNT;
 	wgpu::Buffer compute_render_data_buffer;
-	wgpu::Buffer compute_transitional_buffer;
-	wgpu::Buffer compute_depth_transitional_buffer;
-	uint32_t current_fpf = 0;
-	uint32_t current_fbp = 0;
-	uint32_t current_zbp = 0;
+	wgpu::Buffer readback_buffer;
+	wgpu::Buffer copy_buffer;
+	uint32_t batch_render_data_offset = 0;
+	uint64_t batch_state = UINT64_MAX;
+
+	wgpu::Buffer tile_bin_buffer;
+	wgpu::ComputePipeline tile_bin_pipeline;
+	ShaderID triangle_group_id{};
+	uint32_t triangle_count = 0;
+	uint32_t triangle_offset = 0;
+	glm::uvec2 triangle_tile_min{};
+	glm::uvec2 triangle_tile_max{};
+	wgpu::ComputePipeline batch_pipeline;
+
+	std::unordered_map<uint32_t, RenderSurface> render_surfaces{};
+	RenderSurface* color_surface = nullptr;
+	RenderSurface* depth_surface = nullptr;
 
-	std::unordered_map<uint32_t, TextureCacheEntry> texture_cache{};
+	std::list<TextureCacheEntry> texture_lru{};
+	std::unordered_map<uint64_t, std::list<TextureCacheEntry>::iterator> texture_cache{};
+	std::unordered_map<uint64_t, std::vector<TextureCacheEntry>> texture_pool{};
 	std::vector<TextureCacheEntry> deleted_textures{};
+	uint64_t texture_budget = DEFAULT_TEXTURE_BUDGET;
+	uint64_t texture_cache_size = 0;
+	uint64_t texture_pool_size = 0;
+	TextureStatistics texture_statistics{};
+	int statistics_frames = 0;
 	std::unordered_map<uint64_t, ClutCacheEntry> clut_cache{};
+	ClutCacheEntry dummy_clut{};
 	uint64_t current_clut = 0;
 
 	wgpu::Buffer frame_width_buffer;
 	wgpu::Sampler screen_sampler;
 	wgpu::Texture framebuffer_texture;
+	uint64_t framebuffer_state = 0;
 	uint32_t frame_buffer = 0;
 	int pixel_format = 0;
 	int frame_width = 0;
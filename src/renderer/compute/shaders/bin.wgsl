@@ -0,0 +1,23 @@
+R"(
+// One invocation per triangle, the bit position in each tile keeps the triangles in submission order
+@compute @workgroup_size(64)
+fn binTriangles(@builtin(global_invocation_id) id: vec3u) {
+    if id.x >= renderData.triangleCount {
+        return;
+    }
+
+    // Clipped the same way as on the CPU, which already dropped the triangles outside of the scissor
+    let bounds = vec4i(triangles[id.x].vertices[3].pos);
+    let limit = vec2i(vec2u(TILE_COLUMNS, TILE_ROWS) * TILE_SIZE) - 1;
+    let first = vec2u(max(bounds.xy, renderData.scissorStart)) / TILE_SIZE;
+    let last = vec2u(min(min(bounds.zw, renderData.scissorEnd), limit)) / TILE_SIZE;
+
+    let word = id.x / 32;
+    let bit = 1u << (id.x % 32);
+    for (var y = first.y; y <= last.y; y++) {
+        for (var x = first.x; x <= last.x; x++) {
+            atomicOr(&bins[(y * TILE_COLUMNS + x) * BIN_WORDS + word], bit);
+        }
+    }
+}
+)"
\ No newline at end of file
@@ -0,0 +1,191 @@
+R"(
+struct DecodeData {
+    format: u32,
+    swizzled: u32,
+    pitch: u32,
+    clutFormat: u32,
+    clutShift: u32,
+    clutMask: u32,
+    clutOffset: u32
+}
+
+@group(0) @binding(0) var<uniform> decodeData: DecodeData;
+@group(1) @binding(0) var clut: texture_1d<u32>;
+@group(2) @binding(0) var source: texture_2d<u32>;
+@group(2) @binding(1) var decoded: texture_storage_2d<rgba8uint, write>;
+
+// The source holds the guest bytes as they are, swizzled ones in 16 byte x 8 row blocks
+fn loadByte(x: u32, y: u32) -> u32 {
+    var offset = y * decodeData.pitch + x;
+    if decodeData.swizzled == 1 {
+        let block = (y / 8) * (decodeData.pitch / 16) + x / 16;
+        offset = block * 128 + (y % 8) * 16 + x % 16;
+    }
+    return textureLoad(source, vec2u(offset % decodeData.pitch, offset / decodeData.pitch), 0).r;
+}
+
+fn load16(x: u32, y: u32) -> u32 {
+    return (loadByte(x + 1, y) << 8) | loadByte(x, y);
+}
+
+fn load32(x: u32, y: u32) -> u32 {
+    return (load16(x + 2, y) << 16) | load16(x, y);
+}
+
+fn decode16(value: u32, format: u32) -> vec4u {
+    switch format {
+        case 0u: {
+            let r = extractBits(value, 0u, 5u);
+            let g = extractBits(value, 5u, 6u);
+            let b = extractBits(value, 11u, 5u);
+            return vec4u((r << 3) | (r >> 2), (g << 2) | (g >> 4), (b << 3) | (b >> 2), 0xFF);
+        }
+        case 1u: {
+            let r = extractBits(value, 0u, 5u);
+            let g = extractBits(value, 5u, 5u);
+            let b = extractBits(value, 10u, 5u);
+            let a = extractBits(value, 15u, 1u);
+            return vec4u((r << 3) | (r >> 2), (g << 3) | (g >> 2), (b << 3) | (b >> 2), a * 255);
+        }
+        default: {
+            let r = extractBits(value, 0u, 4u);
+            let g = extractBits(value, 4u, 4u);
+            let b = extractBits(value, 8u, 4u);
+            let a = extractBits(value, 12u, 4u);
+            return vec4u((r << 4) | r, (g << 4) | g, (b << 4) | b, (a << 4) | a);
+        }
+    }
+}
+
+fn unpack32(value: u32) -> vec4u {
+    return vec4u(value & 0xFF, (value >> 8) & 0xFF, (value >> 16) & 0xFF, value >> 24);
+}
+
+fn fetchClut(index: u32) -> vec4u {
+    let i = ((index >> decodeData.clutShift) & decodeData.clutMask) | decodeData.clutOffset;
+    if decodeData.clutFormat == 3 {
+        return textureLoad(clut, i, 0);
+    }
+
+    // Two 16 bit entries share every texel of the CLUT texture
+    let value = textureLoad(clut, i / 2, 0);
+    let color = select((value.a << 8) | value.b, (value.g << 8) | value.r, i % 2 == 0);
+    return decode16(color, decodeData.clutFormat);
+}
+
+fn fetchDXTColor(block_pos: vec2u, local_pos: vec2u, alpha: u32) -> vec4u {
+    let color1 = load16(block_pos.x + 4, block_pos.y);
+    let color2 = load16(block_pos.x + 6, block_pos.y);
+
+    let rgb1 = vec4u((color1 >> 8) & 0xF8, (color1 >> 3) & 0xFC, (color1 << 3) & 0xF8, alpha);
+    let rgb2 = vec4u((color2 >> 8) & 0xF8, (color2 >> 3) & 0xFC, (color2 << 3) & 0xF8, alpha);
+
+    let color_index = (loadByte(block_pos.x + local_pos.y, block_pos.y) >> (local_pos.x * 2)) & 3;
+
+    if color_index == 0 {
+        return rgb1;
+    } else if color_index == 1 {
+        return rgb2;
+    } else if color1 > color2 {
+        if color_index == 2 {
+            return (rgb1 + rgb1 + rgb2) / 3;
+        }
+        return (rgb1 + rgb2 + rgb2) / 3;
+    } else if (color_index == 3) {
+        return vec4u(0);
+    }
+
+    return (rgb1 + rgb2) / 2;
+}
+
+fn decodeDXT5Alpha(block_pos: vec2u, local_pos: vec2u, color: vec4u) -> vec4u {
+    let alpha_data2 = load32(block_pos.x + 8, block_pos.y);
+    let alpha_data1 = load16(block_pos.x + 12, block_pos.y);
+
+    // WGSL doesn't support 64bit numbers, yikes
+    var alpha_index = 0u;
+    let alpha_index_bit = local_pos.y * 12 + local_pos.x * 3;
+    if ((alpha_index_bit + 3) <= 32) {
+        alpha_index = extractBits(alpha_data2, alpha_index_bit, 3u);
+    } else if (alpha_index_bit >= 32) {
+        alpha_index = extractBits(alpha_data1, alpha_index_bit - 32, 3u);
+    } else {
+        let lo_bits = 32u - alpha_index_bit;
+        let hi_bits = 3u - lo_bits;
+
+        let lo = extractBits(alpha_data2, alpha_index_bit, lo_bits);
+        let hi = extractBits(alpha_data1, 0u, hi_bits);
+        alpha_index = (hi << lo_bits) | lo;
+    }
+
+    let alpha1 = loadByte(block_pos.x + 14, block_pos.y);
+    let alpha2 = loadByte(block_pos.x + 15, block_pos.y);
+    if alpha_index == 0 {
+        return vec4u(color.r, color.g, color.b, alpha1);
+    } else if alpha_index == 1 {
+        return vec4u(color.r, color.g, color.b, alpha2);
+    } else if alpha1 > alpha2 {
+        let lerp_alpha1 = (alpha1 * ((7 - (alpha_index - 1)) << 8)) / 7;
+        let lerp_alpha2 = (alpha2 * ((alpha_index - 1) << 8)) / 7;
+        return vec4u(color.r, color.g, color.b, ((lerp_alpha1 + lerp_alpha2 + 31) >> 8) & 0xFF);
+    } else if alpha_index == 6 {
+        return color;
+    } else if alpha_index == 7 {
+        return vec4u(color.r, color.g, color.b, 0xFF);
+    }
+
+    let lerp_alpha1 = (alpha1 * ((5 - (alpha_index - 1)) << 8)) / 5;
+    let lerp_alpha2 = (alpha2 * ((alpha_index - 1) << 8)) / 5;
+    return vec4u(color.r, color.g, color.b, ((lerp_alpha1 + lerp_alpha2 + 31) >> 8) & 0xFF);
+}
+
+fn decodeTexel(pos: vec2u) -> vec4u {
+    switch decodeData.format {
+        case 0u, 1u, 2u: {
+            return decode16(load16(pos.x * 2, pos.y), decodeData.format);
+        }
+        case 3u: {
+            return unpack32(load32(pos.x * 4, pos.y));
+        }
+        case 4u: {
+            let index = loadByte(pos.x / 2, pos.y);
+            return fetchClut(extractBits(index, select(4u, 0u, pos.x % 2 == 0), 4u));
+        }
+        case 5u: {
+            return fetchClut(loadByte(pos.x, pos.y));
+        }
+        case 6u: {
+            return fetchClut(load16(pos.x * 2, pos.y));
+        }
+        case 7u: {
+            return fetchClut(load32(pos.x * 4, pos.y));
+        }
+        case 8u: {
+            let local_pos = pos % 4;
+            let block_pos = vec2u((pos.x - local_pos.x) * 2, pos.y / 4);
+            return fetchDXTColor(block_pos, local_pos, 0xFF);
+        }
+        case 9u: {
+            let local_pos = pos % 4;
+            let block_pos = vec2u((pos.x - local_pos.x) * 4, pos.y / 4);
+            let color = fetchDXTColor(block_pos, local_pos, 0);
+            let alpha = load16(block_pos.x + 8 + local_pos.y * 2, block_pos.y);
+            return vec4u(color.r, color.g, color.b, ((alpha >> (local_pos.x * 4)) & 0xF) << 4);
+        }
+        case 10u: {
+            let local_pos = pos % 4;
+            let block_pos = vec2u((pos.x - local_pos.x) * 4, pos.y / 4);
+            return decodeDXT5Alpha(block_pos, local_pos, fetchDXTColor(block_pos, local_pos, 0));
+        }
+        default: { return vec4u(255, 0, 0, 255); }
+    }
+}
+
+@compute @workgroup_size(8, 8)
+fn decode(@builtin(global_invocation_id) id: vec3u) {
+    if any(id.xy >= textureDimensions(decoded)) {
+        return;
+    }
+    textureStore(decoded, id.xy, decodeTexel(id.xy));
+}
+)"
\ No newline at end of file
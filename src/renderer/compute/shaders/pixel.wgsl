@@ -70,10 +70,15 @@ fn test(func: u32, src: u32, dst: u32) -> bool {
     }
 }
 
-fn loadPixel(pos: vec2i) -> vec4u {
+// A framebuffer pixel while it is being shaded
+struct Fragment {
+    color: vec4u,
+    depth: u32
+}
+
+fn unpackPixel(pixel: u32) -> vec4u {
     switch (FRAMEBUFFER_FORMAT) {
     case 0u: {
-        let pixel = textureLoad(framebuffer16, pos).r;
         let r = extractBits(pixel, 0u, 5u);
         let g = extractBits(pixel, 5u, 6u);
         let b = extractBits(pixel, 11u, 5u);
@@ -86,7 +91,6 @@ fn loadPixel(pos: vec2i) -> vec4u {
         );
     }
     case 1u: {
-        let pixel = textureLoad(framebuffer16, pos).r;
         let r = extractBits(pixel, 0u, 5u);
         let g = extractBits(pixel, 5u, 5u);
         let b = extractBits(pixel, 10u, 5u);
@@ -99,8 +103,7 @@ fn loadPixel(pos: vec2i) -> vec4u {
             select(0u, 255u, a == 1)
         );
     }
-    case 2u: {
-        let pixel = textureLoad(framebuffer16, pos).r;
+    default: {
         let r = extractBits(pixel, 0u, 4u);
         let g = extractBits(pixel, 4u, 4u);
         let b = extractBits(pixel, 8u, 4u);
@@ -113,25 +116,17 @@ fn loadPixel(pos: vec2i) -> vec4u {
             (a << 4) | a
         );
     }
-    case 3u: {
-        return textureLoad(framebuffer, pos);
-    }
-    default: { break; }
     }
-
-    return vec4u(0);
 }
 
-fn storePixel(pos: vec2i, color: vec4u) {
+fn packPixel(color: vec4u) -> u32 {
     switch (FRAMEBUFFER_FORMAT) {
     case 0u: {
         let r = color.r >> 3;
         let g = color.g >> 2;
         let b = color.b >> 3;
 
-        let value = (b << 11) | (g << 5) | r;
-
-        textureStore(framebuffer16, pos, vec4u(value));
+        return (b << 11) | (g << 5) | r;
     }
     case 1u: {
         let r = color.r >> 3;
@@ -139,35 +134,43 @@ fn storePixel(pos: vec2i, color: vec4u) {
         let b = color.b >> 3;
         let a = select(0u, 1u, color.a > 0);
 
-        let value = (a << 15) | (b << 10) | (g << 5) | r;
-        textureStore(framebuffer16, pos, vec4u(value));
+        return (a << 15) | (b << 10) | (g << 5) | r;
     }
-    case 2u: {
+    default: {
         let r = color.r >> 4;
         let g = color.g >> 4;
         let b = color.b >> 4;
         let a = color.a >> 4;
 
-        let value = (a << 12) | (b << 8) | (g << 4) | r;
-        textureStore(framebuffer16, pos, vec4u(value));
+        return (a << 12) | (b << 8) | (g << 4) | r;
     }
-    case 3u: {
-        textureStore(framebuffer, pos, color);
     }
-    default: { break; }
+}
+
+fn loadPixel(pos: vec2i) -> vec4u {
+    if FRAMEBUFFER_FORMAT == 3 {
+        return textureLoad(framebuffer, pos);
     }
+    return unpackPixel(textureLoad(framebuffer16, pos).r);
 }
 
-fn drawPixel(pos: vec4i, uv: vec2f, c: vec4u) {
-    if pos.x < renderData.scissorStart.x || pos.x > renderData.scissorEnd.x 
-    ||  pos.y < renderData.scissorStart.y || pos.y > renderData.scissorEnd.y {
-        return;
+fn storePixel(pos: vec2i, color: vec4u) {
+    if FRAMEBUFFER_FORMAT == 3 {
+        textureStore(framebuffer, pos, color);
+    } else {
+        textureStore(framebuffer16, pos, vec4u(packPixel(color)));
     }
+}
+
+fn insideScissor(pos: vec2i) -> bool {
+    return all(pos >= renderData.scissorStart) && all(pos <= renderData.scissorEnd);
+}
 
+// Runs the depth test, texturing, alpha test and blending against dst, false when the fragment is discarded
+fn shadePixel(pos: vec4i, uv: vec2f, c: vec4u, dst: ptr<function, Fragment>) -> bool {
     if DEPTH_FUNC != 100 {
-        let dstDepth = textureLoad(depthBuffer, pos.xy).r;
-        if !test(DEPTH_FUNC, u32(pos.z), dstDepth) {
-            return;
+        if !test(DEPTH_FUNC, u32(pos.z), (*dst).depth) {
+            return false;
         }
     }
 
@@ -178,19 +181,37 @@ fn drawPixel(pos: vec4i, uv: vec2f, c: vec4u) {
 
     if ALPHA_FUNC != 100 {
         if !test(ALPHA_FUNC, color.a & renderData.alphaMask, renderData.alphaRef) {
-            return;
+            return false;
         }
     }
 
-    let dst = loadPixel(pos.xy);
     if BLEND_OPERATION != 100 {
-        color = blend(vec4i(color), vec4i(dst));
+        color = blend(vec4i(color), vec4i((*dst).color));
     }
-    color.a = dst.a;
+    color.a = (*dst).color.a;
 
-    storePixel(pos.xy, color);
+    (*dst).color = color;
     if DEPTH_WRITE == 1 {
-        textureStore(depthBuffer, pos.xy, vec4u(u32(pos.z)));
+        (*dst).depth = u32(pos.z) & 0xFFFF;
+    }
+    return true;
+}
+
+fn drawPixel(pos: vec4i, uv: vec2f, c: vec4u) {
+    if !insideScissor(pos.xy) {
+        return;
+    }
+
+    var dst = Fragment(loadPixel(pos.xy), 0u);
+    if DEPTH_FUNC != 100 {
+        dst.depth = textureLoad(depthBuffer, pos.xy).r;
+    }
+
+    if shadePixel(pos, uv, c, &dst) {
+        storePixel(pos.xy, dst.color);
+        if DEPTH_WRITE == 1 {
+            textureStore(depthBuffer, pos.xy, vec4u(dst.depth));
+        }
     }
 }
 )"
\ No newline at end of file
@@ -3,6 +3,7 @@ R"(
 
 @compute @workgroup_size(1, 1)
 fn draw(@builtin(global_invocation_id) id: vec3u) {
+    loadPipelineState();
     drawPixel(vec4i(vertex.pos), vertex.uv, vertex.color);
 }
 )"
\ No newline at end of file
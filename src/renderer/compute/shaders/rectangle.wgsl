@@ -8,6 +8,7 @@ struct Vertices {
 
 @compute @workgroup_size(8, 8)
 fn draw(@builtin(global_invocation_id) id: vec3u) {
+    loadPipelineState();
     let fid = vec4f(vec3f(id), 0.0);
     let pos = vertices.start.pos + fid;
 
@@ -8,10 +8,26 @@ constexpr const char common_shader[] =
 #include "common.wgsl"
 ;
 
+constexpr const char specialized_shader[] =
+#include "specialized.wgsl"
+;
+
+constexpr const char ubershader_shader[] =
+#include "ubershader.wgsl"
+;
+
 constexpr const char texture_shader[] =
 #include "texture.wgsl"
 ;
 
+constexpr const char bin_shader[] =
+#include "bin.wgsl"
+;
+
+constexpr const char decode_shader[] =
+#include "decode.wgsl"
+;
+
 constexpr const char pixel_shader[] =
 #include "pixel.wgsl"
 ;
@@ -0,0 +1,20 @@
+R"(
+override FRAMEBUFFER_FORMAT: u32 = 0;
+override TEXTURE_FORMAT: u32 = 100;
+override BILINEAR: u32 = 0;
+override U_CLAMP: u32 = 0;
+override V_CLAMP: u32 = 0;
+override CLUT_FORMAT: u32 = 0;
+override BLEND_OPERATION: u32 = 100;
+override BLEND_SOURCE: u32 = 0;
+override BLEND_DESTINATION: u32 = 0;
+override ALPHA_FUNC: u32 = 100;
+override USE_TEXTURE_ALPHA: u32 = 0;
+override FRAGMENT_DOUBLE : u32 = 0;
+override TEXTURE_FUNCTION : u32 = 0;
+override DEPTH_FUNC: u32 = 100;
+override DEPTH_WRITE: u32 = 0;
+override GOURAUD_SHADING: u32 = 0;
+
+fn loadPipelineState() {}
+)"
\ No newline at end of file
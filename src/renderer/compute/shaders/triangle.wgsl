@@ -1,5 +1,5 @@
 R"(
-@group(1) @binding(1) var<uniform> vertices: array<Vertex, 4>;
+var<workgroup> tileBins: array<u32, BIN_WORDS>;
 
 fn edge(v0: vec4f, v1: vec4f, v2: vec4f) -> f32 {
     return (v1.x - v0.x) * (v2.y - v0.y) - (v1.y - v0.y) * (v2.x - v0.x);
@@ -9,38 +9,90 @@ fn topLeft(v0: vec4f, v1: vec4f) -> bool {
     return (v0.y == v1.y && v1.x > v0.x) || (v0.y > v1.y);
 }
 
+fn drawTriangle(index: u32, pixel: vec2i, dst: ptr<function, Fragment>) -> bool {
+    let v0 = triangles[index].vertices[0];
+    let v1 = triangles[index].vertices[1];
+    let v2 = triangles[index].vertices[2];
+    var pos = vec4f(vec2f(pixel) + 0.5, v0.pos.z, 0.0);
+
+    let e0 = edge(v1.pos, v2.pos, pos);
+    let e1 = edge(v2.pos, v0.pos, pos);
+    let e2 = edge(v0.pos, v1.pos, pos);
+    if !((e0 > 0 || (e0 == 0 && topLeft(v1.pos, v2.pos))) &&
+         (e1 > 0 || (e1 == 0 && topLeft(v2.pos, v0.pos))) &&
+         (e2 > 0 || (e2 == 0 && topLeft(v0.pos, v1.pos)))) {
+        return false;
+    }
+
+    let eSum = e0 + e1 + e2;
+
+    let wq0 = e0 / v0.pos.w;
+    let wq1 = e1 / v1.pos.w;
+    let wq2 = e2 / v2.pos.w;
+    let uv = (v0.uv * wq0 + v1.uv * wq1 + v2.uv * wq2) / (wq0 + wq1 + wq2);
+
+    if v0.pos.z != v1.pos.z || v0.pos.z != v2.pos.z {
+        pos.z = (v0.pos.z * e0 + v1.pos.z * e1 + v2.pos.z * e2) / eSum;
+    }
+
+    var color = v0.color;
+    if GOURAUD_SHADING == 1 {
+        let nColor0 = vec4f(v0.color) / 255.0;
+        let nColor1 = vec4f(v1.color) / 255.0;
+        let nColor2 = vec4f(v2.color) / 255.0;
+
+        color = vec4u((nColor0 * e0 + nColor1 * e1 + nColor2 * e2) / eSum * 255.0);
+    }
+
+    return shadePixel(vec4i(pos), uv, color, dst);
+}
+
+// One workgroup per tile, every invocation keeps its pixel in registers while the binned triangles are drawn in order
 @compute @workgroup_size(8, 8)
-fn draw(@builtin(global_invocation_id) id: vec3u) {
-    let fid = vec4f(vec3f(id), 0.0);
-    var pos = vertices[3].pos + fid + 0.5;
-
-    let e0 = edge(vertices[1].pos, vertices[2].pos, pos);
-    let e1 = edge(vertices[2].pos, vertices[0].pos, pos);
-    let e2 = edge(vertices[0].pos, vertices[1].pos, pos);
-    if (e0 > 0 || (e0 == 0 && topLeft(vertices[1].pos, vertices[2].pos))) &&
-       (e1 > 0 || (e1 == 0 && topLeft(vertices[2].pos, vertices[0].pos))) &&
-       (e2 > 0 || (e2 == 0 && topLeft(vertices[0].pos, vertices[1].pos))) {
-        let eSum = e0 + e1 + e2;
- 
-        let wq0 = e0 / vertices[0].pos.w;
-        let wq1 = e1 / vertices[1].pos.w;
-        let wq2 = e2 / vertices[2].pos.w;
-        let uv = (vertices[0].uv * wq0 + vertices[1].uv * wq1 + vertices[2].uv * wq2) / (wq0 + wq1 + wq2);
-
-        if vertices[0].pos.z != vertices[1].pos.z || vertices[0].pos.z != vertices[2].pos.z {
-            pos.z = (vertices[0].pos.z * e0 + vertices[1].pos.z * e1 + vertices[2].pos.z * e2) / eSum;
-        }
+fn draw(@builtin(workgroup_id) tile_id: vec3u, @builtin(local_invocation_id) local_id: vec3u, @builtin(local_invocation_index) local_index: u32) {
+    loadPipelineState();
+    let tile = renderData.tileStart + tile_id.xy;
+    let pixel = vec2i(tile * TILE_SIZE + local_id.xy);
+    let words = (renderData.triangleCount + 31) / 32;
+
+    // The bins are emptied on the way, so the next group starts from a clean slate
+    let bin = (tile.y * TILE_COLUMNS + tile.x) * BIN_WORDS + local_index;
+    if local_index < words {
+        tileBins[local_index] = atomicExchange(&bins[bin], 0u);
+    }
+    workgroupBarrier();
+
+    if !insideScissor(pixel) {
+        return;
+    }
+
+    var dst = Fragment(loadPixel(pixel), 0u);
+    if DEPTH_FUNC != 100 {
+        dst.depth = textureLoad(depthBuffer, pixel).r;
+    }
 
-        var color = vertices[0].color;
-        if GOURAUD_SHADING == 1 {
-            let nColor0 = vec4f(vertices[0].color) / 255.0;
-            let nColor1 = vec4f(vertices[1].color) / 255.0;
-            let nColor2 = vec4f(vertices[2].color) / 255.0;
+    var written = false;
+    for (var word = 0u; word < words; word++) {
+        var bits = tileBins[word];
+        while bits != 0 {
+            let bit = firstTrailingBit(bits);
+            bits &= bits - 1;
 
-            color = vec4u((nColor0 * e0 + nColor1 * e1 + nColor2 * e2) / eSum * 255.0);
+            if drawTriangle(word * 32 + bit, pixel, &dst) {
+                // Later triangles have to see the pixel the way the framebuffer stores it
+                if FRAMEBUFFER_FORMAT != 3 {
+                    dst.color = unpackPixel(packPixel(dst.color));
+                }
+                written = true;
+            }
         }
+    }
 
-        drawPixel(vec4i(pos), uv, color);
+    if written {
+        storePixel(pixel, dst.color);
+        if DEPTH_WRITE == 1 {
+            textureStore(depthBuffer, pixel, vec4u(dst.depth));
+        }
     }
 }
 )"
\ No newline at end of file
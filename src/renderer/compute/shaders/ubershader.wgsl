@@ -0,0 +1,39 @@
+R"(
+var<private> FRAMEBUFFER_FORMAT: u32;
+var<private> TEXTURE_FORMAT: u32;
+var<private> BILINEAR: u32;
+var<private> U_CLAMP: u32;
+var<private> V_CLAMP: u32;
+var<private> CLUT_FORMAT: u32;
+var<private> BLEND_OPERATION: u32;
+var<private> BLEND_SOURCE: u32;
+var<private> BLEND_DESTINATION: u32;
+var<private> ALPHA_FUNC: u32;
+var<private> USE_TEXTURE_ALPHA: u32;
+var<private> FRAGMENT_DOUBLE: u32;
+var<private> TEXTURE_FUNCTION: u32;
+var<private> DEPTH_FUNC: u32;
+var<private> DEPTH_WRITE: u32;
+var<private> GOURAUD_SHADING: u32;
+
+// The generic variant reads what the specialized pipelines get as override constants
+fn loadPipelineState() {
+    let state = renderData.pipelineState;
+    FRAMEBUFFER_FORMAT = state[0].x;
+    TEXTURE_FORMAT = state[0].y;
+    BILINEAR = state[0].z;
+    U_CLAMP = state[0].w;
+    V_CLAMP = state[1].x;
+    CLUT_FORMAT = state[1].y;
+    BLEND_OPERATION = state[1].z;
+    BLEND_SOURCE = state[1].w;
+    BLEND_DESTINATION = state[2].x;
+    ALPHA_FUNC = state[2].y;
+    USE_TEXTURE_ALPHA = state[2].z;
+    FRAGMENT_DOUBLE = state[2].w;
+    TEXTURE_FUNCTION = state[3].x;
+    DEPTH_FUNC = state[3].y;
+    DEPTH_WRITE = state[3].z;
+    GOURAUD_SHADING = state[3].w;
+}
+)"
\ No newline at end of file
@@ -0,0 +1,231 @@
+#include "renderer.hpp"
+
+#include <algorithm>
+#include <bit>
+#include <cfloat>
+#include <cmath>
+#include <emmintrin.h>
+#include <glm/common.hpp>
+#include <glm/geometric.hpp>
+
+enum LightType {
+	LIGHT_DIRECTIONAL = 0,
+	LIGHT_POINT = 1,
+	LIGHT_SPOT = 2
+};
+
+enum LightComputation {
+	LIGHT_DIFFUSE = 0,
+	LIGHT_DIFFUSE_SPECULAR = 1,
+	LIGHT_POWERED_DIFFUSE = 2
+};
+
+static float GetFloat(uint32_t command) {
+	return std::bit_cast<float>(command << 8);
+}
+
+static glm::vec4 GetColor(uint32_t command, uint8_t alpha = 0xFF) {
+	return glm::vec4(command & 0xFF, command >> 8 & 0xFF, command >> 16 & 0xFF, alpha) / 255.0f;
+}
+
+static glm::vec3 Normalize(glm::vec3 v) {
+	float length = glm::length(v);
+	return length > 0.0f ? v / length : v;
+}
+
+static __m128 LoadMask(const uint32_t* mask) {
+	return _mm_castsi128_ps(_mm_load_si128(reinterpret_cast<const __m128i*>(mask)));
+}
+
+static __m128 Select(__m128 mask, __m128 a, __m128 b) {
+	return _mm_or_ps(_mm_and_ps(mask, a), _mm_andnot_ps(mask, b));
+}
+
+static __m128 Dot3(const __m128 a[3], const __m128 b[3]) {
+	return _mm_add_ps(_mm_add_ps(_mm_mul_ps(a[0], b[0]), _mm_mul_ps(a[1], b[1])), _mm_mul_ps(a[2], b[2]));
+}
+
+static float HorizontalSum(__m128 v) {
+	__m128 shuffled = _mm_shuffle_ps(v, v, _MM_SHUFFLE(2, 3, 0, 1));
+	__m128 sums = _mm_add_ps(v, shuffled);
+	shuffled = _mm_movehl_ps(shuffled, sums);
+	return _mm_cvtss_f32(_mm_add_ss(sums, shuffled));
+}
+
+// SSE has no pow, so the lanes fall back to scalar math
+static __m128 Pow(__m128 base, __m128 exponent) {
+	alignas(16) float b[4];
+	alignas(16) float e[4];
+	_mm_store_ps(b, base);
+	_mm_store_ps(e, exponent);
+	for (int i = 0; i < 4; i++) {
+		b[i] = std::pow(b[i], e[i]);
+	}
+	return _mm_load_ps(b);
+}
+
+void Renderer::UpdateLighting() {
+	if (!lighting_dirty) {
+		return;
+	}
+
+	auto& state = lighting_state;
+	state = {};
+
+	for (int i = 0; i < 4; i++) {
+		uint8_t computation = cmds[CMD_LT0 + i] & 3;
+		uint8_t type = cmds[CMD_LT0 + i] >> 8 & 3;
+
+		glm::vec3 position(GetFloat(cmds[CMD_LXP0 + i * 3]), GetFloat(cmds[CMD_LXP0 + i * 3 + 1]), GetFloat(cmds[CMD_LXP0 + i * 3 + 2]));
+		glm::vec3 direction(GetFloat(cmds[CMD_LXD0 + i * 3]), GetFloat(cmds[CMD_LXD0 + i * 3 + 1]), GetFloat(cmds[CMD_LXD0 + i * 3 + 2]));
+		if (type == LIGHT_DIRECTIONAL) {
+			position = Normalize(position);
+		}
+		direction = Normalize(direction);
+
+		glm::vec4 ambient = GetColor(cmds[CMD_ALC0 + i * 3]);
+		glm::vec4 diffuse = GetColor(cmds[CMD_DLC0 + i * 3]);
+		glm::vec4 specular = GetColor(cmds[CMD_SLC0 + i * 3]);
+
+		for (int axis = 0; axis < 3; axis++) {
+			state.position[axis][i] = position[axis];
+			state.direction[axis][i] = direction[axis];
+			state.attenuation[axis][i] = GetFloat(cmds[CMD_LCA0 + i * 3 + axis]);
+			state.ambient[axis][i] = ambient[axis];
+			state.diffuse[axis][i] = diffuse[axis];
+			state.specular[axis][i] = specular[axis];
+		}
+		state.spot_exponent[i] = GetFloat(cmds[CMD_SPOTEXP0 + i]);
+		state.spot_cutoff[i] = GetFloat(cmds[CMD_SPOTCUT0 + i]);
+
+		bool enabled = cmds[CMD_LE0 + i] & 1;
+		state.enabled[i] = enabled ? 0xFFFFFFFF : 0;
+		state.directional[i] = type == LIGHT_DIRECTIONAL ? 0xFFFFFFFF : 0;
+		state.spot[i] = type == LIGHT_SPOT ? 0xFFFFFFFF : 0;
+		state.specular_light[i] = computation == LIGHT_DIFFUSE_SPECULAR ? 0xFFFFFFFF : 0;
+		state.powered_diffuse[i] = computation == LIGHT_POWERED_DIFFUSE ? 0xFFFFFFFF : 0;
+
+		state.any_enabled |= enabled;
+		state.any_spot |= enabled && type == LIGHT_SPOT;
+		state.any_specular |= enabled && computation == LIGHT_DIFFUSE_SPECULAR;
+		state.any_powered_diffuse |= enabled && computation == LIGHT_POWERED_DIFFUSE;
+	}
+
+	state.specular_power = GetFloat(cmds[CMD_MK]);
+	state.global_ambient = GetColor(cmds[CMD_AC], cmds[CMD_AA] & 0xFF);
+	state.emissive = GetColor(cmds[CMD_MEC]);
+	state.material_ambient = GetColor(ambient_color, ambient_alpha);
+	state.material_diffuse = GetColor(cmds[CMD_MDC]);
+	state.material_specular = GetColor(cmds[CMD_MSC]);
+
+	lighting_dirty = false;
+}
+
+// Evaluates all four lights at once, one light per lane. Positions and normals have to be in world space.
+void Renderer::LightVertices(Vertex* vertices, const glm::vec3* normals, size_t count) {
+	UpdateLighting();
+
+	auto& state = lighting_state;
+
+	const __m128 zero = _mm_setzero_ps();
+	const __m128 one = _mm_set1_ps(1.0f);
+
+	__m128 light_position[3];
+	__m128 light_direction[3];
+	__m128 attenuation[3];
+	__m128 ambient[3];
+	__m128 diffuse[3];
+	__m128 specular[3];
+	for (int i = 0; i < 3; i++) {
+		light_position[i] = _mm_load_ps(state.position[i]);
+		light_direction[i] = _mm_load_ps(state.direction[i]);
+		attenuation[i] = _mm_load_ps(state.attenuation[i]);
+		ambient[i] = _mm_load_ps(state.ambient[i]);
+		diffuse[i] = _mm_load_ps(state.diffuse[i]);
+		specular[i] = _mm_load_ps(state.specular[i]);
+	}
+	__m128 spot_exponent = _mm_load_ps(state.spot_exponent);
+	__m128 spot_cutoff = _mm_load_ps(state.spot_cutoff);
+	__m128 specular_power = _mm_set1_ps(state.specular_power);
+
+	__m128 enabled = LoadMask(state.enabled);
+	__m128 directional = LoadMask(state.directional);
+	__m128 spot = LoadMask(state.spot);
+	__m128 specular_light = LoadMask(state.specular_light);
+	__m128 powered_diffuse = LoadMask(state.powered_diffuse);
+
+	for (size_t i = 0; i < count; i++) {
+		auto& v = vertices[i];
+
+		glm::vec4 color = glm::vec4(v.color.r, v.color.g, v.color.b, v.color.a) / 255.0f;
+		glm::vec4 ambient_source = material_update ? color : state.material_ambient;
+		glm::vec4 diffuse_source = material_diffuse ? color : state.material_diffuse;
+		glm::vec4 specular_source = material_specular ? color : state.material_specular;
+
+		glm::vec4 result = state.emissive + state.global_ambient * ambient_source;
+		result.a = state.global_ambient.a * ambient_source.a;
+
+		if (state.any_enabled) {
+			glm::vec3 normal = Normalize(normals[i]);
+			__m128 n[3] = { _mm_set1_ps(normal.x), _mm_set1_ps(normal.y), _mm_set1_ps(normal.z) };
+
+			// Directional lights store the direction towards the light instead of a position
+			__m128 to_light[3];
+			for (int axis = 0; axis < 3; axis++) {
+				__m128 offset = _mm_sub_ps(light_position[axis], _mm_set1_ps(v.pos[axis]));
+				to_light[axis] = Select(directional, light_position[axis], offset);
+			}
+
+			__m128 distance_squared = Dot3(to_light, to_light);
+			__m128 distance = _mm_sqrt_ps(distance_squared);
+			__m128 inverse_distance = _mm_div_ps(one, _mm_max_ps(distance, _mm_set1_ps(FLT_MIN)));
+			for (int axis = 0; axis < 3; axis++) {
+				to_light[axis] = _mm_mul_ps(to_light[axis], inverse_distance);
+			}
+
+			__m128 falloff = _mm_add_ps(attenuation[0], _mm_add_ps(_mm_mul_ps(attenuation[1], distance), _mm_mul_ps(attenuation[2], distance_squared)));
+			__m128 factor = _mm_min_ps(_mm_max_ps(_mm_div_ps(one, falloff), zero), one);
+			factor = Select(directional, one, factor);
+
+			if (state.any_spot) {
+				__m128 spot_dot = _mm_sub_ps(zero, Dot3(to_light, light_direction));
+				__m128 spot_factor = Pow(_mm_max_ps(spot_dot, zero), spot_exponent);
+				spot_factor = _mm_and_ps(spot_factor, _mm_cmpge_ps(spot_dot, spot_cutoff));
+				factor = Select(spot, _mm_mul_ps(factor, spot_factor), factor);
+			}
+
+			__m128 light_dot = Dot3(to_light, n);
+			__m128 diffuse_factor = _mm_max_ps(light_dot, zero);
+			if (state.any_powered_diffuse) {
+				diffuse_factor = Select(powered_diffuse, Pow(diffuse_factor, specular_power), diffuse_factor);
+			}
+
+			__m128 specular_factor = zero;
+			if (state.any_specular) {
+				__m128 half[3] = { to_light[0], to_light[1], _mm_add_ps(to_light[2], one) };
+				__m128 half_length = _mm_sqrt_ps(Dot3(half, half));
+				__m128 half_dot = _mm_div_ps(Dot3(half, n), _mm_max_ps(half_length, _mm_set1_ps(FLT_MIN)));
+
+				__m128 visible = _mm_and_ps(_mm_cmpge_ps(light_dot, zero), _mm_cmpge_ps(half_dot, zero));
+				specular_factor = Pow(_mm_max_ps(half_dot, zero), specular_power);
+				specular_factor = _mm_and_ps(specular_factor, _mm_and_ps(specular_light, visible));
+			}
+
+			factor = _mm_and_ps(factor, enabled);
+			for (int channel = 0; channel < 3; channel++) {
+				__m128 light = _mm_mul_ps(ambient[channel], _mm_set1_ps(ambient_source[channel]));
+				light = _mm_add_ps(light, _mm_mul_ps(_mm_mul_ps(diffuse[channel], _mm_set1_ps(diffuse_source[channel])), diffuse_factor));
+				light = _mm_add_ps(light, _mm_mul_ps(_mm_mul_ps(specular[channel], _mm_set1_ps(specular_source[channel])), specular_factor));
+				result[channel] += HorizontalSum(_mm_mul_ps(light, factor));
+			}
+		}
+
+		result = glm::clamp(result, 0.0f, 1.0f) * 255.0f;
+		v.color = Color(
+			static_cast<uint8_t>(result.a + 0.5f),
+			static_cast<uint8_t>(result.b + 0.5f),
+			static_cast<uint8_t>(result.g + 0.5f),
+			static_cast<uint8_t>(result.r + 0.5f)
+		);
+	}
+}
@@ -1,12 +1,16 @@
 #include "renderer.hpp"
 
 #include <format>
+#include <iostream>
 #include <thread>
+#include <emmintrin.h>
 #include <spdlog/spdlog.h>
+#include <glm/matrix.hpp>
 #include <glm/gtc/type_ptr.hpp>
 
 #include "../psp.hpp"
 #include "../kernel/thread.hpp"
+#include "texturedecoder.hpp"
 
 struct CmdRange {
 	uint8_t start;
@@ -32,22 +36,151 @@ static const std::vector<CmdRange> CONTEXT_CMD_RANGES = {
 	{0xF8, 0xF9},
 };
 
+enum class BatchEffect {
+	NONE,
+	ON_CHANGE,
+	ALWAYS
+};
+
+// Commands that are only consumed while decoding vertices can't affect primitives that are already batched
+static BatchEffect GetBatchEffect(uint8_t command) {
+	// Lighting is evaluated while decoding as well
+	if (command >= CMD_LMODE && command <= CMD_SLC3) {
+		return BatchEffect::NONE;
+	}
+
+	switch (command) {
+	case CMD_NOP:
+	case CMD_VADR:
+	case CMD_IADR:
+	case CMD_PRIM:
+	case CMD_BEZIER:
+	case CMD_SPLINE:
+	case CMD_BBOX:
+	case CMD_JUMP:
+	case CMD_BJUMP:
+	case CMD_CALL:
+	case CMD_RET:
+	case CMD_BASE:
+	case CMD_OFFSET:
+	case CMD_ORIGIN:
+	case CMD_BONEN:
+	case CMD_BONED:
+	case CMD_DIVIDE:
+	case CMD_PATCHPRIMITIVE:
+	case CMD_PATCHFACING:
+	case CMD_WORLDN:
+	case CMD_WORLDD:
+	case CMD_VIEWN:
+	case CMD_VIEWD:
+	case CMD_PROJN:
+	case CMD_PROJD:
+	case CMD_SX:
+	case CMD_SY:
+	case CMD_SZ:
+	case CMD_TX:
+	case CMD_TY:
+	case CMD_TZ:
+	case CMD_SU:
+	case CMD_SV:
+	case CMD_TU:
+	case CMD_TV:
+	case CMD_OFFSETX:
+	case CMD_OFFSETY:
+	case CMD_LTE:
+	case CMD_LE0:
+	case CMD_LE1:
+	case CMD_LE2:
+	case CMD_LE3:
+	case CMD_MATERIAL:
+	case CMD_MEC:
+	case CMD_MAC:
+	case CMD_MDC:
+	case CMD_MSC:
+	case CMD_MAA:
+	case CMD_MK:
+	case CMD_AC:
+	case CMD_AA:
+		return BatchEffect::NONE;
+	case CMD_CLOAD:
+	case CMD_TFLUSH:
+	case CMD_TSYNC:
+	case CMD_XSTART:
+		return BatchEffect::ALWAYS;
+	default:
+		return BatchEffect::ON_CHANGE;
+	}
+}
+
 static void WakeUpRenderer(uint64_t cycles_late) {
 	PSP::GetInstance()->GetRenderer()->Run();
 }
 
-Renderer::Renderer() {
-	window = SDL_CreateWindow("PSP", BASE_WINDOW_WIDTH, BASE_WINDOW_HEIGHT, SDL_WINDOW_RESIZABLE);
-	SDL_SetWindowMinimumSize(window, BASE_WIDTH, BASE_HEIGHT);
+uint64_t HashMemory(const void* data, size_t size, uint64_t seed) {
+	constexpr uint64_t PRIME = 0x9E3779B97F4A7C15;
+
+	auto bytes = reinterpret_cast<const uint8_t*>(data);
+	uint64_t hash = seed ^ (size * PRIME);
+
+	size_t i = 0;
+	for (; i + 8 <= size; i += 8) {
+		uint64_t word;
+		memcpy(&word, bytes + i, 8);
+		hash = (hash ^ word) * PRIME;
+		hash ^= hash >> 32;
+	}
+
+	uint64_t tail = 0;
+	memcpy(&tail, bytes + i, size - i);
+	hash = (hash ^ tail) * PRIME;
+	return hash ^ (hash >> 29);
+}
+
+uint64_t GetTextureKey(const TextureInfo& info) {
+	uint32_t key[] = { info.texture.buffer, info.texture.pitch, info.texture.width, info.texture.height, info.format | static_cast<uint32_t>(info.swizzling) << 8 };
+	return HashMemory(key, sizeof(key));
+}
+
+// Number of source bytes the texture covers, clamped to the end of its memory region
+uint32_t GetTextureSize(const TextureInfo& info) {
+	// Swizzled textures are stored in whole 16 byte x 8 row blocks
+	uint32_t height = info.swizzling ? (info.texture.height + 7) & ~7 : info.texture.height;
+	return std::min(info.texture.pitch * height * GetTextureBits(info.format) / 8, PSP::GetInstance()->GetMaxSize(info.texture.buffer));
+}
+
+// Hashes the texture's source memory, decoded copies are only reused while it matches
+uint64_t HashTexture(const TextureInfo& info) {
+	void* buffer = PSP::GetInstance()->VirtualToPhysical(info.texture.buffer);
+	if (!buffer) {
+		return 0;
+	}
+	return HashMemory(buffer, GetTextureSize(info), GetTextureKey(info));
+}
+
+Renderer::Renderer(bool headless) {
+	// Headless runs are benchmarks or regression jobs, nothing is shown so nothing is paced either
+	if (headless) {
+		window = nullptr;
+		frame_limiter = false;
+	} else {
+		window = SDL_CreateWindow("PSP", BASE_WINDOW_WIDTH, BASE_WINDOW_HEIGHT, SDL_WINDOW_RESIZABLE);
+		SDL_SetWindowMinimumSize(window, BASE_WIDTH, BASE_HEIGHT);
+	}
 	second_timer = std::chrono::steady_clock::now();
 
 	for (int i = 0; i < cmds.size(); i++) {
 		cmds[i] = i << 24;
 	}
+
+	for (auto& bone_matrix : bone_matrices) {
+		bone_matrix[3][3] = 1.0f;
+	}
 }
 
 Renderer::~Renderer() {
-	SDL_DestroyWindow(window);
+	if (window) {
+		SDL_DestroyWindow(window);
+	}
 }
 
 void Renderer::Frame() {
@@ -77,11 +210,24 @@ void Renderer::Frame() {
 		}
 	}
 
+	for (auto it = patch_cache.begin(); it != patch_cache.end();) {
+		it->second.unused_frames++;
+		if (it->second.unused_frames >= PATCH_CACHE_CLEAR_FRAMES) {
+			it = patch_cache.erase(it);
+		} else {
+			it++;
+		}
+	}
+
 	frames++;
 	auto now = std::chrono::steady_clock::now();
 	if (now >= second_timer) {
 		std::string title = std::format("PSP | {} FPS | {} Game FPS", frames, flips);
-		SDL_SetWindowTitle(window, title.c_str());
+		if (window) {
+			SDL_SetWindowTitle(window, title.c_str());
+		} else {
+			spdlog::debug("Renderer: {}", title);
+		}
 		second_timer = now + std::chrono::seconds(1);
 		frames = 0;
 		flips = 0;
@@ -94,6 +240,44 @@ void Renderer::Frame() {
 		}
 	}
 	last_frame_time = std::chrono::steady_clock::now();
+
+	if (capture_frames && ++captured_frames >= capture_frames) {
+		SaveCapture();
+		psp->ForceExit();
+	}
+}
+
+void Renderer::CaptureFrame(int frame_count, const std::filesystem::path& dump_path, bool print_hash) {
+	capture_frames = frame_count;
+	captured_frames = 0;
+	capture_path = dump_path;
+	capture_hash = print_hash;
+}
+
+void Renderer::SaveCapture() {
+	if (capture_path.empty() && !capture_hash) {
+		return;
+	}
+
+	std::vector<uint8_t> pixels;
+	uint32_t width = 0;
+	uint32_t height = 0;
+	if (!ReadFrame(pixels, width, height)) {
+		spdlog::error("Renderer: failed reading frame {}", captured_frames);
+		return;
+	}
+
+	if (capture_hash) {
+		std::cout << std::format("{:016x}", HashMemory(pixels.data(), pixels.size())) << std::endl;
+	}
+
+	if (!capture_path.empty()) {
+		SDL_Surface* surface = SDL_CreateSurfaceFrom(width, height, SDL_PIXELFORMAT_RGBA32, pixels.data(), width * 4);
+		if (!surface || !SDL_SaveBMP(surface, capture_path.string().c_str())) {
+			spdlog::error("Renderer: failed saving frame to {}: {}", capture_path.string(), SDL_GetError());
+		}
+		SDL_DestroySurface(surface);
+	}
 }
 
 void Renderer::Run() {
@@ -112,13 +296,17 @@ void Renderer::Run() {
 	current_dl.state = SCE_GE_LIST_DRAWING;
 	offset = current_dl.offset_addr;
 
+	Prefetch(current_dl_id);
+
 	while (true) {
 		if (!current_dl.valid || current_dl.state == SCE_GE_LIST_PAUSED) {
+			FlushPrimitives();
 			break;
 		}
 
 		if (current_dl.current_addr == current_dl.stall_addr) {
 			current_dl.state = SCE_GE_LIST_STALLING;
+			FlushPrimitives();
 			break;
 		}
 
@@ -136,9 +324,60 @@ void Renderer::Run() {
 	current_dl.offset_addr = offset;
 }
 
+// Scans the enqueued part of the list ahead of execution, so backends can decode upcoming textures on the worker pool
+void Renderer::Prefetch(int id) {
+	auto psp = PSP::GetInstance();
+	auto& dl = display_lists[id];
+
+	// Resume where the last scan stopped as long as execution hasn't left the scanned range
+	uint32_t addr = dl.prefetch_addr;
+	if (prefetch_list != id || addr < dl.current_addr || addr > dl.current_addr + PREFETCH_MAX_COMMANDS * 4) {
+		addr = dl.current_addr;
+		prefetch_cmds = cmds;
+		prefetch_list = id;
+		prefetch_texture_key = 0;
+	}
+
+	uint32_t end_addr = dl.current_addr + PREFETCH_MAX_COMMANDS * 4;
+	for (; addr != dl.stall_addr && addr < end_addr; addr += 4) {
+		uint32_t command = psp->ReadMemory32(addr);
+		uint8_t cmd = command >> 24;
+
+		// The scan doesn't follow branches, execution restarts it once it reaches the target
+		if (cmd == CMD_JUMP || cmd == CMD_BJUMP || cmd == CMD_CALL || cmd == CMD_RET || cmd == CMD_END || cmd == CMD_FINISH) {
+			break;
+		}
+		prefetch_cmds[cmd] = command;
+
+		if ((cmd == CMD_PRIM || cmd == CMD_BEZIER || cmd == CMD_SPLINE) && (prefetch_cmds[CMD_TME] & 1) && !(prefetch_cmds[CMD_CMODE] & 1)) {
+			TextureInfo info{};
+			info.texture.buffer = (prefetch_cmds[CMD_TBP0] & 0xFFFFFF) | (prefetch_cmds[CMD_TBW0] & 0xFF0000) << 8;
+			info.texture.pitch = prefetch_cmds[CMD_TBW0] & 0x1FFF;
+			info.texture.width = 1 << (prefetch_cmds[CMD_TSIZE0] & 0xF);
+			info.texture.height = 1 << (prefetch_cmds[CMD_TSIZE0] >> 8 & 0xF);
+			info.format = prefetch_cmds[CMD_TPF] & 0xFFFFFF;
+			info.swizzling = prefetch_cmds[CMD_TMODE] & 1;
+
+			uint64_t key = GetTextureKey(info);
+			if (key != prefetch_texture_key && info.texture.buffer) {
+				PrefetchTexture(info);
+				prefetch_texture_key = key;
+			}
+		}
+	}
+	dl.prefetch_addr = addr;
+}
+
 void Renderer::ExecuteCommand(uint32_t command) {
 	auto psp = PSP::GetInstance();
 
+	if (!batch.vertices.empty()) {
+		auto effect = GetBatchEffect(command >> 24);
+		if (effect == BatchEffect::ALWAYS || (effect == BatchEffect::ON_CHANGE && cmds[command >> 24] != command)) {
+			FlushPrimitives();
+		}
+	}
+
 	cmds[command >> 24] = command;
 
 	switch (command >> 24) {
@@ -146,7 +385,8 @@ void Renderer::ExecuteCommand(uint32_t command) {
 	case CMD_VADR: vaddr = GetBaseAddress(command & 0xFFFFFF); break;
 	case CMD_IADR: iaddr = GetBaseAddress(command & 0xFFFFFF); break;
 	case CMD_PRIM: Prim(command); break;
-	case CMD_BEZIER: spdlog::warn("Renderer: unimplemented GE command CMD_BEZIER"); break;
+	case CMD_BEZIER: Bezier(command); break;
+	case CMD_SPLINE: Spline(command); break;
 	case CMD_BBOX: BBox(command); break;
 	case CMD_JUMP: Jump(command); break;
 	case CMD_BJUMP: BJump(command); break;
@@ -161,16 +401,25 @@ void Renderer::ExecuteCommand(uint32_t command) {
 	case CMD_ORIGIN: if (!queue.empty()) { offset = display_lists[queue.front()].current_addr; } break;
 	case CMD_REGION1: min_draw_area = glm::ivec2(command & 0x1FF, command >> 10 & 0x1FF); break;
 	case CMD_REGION2: max_draw_area = glm::ivec2(command & 0x1FF, command >> 10 & 0x1FF); break;
-	case CMD_LTE: spdlog::warn("Renderer: unimplemented GE command CMD_LTE"); break;
+	case CMD_LTE: lighting = command & 1; break;
+	case CMD_LE0:
+	case CMD_LE1:
+	case CMD_LE2:
+	case CMD_LE3:
+		lighting_dirty = true; break;
 	case CMD_CLE: clip_plane = command & 1; break;
 	case CMD_BCE: culling = command & 1; break;
 	case CMD_TME: textures_enabled = command & 1; break;
 	case CMD_FGE: spdlog::warn("Renderer: unimplemented GE command CMD_FGE"); break;
-	case CMD_DTE: spdlog::warn("Renderer: unimplemented GE command CMD_DTE"); break;
+	case CMD_DTE: dither = command & 1; break;
 	case CMD_ABE: blend = command & 1; break;
 	case CMD_ATE: alpha_test = command & 1; break;
 	case CMD_ZTE: depth_test = command & 1; break;
-	case CMD_DIVIDE: spdlog::warn("Renderer: unimplemented GE command CMD_DIVIDE"); break;
+	case CMD_BONEN: bone_matrix_num = command & 0x7F; break;
+	case CMD_BONED: BoneD(command); break;
+	case CMD_DIVIDE: patch_divide_u = std::max(command & 0x7F, 1U); patch_divide_v = std::max(command >> 8 & 0x7F, 1U); break;
+	case CMD_PATCHPRIMITIVE: patch_primitive = command & 3; break;
+	case CMD_PATCHFACING: patch_facing = command & 1; break;
 	case CMD_WORLDN: world_matrix_num = command & 0xF; break;
 	case CMD_WORLDD: WorldD(command); break;
 	case CMD_VIEWN: view_matrix_num = command & 0xF; break;
@@ -190,14 +439,15 @@ void Renderer::ExecuteCommand(uint32_t command) {
 	case CMD_OFFSETX: viewport_offset.x = command & 0xFFFFFF; break;
 	case CMD_OFFSETY: viewport_offset.y = command & 0xFFFFFF; break;
 	case CMD_SHADE: gouraud_shading = command & 1; break;
-	case CMD_MATERIAL: material_update = command & 1; break;
-	case CMD_MAC: ambient_color = command & 0xFFFFFF; break;
-	case CMD_MDC: spdlog::warn("Renderer: unimplemented GE command CMD_MDC"); break;
-	case CMD_MSC: spdlog::warn("Renderer: unimplemented GE command CMD_MSC"); break;
-	case CMD_MAA: ambient_alpha = command & 0xFF; break;
-	case CMD_MK: spdlog::warn("Renderer: unimplemented GE command CMD_MK"); break;
-	case CMD_AC: spdlog::warn("Renderer: unimplemented GE command CMD_AC"); break;
-	case CMD_AA: spdlog::warn("Renderer: unimplemented GE command CMD_AA"); break;
+	case CMD_MATERIAL: material_update = command & 1; material_diffuse = command & 2; material_specular = command & 4; break;
+	case CMD_MEC: lighting_dirty = true; break;
+	case CMD_MAC: ambient_color = command & 0xFFFFFF; lighting_dirty = true; break;
+	case CMD_MDC: lighting_dirty = true; break;
+	case CMD_MSC: lighting_dirty = true; break;
+	case CMD_MAA: ambient_alpha = command & 0xFF; lighting_dirty = true; break;
+	case CMD_MK: lighting_dirty = true; break;
+	case CMD_AC: lighting_dirty = true; break;
+	case CMD_AA: lighting_dirty = true; break;
 	case CMD_CULL: cull_type = command & 0x1; break;
 	case CMD_FBP: RenderFramebufferChange(); fbp &= 0xFF000000; fbp |= command & 0xFFFFFF; break;
 	case CMD_FBW: RenderFramebufferChange(); fbp &= 0x00FFFFFF; fbp |= (command & 0xFF0000) << 8; fbw = command & 0x07FC; break;
@@ -242,10 +492,11 @@ void Renderer::ExecuteCommand(uint32_t command) {
 	case CMD_BLEND: Blend(command); break;
 	case CMD_FIXA: blend_afix = { command & 0xFF, command >> 8 & 0xFF, command >> 16 & 0xFF, 0x00 }; break;
 	case CMD_FIXB: blend_bfix = { command & 0xFF, command >> 8 & 0xFF, command >> 16 & 0xFF, 0x00 }; break;
-	case CMD_DITH1: spdlog::warn("Renderer: unimplemented GE command CMD_DITH1"); break;
-	case CMD_DITH2: spdlog::warn("Renderer: unimplemented GE command CMD_DITH2"); break;
-	case CMD_DITH3: spdlog::warn("Renderer: unimplemented GE command CMD_DITH3"); break;
-	case CMD_DITH4: spdlog::warn("Renderer: unimplemented GE command CMD_DITH4"); break;
+	case CMD_DITH1:
+	case CMD_DITH2:
+	case CMD_DITH3:
+	case CMD_DITH4:
+		break; // The matrix is read from cmds when drawing
 	case CMD_ZMSK: depth_write = !(command & 1); break;
 	case CMD_PMSK2: spdlog::warn("Renderer: unimplemented GE command CMD_PMSK2"); break;
 	case CMD_XSTART: XStart(command); break;
@@ -253,11 +504,50 @@ void Renderer::ExecuteCommand(uint32_t command) {
 	case CMD_XPOS2: transfer_dest.pos.x = command & 0x3FF; transfer_dest.pos.y = (command >> 10) & 0x3FF; break;
 	case CMD_XSIZE: transfer_size.x = command & 0x3FF; transfer_size.y = (command >> 10) & 0x3FF; break;
 	default:
+		if ((command >> 24) >= CMD_LMODE && (command >> 24) <= CMD_SLC3) {
+			lighting_dirty = true;
+			break;
+		}
 		spdlog::error("Renderer: unknown GE command {:x}", command >> 24);
 		break;
 	}
 }
 
+void Renderer::FlushPrimitives() {
+	if (batch.vertices.empty()) {
+		return;
+	}
+
+	DrawBatch(batch);
+	batch.vertices.clear();
+}
+
+void Renderer::DrawBatch(const PrimitiveBatch& batch) {
+	auto& vertices = batch.vertices;
+	switch (batch.primitive_type) {
+	case SCEGU_PRIM_POINTS:
+		for (auto& vertex : vertices) {
+			DrawPoint(vertex);
+		}
+		break;
+	case SCEGU_PRIM_LINES:
+		for (int i = 0; i + 1 < vertices.size(); i += 2) {
+			DrawLine(vertices[i], vertices[i + 1]);
+		}
+		break;
+	case SCEGU_PRIM_TRIANGLES:
+		for (int i = 0; i + 2 < vertices.size(); i += 3) {
+			DrawTriangle(vertices[i], vertices[i + 1], vertices[i + 2]);
+		}
+		break;
+	case SCEGU_PRIM_RECTANGLES:
+		for (int i = 0; i + 1 < vertices.size(); i += 2) {
+			DrawRectangle(vertices[i], vertices[i + 1]);
+		}
+		break;
+	}
+}
+
 int Renderer::EnQueueList(uint32_t addr, uint32_t stall_addr, int cbid, uint32_t opt_addr, bool head) {
 	auto psp = PSP::GetInstance();
 
@@ -333,6 +623,7 @@ int Renderer::Break(int mode) {
 	}
 
 	if (mode == 1) {
+		FlushPrimitives();
 		queue.clear();
 		for (auto& dl : display_lists) {
 			dl.valid = false;
@@ -510,7 +801,7 @@ void Renderer::SaveContext(uint32_t* context) {
 	*cmds_context++ = texture_matrix_num;
 
 	auto matrices = reinterpret_cast<uint8_t*>(cmds_context);
-	memcpy(matrices, glm::value_ptr(bone_matrix), sizeof(bone_matrix)); matrices += sizeof(bone_matrix);
+	memcpy(matrices, bone_matrices.data(), sizeof(bone_matrices)); matrices += sizeof(bone_matrices);
 	memcpy(matrices, glm::value_ptr(world_matrix), sizeof(world_matrix)); matrices += sizeof(world_matrix);
 	memcpy(matrices, glm::value_ptr(view_matrix), sizeof(view_matrix)); matrices += sizeof(view_matrix);
 	memcpy(matrices, glm::value_ptr(projection_matrix), sizeof(projection_matrix)); matrices += sizeof(projection_matrix);
@@ -536,16 +827,60 @@ void Renderer::RestoreContext(uint32_t* context) {
 	texture_matrix_num = *cmds_context++;
 
 	auto matrices = reinterpret_cast<uint8_t*>(cmds_context);
-	memcpy(glm::value_ptr(bone_matrix), matrices, sizeof(bone_matrix)); matrices += sizeof(bone_matrix);
+	memcpy(bone_matrices.data(), matrices, sizeof(bone_matrices)); matrices += sizeof(bone_matrices);
 	memcpy(glm::value_ptr(world_matrix), matrices, sizeof(world_matrix)); matrices += sizeof(world_matrix);
 	memcpy(glm::value_ptr(view_matrix), matrices, sizeof(view_matrix)); matrices += sizeof(view_matrix);
 	memcpy(glm::value_ptr(projection_matrix), matrices, sizeof(projection_matrix)); matrices += sizeof(projection_matrix);
 	memcpy(glm::value_ptr(texture_matrix), matrices, sizeof(texture_matrix)); matrices += sizeof(texture_matrix);
+
+	transform_dirty = true;
 }
 
+// Skin matrices are stored transposed, so a bone only costs one multiply-add per row and weight.
+// Unlike the hardware, premultiplying the world matrix would scale its translation by the weight sum, so that part is blended separately.
+static glm::vec4 SkinVertex(glm::vec4 pos, glm::vec3* normal, const float* weights, int count, const std::array<glm::mat4, 8>& skin_matrices, glm::vec4 world_translation) {
+	__m128 rows[4] = { _mm_setzero_ps(), _mm_setzero_ps(), _mm_setzero_ps(), _mm_loadu_ps(glm::value_ptr(world_translation)) };
+	for (int i = 0; i < count; i++) {
+		__m128 weight = _mm_set1_ps(weights[i]);
+		auto& matrix = skin_matrices[i];
+		for (int row = 0; row < 4; row++) {
+			rows[row] = _mm_add_ps(rows[row], _mm_mul_ps(_mm_loadu_ps(glm::value_ptr(matrix[row])), weight));
+		}
+	}
+
+	__m128 xy = _mm_add_ps(_mm_mul_ps(rows[0], _mm_set1_ps(pos.x)), _mm_mul_ps(rows[1], _mm_set1_ps(pos.y)));
+	__m128 zw = _mm_add_ps(_mm_mul_ps(rows[2], _mm_set1_ps(pos.z)), rows[3]);
+
+	if (normal) {
+		__m128 normal_xy = _mm_add_ps(_mm_mul_ps(rows[0], _mm_set1_ps(normal->x)), _mm_mul_ps(rows[1], _mm_set1_ps(normal->y)));
+		glm::vec4 result;
+		_mm_storeu_ps(glm::value_ptr(result), _mm_add_ps(normal_xy, _mm_mul_ps(rows[2], _mm_set1_ps(normal->z))));
+		*normal = glm::vec3(result);
+	}
+
+	glm::vec4 result;
+	_mm_storeu_ps(glm::value_ptr(result), _mm_add_ps(xy, zw));
+	return result;
+}
+
+void Renderer::UpdateTransform() {
+	if (!transform_dirty) {
+		return;
+	}
+
+	view_projection_matrix = view_matrix * projection_matrix;
+	world_translation = glm::transpose(world_matrix)[3];
+	for (int i = 0; i < bone_matrices.size(); i++) {
+		skin_matrices[i] = glm::transpose(bone_matrices[i] * world_matrix);
+		skin_matrices[i][3] -= world_translation;
+	}
+
+	transform_dirty = false;
+}
+
+// Expects a world space position, DecodeVertex keeps the view and projection matrices up to date
 bool Renderer::TransformVertex(Vertex& v) const {
-	glm::mat4 worldviewproj = world_matrix * view_matrix * projection_matrix;
-	glm::vec4 clip_pos = v.pos * worldviewproj;
+	glm::vec4 clip_pos = v.pos * view_projection_matrix;
 
 	auto translated_pos = glm::vec3(clip_pos) * viewport_scale / clip_pos.w + viewport_pos;
 
@@ -565,12 +900,61 @@ bool Renderer::TransformVertex(Vertex& v) const {
 }
 
 Vertex Renderer::ParseVertex() {
+	if (index_format != FORMAT_NONE) {
+		spdlog::error("Renderer: index not supported");
+	}
+
+	Vertex v = DecodeVertex();
+	if (!through) {
+		if (!TransformVertex(v)) {
+			v.pos.w = std::numeric_limits<double>::quiet_NaN();
+		}
+	}
+
+	return v;
+}
+
+Vertex Renderer::DecodeVertex(glm::vec3* normal) {
+	float weights[8]{};
+	glm::vec3 vertex_normal{};
+	Vertex v = DecodeModelVertex(weights, vertex_normal);
+
+	if (!through) {
+		// Normals only need to be transformed for lighting, which normalizes them afterwards
+		ApplyWorldTransform(v, weights, normal ? &vertex_normal : nullptr);
+		if (normal) {
+			*normal = vertex_normal;
+		}
+	}
+
+	return v;
+}
+
+// Reads the vertex at vaddr without the world or skinning transform, weights has room for all eight
+Vertex Renderer::DecodeModelVertex(float* weights, glm::vec3& vertex_normal) {
 	auto psp = PSP::GetInstance();
 
 	Vertex v{};
 
-	if (index_format != FORMAT_NONE) {
-		spdlog::error("Renderer: index not supported");
+	if (weight_format != FORMAT_NONE) {
+		for (int i = 0; i < weight_count; i++) {
+			switch (weight_format) {
+			case FORMAT_BYTE:
+				weights[i] = psp->ReadMemory8(vaddr) / 128.0f;
+				vaddr += 1;
+				break;
+			case FORMAT_SHORT:
+				vaddr = ALIGN(vaddr, 2);
+				weights[i] = psp->ReadMemory16(vaddr) / 32768.0f;
+				vaddr += 2;
+				break;
+			case FORMAT_FLOAT:
+				vaddr = ALIGN(vaddr, 4);
+				weights[i] = std::bit_cast<float>(psp->ReadMemory32(vaddr));
+				vaddr += 4;
+				break;
+			}
+		}
 	}
 
 	if (uv_format != FORMAT_NONE) {
@@ -630,8 +1014,28 @@ Vertex Renderer::ParseVertex() {
 		break;
 	}
 
-	if (normal_format != FORMAT_NONE) {
-		spdlog::error("Renderer: normal not supported");
+	vertex_normal = glm::vec3(0.0f, 0.0f, 1.0f);
+	switch (normal_format) {
+	case FORMAT_BYTE:
+		vertex_normal.x = static_cast<int8_t>(psp->ReadMemory8(vaddr));
+		vertex_normal.y = static_cast<int8_t>(psp->ReadMemory8(vaddr + 1));
+		vertex_normal.z = static_cast<int8_t>(psp->ReadMemory8(vaddr + 2));
+		vaddr += 3;
+		break;
+	case FORMAT_SHORT:
+		vaddr = ALIGN(vaddr, 2);
+		vertex_normal.x = static_cast<int16_t>(psp->ReadMemory16(vaddr));
+		vertex_normal.y = static_cast<int16_t>(psp->ReadMemory16(vaddr + 2));
+		vertex_normal.z = static_cast<int16_t>(psp->ReadMemory16(vaddr + 4));
+		vaddr += 6;
+		break;
+	case FORMAT_FLOAT:
+		vaddr = ALIGN(vaddr, 4);
+		vertex_normal.x = std::bit_cast<float>(psp->ReadMemory32(vaddr));
+		vertex_normal.y = std::bit_cast<float>(psp->ReadMemory32(vaddr + 4));
+		vertex_normal.z = std::bit_cast<float>(psp->ReadMemory32(vaddr + 8));
+		vaddr += 12;
+		break;
 	}
 
 	switch (position_format) {
@@ -667,13 +1071,19 @@ Vertex Renderer::ParseVertex() {
 	}
 
 	v.pos.w = 1.0;
-	if (!through) {
-		if (!TransformVertex(v)) {
-			v.pos.w = std::numeric_limits<double>::quiet_NaN();
+	return v;
+}
+
+void Renderer::ApplyWorldTransform(Vertex& v, const float* weights, glm::vec3* normal) {
+	UpdateTransform();
+	if (weight_format != FORMAT_NONE) {
+		v.pos = SkinVertex(v.pos, normal, weights, weight_count, skin_matrices, world_translation);
+	} else {
+		v.pos = v.pos * world_matrix;
+		if (normal) {
+			*normal = glm::vec3(glm::vec4(*normal, 0.0f) * world_matrix);
 		}
 	}
-
-	return v;
 }
 
 uint8_t Renderer::GetFilter(float du, float dv) {
@@ -733,6 +1143,13 @@ Color Renderer::BGR565ToABGR8888(uint16_t color) {
 	return { 0xFF, b, g, r };
 }
 
+void Renderer::BeginBatch(uint8_t primitive_type) {
+	if (batch.primitive_type != primitive_type) {
+		FlushPrimitives();
+		batch.primitive_type = primitive_type;
+	}
+}
+
 void Renderer::Prim(uint32_t opcode) {
 	auto psp = PSP::GetInstance();
 	uint8_t primitive_type = opcode >> 16 & 7;
@@ -743,50 +1160,72 @@ void Renderer::Prim(uint32_t opcode) {
 		return;
 	}
 
-	std::vector<Vertex> vertices;
+	if (index_format != FORMAT_NONE) {
+		spdlog::error("Renderer: index not supported");
+	}
+
+	bool lighting_enabled = lighting && !through;
+	std::vector<Vertex> vertices(count);
+	std::vector<glm::vec3> normals(lighting_enabled ? count : 0);
 	for (int i = 0; i < count; i++) {
-		vertices.push_back(ParseVertex());
+		vertices[i] = DecodeVertex(lighting_enabled ? &normals[i] : nullptr);
+	}
+
+	if (lighting_enabled) {
+		LightVertices(vertices.data(), normals.data(), count);
+	}
+
+	if (!through) {
+		for (auto& v : vertices) {
+			if (!TransformVertex(v)) {
+				v.pos.w = std::numeric_limits<double>::quiet_NaN();
+			}
+		}
 	}
 
 	executed_cycles = count * 40;
 
+	// Strips and fans are assembled into lists here, so that consecutive draws can share one batch
+	auto& batch_vertices = batch.vertices;
 	switch (primitive_type) {
 	case SCEGU_PRIM_POINTS:
-		for (auto& vertex : vertices) {
-			DrawPoint(vertex);
-		}
+		BeginBatch(SCEGU_PRIM_POINTS);
+		batch_vertices.insert(batch_vertices.end(), vertices.begin(), vertices.end());
 		break;
 	case SCEGU_PRIM_LINES:
-		for (int i = 0; i < vertices.size() - 1; i += 2) {
-			DrawLine(vertices[i], vertices[i + 1]);
-		}
+		BeginBatch(SCEGU_PRIM_LINES);
+		batch_vertices.insert(batch_vertices.end(), vertices.begin(), vertices.begin() + (count & ~1));
 		break;
 	case SCEGU_PRIM_LINE_STRIP:
-		if (count >= 2) {
-			DrawLineStrip(vertices);
+		BeginBatch(SCEGU_PRIM_LINES);
+		for (int i = 1; i < count; i++) {
+			batch_vertices.push_back(vertices[i - 1]);
+			batch_vertices.push_back(vertices[i]);
 		}
 		break;
 	case SCEGU_PRIM_TRIANGLES:
-		if (count >= 3) {
-			for (int i = 0; i < vertices.size() - 2; i += 3) {
-				DrawTriangle(vertices[i], vertices[i + 1], vertices[i + 2]);
-			}
-		}
+		BeginBatch(SCEGU_PRIM_TRIANGLES);
+		batch_vertices.insert(batch_vertices.end(), vertices.begin(), vertices.begin() + (count - count % 3));
 		break;
 	case SCEGU_PRIM_TRIANGLE_STRIP:
-		if (count >= 3) {
-			DrawTriangleStrip(vertices);
+		BeginBatch(SCEGU_PRIM_TRIANGLES);
+		for (int i = 2; i < count; i++) {
+			if (i % 2 == 0) {
+				batch_vertices.insert(batch_vertices.end(), { vertices[i - 2], vertices[i - 1], vertices[i] });
+			} else {
+				batch_vertices.insert(batch_vertices.end(), { vertices[i - 1], vertices[i - 2], vertices[i] });
+			}
 		}
 		break;
 	case SCEGU_PRIM_TRIANGLE_FAN: 
-		if (count >= 3) {
-			DrawTriangleFan(vertices);
+		BeginBatch(SCEGU_PRIM_TRIANGLES);
+		for (int i = 2; i < count; i++) {
+			batch_vertices.insert(batch_vertices.end(), { vertices[0], vertices[i - 1], vertices[i] });
 		}
 		break;
 	case SCEGU_PRIM_RECTANGLES:
-		for (int i = 0; i < vertices.size() - 1; i += 2) {
-			DrawRectangle(vertices[i], vertices[i + 1]);
-		}
+		BeginBatch(SCEGU_PRIM_RECTANGLES);
+		batch_vertices.insert(batch_vertices.end(), vertices.begin(), vertices.begin() + (count & ~1));
 		break;
 	default:
 		spdlog::error("Renderer: unknown primitive type {}", primitive_type);
@@ -912,6 +1351,7 @@ void Renderer::End(uint32_t opcode) {
 			}
 			break;
 		default:
+			FlushPrimitives();
 			if (dl.context_addr) {
 				auto context = reinterpret_cast<uint32_t*>(psp->VirtualToPhysical(dl.context_addr));
 				RestoreContext(context);
@@ -1008,6 +1448,7 @@ void Renderer::VType(uint32_t opcode) {
 	through = (opcode & 0x800000) != 0;
 	index_format = opcode >> 11 & 3;
 	weight_format = opcode >> 9 & 3;
+	weight_count = (opcode >> 14 & 7) + 1;
 	position_format = opcode >> 7 & 3;
 	normal_format = opcode >> 5 & 3;
 	color_format = opcode >> 2 & 7;
@@ -1017,6 +1458,7 @@ void Renderer::VType(uint32_t opcode) {
 void Renderer::WorldD(uint32_t opcode) {
 	if (world_matrix_num < 12) {
 		world_matrix[world_matrix_num % 3][world_matrix_num / 3] = std::bit_cast<float>(opcode << 8);
+		transform_dirty = true;
 	}
 	world_matrix_num++;
 }
@@ -1024,6 +1466,7 @@ void Renderer::WorldD(uint32_t opcode) {
 void Renderer::ViewD(uint32_t opcode) {
 	if (view_matrix_num < 12) {
 		view_matrix[view_matrix_num % 3][view_matrix_num / 3] = std::bit_cast<float>(opcode << 8);
+		transform_dirty = true;
 	}
 	view_matrix_num++;
 }
@@ -1031,10 +1474,20 @@ void Renderer::ViewD(uint32_t opcode) {
 void Renderer::ProjD(uint32_t opcode) {
 	if (projection_matrix_num < 16) {
 		projection_matrix[projection_matrix_num % 4][projection_matrix_num / 4] = std::bit_cast<float>(opcode << 8);
+		transform_dirty = true;
 	}
 	projection_matrix_num++;
 }
 
+void Renderer::BoneD(uint32_t opcode) {
+	if (bone_matrix_num < 96) {
+		int num = bone_matrix_num % 12;
+		bone_matrices[bone_matrix_num / 12][num % 3][num / 3] = std::bit_cast<float>(opcode << 8);
+		transform_dirty = true;
+	}
+	bone_matrix_num++;
+}
+
 void Renderer::Blend(uint32_t opcode) {
 	blend_source = opcode & 0xF;
 	blend_destination = opcode >> 4 & 0xF;
@@ -1044,6 +1497,7 @@ void Renderer::Blend(uint32_t opcode) {
 void Renderer::XStart(uint32_t opcode) {
 	auto psp = PSP::GetInstance();
 
+	FlushPrimitives();
 	FlushRender();
 
 	int bpp = opcode & 1 ? 4 : 2;
@@ -1054,8 +1508,20 @@ void Renderer::XStart(uint32_t opcode) {
 	auto src = reinterpret_cast<uint8_t*>(psp->VirtualToPhysical(src_addr));
 	auto dst = reinterpret_cast<uint8_t*>(psp->VirtualToPhysical(dst_addr));
 
-	for (int y = 0; y <= transfer_size.y; y++) {
-		memcpy(dst + y * transfer_dest.pitch * bpp, src + y * transfer_source.pitch * bpp, (transfer_size.x + 1) * bpp);
+	uint32_t src_pitch = transfer_source.pitch * bpp;
+	uint32_t dst_pitch = transfer_dest.pitch * bpp;
+	uint32_t width = (transfer_size.x + 1) * bpp;
+	uint32_t height = transfer_size.y + 1;
+	if (!TransferBlock(src_addr, src_pitch, dst_addr, dst_pitch, width, height)) {
+		uint32_t src_size = (height - 1) * src_pitch + width;
+		uint32_t dst_size = (height - 1) * dst_pitch + width;
+		SyncMemory(src_addr, src_size);
+		SyncMemory(dst_addr, dst_size);
+
+		for (int y = 0; y < height; y++) {
+			memcpy(dst + y * dst_pitch, src + y * src_pitch, width);
+		}
+		ClearTextureCache(dst_addr, dst_size);
 	}
 	RenderFramebufferChange();
 
@@ -2,8 +2,10 @@
 
 #include <array>
 #include <deque>
+#include <unordered_map>
 #include <vector>
 #include <chrono>
+#include <filesystem>
 
 #include <SDL3/SDL.h>
 #include <glm/vec2.hpp>
@@ -11,8 +13,15 @@
 #include <glm/mat4x4.hpp>
 
 #include "..\hle\defs.hpp"
+#include "workerpool.hpp"
 
 constexpr auto TEXTURE_CACHE_CLEAR_FRAMES = 120;
+constexpr auto PATCH_CACHE_CLEAR_FRAMES = 120;
+constexpr auto PREFETCH_CLEAR_FRAMES = 2;
+constexpr auto PREFETCH_MAX_COMMANDS = 4096;
+
+// GPU texture memory the compute renderer keeps resident and pooled before evicting by least recent use
+constexpr auto DEFAULT_TEXTURE_BUDGET = 256 * 1024 * 1024;
 
 enum class RendererType {
 	SOFTWARE,
@@ -46,6 +55,50 @@ struct Vertex {
 	Color color;
 };
 
+// Primitives with identical render state, already assembled into point, line, triangle or rectangle lists
+struct PrimitiveBatch {
+	uint8_t primitive_type;
+	std::vector<Vertex> vertices;
+};
+
+// Tessellated surface in model space, reused as long as the control point memory and patch state match
+struct PatchCacheEntry {
+	int unused_frames;
+	uint64_t state;
+	std::vector<uint8_t> source;
+	std::vector<Vertex> vertices;
+	std::vector<glm::vec3> normals;
+	std::vector<std::array<float, 8>> weights;
+	std::vector<uint32_t> indices;
+};
+
+// Parameters of the four lights packed one light per lane, rebuilt only after a lighting command
+struct LightingState {
+	alignas(16) float position[3][4];
+	alignas(16) float direction[3][4];
+	alignas(16) float attenuation[3][4];
+	alignas(16) float spot_exponent[4];
+	alignas(16) float spot_cutoff[4];
+	alignas(16) float ambient[3][4];
+	alignas(16) float diffuse[3][4];
+	alignas(16) float specular[3][4];
+	alignas(16) uint32_t enabled[4];
+	alignas(16) uint32_t directional[4];
+	alignas(16) uint32_t spot[4];
+	alignas(16) uint32_t specular_light[4];
+	alignas(16) uint32_t powered_diffuse[4];
+	bool any_enabled;
+	bool any_spot;
+	bool any_specular;
+	bool any_powered_diffuse;
+	float specular_power;
+	glm::vec4 global_ambient;
+	glm::vec4 emissive;
+	glm::vec4 material_ambient;
+	glm::vec4 material_diffuse;
+	glm::vec4 material_specular;
+};
+
 constexpr auto BASE_WIDTH = 480;
 constexpr auto BASE_HEIGHT = 272;
 constexpr auto BASE_WINDOW_WIDTH = BASE_WIDTH * 2;
@@ -75,6 +128,7 @@ struct DisplayList {
 	int stack_ptr;
 
 	uint32_t stall_addr;
+	uint32_t prefetch_addr;
 
 	bool bounding_box_check;
 
@@ -92,6 +146,13 @@ struct Texture {
 	uint32_t width;
 };
 
+// Everything needed to decode a texture without looking at the register state
+struct TextureInfo {
+	Texture texture;
+	uint8_t format;
+	bool swizzling;
+};
+
 struct Transfer {
 	uint32_t buffer;
 	uint32_t pitch;
@@ -106,19 +167,30 @@ public:
 	virtual void SetFrameBuffer(uint32_t frame_buffer, int frame_width, int pixel_format) { flips++; }
 	virtual void Resize(int width, int height) = 0;
 	virtual void RenderFramebufferChange() = 0;
+	virtual void DrawBatch(const PrimitiveBatch& batch);
 	virtual void DrawPoint(Vertex point) = 0;
 	virtual void DrawLine(Vertex start, Vertex end) = 0;
-	virtual void DrawLineStrip(std::vector<Vertex> vertices) = 0;
 	virtual void DrawRectangle(Vertex start, Vertex end) = 0;
 	virtual void DrawTriangle(Vertex v0, Vertex v1, Vertex v2) = 0;
-	virtual void DrawTriangleStrip(std::vector<Vertex> vertices) = 0;
-	virtual void DrawTriangleFan(std::vector<Vertex> vertices) = 0;
 	virtual void ClearTextureCache() = 0;
 	virtual void ClearTextureCache(uint32_t addr, uint32_t size) = 0;
+	// Brings guest memory up to date before something outside of the GE reads it
+	virtual void SyncMemory(uint32_t addr, uint32_t size) = 0;
+	// Lets a renderer keep a block transfer on its own copy of VRAM, pitches and width are in bytes
+	virtual bool TransferBlock(uint32_t src_addr, uint32_t src_pitch, uint32_t dst_addr, uint32_t dst_pitch, uint32_t width, uint32_t height) { return false; }
 	virtual void FlushRender() = 0;
+	virtual void PrefetchTexture(const TextureInfo& info) {}
+	// Restores the pipelines a game used in earlier runs, report logs how long each one takes to compile
+	virtual void LoadPipelineCache(const std::filesystem::path& path, bool report) {}
+	// Copies the last presented frame as tightly packed RGBA8 rows, for hashing or dumping it
+	virtual bool ReadFrame(std::vector<uint8_t>& pixels, uint32_t& width, uint32_t& height) { return false; }
+	// Exits after frame_count presented frames, the last one is saved as a BMP and/or its hash printed
+	void CaptureFrame(int frame_count, const std::filesystem::path& dump_path, bool print_hash);
 
 	void Run();
+	void Prefetch(int id);
 	void ExecuteCommand(uint32_t command);
+	void FlushPrimitives();
 	int EnQueueList(uint32_t addr, uint32_t stall_addr, int cbid, uint32_t opt, bool head);
 	void DeQueueList(int id);
 	int SetStallAddr(int id, uint32_t stall_addr);
@@ -170,16 +242,28 @@ public:
 		return y;
 	}
 
+	Vertex DecodeVertex(glm::vec3* normal = nullptr);
+	Vertex DecodeModelVertex(float* weights, glm::vec3& vertex_normal);
+	void ApplyWorldTransform(Vertex& v, const float* weights, glm::vec3* normal);
 	Vertex ParseVertex();
 	bool TransformVertex(Vertex& v) const;
+	void UpdateTransform();
+	void UpdateLighting();
+	void LightVertices(Vertex* vertices, const glm::vec3* normals, size_t count);
 
 	uint8_t GetFilter(float du, float dv);
+	TextureInfo GetTextureInfo() const { return { textures[0], texture_format, texture_swizzling }; }
 
 	Color ABGR4444ToABGR8888(uint16_t color);
 	Color ABGR1555ToABGR8888(uint16_t color);
 	Color BGR565ToABGR8888(uint16_t color);
 
+	void BeginBatch(uint8_t primitive_type);
 	void Prim(uint32_t opcode);
+	void Bezier(uint32_t opcode);
+	void Spline(uint32_t opcode);
+	bool ReadPatchSource(int count, std::vector<uint32_t>& indices, uint32_t& vertex_size, std::vector<uint8_t>& source);
+	void DrawPatch(uint32_t opcode, int count_u, int count_v);
 	void BBox(uint32_t opcode);
 	void Jump(uint32_t opcode);
 	void BJump(uint32_t opcode);
@@ -190,6 +274,7 @@ public:
 	void WorldD(uint32_t opcode);
 	void ViewD(uint32_t opcode);
 	void ProjD(uint32_t opcode);
+	void BoneD(uint32_t opcode);
 	virtual void CLoad(uint32_t opcode);
 	void CLUT(uint32_t opcode);
 	void TSize(uint32_t opcode);
@@ -197,10 +282,19 @@ public:
 	void Blend(uint32_t opcode);
 	void XStart(uint32_t opcode);
 protected:
-	Renderer();
+	Renderer(bool headless = false);
 
 	std::array<uint32_t, 512> cmds{};
 
+	PrimitiveBatch batch{};
+
+	WorkerPool worker_pool{};
+
+	// Register state as seen by the lookahead scan, which runs ahead of cmds
+	std::array<uint32_t, 512> prefetch_cmds{};
+	int prefetch_list = -1;
+	uint64_t prefetch_texture_key = 0;
+
 	uint32_t offset = 0x0;
 	uint32_t base = 0x0;
 	uint32_t vaddr = 0x0;
@@ -223,12 +317,7 @@ protected:
 	int projection_matrix_num = 0;
 	glm::mat4 projection_matrix{};
 	int bone_matrix_num = 0;
-	glm::mat4 bone_matrix{
-		{0.0, 0.0, 0.0, 0.0},
-		{0.0, 0.0, 0.0, 0.0},
-		{0.0, 0.0, 0.0, 0.0},
-		{0.0, 0.0, 0.0, 1.0}
-	};
+	std::array<glm::mat4, 8> bone_matrices{};
 	int texture_matrix_num = 0;
 	glm::mat4 texture_matrix{
 		{0.0, 0.0, 0.0, 0.0},
@@ -237,6 +326,12 @@ protected:
 		{0.0, 0.0, 0.0, 1.0}
 	};
 
+	// Derived from the matrices above whenever one of them is uploaded
+	bool transform_dirty = true;
+	glm::mat4 view_projection_matrix{};
+	glm::vec4 world_translation{};
+	std::array<glm::mat4, 8> skin_matrices{};
+
 	glm::ivec2 min_draw_area{};
 	glm::ivec2 max_draw_area{};
 
@@ -254,6 +349,16 @@ protected:
 
 	bool gouraud_shading = false;
 
+	bool lighting = false;
+	bool lighting_dirty = true;
+	LightingState lighting_state{};
+
+	uint8_t patch_divide_u = 1;
+	uint8_t patch_divide_v = 1;
+	uint8_t patch_primitive = 0;
+	bool patch_facing = false;
+	std::unordered_map<uint64_t, PatchCacheEntry> patch_cache{};
+
 	Transfer transfer_source{};
 	Transfer transfer_dest{};
 	glm::uvec2 transfer_size{};
@@ -268,6 +373,8 @@ protected:
 	glm::ivec2 scissor_start{};
 	glm::ivec2 scissor_end{};
 
+	bool dither = false;
+
 	bool blend = false;
 	uint8_t blend_operation = 0;
 	uint8_t blend_source = 0;
@@ -319,6 +426,7 @@ protected:
 	uint8_t color_format = FORMAT_NONE;
 	uint8_t uv_format = FORMAT_NONE;
 	uint8_t weight_format = FORMAT_NONE;
+	uint8_t weight_count = 0;
 	uint8_t index_format = FORMAT_NONE;
 	uint8_t normal_format = FORMAT_NONE;
 
@@ -338,8 +446,20 @@ protected:
 	int flips = 0;
 	std::chrono::steady_clock::time_point second_timer{};
 	std::chrono::steady_clock::time_point last_frame_time{};
+
+	void SaveCapture();
+
+	int capture_frames = 0;
+	int captured_frames = 0;
+	std::filesystem::path capture_path{};
+	bool capture_hash = false;
 };
 
+uint64_t HashMemory(const void* data, size_t size, uint64_t seed = 0);
+uint64_t GetTextureKey(const TextureInfo& info);
+uint32_t GetTextureSize(const TextureInfo& info);
+uint64_t HashTexture(const TextureInfo& info);
+
 enum GECommand {
 	CMD_NOP = 0x00,
 	CMD_VADR = 0x01,
@@ -390,6 +510,8 @@ enum GECommand {
 	CMD_WEIGHT6 = 0x32,
 	CMD_WEIGHT7 = 0x33,
 	CMD_DIVIDE = 0x36,
+	CMD_PATCHPRIMITIVE = 0x37,
+	CMD_PATCHFACING = 0x38,
 	CMD_WORLDN = 0x3A,
 	CMD_WORLDD = 0x3B,
 	CMD_VIEWN = 0x3C,
@@ -410,6 +532,7 @@ enum GECommand {
 	CMD_OFFSETY = 0x4D,
 	CMD_SHADE = 0x50,
 	CMD_MATERIAL = 0x53,
+	CMD_MEC = 0x54,
 	CMD_MAC = 0x55,
 	CMD_MDC = 0x56,
 	CMD_MSC = 0x57,
@@ -417,6 +540,17 @@ enum GECommand {
 	CMD_MK = 0x5B,
 	CMD_AC = 0x5C,
 	CMD_AA = 0x5D,
+	CMD_LMODE = 0x5E,
+	CMD_LT0 = 0x5F,
+	CMD_LXP0 = 0x63,
+	CMD_LXD0 = 0x6F,
+	CMD_LCA0 = 0x7B,
+	CMD_SPOTEXP0 = 0x87,
+	CMD_SPOTCUT0 = 0x8B,
+	CMD_ALC0 = 0x8F,
+	CMD_DLC0 = 0x90,
+	CMD_SLC0 = 0x91,
+	CMD_SLC3 = 0x9A,
 	CMD_CULL = 0x9B,
 	CMD_FBP = 0x9C,
 	CMD_FBW = 0x9D,
@@ -1,42 +1,103 @@
 #include "renderer.hpp"
 
+#include <cmath>
+#include <utility>
+#include <emmintrin.h>
 #include <spdlog/spdlog.h>
 
 #include "../../psp.hpp"
 
-SoftwareRenderer::SoftwareRenderer() : Renderer() {
-	renderer = SDL_CreateRenderer(window, NULL);
+SoftwareRenderer::SoftwareRenderer(bool tiled, bool headless) : Renderer(headless), tiled(tiled) {
+	// Headless frames are presented into a surface nobody shows, ReadFrame takes them from guest memory anyway
+	if (window) {
+		renderer = SDL_CreateRenderer(window, NULL);
+	} else {
+		headless_surface = SDL_CreateSurface(BASE_WIDTH, BASE_HEIGHT, SDL_PIXELFORMAT_RGBA32);
+		renderer = SDL_CreateSoftwareRenderer(headless_surface);
+	}
 	SDL_SetRenderLogicalPresentation(renderer, BASE_WIDTH, BASE_HEIGHT, SDL_LOGICAL_PRESENTATION_LETTERBOX);
 }
 
 SoftwareRenderer::~SoftwareRenderer() {
+	// Prefetch jobs decode into this renderer, the base class only joins the pool after its members are gone
+	worker_pool.Wait();
+
 	if (texture) {
 		SDL_DestroyTexture(texture);
 	}
 	SDL_DestroyRenderer(renderer);
+	if (headless_surface) {
+		SDL_DestroySurface(headless_surface);
+	}
 }
 
 void SoftwareRenderer::Frame() {
+	FlushPrimitives();
+	FlushRender();
+
 	SDL_RenderClear(renderer);
-	if (texture && frame_buffer) {
-		void* framebuffer = PSP::GetInstance()->VirtualToPhysical(frame_buffer);
-		SDL_UpdateTexture(texture, nullptr, framebuffer, frame_width);
+	void* framebuffer = texture && frame_buffer ? PSP::GetInstance()->VirtualToPhysical(frame_buffer) : nullptr;
+	if (framebuffer) {
+		// Menus and static screens present the texture that was uploaded last time
+		uint64_t hash = HashMemory(framebuffer, frame_width * BASE_HEIGHT, (static_cast<uint64_t>(frame_buffer) << 32) | frame_width);
+		if (hash != frame_hash) {
+			SDL_UpdateTexture(texture, nullptr, framebuffer, frame_width);
+			frame_hash = hash;
+		}
 		SDL_RenderTexture(renderer, texture, nullptr, nullptr);
 		SDL_RenderPresent(renderer);
 	}
 
-	for (auto it = texture_cache.begin(); it != texture_cache.end();) {
+	// Cached textures get hashed again on their first use of the next frame
+	texture_frame++;
+
+	// Uncached CPU writes aren't reported, so the depth bounds are rebuilt every frame as well
+	InvalidateDepthTiles();
+
+	for (auto it = prefetched_textures.begin(); it != prefetched_textures.end();) {
 		it->second.unused_frames++;
-		if (it->second.unused_frames >= TEXTURE_CACHE_CLEAR_FRAMES) {
-			it = texture_cache.erase(it);
+		if (it->second.unused_frames >= PREFETCH_CLEAR_FRAMES) {
+			it = prefetched_textures.erase(it);
 		} else {
 			it++;
 		}
 	}
 
+	if (++statistics_frames >= FRAGMENT_STATISTICS_FRAMES) {
+		LogFragmentStatistics();
+		statistics_frames = 0;
+	}
+
 	Renderer::Frame();
 }
 
+// Converts the displayed framebuffer instead of the window, so the result doesn't depend on its size
+bool SoftwareRenderer::ReadFrame(std::vector<uint8_t>& pixels, uint32_t& width, uint32_t& height) {
+	void* framebuffer = texture && frame_buffer ? PSP::GetInstance()->VirtualToPhysical(frame_buffer) : nullptr;
+	if (!framebuffer) {
+		return false;
+	}
+
+	width = BASE_WIDTH;
+	height = BASE_HEIGHT;
+	pixels.resize(width * height * 4);
+	if (!SDL_ConvertPixels(width, height, frame_format, framebuffer, frame_width, SDL_PIXELFORMAT_RGBA32, pixels.data(), width * 4)) {
+		spdlog::error("SoftwareRenderer: failed converting frame: {}", SDL_GetError());
+		return false;
+	}
+
+	// The alpha channel holds stencil values, the window shows it as opaque
+	for (size_t i = 3; i < pixels.size(); i += 4) {
+		pixels[i] = 0xFF;
+	}
+	return true;
+}
+
+// Block transfers and framebuffer switches may have overwritten the depth buffer
+void SoftwareRenderer::RenderFramebufferChange() {
+	InvalidateDepthTiles();
+}
+
 void SoftwareRenderer::SetFrameBuffer(uint32_t frame_buffer, int frame_width, int pixel_format) {
 	Renderer::SetFrameBuffer(frame_buffer, frame_width, pixel_format);
 
@@ -64,15 +125,489 @@ void SoftwareRenderer::SetFrameBuffer(uint32_t frame_buffer, int frame_width, in
 		spdlog::error("SoftwareRenderer: invalid pixel format");
 	}
 
+	frame_hash = 0;
 	texture = SDL_CreateTexture(renderer, sdl_pixel_format, SDL_TEXTUREACCESS_STREAMING, BASE_WIDTH, BASE_HEIGHT);
 	SDL_SetTextureScaleMode(texture, SDL_SCALEMODE_NEAREST);
 	SDL_SetTextureBlendMode(texture, SDL_BLENDMODE_NONE);
 }
 
+static bool IsVRAM(uint32_t addr) {
+	addr &= 0x0FFFFFFF;
+	return addr >= VRAM_START && addr < VRAM_END;
+}
+
+// Mirrors of VRAM alias the same memory, so ranges in it are compared by their offset
+static uint32_t GetVRAMOffset(uint32_t addr) {
+	return ((addr & 0x0FFFFFFF) - VRAM_START) % VRAM_SIZE;
+}
+
+template <uint8_t TEST>
+static bool Compare(int src, int dst) {
+	if constexpr (TEST == SCEGU_NEVER) {
+		return false;
+	} else if constexpr (TEST == SCEGU_EQUAL) {
+		return src == dst;
+	} else if constexpr (TEST == SCEGU_NOTEQUAL) {
+		return src != dst;
+	} else if constexpr (TEST == SCEGU_LESS) {
+		return src < dst;
+	} else if constexpr (TEST == SCEGU_LEQUAL) {
+		return src <= dst;
+	} else if constexpr (TEST == SCEGU_GREATER) {
+		return src > dst;
+	} else if constexpr (TEST == SCEGU_GEQUAL) {
+		return src >= dst;
+	}
+	return true;
+}
+
+template <uint8_t TEST>
+static __m128i CompareQuad(__m128i src, __m128i dst) {
+	const __m128i all = _mm_set1_epi32(-1);
+	if constexpr (TEST == SCEGU_NEVER) {
+		return _mm_setzero_si128();
+	} else if constexpr (TEST == SCEGU_EQUAL) {
+		return _mm_cmpeq_epi32(src, dst);
+	} else if constexpr (TEST == SCEGU_NOTEQUAL) {
+		return _mm_xor_si128(_mm_cmpeq_epi32(src, dst), all);
+	} else if constexpr (TEST == SCEGU_LESS) {
+		return _mm_cmplt_epi32(src, dst);
+	} else if constexpr (TEST == SCEGU_LEQUAL) {
+		return _mm_xor_si128(_mm_cmpgt_epi32(src, dst), all);
+	} else if constexpr (TEST == SCEGU_GREATER) {
+		return _mm_cmpgt_epi32(src, dst);
+	} else if constexpr (TEST == SCEGU_GEQUAL) {
+		return _mm_xor_si128(_mm_cmplt_epi32(src, dst), all);
+	}
+	return all;
+}
+
+static Color GetCLUT(const RasterState& state, uint32_t index) {
+	return state.clut[((index >> state.clut_shift) & state.clut_mask) | state.clut_base];
+}
+
+template <bool CLUT, bool U_CLAMP, bool V_CLAMP>
+static Color GetTexel(const RasterState& state, int x, int y) {
+	auto& texture = state.texture;
+	if constexpr (U_CLAMP) {
+		x = std::clamp<int>(x, 0, texture.width - 1);
+	} else {
+		x %= texture.width;
+	}
+
+	if constexpr (V_CLAMP) {
+		y = std::clamp<int>(y, 0, texture.height - 1);
+	} else {
+		y %= texture.height;
+	}
+
+	Color texel = state.texture_data->data[y * texture.width + x];
+	if constexpr (CLUT) {
+		return GetCLUT(state, texel.abgr);
+	}
+	return texel;
+}
+
+// Indexed texels are looked up before filtering, the GE blends palette colors and not indices
+template <bool CLUT, bool LINEAR, bool U_CLAMP, bool V_CLAMP>
+static Color SampleTexture(const RasterState& state, glm::vec2 uv) {
+	auto& texture = state.texture;
+
+	if constexpr (!LINEAR) {
+		int x = static_cast<int>(uv.x * texture.width * 256) >> 8;
+		int y = static_cast<int>(uv.y * texture.height * 256) >> 8;
+
+		return GetTexel<CLUT, U_CLAMP, V_CLAMP>(state, x, y);
+	} else {
+		int base_x = static_cast<int>(uv.x * texture.width * 256) - 128;
+		int base_y = static_cast<int>(uv.y * texture.height * 256) - 128;
+
+		int x0 = base_x >> 8;
+		int frac_u = base_x >> 4 & 0xF;
+		int y0 = base_y >> 8;
+		int frac_v = base_y >> 4 & 0xF;
+
+		int x1 = x0 + 1;
+		int y1 = y0 + 1;
+
+		Color t0 = GetTexel<CLUT, U_CLAMP, V_CLAMP>(state, x0, y0);
+		auto c00 = glm::ivec4(t0.r, t0.g, t0.b, t0.a);
+		Color t1 = GetTexel<CLUT, U_CLAMP, V_CLAMP>(state, x1, y0);
+		auto c10 = glm::ivec4(t1.r, t1.g, t1.b, t1.a);
+		Color t2 = GetTexel<CLUT, U_CLAMP, V_CLAMP>(state, x0, y1);
+		auto c01 = glm::ivec4(t2.r, t2.g, t2.b, t2.a);
+		Color t3 = GetTexel<CLUT, U_CLAMP, V_CLAMP>(state, x1, y1);
+		auto c11 = glm::ivec4(t3.r, t3.g, t3.b, t3.a);
+
+		auto c0 = c00 * (0x10 - frac_u) + c10 * frac_u;
+		auto c1 = c01 * (0x10 - frac_u) + c11 * frac_u;
+		auto result = (c0 * (0x10 - frac_v) + c1 * frac_v) >> 8;
+		return {
+			static_cast<uint8_t>(std::clamp(result.a, 0, 255)),
+			static_cast<uint8_t>(std::clamp(result.b, 0, 255)),
+			static_cast<uint8_t>(std::clamp(result.g, 0, 255)),
+			static_cast<uint8_t>(std::clamp(result.r, 0, 255)) };
+	}
+}
+
+template <uint8_t FUNCTION, bool DOUBLE, bool ALPHA>
+static Color ApplyTextureFunction(const RasterState& state, Color texture, Color blending) {
+	glm::ivec4 tex_color{ texture.r, texture.g, texture.b, texture.a };
+	glm::ivec4 blend_color{ blending.r, blending.g, blending.b, blending.a };
+
+	glm::ivec4 result{};
+	if constexpr (FUNCTION == SCEGU_TEX_MODULATE) {
+		if constexpr (DOUBLE) {
+			result = ((blend_color + 1) * tex_color * 2) / 256;
+		} else {
+			result = (blend_color + 1) * tex_color / 256;
+		}
+
+		result.a = ALPHA ? (blend_color.a + 1) * tex_color.a / 256 : blend_color.a;
+	} else if constexpr (FUNCTION == SCEGU_TEX_DECAL) {
+		if constexpr (ALPHA) {
+			result = ((blend_color + 1) * (255 - tex_color.a) + (tex_color + 1) * tex_color.a);
+			result /= DOUBLE ? 128 : 256;
+		} else {
+			result = DOUBLE ? tex_color * 2 : tex_color;
+		}
+		result.a = blend_color.a;
+	} else if constexpr (FUNCTION == SCEGU_TEX_BLEND) {
+		result = ((255 - tex_color) * blend_color + tex_color * state.environment_texture + 255);
+		result /= DOUBLE ? 128 : 256;
+
+		result.a = ALPHA ? (blend_color.a + 1) * tex_color.a / 256 : blend_color.a;
+	} else if constexpr (FUNCTION == SCEGU_TEX_REPLACE) {
+		result = DOUBLE ? tex_color * 2 : tex_color;
+		result.a = ALPHA ? tex_color.a : blending.a;
+	} else if constexpr (FUNCTION == SCEGU_TEX_ADD) {
+		result = DOUBLE ? (tex_color + blend_color) * 2 : tex_color + blend_color;
+		result.a = ALPHA ? (blend_color.a + 1) * tex_color.a / 256 : blend_color.a;
+	}
+
+	return {
+		static_cast<uint8_t>(std::clamp(result.a, 0, 255)),
+		static_cast<uint8_t>(std::clamp(result.b, 0, 255)),
+		static_cast<uint8_t>(std::clamp(result.g, 0, 255)),
+		static_cast<uint8_t>(std::clamp(result.r, 0, 255)) };
+}
+
+// Color is the other side of the equation, the source factor reads the destination color and vice versa
+template <uint8_t FACTOR>
+static glm::ivec4 GetBlendFactor(glm::ivec4 color, glm::ivec4 src, glm::ivec4 dest, glm::ivec4 fix) {
+	if constexpr (FACTOR == SCEGU_COLOR) {
+		return color;
+	} else if constexpr (FACTOR == SCEGU_ONE_MINUS_COLOR) {
+		return 255 - color;
+	} else if constexpr (FACTOR == SCEGU_SRC_ALPHA) {
+		return glm::ivec4(src.a);
+	} else if constexpr (FACTOR == SCEGU_ONE_MINUS_SRC_ALPHA) {
+		return glm::ivec4(255 - src.a);
+	} else if constexpr (FACTOR == SCEGU_DST_ALPHA) {
+		return glm::ivec4(dest.a);
+	} else if constexpr (FACTOR == SCEGU_ONE_MINUS_DST_ALPHA) {
+		return glm::ivec4(255 - dest.a);
+	} else if constexpr (FACTOR == SCEGU_DOUBLE_SRC_ALPHA) {
+		return glm::ivec4(2 * src.a);
+	} else if constexpr (FACTOR == SCEGU_ONE_MINUS_DOUBLE_SRC_ALPHA) {
+		return glm::ivec4(255 - std::min(2 * src.a, 255));
+	} else if constexpr (FACTOR == SCEGU_DOUBLE_DST_ALPHA) {
+		return glm::ivec4(2 * dest.a);
+	} else if constexpr (FACTOR == SCEGU_ONE_MINUS_DOUBLE_DST_ALPHA) {
+		return glm::ivec4(255 - std::min(2 * dest.a, 255));
+	}
+	return fix;
+}
+
+template <uint8_t OPERATION>
+static Color BlendColors(const RasterState& state, Color src, Color dest) {
+	glm::ivec4 src_color{ src.r, src.g, src.b, src.a };
+	glm::ivec4 dest_color{ dest.r, dest.g, dest.b, dest.a };
+
+	glm::ivec4 result(0);
+	if constexpr (OPERATION < SCEGU_MIN) {
+		glm::ivec4 asel = state.blend_factor_a(dest_color, src_color, dest_color, state.blend_afix);
+		glm::ivec4 bsel = state.blend_factor_b(src_color, src_color, dest_color, state.blend_bfix);
+		glm::ivec4 src_term = (src_color * 2 + 1) * (asel * 2 + 1) / 1024;
+		glm::ivec4 dest_term = (dest_color * 2 + 1) * (bsel * 2 + 1) / 1024;
+		if constexpr (OPERATION == SCEGU_ADD) {
+			result = src_term + dest_term;
+		} else if constexpr (OPERATION == SCEGU_SUBTRACT) {
+			result = src_term - dest_term;
+		} else {
+			result = dest_term - src_term;
+		}
+	} else if constexpr (OPERATION == SCEGU_MIN) {
+		result = glm::min(dest_color, src_color);
+	} else if constexpr (OPERATION == SCEGU_MAX) {
+		result = glm::max(dest_color, src_color);
+	} else if constexpr (OPERATION == SCEGU_ABS) {
+		result = glm::abs(src_color - dest_color);
+	}
+	return { 0x00,
+		static_cast<uint8_t>(std::clamp(result.b, 0, 255)),
+		static_cast<uint8_t>(std::clamp(result.g, 0, 255)),
+		static_cast<uint8_t>(std::clamp(result.r, 0, 255)) };
+}
+
+template <size_t... INDICES>
+static constexpr std::array<CompareFunction, sizeof...(INDICES)> MakeCompareFunctions(std::index_sequence<INDICES...>) {
+	return { &Compare<INDICES>... };
+}
+
+// Indexed by CLUT | LINEAR << 1 | U_CLAMP << 2 | V_CLAMP << 3
+template <size_t... INDICES>
+static constexpr std::array<TextureSampler, sizeof...(INDICES)> MakeTextureSamplers(std::index_sequence<INDICES...>) {
+	return { &SampleTexture<(INDICES & 1) != 0, (INDICES >> 1 & 1) != 0, (INDICES >> 2 & 1) != 0, (INDICES >> 3 & 1) != 0>... };
+}
+
+// Indexed by FUNCTION | DOUBLE << 3 | ALPHA << 4
+template <size_t... INDICES>
+static constexpr std::array<TextureFunction, sizeof...(INDICES)> MakeTextureFunctions(std::index_sequence<INDICES...>) {
+	return { &ApplyTextureFunction<INDICES & 7, (INDICES >> 3 & 1) != 0, (INDICES >> 4 & 1) != 0>... };
+}
+
+template <size_t... INDICES>
+static constexpr std::array<BlendFactor, sizeof...(INDICES)> MakeBlendFactors(std::index_sequence<INDICES...>) {
+	return { &GetBlendFactor<INDICES>... };
+}
+
+template <size_t... INDICES>
+static constexpr std::array<BlendFunction, sizeof...(INDICES)> MakeBlendFunctions(std::index_sequence<INDICES...>) {
+	return { &BlendColors<INDICES>... };
+}
+
+static const auto COMPARE_FUNCTIONS = MakeCompareFunctions(std::make_index_sequence<8>());
+static const QuadCompareFunction QUAD_COMPARE_FUNCTIONS[] = {
+	&CompareQuad<0>, &CompareQuad<1>, &CompareQuad<2>, &CompareQuad<3>, &CompareQuad<4>, &CompareQuad<5>, &CompareQuad<6>, &CompareQuad<7>
+};
+static const auto TEXTURE_SAMPLERS = MakeTextureSamplers(std::make_index_sequence<16>());
+static const auto TEXTURE_FUNCTIONS = MakeTextureFunctions(std::make_index_sequence<32>());
+static const auto BLEND_FACTORS = MakeBlendFactors(std::make_index_sequence<16>());
+static const auto BLEND_FUNCTIONS = MakeBlendFunctions(std::make_index_sequence<8>());
+
+void SoftwareRenderer::DrawBatch(const PrimitiveBatch& batch) {
+	// Render state can't change inside of a batch, so the texture only has to be decoded once
+	std::shared_ptr<const TextureCacheEntry> texture_data{};
+	if (!clear_mode && textures_enabled) {
+		// Rendering to a texture has to land before it's sampled
+		if (IsVRAM(textures[0].buffer)) {
+			FlushRender();
+		}
+		texture_data = GetTexture();
+	}
+
+	if (binned_primitives.size() >= MAX_BINNED_PRIMITIVES) {
+		FlushRender();
+	}
+
+	// The depth bounds only describe one depth buffer, pending primitives have to be drawn before it changes
+	uint32_t depth_addr = GetDepthBufferAddress();
+	if ((depth_test || depth_write) && (depth_addr != depth_tiles_addr || zbw != depth_tiles_zbw)) {
+		FlushRender();
+		InvalidateDepthTiles();
+		depth_tiles_addr = depth_addr;
+		depth_tiles_zbw = zbw;
+	}
+
+	// Color writes into the depth buffer's memory change it behind the bounds' back
+	uint32_t color_size = fbw * (fpf == SCE_DISPLAY_PIXEL_RGBA8888 ? 4 : 2) * TILE_COUNT_Y * TILE_SIZE;
+	bool aliased = OverlapsDepthTiles(GetFrameBufferAddress(), color_size);
+	if (aliased) {
+		FlushRender();
+		InvalidateDepthTiles();
+	}
+	raster_states.push_back(CaptureRasterState(texture_data));
+
+	Renderer::DrawBatch(batch);
+
+	if (aliased) {
+		FlushRender();
+		InvalidateDepthTiles();
+	}
+}
+
+RasterState SoftwareRenderer::CaptureRasterState(std::shared_ptr<const TextureCacheEntry> texture_data) {
+	auto psp = PSP::GetInstance();
+
+	RasterState state{};
+	state.frame_buffer = reinterpret_cast<uint8_t*>(psp->VirtualToPhysical(GetFrameBufferAddress()));
+	state.depth_buffer = reinterpret_cast<uint16_t*>(psp->VirtualToPhysical(GetDepthBufferAddress()));
+	state.fbw = fbw;
+	state.zbw = zbw;
+	state.pixel_format = fpf;
+
+	// Each DITH register holds one row of signed 4-bit offsets
+	state.dither = !clear_mode && dither && fpf != SCE_DISPLAY_PIXEL_RGBA8888;
+	for (int y = 0; y < 4; y++) {
+		for (int x = 0; x < 4; x++) {
+			int value = cmds[CMD_DITH1 + y] >> (x * 4) & 0xF;
+			state.dither_matrix[y * 4 + x] = (value ^ 8) - 8;
+		}
+	}
+
+	state.through = through;
+	state.clear_mode = clear_mode;
+	state.min_z = min_z;
+	state.max_z = max_z;
+	state.depth_test = depth_test;
+	state.depth_test_func = depth_test_func;
+	state.depth_write = depth_write;
+	state.gouraud_shading = gouraud_shading;
+	state.depth_compare = COMPARE_FUNCTIONS[depth_test_func & 7];
+	state.depth_compare_quad = QUAD_COMPARE_FUNCTIONS[depth_test_func & 7];
+
+	state.use_texture = texture_data != nullptr;
+	state.texture = textures[0];
+	state.texture_data = texture_data;
+	state.u_clamp = u_clamp;
+	state.v_clamp = v_clamp;
+	state.texture_function = texture_function;
+	state.texture_alpha = texture_alpha;
+	state.fragment_double = fragment_double;
+	state.environment_texture = environment_texture;
+	state.texture_stage = TEXTURE_FUNCTIONS[(texture_function & 7) | fragment_double << 3 | texture_alpha << 4];
+	if (state.use_texture) {
+		int sampler = texture_data->clut | u_clamp << 2 | v_clamp << 3;
+		state.samplers = { TEXTURE_SAMPLERS[sampler], TEXTURE_SAMPLERS[sampler | 2] };
+	}
+
+	// Textures that couldn't be resolved up front sample through the converted CLUT
+	if (state.use_texture && texture_data->clut) {
+		DecodeCLUT(clut.data(), clut_format, reinterpret_cast<uint32_t*>(state.clut.data()));
+	}
+	state.clut_format = clut_format;
+	state.clut_shift = clut_shift;
+	state.clut_mask = clut_mask;
+	state.clut_offset = clut_offset;
+	state.clut_base = clut_offset & (clut_format == SCEGU_PF8888 ? 0xFF : 0x1FF);
+
+	state.alpha_test = alpha_test;
+	state.alpha_test_func = alpha_test_func;
+	state.alpha_test_ref = alpha_test_ref;
+	state.alpha_test_mask = alpha_test_mask;
+	state.alpha_compare = COMPARE_FUNCTIONS[alpha_test_func & 7];
+
+	state.blend = blend;
+	state.blend_operation = blend_operation;
+	state.blend_source = blend_source;
+	state.blend_destination = blend_destination;
+	state.blend_afix = blend_afix;
+	state.blend_bfix = blend_bfix;
+	state.blend_stage = BLEND_FUNCTIONS[blend_operation & 7];
+	state.blend_factor_a = BLEND_FACTORS[blend_source & 0xF];
+	state.blend_factor_b = BLEND_FACTORS[blend_destination & 0xF];
+
+	FragmentKey key{};
+	key.depth_test = !clear_mode && depth_test;
+	if (state.use_texture) {
+		key.shade_mode = texture_data->clut ? SHADE_TEXTURE_CLUT : SHADE_TEXTURE;
+	} else {
+		key.shade_mode = gouraud_shading ? SHADE_GOURAUD : SHADE_FLAT;
+	}
+	key.alpha_test = !clear_mode && alpha_test;
+	key.blend = !clear_mode && blend;
+	key.depth_write = depth_write;
+	key.range_test = !through;
+	key.pixel_format = fpf;
+	key.depth_func = depth_test_func;
+	key.alpha_func = alpha_test_func;
+	key.blend_operation = blend_operation;
+	key.blend_source = blend_source;
+	key.blend_destination = blend_destination;
+	key.texture_function = texture_function;
+	state.pipeline = GetFragmentPipeline(key);
+	return state;
+}
+
+void SoftwareRenderer::BinPrimitive(const BinnedPrimitive& primitive) {
+	if (primitive.min.x >= primitive.max.x || primitive.min.y >= primitive.max.y) {
+		return;
+	}
+
+	if (!tiled) {
+		RasterizePrimitive(primitive, primitive.min, primitive.max);
+		return;
+	}
+
+	uint32_t index = binned_primitives.size();
+	binned_primitives.push_back(primitive);
+
+	int tile_min_x = primitive.min.x / TILE_SIZE;
+	int tile_min_y = primitive.min.y / TILE_SIZE;
+	int tile_max_x = std::min((primitive.max.x - 1) / TILE_SIZE, TILE_COUNT_X - 1);
+	int tile_max_y = std::min((primitive.max.y - 1) / TILE_SIZE, TILE_COUNT_Y - 1);
+	for (int y = tile_min_y; y <= tile_max_y; y++) {
+		for (int x = tile_min_x; x <= tile_max_x; x++) {
+			tile_bins[y * TILE_COUNT_X + x].push_back(index);
+		}
+	}
+}
+
+void SoftwareRenderer::RasterizePrimitive(const BinnedPrimitive& primitive, glm::ivec2 min, glm::ivec2 max) {
+	switch (primitive.primitive_type) {
+	case SCEGU_PRIM_RECTANGLES:
+		RasterizeRectangle(primitive, min, max);
+		break;
+	case SCEGU_PRIM_TRIANGLES:
+		(this->*primitive.state->pipeline->rasterize_triangle)(primitive, min, max);
+		break;
+	default:
+		(this->*primitive.state->pipeline->rasterize_line)(primitive, min, max);
+		break;
+	}
+}
+
+void SoftwareRenderer::FlushRender() {
+	// Serial rasterization never bins anything, but its states still pile up until a flush
+	if (binned_primitives.empty()) {
+		raster_states.clear();
+		return;
+	}
+
+	std::vector<int> active_tiles{};
+	for (int i = 0; i < tile_bins.size(); i++) {
+		if (!tile_bins[i].empty()) {
+			active_tiles.push_back(i);
+		}
+	}
+
+	// Tiles don't share pixels, so only the order inside of a tile has to be kept
+	worker_pool.ParallelFor(active_tiles.size(), [this, &active_tiles](int i) {
+		int tile = active_tiles[i];
+		glm::ivec2 tile_min(tile % TILE_COUNT_X * TILE_SIZE, tile / TILE_COUNT_X * TILE_SIZE);
+		glm::ivec2 tile_max = tile_min + TILE_SIZE;
+
+		for (auto index : tile_bins[tile]) {
+			auto& primitive = binned_primitives[index];
+			glm::ivec2 min = glm::max(primitive.min, tile_min);
+			glm::ivec2 max = glm::min(primitive.max, tile_max);
+			RasterizePrimitive(primitive, min, max);
+		}
+		tile_bins[tile].clear();
+	});
+
+	binned_primitives.clear();
+	raster_states.clear();
+}
+
+void SoftwareRenderer::SyncMemory(uint32_t addr, uint32_t size) {
+	// Binned primitives only reach guest memory once the tiles are rasterized
+	if (IsVRAM(addr) || IsVRAM(addr + size - 1)) {
+		FlushPrimitives();
+		FlushRender();
+	}
+}
+
+void SoftwareRenderer::CLoad(uint32_t opcode) {
+	if (IsVRAM(clut_addr)) {
+		FlushRender();
+	}
+	Renderer::CLoad(opcode);
+	clut_hash = HashMemory(clut.data(), clut.size());
+}
+
 void SoftwareRenderer::DrawRectangle(Vertex start, Vertex end) {
-	uint32_t* frame_buffer_start = reinterpret_cast<uint32_t*>(PSP::GetInstance()->VirtualToPhysical(GetFrameBufferAddress()));
-	uint16_t* depth_buffer_start = reinterpret_cast<uint16_t*>(PSP::GetInstance()->VirtualToPhysical(GetDepthBufferAddress()));
-	
 	glm::ivec3 min = glm::round(start.pos);
 	glm::ivec3 max = glm::round(end.pos);
 
@@ -92,100 +627,537 @@ void SoftwareRenderer::DrawRectangle(Vertex start, Vertex end) {
 	uint32_t height = max.y - min.y;
 	if (width == 0 || height == 0) return;
 
-	if (fpf != SCE_DISPLAY_PIXEL_RGBA8888) {
-		spdlog::error("SoftwareRenderer: unimplemented pixel format for triangle {}", fpf);
-		return;
-	}
+	if (fpf > SCE_DISPLAY_PIXEL_RGBA8888) {
+		spdlog::error("SoftwareRenderer: unknown pixel format {}", fpf);
+		return;
+	}
+
+	if (!through && (max.z < min_z || max.z > max_z)) {
+		return;
+	}
+
+	auto& state = raster_states.back();
+
+	BinnedPrimitive primitive{};
+	primitive.primitive_type = SCEGU_PRIM_RECTANGLES;
+	primitive.filter = -1;
+	if (state.use_texture) {
+		primitive.filter = GetFilter((end.uv.x - start.uv.x) / width, (end.uv.y - start.uv.y) / height);
+	}
+	primitive.min = glm::ivec2(ScissorTestX(min.x), ScissorTestY(min.y));
+	primitive.max = glm::ivec2(ScissorTestX(max.x), ScissorTestY(max.y));
+	primitive.vertices[0] = start;
+	primitive.vertices[1] = end;
+	primitive.state = &state;
+	primitive.rectangle_mode = GetRectangleMode(state, start, end, glm::ivec2(width, height), primitive.filter);
+	BinPrimitive(primitive);
+}
+
+// The fast paths only cover rectangles whose result is a plain fill, copy or alpha blend of whole spans
+uint8_t SoftwareRenderer::GetRectangleMode(const RasterState& state, const Vertex& start, const Vertex& end, glm::ivec2 size, uint8_t filter) {
+	if (state.clear_mode) {
+		return RECTANGLE_FILL;
+	}
+
+	if (state.depth_test || state.alpha_test) {
+		return RECTANGLE_GENERIC;
+	}
+
+	bool alpha_blend = state.blend && state.blend_operation == SCEGU_ADD &&
+		state.blend_source == SCEGU_SRC_ALPHA && state.blend_destination == SCEGU_ONE_MINUS_SRC_ALPHA;
+	if (state.blend && !alpha_blend) {
+		return RECTANGLE_GENERIC;
+	}
+
+	if (!state.use_texture) {
+		return alpha_blend ? RECTANGLE_BLEND : RECTANGLE_FILL;
+	}
+
+	// The texture function has to pass texels through unchanged, alpha included when it gets blended
+	bool replace = state.texture_function == SCEGU_TEX_REPLACE;
+	bool modulate_white = state.texture_function == SCEGU_TEX_MODULATE && end.color.abgr == 0xFFFFFFFF;
+	if (state.fragment_double || !(replace || modulate_white) || (alpha_blend && !state.texture_alpha)) {
+		return RECTANGLE_GENERIC;
+	}
+
+	// One texel per pixel, starting on a texel and never wrapping. The float steps stay exact for these
+	auto& texture = state.texture;
+	float u0 = start.uv.x * texture.width;
+	float v0 = start.uv.y * texture.height;
+	bool unscaled = (end.uv.x - start.uv.x) * texture.width == size.x && (end.uv.y - start.uv.y) * texture.height == size.y;
+	bool aligned = u0 == std::floor(u0) && v0 == std::floor(v0);
+	bool inside = u0 >= 0 && v0 >= 0 && u0 + size.x <= texture.width && v0 + size.y <= texture.height;
+	if (filter != SCEGU_NEAREST || state.texture_data->clut || !unscaled || !aligned || !inside) {
+		return RECTANGLE_GENERIC;
+	}
+	return alpha_blend ? RECTANGLE_BLEND : RECTANGLE_COPY;
+}
+
+template <uint8_t PIXEL_FORMAT>
+static Color ReadPixel(const RasterState& state, uint32_t index) {
+	uint32_t color;
+	if constexpr (PIXEL_FORMAT == SCE_DISPLAY_PIXEL_RGBA8888) {
+		color = reinterpret_cast<const uint32_t*>(state.frame_buffer)[index];
+	} else {
+		auto pixel = reinterpret_cast<const uint16_t*>(state.frame_buffer) + index;
+		if constexpr (PIXEL_FORMAT == SCE_DISPLAY_PIXEL_RGB565) {
+			Decode5650(pixel, &color, 1);
+		} else if constexpr (PIXEL_FORMAT == SCE_DISPLAY_PIXEL_RGBA5551) {
+			Decode5551(pixel, &color, 1);
+		} else {
+			Decode4444(pixel, &color, 1);
+		}
+	}
+	return color;
+}
+
+template <uint8_t PIXEL_FORMAT>
+static void WritePixel(const RasterState& state, uint32_t index, Color color, int x, int y) {
+	if constexpr (PIXEL_FORMAT == SCE_DISPLAY_PIXEL_RGBA8888) {
+		reinterpret_cast<uint32_t*>(state.frame_buffer)[index] = color.abgr;
+	} else {
+		auto pixel = reinterpret_cast<uint16_t*>(state.frame_buffer) + index;
+		const int8_t* dither = state.dither ? &state.dither_matrix[(y & 3) * 4 + (x & 3)] : nullptr;
+		if constexpr (PIXEL_FORMAT == SCE_DISPLAY_PIXEL_RGB565) {
+			Encode5650(&color.abgr, pixel, 1, dither);
+		} else if constexpr (PIXEL_FORMAT == SCE_DISPLAY_PIXEL_RGBA5551) {
+			Encode5551(&color.abgr, pixel, 1, dither);
+		} else {
+			Encode4444(&color.abgr, pixel, 1, dither);
+		}
+	}
+}
+
+// Every span keeps the destination alpha, just like the per-pixel path
+static void FillSpan(uint32_t* dst, int count, uint32_t color) {
+	const __m128i alpha_mask = _mm_set1_epi32(0xFF000000);
+	const __m128i rgb = _mm_set1_epi32(color & 0xFFFFFF);
+
+	int i = 0;
+	for (; i + 4 <= count; i += 4) {
+		__m128i dest = _mm_loadu_si128(reinterpret_cast<const __m128i*>(dst + i));
+		_mm_storeu_si128(reinterpret_cast<__m128i*>(dst + i), _mm_or_si128(_mm_and_si128(dest, alpha_mask), rgb));
+	}
+
+	for (; i < count; i++) {
+		dst[i] = (dst[i] & 0xFF000000) | (color & 0xFFFFFF);
+	}
+}
+
+static void CopySpan(uint32_t* dst, const uint32_t* src, int count) {
+	const __m128i alpha_mask = _mm_set1_epi32(0xFF000000);
+
+	int i = 0;
+	for (; i + 4 <= count; i += 4) {
+		__m128i dest = _mm_loadu_si128(reinterpret_cast<const __m128i*>(dst + i));
+		__m128i color = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + i));
+		_mm_storeu_si128(reinterpret_cast<__m128i*>(dst + i), _mm_or_si128(_mm_and_si128(dest, alpha_mask), _mm_andnot_si128(alpha_mask, color)));
+	}
+
+	for (; i < count; i++) {
+		dst[i] = (dst[i] & 0xFF000000) | (src[i] & 0xFFFFFF);
+	}
+}
+
+static void FillDepthSpan(uint16_t* dst, int count, uint16_t z) {
+	const __m128i depth = _mm_set1_epi16(static_cast<short>(z));
+
+	int i = 0;
+	for (; i + 8 <= count; i += 8) {
+		_mm_storeu_si128(reinterpret_cast<__m128i*>(dst + i), depth);
+	}
+
+	for (; i < count; i++) {
+		dst[i] = z;
+	}
+}
+
+// (a * 2 + 1) * (b * 2 + 1) / 1024 on 16-bit lanes, the 18-bit product is split over mulhi and mullo
+static __m128i BlendTerm(__m128i color, __m128i factor) {
+	const __m128i one = _mm_set1_epi16(1);
+	color = _mm_add_epi16(_mm_add_epi16(color, color), one);
+	factor = _mm_add_epi16(_mm_add_epi16(factor, factor), one);
+	__m128i hi = _mm_mulhi_epu16(color, factor);
+	__m128i lo = _mm_mullo_epi16(color, factor);
+	return _mm_or_si128(_mm_slli_epi16(hi, 6), _mm_srli_epi16(lo, 10));
+}
+
+// Two pixels in 16-bit lanes, source alpha over destination with the GE's rounding
+static __m128i BlendPixels(__m128i src, __m128i dest) {
+	__m128i alpha = _mm_shufflehi_epi16(_mm_shufflelo_epi16(src, _MM_SHUFFLE(3, 3, 3, 3)), _MM_SHUFFLE(3, 3, 3, 3));
+	__m128i inverse_alpha = _mm_sub_epi16(_mm_set1_epi16(255), alpha);
+	return _mm_add_epi16(BlendTerm(src, alpha), BlendTerm(dest, inverse_alpha));
+}
+
+// A constant source blends one color over the whole span
+static void BlendSpan(uint32_t* dst, const uint32_t* src, bool constant_source, int count) {
+	const __m128i zero = _mm_setzero_si128();
+	const __m128i alpha_mask = _mm_set1_epi32(0xFF000000);
+
+	int i = 0;
+	for (; i + 4 <= count; i += 4) {
+		__m128i dest = _mm_loadu_si128(reinterpret_cast<const __m128i*>(dst + i));
+		__m128i color = constant_source ? _mm_set1_epi32(src[0]) : _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + i));
+
+		__m128i lo = BlendPixels(_mm_unpacklo_epi8(color, zero), _mm_unpacklo_epi8(dest, zero));
+		__m128i hi = BlendPixels(_mm_unpackhi_epi8(color, zero), _mm_unpackhi_epi8(dest, zero));
+		__m128i result = _mm_packus_epi16(lo, hi);
+		_mm_storeu_si128(reinterpret_cast<__m128i*>(dst + i), _mm_or_si128(_mm_and_si128(dest, alpha_mask), _mm_andnot_si128(alpha_mask, result)));
+	}
+
+	for (; i < count; i++) {
+		__m128i color = _mm_unpacklo_epi8(_mm_cvtsi32_si128(constant_source ? src[0] : src[i]), zero);
+		__m128i dest = _mm_unpacklo_epi8(_mm_cvtsi32_si128(dst[i]), zero);
+		uint32_t result = _mm_cvtsi128_si32(_mm_packus_epi16(BlendPixels(color, dest), zero));
+		dst[i] = (dst[i] & 0xFF000000) | (result & 0xFFFFFF);
+	}
+}
+
+static void DrawSpan(uint8_t mode, uint32_t* dst, const uint32_t* texels, uint32_t color, int count) {
+	switch (mode) {
+	case RECTANGLE_FILL:
+		FillSpan(dst, count, color);
+		break;
+	case RECTANGLE_COPY:
+		CopySpan(dst, texels, count);
+		break;
+	case RECTANGLE_BLEND:
+		BlendSpan(dst, texels ? texels : &color, !texels, count);
+		break;
+	}
+}
+
+static void DecodeSpan(uint8_t pixel_format, const uint16_t* src, uint32_t* dst, int count) {
+	switch (pixel_format) {
+	case SCE_DISPLAY_PIXEL_RGB565: Decode5650(src, dst, count); break;
+	case SCE_DISPLAY_PIXEL_RGBA5551: Decode5551(src, dst, count); break;
+	case SCE_DISPLAY_PIXEL_RGBA4444: Decode4444(src, dst, count); break;
+	}
+}
+
+static void EncodeSpan(uint8_t pixel_format, const uint32_t* src, uint16_t* dst, int count, const int8_t* dither) {
+	switch (pixel_format) {
+	case SCE_DISPLAY_PIXEL_RGB565: Encode5650(src, dst, count, dither); break;
+	case SCE_DISPLAY_PIXEL_RGBA5551: Encode5551(src, dst, count, dither); break;
+	case SCE_DISPLAY_PIXEL_RGBA4444: Encode4444(src, dst, count, dither); break;
+	}
+}
+
+void SoftwareRenderer::RasterizeRectangleSpans(const BinnedPrimitive& primitive, glm::ivec2 min, glm::ivec2 max) {
+	auto& state = *primitive.state;
+	auto& start = primitive.vertices[0];
+	auto& end = primitive.vertices[1];
+
+	glm::ivec3 start_pos = glm::round(start.pos);
+	glm::ivec3 end_pos = glm::round(end.pos);
+	uint16_t z = end_pos.z;
+	int count = max.x - min.x;
+
+	// Only clears can get here with the depth test enabled
+	bool write_depth = state.depth_write && state.depth_test;
+	const uint32_t* texels = nullptr;
+	if (primitive.rectangle_mode != RECTANGLE_FILL && state.use_texture) {
+		int u = static_cast<int>(start.uv.x * state.texture.width) + min.x - start_pos.x;
+		int v = static_cast<int>(start.uv.y * state.texture.height) + min.y - start_pos.y;
+		texels = reinterpret_cast<const uint32_t*>(state.texture_data->data.data()) + v * state.texture.width + u;
+	}
+
+	for (int y = min.y; y < max.y; y++) {
+		if (state.pixel_format == SCE_DISPLAY_PIXEL_RGBA8888) {
+			uint32_t* dst = reinterpret_cast<uint32_t*>(state.frame_buffer) + y * state.fbw + min.x;
+			DrawSpan(primitive.rectangle_mode, dst, texels, end.color.abgr, count);
+		} else {
+			// 16-bit rows are widened in chunks, drawn like 32-bit ones and packed again
+			uint16_t* dst = reinterpret_cast<uint16_t*>(state.frame_buffer) + y * state.fbw + min.x;
+			for (int i = 0; i < count; i += SPAN_CHUNK_SIZE) {
+				int chunk = std::min(count - i, SPAN_CHUNK_SIZE);
+				alignas(16) uint32_t pixels[SPAN_CHUNK_SIZE];
+				DecodeSpan(state.pixel_format, dst + i, pixels, chunk);
+				DrawSpan(primitive.rectangle_mode, pixels, texels ? texels + i : nullptr, end.color.abgr, chunk);
+
+				int8_t dither[4];
+				for (int lane = 0; lane < 4; lane++) {
+					dither[lane] = state.dither_matrix[(y & 3) * 4 + ((min.x + i + lane) & 3)];
+				}
+				EncodeSpan(state.pixel_format, pixels, dst + i, chunk, state.dither ? dither : nullptr);
+			}
+		}
+
+		if (write_depth) {
+			FillDepthSpan(&state.depth_buffer[y * state.zbw + min.x], count, z);
+		}
+		if (texels) {
+			texels += state.texture.width;
+		}
+	}
+
+	if (write_depth) {
+		UpdateDepthBounds(min, max, z, z, true);
+	}
+}
+
+void SoftwareRenderer::RasterizeRectangle(const BinnedPrimitive& primitive, glm::ivec2 min, glm::ivec2 max) {
+	if (primitive.rectangle_mode != RECTANGLE_GENERIC) {
+		RasterizeRectangleSpans(primitive, min, max);
+		return;
+	}
+
+	switch (primitive.state->pixel_format) {
+	case SCE_DISPLAY_PIXEL_RGB565: RasterizeRectangleGeneric<SCE_DISPLAY_PIXEL_RGB565>(primitive, min, max); break;
+	case SCE_DISPLAY_PIXEL_RGBA5551: RasterizeRectangleGeneric<SCE_DISPLAY_PIXEL_RGBA5551>(primitive, min, max); break;
+	case SCE_DISPLAY_PIXEL_RGBA4444: RasterizeRectangleGeneric<SCE_DISPLAY_PIXEL_RGBA4444>(primitive, min, max); break;
+	case SCE_DISPLAY_PIXEL_RGBA8888: RasterizeRectangleGeneric<SCE_DISPLAY_PIXEL_RGBA8888>(primitive, min, max); break;
+	}
+}
+
+template <uint8_t PIXEL_FORMAT>
+void SoftwareRenderer::RasterizeRectangleGeneric(const BinnedPrimitive& primitive, glm::ivec2 min, glm::ivec2 max) {
+	auto& state = *primitive.state;
+	auto& start = primitive.vertices[0];
+	auto& end = primitive.vertices[1];
+
+	glm::ivec3 start_pos = glm::round(start.pos);
+	glm::ivec3 end_pos = glm::round(end.pos);
+	float du = (end.uv.x - start.uv.x) / (end_pos.x - start_pos.x);
+	float dv = (end.uv.y - start.uv.y) / (end_pos.y - start_pos.y);
+	uint16_t z = end_pos.z;
+
+	for (int y = min.y; y < max.y; y++) {
+		glm::vec2 uv{
+			start.uv.x + (min.x - start_pos.x) * du,
+			start.uv.y + (y - start_pos.y) * dv
+		};
+
+		uint32_t frame_buffer_index = y * state.fbw;
+		uint32_t depth_buffer_index = y * state.zbw;
+		for (int x = min.x; x < max.x; x++, uv.x += du) {
+			if (!state.clear_mode && state.depth_test) {
+				if (!state.depth_compare(z, state.depth_buffer[depth_buffer_index + x])) {
+					continue;
+				}
+			}
+
+			Color color = end.color;
+			if (state.use_texture) {
+				Color texel = state.samplers[primitive.filter & 1](state, uv);
+				color = state.texture_stage(state, texel, color);
+			}
+
+			if (!state.clear_mode && state.alpha_test) {
+				if (!state.alpha_compare(color.a & state.alpha_test_mask, state.alpha_test_ref & state.alpha_test_mask)) {
+					continue;
+				}
+			}
+
+			Color dest = ReadPixel<PIXEL_FORMAT>(state, frame_buffer_index + x);
+			if (!state.clear_mode && state.blend) {
+				color = state.blend_stage(state, color, dest);
+			}
+			color = (dest.a << 24) | (color.abgr & 0xFFFFFF);
+
+			WritePixel<PIXEL_FORMAT>(state, frame_buffer_index + x, color, x, y);
+			if (state.depth_write && state.depth_test) {
+				state.depth_buffer[depth_buffer_index + x] = z;
+			}
+		}
+	}
+
+	if (state.depth_write && state.depth_test) {
+		UpdateDepthBounds(min, max, z, z, false);
+	}
+}
+
+// Edge function in fixed point, the bias turns the inside test into a plain sign check that honors the top-left rule
+struct EdgeSetup {
+	int64_t x;
+	int64_t y;
+	int64_t dx;
+	int64_t dy;
+	int bias;
+};
+
+static int64_t ToFixed(float value) {
+	return static_cast<int64_t>(std::llround(value * SUBPIXEL_SCALE));
+}
+
+static EdgeSetup SetupEdge(const Vertex& a, const Vertex& b) {
+	EdgeSetup edge{};
+	edge.x = ToFixed(a.pos.x);
+	edge.y = ToFixed(a.pos.y);
+	edge.dx = ToFixed(b.pos.x) - edge.x;
+	edge.dy = ToFixed(b.pos.y) - edge.y;
+
+	bool top_left = (edge.dy == 0 && edge.dx > 0) || edge.dy < 0;
+	edge.bias = top_left ? 0 : -1;
+	return edge;
+}
 
-	bool use_texture = !clear_mode && textures_enabled;
+static int64_t EvaluateEdge(const EdgeSetup& edge, int64_t x, int64_t y) {
+	return edge.dx * (y - edge.y) - edge.dy * (x - edge.x);
+}
 
-	float du = (end.uv.x - start.uv.x) / width;
-	float dv = (end.uv.y - start.uv.y) / height;
+static __m128 Interpolate(float base, float delta1, float delta2, __m128 w1, __m128 w2) {
+	return _mm_add_ps(_mm_set1_ps(base), _mm_add_ps(_mm_mul_ps(w1, _mm_set1_ps(delta1)), _mm_mul_ps(w2, _mm_set1_ps(delta2))));
+}
 
-	uint8_t filter = -1;
-	TextureCacheEntry texture{};
-	if (use_texture) {
-		texture = DecodeTexture();
-		filter = GetFilter(du, dv);
+// Whether fragments within the z range pass or fail the depth test against every value within the bounds
+static uint8_t TestDepthBounds(uint8_t test, int z_min, int z_max, DepthBounds bounds) {
+	switch (test) {
+	case SCEGU_NEVER:
+		return DEPTH_REJECT;
+	case SCEGU_ALWAYS:
+		return DEPTH_ACCEPT;
+	case SCEGU_EQUAL:
+		if (z_max < bounds.min || z_min > bounds.max) return DEPTH_REJECT;
+		break;
+	case SCEGU_NOTEQUAL:
+		if (z_max < bounds.min || z_min > bounds.max) return DEPTH_ACCEPT;
+		break;
+	case SCEGU_LESS:
+		if (z_min >= bounds.max) return DEPTH_REJECT;
+		if (z_max < bounds.min) return DEPTH_ACCEPT;
+		break;
+	case SCEGU_LEQUAL:
+		if (z_min > bounds.max) return DEPTH_REJECT;
+		if (z_max <= bounds.min) return DEPTH_ACCEPT;
+		break;
+	case SCEGU_GREATER:
+		if (z_max <= bounds.min) return DEPTH_REJECT;
+		if (z_min > bounds.max) return DEPTH_ACCEPT;
+		break;
+	case SCEGU_GEQUAL:
+		if (z_max < bounds.min) return DEPTH_REJECT;
+		if (z_min >= bounds.max) return DEPTH_ACCEPT;
+		break;
 	}
+	return DEPTH_PARTIAL;
+}
 
-	int scissor_min_x = ScissorTestX(min.x);
-	int scissor_max_x = ScissorTestX(max.x);
-	int scissor_min_y = ScissorTestY(min.y);
-	int scissor_max_y = ScissorTestY(max.y);
+// SSE2 only has signed 16-bit min and max, flipping the sign bit keeps the unsigned order
+static DepthBounds ScanDepthBlock(const uint16_t* depth, uint32_t stride) {
+	const __m128i sign = _mm_set1_epi16(static_cast<short>(0x8000));
+	__m128i low = _mm_set1_epi16(0x7FFF);
+	__m128i high = sign;
+	for (int y = 0; y < DEPTH_BLOCK_SIZE; y++) {
+		__m128i row = _mm_xor_si128(_mm_loadu_si128(reinterpret_cast<const __m128i*>(depth + y * stride)), sign);
+		low = _mm_min_epi16(low, row);
+		high = _mm_max_epi16(high, row);
+	}
 
-	float inv_min_z = 1.0f / start.pos.z;
-	float inv_max_z = 1.0f / start.pos.z;
-	for (int y = scissor_min_y; y < scissor_max_y; y++) {
-		glm::vec2 uv{
-			start.uv.x,
-			start.uv.y + (y - min.y) * dv
-		};
+	low = _mm_min_epi16(low, _mm_srli_si128(low, 8));
+	low = _mm_min_epi16(low, _mm_srli_si128(low, 4));
+	low = _mm_min_epi16(low, _mm_srli_si128(low, 2));
+	high = _mm_max_epi16(high, _mm_srli_si128(high, 8));
+	high = _mm_max_epi16(high, _mm_srli_si128(high, 4));
+	high = _mm_max_epi16(high, _mm_srli_si128(high, 2));
+	return { static_cast<uint16_t>(_mm_cvtsi128_si32(low) ^ 0x8000), static_cast<uint16_t>(_mm_cvtsi128_si32(high) ^ 0x8000) };
+}
 
-		uint32_t frame_buffer_index = y * fbw;
-		uint32_t depth_buffer_index = y * zbw;
-		for (int x = scissor_min_x; x < scissor_max_x; x++, uv.x += du) {
-			if (!through && (max.z < min_z || max.z > max_z)) {
-				return;
-			}
+// Invalid tiles are scanned on their first use, tiles outside of the summary or the depth buffer return null
+DepthTile* SoftwareRenderer::GetDepthTile(const RasterState& state, int tile_x, int tile_y) {
+	if (tile_x >= TILE_COUNT_X || tile_y >= TILE_COUNT_Y) {
+		return nullptr;
+	}
 
-			if (!clear_mode && depth_test) {
-				if (!Test(depth_test_func, max.z, depth_buffer_start[depth_buffer_index + x])) {
-					continue;
-				}
-			}
+	// Past the buffer's width the stride wraps into the next row, and nothing may be read past VRAM
+	uint32_t tile_end = (((tile_y + 1) * TILE_SIZE - 1) * state.zbw + (tile_x + 1) * TILE_SIZE) * sizeof(uint16_t);
+	if ((tile_x + 1) * TILE_SIZE > state.zbw || GetVRAMOffset(depth_tiles_addr) + tile_end > VRAM_SIZE) {
+		return nullptr;
+	}
 
-			Color color = end.color;
-			if (use_texture) {
-				Color texel = FilterTexture(filter, uv, texture.data);
-				if (texture.clut) {
-					texel = GetCLUT(texel.abgr);
-				}
-				color = BlendTexture(texel, color);
+	auto& tile = depth_tiles[tile_y * TILE_COUNT_X + tile_x];
+	if (!tile.valid) {
+		const uint16_t* depth = &state.depth_buffer[tile_y * TILE_SIZE * state.zbw + tile_x * TILE_SIZE];
+		tile.bounds = { 0xFFFF, 0 };
+		for (int y = 0; y < DEPTH_BLOCKS_PER_TILE; y++) {
+			for (int x = 0; x < DEPTH_BLOCKS_PER_TILE; x++) {
+				auto& block = tile.blocks[y * DEPTH_BLOCKS_PER_TILE + x];
+				block = ScanDepthBlock(depth + (y * state.zbw + x) * DEPTH_BLOCK_SIZE, state.zbw);
+				tile.bounds.min = std::min(tile.bounds.min, block.min);
+				tile.bounds.max = std::max(tile.bounds.max, block.max);
 			}
+		}
+		tile.valid = true;
+	}
+	return &tile;
+}
 
-			if (!clear_mode && alpha_test) {
-				if (!Test(alpha_test_func, color.a & alpha_test_mask, alpha_test_ref & alpha_test_mask)) {
+// Blocks that were overwritten completely get exact bounds, every other touched block only widens
+void SoftwareRenderer::UpdateDepthBounds(glm::ivec2 min, glm::ivec2 max, uint16_t z_min, uint16_t z_max, bool overwrite) {
+	int tile_max_x = std::min((max.x - 1) / TILE_SIZE, TILE_COUNT_X - 1);
+	int tile_max_y = std::min((max.y - 1) / TILE_SIZE, TILE_COUNT_Y - 1);
+	for (int tile_y = min.y / TILE_SIZE; tile_y <= tile_max_y; tile_y++) {
+		for (int tile_x = min.x / TILE_SIZE; tile_x <= tile_max_x; tile_x++) {
+			auto& tile = depth_tiles[tile_y * TILE_COUNT_X + tile_x];
+			glm::ivec2 tile_min(tile_x * TILE_SIZE, tile_y * TILE_SIZE);
+			if (!tile.valid) {
+				// A partly written tile stays invalid and gets scanned once it's needed
+				bool covered = min.x <= tile_min.x && min.y <= tile_min.y && max.x >= tile_min.x + TILE_SIZE && max.y >= tile_min.y + TILE_SIZE;
+				if (!overwrite || !covered) {
 					continue;
 				}
+				tile.blocks.fill({ z_min, z_max });
+				tile.bounds = { z_min, z_max };
+				tile.valid = true;
+				continue;
 			}
 
-			auto dest = static_cast<Color>(frame_buffer_start[frame_buffer_index + x]);
-			if (!clear_mode && blend) {
-				color = Blend(color, dest);
-			}
-			color = (dest.a << 24) | (color.abgr & 0xFFFFFF);
-
-			frame_buffer_start[frame_buffer_index + x] = color.abgr;
-			if (depth_write && depth_test) {
-				depth_buffer_start[depth_buffer_index + x] = max.z;
+			tile.bounds = { 0xFFFF, 0 };
+			for (int y = 0; y < DEPTH_BLOCKS_PER_TILE; y++) {
+				for (int x = 0; x < DEPTH_BLOCKS_PER_TILE; x++) {
+					auto& block = tile.blocks[y * DEPTH_BLOCKS_PER_TILE + x];
+					glm::ivec2 block_min = tile_min + glm::ivec2(x, y) * DEPTH_BLOCK_SIZE;
+					glm::ivec2 block_max = block_min + DEPTH_BLOCK_SIZE;
+					if (block_min.x < max.x && block_min.y < max.y && block_max.x > min.x && block_max.y > min.y) {
+						bool covered = min.x <= block_min.x && min.y <= block_min.y && max.x >= block_max.x && max.y >= block_max.y;
+						if (overwrite && covered) {
+							block = { z_min, z_max };
+						} else {
+							block.min = std::min(block.min, z_min);
+							block.max = std::max(block.max, z_max);
+						}
+					}
+					tile.bounds.min = std::min(tile.bounds.min, block.min);
+					tile.bounds.max = std::max(tile.bounds.max, block.max);
+				}
 			}
 		}
 	}
 }
 
-void SoftwareRenderer::DrawTriangle(Vertex v0, Vertex v1, Vertex v2) {
-	auto edge = [](glm::vec3 v0, glm::vec3 v1, glm::vec3 v2) -> float {
-		return (v1.x - v0.x) * (v2.y - v0.y) - (v1.y - v0.y) * (v2.x - v0.x);
-	};
+void SoftwareRenderer::InvalidateDepthTiles() {
+	for (auto& tile : depth_tiles) {
+		tile.valid = false;
+	}
+}
 
-	auto topleft = [](glm::ivec3 v0, glm::ivec3 v1) -> bool {
-		return (v0.y == v1.y && v1.x > v0.x) || (v0.y > v1.y);
-	};
+bool SoftwareRenderer::OverlapsDepthTiles(uint32_t addr, uint32_t size) const {
+	if (!IsVRAM(addr) || depth_tiles_zbw == 0) {
+		return false;
+	}
+
+	uint32_t start = GetVRAMOffset(addr);
+	uint32_t depth_start = GetVRAMOffset(depth_tiles_addr);
+	uint32_t depth_end = std::min<uint32_t>(depth_start + depth_tiles_zbw * 2 * TILE_COUNT_Y * TILE_SIZE, VRAM_SIZE);
+	return start < depth_end && start + size > depth_start;
+}
 
-	uint32_t* frame_buffer_start = reinterpret_cast<uint32_t*>(PSP::GetInstance()->VirtualToPhysical(GetFrameBufferAddress()));
-	uint16_t* depth_buffer_start = reinterpret_cast<uint16_t*>(PSP::GetInstance()->VirtualToPhysical(GetDepthBufferAddress()));
+void SoftwareRenderer::DrawTriangle(Vertex v0, Vertex v1, Vertex v2) {
+	// Anything further out would overflow the 32 bit edge functions
+	for (auto v : { &v0, &v1, &v2 }) {
+		if (!(std::abs(v->pos.x) < MAX_COORDINATE && std::abs(v->pos.y) < MAX_COORDINATE)) {
+			return;
+		}
+		v->pos = glm::vec4(glm::round(glm::vec2(v->pos) * static_cast<float>(SUBPIXEL_SCALE)) / static_cast<float>(SUBPIXEL_SCALE), std::round(v->pos.z), v->pos.w);
+	}
 
 	int min_x = floorf(std::min({ v0.pos.x, v1.pos.x, v2.pos.x }));
 	int max_x = ceilf(std::max({ v0.pos.x, v1.pos.x, v2.pos.x }));
 	int min_y = floorf(std::min({ v0.pos.y, v1.pos.y, v2.pos.y }));
 	int max_y = ceilf(std::max({ v0.pos.y, v1.pos.y, v2.pos.y }));
 
-	v0.pos = glm::round(v0.pos);
-	v1.pos = glm::round(v1.pos);
-	v2.pos = glm::round(v2.pos);
-
-	float area = edge(v0.pos, v1.pos, v2.pos);
+	auto edge = SetupEdge(v0, v1);
+	int64_t area = EvaluateEdge(edge, ToFixed(v2.pos.x), ToFixed(v2.pos.y));
 	if (area == 0) return;
 
 	/*if (culling) {
@@ -200,588 +1172,708 @@ void SoftwareRenderer::DrawTriangle(Vertex v0, Vertex v1, Vertex v2) {
 				return;
 			}
 			std::swap(v0, v1);
-			area = edge(v0.pos, v1.pos, v2.pos);
 			break;
 		}
 	}
 	else*/ if (area < 0) {
 		std::swap(v0, v1);
-		area = edge(v0.pos, v1.pos, v2.pos);
 	}
 
-	if (fpf != SCE_DISPLAY_PIXEL_RGBA8888) {
-		spdlog::error("SoftwareRenderer: unimplemented pixel format for triangle {}", fpf);
+	if (fpf > SCE_DISPLAY_PIXEL_RGBA8888) {
+		spdlog::error("SoftwareRenderer: unknown pixel format {}", fpf);
 		return;
 	}
 
-	uint8_t filter = -1;
-	bool use_texture = !clear_mode && textures_enabled;
-	TextureCacheEntry texture{};
-	if (use_texture) {
-		texture = DecodeTexture();
-		filter = GetFilter(v1.uv.x - v0.uv.x, v2.uv.y - v0.uv.y);
-	}
+	auto& state = raster_states.back();
 
-	int scissor_min_x = ScissorTestX(min_x);
-	int scissor_max_x = ScissorTestX(max_x);
-	int scissor_min_y = ScissorTestY(min_y);
-	int scissor_max_y = ScissorTestY(max_y);
+	BinnedPrimitive primitive{};
+	primitive.primitive_type = SCEGU_PRIM_TRIANGLES;
+	primitive.filter = -1;
+	if (state.use_texture) {
+		primitive.filter = GetFilter(v1.uv.x - v0.uv.x, v2.uv.y - v0.uv.y);
+	}
+	primitive.min = glm::ivec2(ScissorTestX(min_x), ScissorTestY(min_y));
+	primitive.max = glm::ivec2(ScissorTestX(max_x), ScissorTestY(max_y));
+	primitive.vertices[0] = v0;
+	primitive.vertices[1] = v1;
+	primitive.vertices[2] = v2;
+	primitive.state = &state;
+	state.pipeline->primitive_count++;
+	BinPrimitive(primitive);
+}
 
-	int bias0 = topleft(v1.pos, v2.pos) ? 0 : -1;
-	int bias1 = topleft(v2.pos, v0.pos) ? 0 : -1;
-	int bias2 = topleft(v0.pos, v1.pos) ? 0 : -1;
+// Everything after the depth test, shared by all primitives that go through the fragment pipelines
+template <uint8_t SHADE_MODE, bool ALPHA_TEST, bool BLEND, bool DEPTH_WRITE, uint8_t PIXEL_FORMAT>
+void SoftwareRenderer::ShadeFragment(const RasterState& state, uint8_t filter, int x, int y, uint16_t z, Color color, glm::vec2 uv) {
+	if constexpr (SHADE_MODE >= SHADE_TEXTURE) {
+		Color texel = state.samplers[filter & 1](state, uv);
+		color = state.texture_stage(state, texel, color);
+	}
 
-	float A01 = v0.pos.y - v1.pos.y;
-	float A12 = v1.pos.y - v2.pos.y;
-	float A20 = v2.pos.y - v0.pos.y;
+	if constexpr (ALPHA_TEST) {
+		if (!state.alpha_compare(color.a & state.alpha_test_mask, state.alpha_test_ref & state.alpha_test_mask)) {
+			return;
+		}
+	}
 
-	float B01 = v1.pos.x - v0.pos.x;
-	float B12 = v2.pos.x - v1.pos.x;
-	float B20 = v0.pos.x - v2.pos.x;
+	if constexpr (BLEND) {
+		color = state.blend_stage(state, color, ReadPixel<PIXEL_FORMAT>(state, x + y * state.fbw));
+	}
 
-	glm::ivec3 p{ scissor_min_x, scissor_min_y, 0.0 };
-	float w0_row = edge(v1.pos, v2.pos, p) + bias0;
-	float w1_row = edge(v2.pos, v0.pos, p) + bias1;
-	float w2_row = edge(v0.pos, v1.pos, p) + bias2;
+	WritePixel<PIXEL_FORMAT>(state, x + y * state.fbw, color, x, y);
+	if constexpr (DEPTH_WRITE) {
+		state.depth_buffer[x + y * state.zbw] = z;
+	}
+}
 
-	for (p.y = scissor_min_y; p.y < scissor_max_y; p.y++, w0_row += B12, w1_row += B20, w2_row += B01) {
-		float e0 = w0_row;
-		float e1 = w1_row;
-		float e2 = w2_row;
+// Walks 2x2 quads, coverage and depth are tested for the whole quad before the remaining fragments get shaded.
+// Every state flag is a template parameter and the stages come resolved with the state, so the loops never switch on it
+template <bool DEPTH_TEST, uint8_t SHADE_MODE, bool ALPHA_TEST, bool BLEND, bool DEPTH_WRITE, bool RANGE_TEST, uint8_t PIXEL_FORMAT>
+void SoftwareRenderer::RasterizeTriangle(const BinnedPrimitive& primitive, glm::ivec2 min, glm::ivec2 max) {
+	auto& state = *primitive.state;
+	auto& v0 = primitive.vertices[0];
+	auto& v1 = primitive.vertices[1];
+	auto& v2 = primitive.vertices[2];
+
+	// Edge i is the barycentric weight of vertex i before the division by the area
+	EdgeSetup edges[3] = { SetupEdge(v1, v2), SetupEdge(v2, v0), SetupEdge(v0, v1) };
+	int64_t area = EvaluateEdge(edges[2], ToFixed(v2.pos.x), ToFixed(v2.pos.y));
+	double inv_area = 1.0 / area;
+
+	float w1_dx = -edges[1].dy * SUBPIXEL_SCALE * inv_area;
+	float w1_dy = edges[1].dx * SUBPIXEL_SCALE * inv_area;
+	float w2_dx = -edges[2].dy * SUBPIXEL_SCALE * inv_area;
+	float w2_dy = edges[2].dx * SUBPIXEL_SCALE * inv_area;
+
+	const __m128 lane_x = _mm_setr_ps(0.0f, 1.0f, 0.0f, 1.0f);
+	const __m128 lane_y = _mm_setr_ps(0.0f, 0.0f, 1.0f, 1.0f);
+	const __m128i lane_x_int = _mm_setr_epi32(0, 1, 0, 1);
+	const __m128i lane_y_int = _mm_setr_epi32(0, 0, 1, 1);
+
+	alignas(16) int32_t z_values[4];
+	alignas(16) float u_values[4];
+	alignas(16) float v_values[4];
+	alignas(16) int32_t color_values[3][4];
+
+	// Interpolated depth stays within the vertex range, one unit of slack covers the float rounding
+	int z_min = std::clamp(std::min({ v0.pos.z, v1.pos.z, v2.pos.z }) - 1.0f, 0.0f, 65535.0f);
+	int z_max = std::clamp(std::max({ v0.pos.z, v1.pos.z, v2.pos.z }) + 1.0f, 0.0f, 65535.0f);
+	uint8_t block_coverage[DEPTH_BLOCKS_PER_TILE * DEPTH_BLOCKS_PER_TILE];
+
+	// Blocks keep the edge values small enough for 32 bit lanes. They are aligned to tiles, in tiled mode a block is exactly one tile
+	for (int block_y = min.y; block_y < max.y; block_y = (block_y / TILE_SIZE + 1) * TILE_SIZE) {
+		int block_max_y = std::min((block_y / TILE_SIZE + 1) * TILE_SIZE, max.y);
+		for (int block_x = min.x; block_x < max.x; block_x = (block_x / TILE_SIZE + 1) * TILE_SIZE) {
+			int block_max_x = std::min((block_x / TILE_SIZE + 1) * TILE_SIZE, max.x);
+
+			int64_t origin_x = static_cast<int64_t>(block_x) * SUBPIXEL_SCALE;
+			int64_t origin_y = static_cast<int64_t>(block_y) * SUBPIXEL_SCALE;
+
+			bool outside = false;
+			__m128i edge_row[3];
+			__m128i edge_step_x[3];
+			__m128i edge_step_y[3];
+			for (int i = 0; i < 3; i++) {
+				int64_t value = EvaluateEdge(edges[i], origin_x, origin_y) + edges[i].bias;
+				int64_t step_x = -edges[i].dy * SUBPIXEL_SCALE;
+				int64_t step_y = edges[i].dx * SUBPIXEL_SCALE;
+
+				int64_t best = value + std::max<int64_t>(step_x * (block_max_x - 1 - block_x), 0) + std::max<int64_t>(step_y * (block_max_y - 1 - block_y), 0);
+				if (best < 0) {
+					outside = true;
+					break;
+				}
 
-		for (p.x = scissor_min_x; p.x < scissor_max_x; p.x++, e0 += A12, e1 += A20, e2 += A01) {
-			if ((static_cast<int>(e0) | static_cast<int>(e1) | static_cast<int>(e2)) >= 0) {
-				float w0 = (e0 - bias0 + 0.5) / area;
-				float w1 = (e1 - bias1 + 0.5) / area;
-				float w2 = (e2 - bias2 + 0.5) / area;
+				// Clamping doesn't change any sign inside of the block since it spans less than 2^29
+				value = std::clamp<int64_t>(value, -(1 << 29), 1 << 29);
+				edge_row[i] = _mm_add_epi32(_mm_set1_epi32(static_cast<int32_t>(value)),
+					_mm_setr_epi32(0, static_cast<int32_t>(step_x), static_cast<int32_t>(step_y), static_cast<int32_t>(step_x + step_y)));
+				edge_step_x[i] = _mm_set1_epi32(static_cast<int32_t>(step_x * 2));
+				edge_step_y[i] = _mm_set1_epi32(static_cast<int32_t>(step_y * 2));
+			}
+			if (outside) {
+				continue;
+			}
 
-				uint16_t z = v0.pos.z * w0 + v1.pos.z * w1 + v2.pos.z * w2;
-				if (!through && (z < min_z || z > max_z)) {
+			// The depth bounds can decide the test for the whole tile or single 8x8 blocks of it
+			if constexpr (DEPTH_TEST) {
+				uint8_t tile_coverage = DEPTH_PARTIAL;
+				auto tile = GetDepthTile(state, block_x / TILE_SIZE, block_y / TILE_SIZE);
+				if (tile) {
+					tile_coverage = TestDepthBounds(state.depth_test_func, z_min, z_max, tile->bounds);
+				}
+				if (tile_coverage == DEPTH_REJECT) {
 					continue;
 				}
-
-				if (!clear_mode && depth_test) {
-					if (!Test(depth_test_func, z, depth_buffer_start[p.x + p.y * zbw])) {
-						continue;
-					}
+				for (int i = 0; i < DEPTH_BLOCKS_PER_TILE * DEPTH_BLOCKS_PER_TILE; i++) {
+					block_coverage[i] = tile_coverage == DEPTH_PARTIAL && tile ? TestDepthBounds(state.depth_test_func, z_min, z_max, tile->blocks[i]) : tile_coverage;
 				}
+			}
 
-				Color color = v0.color;
-				if (use_texture) {
-					glm::vec2 uv{
-						v0.uv.x * w0 + v1.uv.x * w1 + v2.uv.x * w2,
-						v0.uv.y * w0 + v1.uv.y * w1 + v2.uv.y * w2,
-					};
-					Color texel = FilterTexture(filter, uv, texture.data);
-					if (texture.clut) {
-						texel = GetCLUT(texel.abgr);
+			float w1_origin = EvaluateEdge(edges[1], origin_x, origin_y) * inv_area;
+			float w2_origin = EvaluateEdge(edges[2], origin_x, origin_y) * inv_area;
+			__m128 w1_row = _mm_add_ps(_mm_set1_ps(w1_origin), _mm_add_ps(_mm_mul_ps(lane_x, _mm_set1_ps(w1_dx)), _mm_mul_ps(lane_y, _mm_set1_ps(w1_dy))));
+			__m128 w2_row = _mm_add_ps(_mm_set1_ps(w2_origin), _mm_add_ps(_mm_mul_ps(lane_x, _mm_set1_ps(w2_dx)), _mm_mul_ps(lane_y, _mm_set1_ps(w2_dy))));
+
+			for (int y = block_y; y < block_max_y; y += 2) {
+				__m128i e0 = edge_row[0];
+				__m128i e1 = edge_row[1];
+				__m128i e2 = edge_row[2];
+				__m128 w1 = w1_row;
+				__m128 w2 = w2_row;
+
+				__m128i inside_y = _mm_cmplt_epi32(_mm_add_epi32(_mm_set1_epi32(y), lane_y_int), _mm_set1_epi32(block_max_y));
+				for (int x = block_x; x < block_max_x; x += 2) {
+					__m128i inside_x = _mm_cmplt_epi32(_mm_add_epi32(_mm_set1_epi32(x), lane_x_int), _mm_set1_epi32(block_max_x));
+					__m128i mask = _mm_cmpgt_epi32(_mm_or_si128(_mm_or_si128(e0, e1), e2), _mm_set1_epi32(-1));
+					mask = _mm_and_si128(mask, _mm_and_si128(inside_x, inside_y));
+
+					// Quads straddling two depth blocks only happen for odd bounds and always take the per pixel test
+					uint8_t coverage = DEPTH_PARTIAL;
+					if (DEPTH_TEST && (x & (DEPTH_BLOCK_SIZE - 1)) != DEPTH_BLOCK_SIZE - 1 && (y & (DEPTH_BLOCK_SIZE - 1)) != DEPTH_BLOCK_SIZE - 1) {
+						coverage = block_coverage[y % TILE_SIZE / DEPTH_BLOCK_SIZE * DEPTH_BLOCKS_PER_TILE + x % TILE_SIZE / DEPTH_BLOCK_SIZE];
 					}
-					color = BlendTexture(texel, color);
-				} else if (gouraud_shading) {
-					color.r = v0.color.r * w0 + v1.color.r * w1 + v2.color.r * w2;
-					color.g = v0.color.g * w0 + v1.color.g * w1 + v2.color.g * w2;
-					color.b = v0.color.b * w0 + v1.color.b * w1 + v2.color.b * w2;
-				}
 
-				if (!clear_mode && alpha_test) {
-					if (!Test(alpha_test_func, color.a & alpha_test_mask, alpha_test_ref & alpha_test_mask)) {
-						continue;
+					if (coverage != DEPTH_REJECT && _mm_movemask_ps(_mm_castsi128_ps(mask))) {
+						__m128 z = Interpolate(v0.pos.z, v1.pos.z - v0.pos.z, v2.pos.z - v0.pos.z, w1, w2);
+						__m128i z_int = _mm_cvttps_epi32(_mm_min_ps(_mm_max_ps(z, _mm_setzero_ps()), _mm_set1_ps(65535.0f)));
+
+						if constexpr (RANGE_TEST) {
+							__m128i below = _mm_cmplt_epi32(z_int, _mm_set1_epi32(state.min_z));
+							__m128i above = _mm_cmpgt_epi32(z_int, _mm_set1_epi32(state.max_z));
+							mask = _mm_andnot_si128(_mm_or_si128(below, above), mask);
+						}
+
+						int bits = _mm_movemask_ps(_mm_castsi128_ps(mask));
+						if (bits && DEPTH_TEST && coverage == DEPTH_PARTIAL) {
+							auto depth_row = &state.depth_buffer[x + y * state.zbw];
+							__m128i depth = _mm_setr_epi32(
+								bits & 1 ? depth_row[0] : 0,
+								bits & 2 ? depth_row[1] : 0,
+								bits & 4 ? depth_row[state.zbw] : 0,
+								bits & 8 ? depth_row[state.zbw + 1] : 0
+							);
+							mask = _mm_and_si128(mask, state.depth_compare_quad(z_int, depth));
+							bits = _mm_movemask_ps(_mm_castsi128_ps(mask));
+						}
+
+						if (bits) {
+							_mm_store_si128(reinterpret_cast<__m128i*>(z_values), z_int);
+							if constexpr (SHADE_MODE >= SHADE_TEXTURE) {
+								_mm_store_ps(u_values, Interpolate(v0.uv.x, v1.uv.x - v0.uv.x, v2.uv.x - v0.uv.x, w1, w2));
+								_mm_store_ps(v_values, Interpolate(v0.uv.y, v1.uv.y - v0.uv.y, v2.uv.y - v0.uv.y, w1, w2));
+							} else if constexpr (SHADE_MODE == SHADE_GOURAUD) {
+								for (int channel = 0; channel < 3; channel++) {
+									float c0 = v0.color.abgr >> (channel * 8) & 0xFF;
+									float c1 = v1.color.abgr >> (channel * 8) & 0xFF;
+									float c2 = v2.color.abgr >> (channel * 8) & 0xFF;
+									__m128 color = Interpolate(c0, c1 - c0, c2 - c0, w1, w2);
+									color = _mm_min_ps(_mm_max_ps(color, _mm_setzero_ps()), _mm_set1_ps(255.0f));
+									_mm_store_si128(reinterpret_cast<__m128i*>(color_values[channel]), _mm_cvttps_epi32(color));
+								}
+							}
+
+							for (int lane = 0; lane < 4; lane++) {
+								if (!(bits & (1 << lane))) {
+									continue;
+								}
+
+								Color color = v0.color;
+								glm::vec2 uv{};
+								if constexpr (SHADE_MODE >= SHADE_TEXTURE) {
+									uv = glm::vec2(u_values[lane], v_values[lane]);
+								} else if constexpr (SHADE_MODE == SHADE_GOURAUD) {
+									color.r = color_values[0][lane];
+									color.g = color_values[1][lane];
+									color.b = color_values[2][lane];
+								}
+
+								ShadeFragment<SHADE_MODE, ALPHA_TEST, BLEND, DEPTH_WRITE, PIXEL_FORMAT>(state, primitive.filter, x + (lane & 1), y + (lane >> 1), z_values[lane], color, uv);
+							}
+						}
 					}
-				}
 
-				if (!clear_mode && blend) {
-					color = Blend(color, static_cast<Color>(frame_buffer_start[p.x + p.y * fbw]));
+					e0 = _mm_add_epi32(e0, edge_step_x[0]);
+					e1 = _mm_add_epi32(e1, edge_step_x[1]);
+					e2 = _mm_add_epi32(e2, edge_step_x[2]);
+					w1 = _mm_add_ps(w1, _mm_set1_ps(w1_dx * 2));
+					w2 = _mm_add_ps(w2, _mm_set1_ps(w2_dx * 2));
 				}
 
-				frame_buffer_start[p.x + p.y * fbw] = color.abgr;
-				if (depth_write) {
-					depth_buffer_start[p.x + p.y * zbw] = z;
+				for (int i = 0; i < 3; i++) {
+					edge_row[i] = _mm_add_epi32(edge_row[i], edge_step_y[i]);
 				}
+				w1_row = _mm_add_ps(w1_row, _mm_set1_ps(w1_dy * 2));
+				w2_row = _mm_add_ps(w2_row, _mm_set1_ps(w2_dy * 2));
 			}
 		}
 	}
-}
 
-void SoftwareRenderer::DrawTriangleStrip(std::vector<Vertex> vertices) {
-	for (int i = 2; i < vertices.size(); i++) {
-		DrawTriangle(vertices[i - 2], vertices[i - 1], vertices[i]);
+	if constexpr (DEPTH_WRITE) {
+		UpdateDepthBounds(min, max, z_min, z_max, false);
 	}
 }
 
-void SoftwareRenderer::DrawTriangleFan(std::vector<Vertex> vertices) {
-	for (int i = 1; i < vertices.size() - 1; i++) {
-		DrawTriangle(vertices[0], vertices[i], vertices[i + 1]);
-	}
+// Snapped to the subpixel grid, the half pixel bias makes the shift round to the nearest pixel
+static int64_t ToLineFixed(float value) {
+	return ToFixed(value) * ((1 << LINE_FRACTION_BITS) / SUBPIXEL_SCALE) + (1 << (LINE_FRACTION_BITS - 1));
 }
 
-void SoftwareRenderer::ClearTextureCache() {
-	texture_cache.clear();
-}
+void SoftwareRenderer::DrawPoint(Vertex point) {
+	// Also catches vertices that were invalidated by clipping
+	if (!(std::abs(point.pos.x) < MAX_COORDINATE && std::abs(point.pos.y) < MAX_COORDINATE)) {
+		return;
+	}
 
-void SoftwareRenderer::ClearTextureCache(uint32_t addr, uint32_t size) {
-	addr &= 0x3FFFFFFF;
-	uint32_t addr_end = addr + size;
-	for (auto it = texture_cache.begin(); it != texture_cache.end();) {
-		uint32_t texture_end = it->first + it->second.size / 2;
-		if (addr <= texture_end && addr_end >= it->first) {
-			it = texture_cache.erase(it);
-		} else {
-			it++;
-		}
+	if (fpf > SCE_DISPLAY_PIXEL_RGBA8888) {
+		spdlog::error("SoftwareRenderer: unknown pixel format {}", fpf);
+		return;
 	}
-}
 
-void SoftwareRenderer::DecodeDXTColors(const DXT1Block* block, glm::ivec4 palette[4], bool skip_alpha) {
-	palette[0] = {
-		(block->color1 >> 8) & 0xF8,
-		(block->color1 >> 3) & 0xFC,
-		(block->color1 << 3) & 0xF8,
-		skip_alpha ? 0 : 0xFF
-	};
+	auto& state = raster_states.back();
+	point.pos.z = std::round(point.pos.z);
 
-	palette[1] = {
-		(block->color2 >> 8) & 0xF8,
-		(block->color2 >> 3) & 0xFC,
-		(block->color2 << 3) & 0xF8,
-		skip_alpha ? 0 : 0xFF
-	};
+	int x = ToLineFixed(point.pos.x) >> LINE_FRACTION_BITS;
+	int y = ToLineFixed(point.pos.y) >> LINE_FRACTION_BITS;
 
-	if (block->color1 > block->color2) {
-		palette[2] = (2 * palette[0] + palette[1]) / 3;
-		palette[3] = (palette[0] + 2 * palette[1]) / 3;
-	}
-	else {
-		palette[2] = (palette[0] + palette[1]) / 2;
-		palette[3] = glm::ivec4(0);
+	BinnedPrimitive primitive{};
+	primitive.primitive_type = SCEGU_PRIM_POINTS;
+	primitive.filter = -1;
+	if (state.use_texture) {
+		primitive.filter = GetFilter(0, 0);
 	}
+	primitive.min = glm::ivec2(ScissorTestX(x), ScissorTestY(y));
+	primitive.max = glm::ivec2(ScissorTestX(x + 1), ScissorTestY(y + 1));
+	primitive.vertices[0] = point;
+	primitive.state = &state;
+	state.pipeline->primitive_count++;
+	BinPrimitive(primitive);
 }
 
-void SoftwareRenderer::WriteDXT1(const DXT1Block* block, glm::ivec4 palette[4], Color* dst, int pitch) {
-	for (int y = 0; y < 4; y++) {
-		int color_data = block->lines[y];
-		for (int x = 0; x < 4; x++) {
-			int col = color_data & 3;
-			auto& current_palette = palette[col];
-
-			dst[x] = {
-				static_cast<uint8_t>(std::clamp(current_palette.a, 0, 255)),
-				static_cast<uint8_t>(std::clamp(current_palette.b, 0, 255)),
-				static_cast<uint8_t>(std::clamp(current_palette.g, 0, 255)),
-				static_cast<uint8_t>(std::clamp(current_palette.r, 0, 255))
-			};
-			color_data >>= 2;
+void SoftwareRenderer::DrawLine(Vertex start, Vertex end) {
+	// Also catches vertices that were invalidated by clipping
+	for (auto v : { &start, &end }) {
+		if (!(std::abs(v->pos.x) < MAX_COORDINATE && std::abs(v->pos.y) < MAX_COORDINATE)) {
+			return;
 		}
-		dst += pitch;
+		v->pos.z = std::round(v->pos.z);
 	}
-}
 
-void SoftwareRenderer::WriteDXT3(const DXT3Block* block, glm::ivec4 palette[4], Color* dst, int pitch) {
-	for (int y = 0; y < 4; y++) {
-		int color_data = block->color.lines[y];
-		int alpha_data = block->alpha_lines[y];
-		for (int x = 0; x < 4; x++) {
-			int col = color_data & 3;
-			auto& current_palette = palette[col];
+	// Lines shorter than a pixel don't draw anything since the last pixel is left out
+	int64_t dx = ToFixed(end.pos.x) - ToFixed(start.pos.x);
+	int64_t dy = ToFixed(end.pos.y) - ToFixed(start.pos.y);
+	int steps = std::max(std::abs(dx), std::abs(dy)) / SUBPIXEL_SCALE;
+	if (steps == 0) return;
 
-			dst[x] = {
-				static_cast<uint8_t>(std::clamp((alpha_data << 4) & 0xFF, 0, 255)),
-				static_cast<uint8_t>(std::clamp(current_palette.b, 0, 255)),
-				static_cast<uint8_t>(std::clamp(current_palette.g, 0, 255)),
-				static_cast<uint8_t>(std::clamp(current_palette.r, 0, 255))
-			};
-			color_data >>= 2;
-			alpha_data >>= 4;
-		}
-		dst += pitch;
+	if (fpf > SCE_DISPLAY_PIXEL_RGBA8888) {
+		spdlog::error("SoftwareRenderer: unknown pixel format {}", fpf);
+		return;
+	}
+
+	auto& state = raster_states.back();
+
+	glm::ivec2 p0(ToLineFixed(start.pos.x) >> LINE_FRACTION_BITS, ToLineFixed(start.pos.y) >> LINE_FRACTION_BITS);
+	glm::ivec2 p1(ToLineFixed(end.pos.x) >> LINE_FRACTION_BITS, ToLineFixed(end.pos.y) >> LINE_FRACTION_BITS);
+	glm::ivec2 min = glm::min(p0, p1);
+	glm::ivec2 max = glm::max(p0, p1) + 1;
+
+	BinnedPrimitive primitive{};
+	primitive.primitive_type = SCEGU_PRIM_LINES;
+	primitive.filter = -1;
+	if (state.use_texture) {
+		primitive.filter = GetFilter((end.uv.x - start.uv.x) / steps, (end.uv.y - start.uv.y) / steps);
 	}
+	primitive.min = glm::ivec2(ScissorTestX(min.x), ScissorTestY(min.y));
+	primitive.max = glm::ivec2(ScissorTestX(max.x), ScissorTestY(max.y));
+	primitive.vertices[0] = start;
+	primitive.vertices[1] = end;
+	primitive.state = &state;
+	state.pipeline->primitive_count++;
+	BinPrimitive(primitive);
 }
 
-void SoftwareRenderer::WriteDXT5(const DXT5Block* block, glm::ivec4 palette[4], Color* dst, int pitch) {
-	uint8_t alpha_table[8]{};
+// DDA along the major axis, like on the GE the last pixel of a line isn't drawn and a point is a line of one step.
+// Every tile only walks the steps whose major coordinate falls inside of it, the minor one is checked per pixel
+template <bool DEPTH_TEST, uint8_t SHADE_MODE, bool ALPHA_TEST, bool BLEND, bool DEPTH_WRITE, bool RANGE_TEST, uint8_t PIXEL_FORMAT>
+void SoftwareRenderer::RasterizeLine(const BinnedPrimitive& primitive, glm::ivec2 min, glm::ivec2 max) {
+	auto& state = *primitive.state;
+	bool point = primitive.primitive_type == SCEGU_PRIM_POINTS;
+	auto& start = primitive.vertices[0];
+	auto& end = primitive.vertices[point ? 0 : 1];
+
+	int64_t x = ToLineFixed(start.pos.x);
+	int64_t y = ToLineFixed(start.pos.y);
+	int64_t dx = ToLineFixed(end.pos.x) - x;
+	int64_t dy = ToLineFixed(end.pos.y) - y;
+	int steps = point ? 1 : std::max(std::abs(dx), std::abs(dy)) >> LINE_FRACTION_BITS;
+	if (steps == 0) return;
+
+	int64_t step_x = dx / steps;
+	int64_t step_y = dy / steps;
+	bool x_major = std::abs(dx) >= std::abs(dy);
+	int64_t major = x_major ? x : y;
+	int64_t major_step = x_major ? step_x : step_y;
+	int64_t major_min = static_cast<int64_t>(x_major ? min.x : min.y) << LINE_FRACTION_BITS;
+	int64_t major_max = static_cast<int64_t>(x_major ? max.x : max.y) << LINE_FRACTION_BITS;
+
+	int64_t first = 0;
+	int64_t last = steps;
+	if (major_step > 0) {
+		first = std::max<int64_t>((major_min - major) / major_step, 0);
+		last = std::min<int64_t>((major_max - major) / major_step + 1, steps);
+	} else if (major_step < 0) {
+		first = std::max<int64_t>((major - major_max) / -major_step, 0);
+		last = std::min<int64_t>((major - major_min) / -major_step + 1, steps);
+	}
 
-	alpha_table[0] = block->alpha1;
-	alpha_table[1] = block->alpha2;
-	if (block->alpha1 > block->alpha2) {
-		for (int i = 2; i < 8; i++) {
-			int alpha1 = (block->alpha1 * ((7 - (i - 1)) << 8)) / 7;
-			int alpha2 = (block->alpha2 * ((i - 1) << 8)) / 7;
-			alpha_table[i] = (alpha1 + alpha2 + 31) >> 8;
+	float inv_steps = 1.0f / steps;
+	for (int64_t i = first; i < last; i++) {
+		int px = (x + i * step_x) >> LINE_FRACTION_BITS;
+		int py = (y + i * step_y) >> LINE_FRACTION_BITS;
+		if (px < min.x || px >= max.x || py < min.y || py >= max.y) {
+			continue;
 		}
-	}
-	else {
-		for (int i = 2; i < 6; i++) {
-			int alpha1 = (block->alpha1 * ((5 - (i - 1)) << 8)) / 5;
-			int alpha2 = (block->alpha2 * ((i - 1) << 8)) / 5;
-			alpha_table[i] = (alpha1 + alpha2 + 31) >> 8;
+
+		float t = i * inv_steps;
+		uint16_t z = std::clamp(start.pos.z + (end.pos.z - start.pos.z) * t, 0.0f, 65535.0f);
+		if constexpr (RANGE_TEST) {
+			if (z < state.min_z || z > state.max_z) {
+				continue;
+			}
 		}
-		alpha_table[6] = 0;
-		alpha_table[7] = 255;
-	}
 
-	uint64_t all_alpha = (static_cast<uint64_t>(block->alpha_data1) << 32) | block->alpha_data2;
-	for (int y = 0; y < 4; y++) {
-		int color_data = block->color.lines[y];
-		int alpha_data = all_alpha >> (12 * y);
-		for (int x = 0; x < 4; x++) {
-			int col = color_data & 3;
-			auto& current_palette = palette[col];
+		if constexpr (DEPTH_TEST) {
+			if (!state.depth_compare(z, state.depth_buffer[px + py * state.zbw])) {
+				continue;
+			}
+		}
 
-			dst[x] = {
-				static_cast<uint8_t>(std::clamp(static_cast<int>(alpha_table[alpha_data & 7]), 0, 255)),
-				static_cast<uint8_t>(std::clamp(current_palette.b, 0, 255)),
-				static_cast<uint8_t>(std::clamp(current_palette.g, 0, 255)),
-				static_cast<uint8_t>(std::clamp(current_palette.r, 0, 255))
-			};
-			color_data >>= 2;
-			alpha_data >>= 4;
+		Color color = end.color;
+		glm::vec2 uv{};
+		if constexpr (SHADE_MODE >= SHADE_TEXTURE) {
+			uv = start.uv + (end.uv - start.uv) * t;
+		} else if constexpr (SHADE_MODE == SHADE_GOURAUD) {
+			color.r = start.color.r + (end.color.r - start.color.r) * t;
+			color.g = start.color.g + (end.color.g - start.color.g) * t;
+			color.b = start.color.b + (end.color.b - start.color.b) * t;
 		}
-		dst += pitch;
+
+		ShadeFragment<SHADE_MODE, ALPHA_TEST, BLEND, DEPTH_WRITE, PIXEL_FORMAT>(state, primitive.filter, px, py, z, color, uv);
 	}
-}
 
-bool SoftwareRenderer::Test(uint8_t test, int src, int dst) {
-	switch (test) {
-	case SCEGU_NEVER:
-		return false;
-	case SCEGU_ALWAYS:
-		return true;
-	case SCEGU_EQUAL:
-		return src == dst;
-	case SCEGU_NOTEQUAL:
-		return src != dst;
-	case SCEGU_LESS:
-		return src < dst;
-	case SCEGU_LEQUAL:
-		return src <= dst;
-	case SCEGU_GREATER:
-		return src > dst;
-	case SCEGU_GEQUAL:
-		return src >= dst;
+	if constexpr (DEPTH_WRITE) {
+		uint16_t z_min = std::clamp(std::min(start.pos.z, end.pos.z) - 1.0f, 0.0f, 65535.0f);
+		uint16_t z_max = std::clamp(std::max(start.pos.z, end.pos.z) + 1.0f, 0.0f, 65535.0f);
+		UpdateDepthBounds(min, max, z_min, z_max, false);
 	}
-	return true;
 }
 
-Color SoftwareRenderer::GetTexel(int x, int y, const std::vector<Color>& tex_data) {
-	auto& texture = textures[0];
-	if (u_clamp) {
-		x = std::clamp<int>(x, 0, texture.width - 1);
+template <size_t INDEX>
+static constexpr FragmentPipeline MakeFragmentPipeline() {
+	constexpr bool depth_test = (INDEX & 1) != 0;
+	constexpr uint8_t shade_mode = INDEX >> 1 & 3;
+	constexpr bool alpha_test = (INDEX >> 3 & 1) != 0;
+	constexpr bool blend = (INDEX >> 4 & 1) != 0;
+	constexpr bool depth_write = (INDEX >> 5 & 1) != 0;
+	constexpr bool range_test = (INDEX >> 6 & 1) != 0;
+	constexpr uint8_t pixel_format = INDEX >> 7 & 3;
+	return {
+		&SoftwareRenderer::RasterizeTriangle<depth_test, shade_mode, alpha_test, blend, depth_write, range_test, pixel_format>,
+		&SoftwareRenderer::RasterizeLine<depth_test, shade_mode, alpha_test, blend, depth_write, range_test, pixel_format>,
+		0
+	};
+}
+
+template <size_t... INDICES>
+static constexpr std::array<FragmentPipeline, sizeof...(INDICES)> MakeFragmentPipelines(std::index_sequence<INDICES...>) {
+	return { MakeFragmentPipeline<INDICES>()... };
+}
+
+static const auto FRAGMENT_PIPELINES = MakeFragmentPipelines(std::make_index_sequence<FRAGMENT_PIPELINE_COUNT>());
+
+// Lists the states that rasterized the most primitives since the last report
+void SoftwareRenderer::LogFragmentStatistics() {
+	std::vector<std::pair<uint32_t, uint64_t>> counts;
+	for (auto& [key, pipeline] : fragment_pipelines) {
+		if (pipeline.primitive_count) {
+			counts.emplace_back(key, pipeline.primitive_count);
+			pipeline.primitive_count = 0;
+		}
 	}
-	else {
-		x %= texture.width;
+
+	int count = std::min<int>(counts.size(), FRAGMENT_STATISTICS_TOP);
+	std::partial_sort(counts.begin(), counts.begin() + count, counts.end(), [](auto& a, auto& b) { return a.second > b.second; });
+	for (int i = 0; i < count; i++) {
+		spdlog::debug("SoftwareRenderer: fragment state {:08x} drew {} primitives", counts[i].first, counts[i].second);
 	}
+}
 
-	if (v_clamp) {
-		y = std::clamp<int>(y, 0, texture.height - 1);
+FragmentPipeline* SoftwareRenderer::GetFragmentPipeline(FragmentKey key) {
+	auto& pipeline = fragment_pipelines[key.full];
+	if (!pipeline.rasterize_triangle) {
+		int index = key.depth_test | key.shade_mode << 1 | key.alpha_test << 3 | key.blend << 4 | key.depth_write << 5 | key.range_test << 6 | key.pixel_format << 7;
+		pipeline.rasterize_triangle = FRAGMENT_PIPELINES[index].rasterize_triangle;
+		pipeline.rasterize_line = FRAGMENT_PIPELINES[index].rasterize_line;
 	}
-	else {
-		y %= texture.height;
+	return &pipeline;
+}
+
+void SoftwareRenderer::PrefetchTexture(const TextureInfo& info) {
+	uint64_t key = GetTextureKey(info);
+	if (prefetched_textures.contains(key) || texture_cache.contains(key)) {
+		return;
 	}
 
-	return tex_data[y * texture.width + x];
+	PrefetchedTexture prefetched{};
+	prefetched.entry = worker_pool.Submit([this, info] {
+		// Hashing before decoding makes a concurrent write show up as a mismatch
+		uint64_t hash = HashTexture(info);
+		auto entry = std::make_shared<TextureCacheEntry>(DecodeTexture(info));
+		entry->hash = hash;
+		return std::shared_ptr<const TextureCacheEntry>(entry);
+	}).share();
+	prefetched_textures[key] = prefetched;
 }
 
-Color SoftwareRenderer::GetCLUT(uint32_t index) {
-	index = ((index >> clut_shift) & clut_mask) | (clut_offset & (clut_format == SCEGU_PF8888 ? 0xFF : 0x1FF));
-	switch (clut_format) {
-	case SCEGU_PF4444: {
-		return ABGR4444ToABGR8888(reinterpret_cast<uint16_t*>(clut.data())[index]);
-	}
-	case SCEGU_PF8888: {
-		return reinterpret_cast<Color*>(clut.data())[index];
-	}
-	default:
-		spdlog::error("SoftwareRenderer: unknown clut format {}", clut_format);
+// Flushed textures are only marked, the hash check keeps them if their memory didn't actually change
+void SoftwareRenderer::ClearTextureCache() {
+	for (auto& cached : texture_lru) {
+		cached.dirty = true;
 	}
-	return {};
+	InvalidateDepthTiles();
 }
 
-Color SoftwareRenderer::Blend(Color src, Color dest) {
-	glm::ivec4 src_color{ src.r, src.g, src.b, src.a };
-	glm::ivec4 dest_color{ dest.r, dest.g, dest.b, dest.a };
-
-	glm::ivec4 asel{};
-	glm::ivec4 bsel{};
-	if (blend_operation < SCEGU_MIN) {
-		switch (blend_source) {
-		case SCEGU_COLOR: asel = dest_color; break;
-		case SCEGU_ONE_MINUS_COLOR: asel = 255 - glm::ivec4(dest_color); break;
-		case SCEGU_SRC_ALPHA: asel = glm::ivec4(src_color.a); break;
-		case SCEGU_ONE_MINUS_SRC_ALPHA: asel = glm::ivec4(255 - src_color.a); break;
-		case SCEGU_DST_ALPHA: asel = glm::ivec4(dest_color.a); break;
-		case SCEGU_ONE_MINUS_DST_ALPHA: asel = glm::ivec4(255 - dest_color.a); break;
-		case SCEGU_DOUBLE_SRC_ALPHA: asel = glm::ivec4(2 * src_color.a); break;
-		case SCEGU_ONE_MINUS_DOUBLE_SRC_ALPHA: asel = glm::ivec4(255 - std::min(2 * src_color.a, 255)); break;
-		case SCEGU_DOUBLE_DST_ALPHA: asel = glm::ivec4(2 * dest_color.a); break;
-		case SCEGU_ONE_MINUS_DOUBLE_DST_ALPHA: asel = glm::ivec4(255 - std::min(2 * dest_color.a, 255)); break;
-		default: asel = blend_afix; break;
-		}
-
-		switch (blend_destination) {
-		case SCEGU_COLOR: bsel = src_color; break;
-		case SCEGU_ONE_MINUS_COLOR: bsel = 255 - glm::ivec4(src_color); break;
-		case SCEGU_SRC_ALPHA: bsel = glm::ivec4(src_color.a); break;
-		case SCEGU_ONE_MINUS_SRC_ALPHA: bsel = glm::ivec4(255 - src_color.a); break;
-		case SCEGU_DST_ALPHA: bsel = glm::ivec4(dest_color.a); break;
-		case SCEGU_ONE_MINUS_DST_ALPHA: bsel = glm::ivec4(255 - dest_color.a); break;
-		case SCEGU_DOUBLE_SRC_ALPHA: bsel = glm::ivec4(2 * src_color.a); break;
-		case SCEGU_ONE_MINUS_DOUBLE_SRC_ALPHA: bsel = glm::ivec4(255 - std::min(2 * src_color.a, 255)); break;
-		case SCEGU_DOUBLE_DST_ALPHA: bsel = glm::ivec4(2 * dest_color.a); break;
-		case SCEGU_ONE_MINUS_DOUBLE_DST_ALPHA: bsel = glm::ivec4(255 - std::min(2 * dest_color.a, 255)); break;
-		default: bsel = blend_bfix; break;
+void SoftwareRenderer::ClearTextureCache(uint32_t addr, uint32_t size) {
+	addr &= 0x3FFFFFFF;
+	uint32_t addr_end = addr + size;
+	for (auto& cached : texture_lru) {
+		uint32_t texture_addr = cached.addr & 0x3FFFFFFF;
+		if (addr < texture_addr + cached.source_size && addr_end > texture_addr) {
+			cached.dirty = true;
 		}
 	}
 
-	glm::ivec4 result(0);
-	switch (blend_operation) {
-	case SCEGU_ADD:
-		result = ((src_color * 2 + 1) * (asel * 2 + 1) / 1024) + ((dest_color * 2 + 1) * (bsel * 2 + 1) / 1024);
-		break;
-	case SCEGU_SUBTRACT:
-		result = ((src_color * 2 + 1) * (asel * 2 + 1) / 1024) - ((dest_color * 2 + 1) * (bsel * 2 + 1) / 1024);
-		break;
-	case SCEGU_REVERSE_SUBTRACT:
-		result = ((dest_color * 2 + 1) * (bsel * 2 + 1) / 1024) - ((src_color * 2 + 1) * (asel * 2 + 1) / 1024);
-		break;
-	case SCEGU_MIN: result = glm::min(dest_color, src_color); break;
-	case SCEGU_MAX: result = glm::max(dest_color, src_color); break;
-	case SCEGU_ABS: result = glm::abs(src_color - dest_color); break;
+	if (OverlapsDepthTiles(addr, size)) {
+		InvalidateDepthTiles();
 	}
-	return { 0x00, 
-		static_cast<uint8_t>(std::clamp(result.b, 0, 255)), 
-		static_cast<uint8_t>(std::clamp(result.g, 0, 255)), 
-		static_cast<uint8_t>(std::clamp(result.r, 0, 255)) };
 }
 
-Color SoftwareRenderer::BlendTexture(Color texture, Color blending) {
-	glm::ivec4 tex_color{ texture.r, texture.g, texture.b, texture.a };
-	glm::ivec4 blend_color{ blending.r, blending.g, blending.b, blending.a };
+std::shared_ptr<const TextureCacheEntry> SoftwareRenderer::GetTexture() {
+	auto info = GetTextureInfo();
+	uint64_t key = GetTextureKey(info);
 
-	glm::ivec4 result{};
-	switch (texture_function) {
-	case SCEGU_TEX_MODULATE:
-		if (fragment_double) {
-			result = ((blend_color + 1) * tex_color * 2) / 256;
-		} else {
-			result = (blend_color + 1) * tex_color / 256;
+	// VRAM textures are usually render targets, they're written without any cache flush
+	bool vram = IsVRAM(info.texture.buffer);
+
+	auto it = texture_cache.find(key);
+	if (it != texture_cache.end()) {
+		auto& cached = *it->second;
+		texture_lru.splice(texture_lru.begin(), texture_lru, it->second);
+		if (!cached.dirty && !vram && cached.validated_frame == texture_frame) {
+			return cached.entry->clut ? ResolveTexture(key, cached) : cached.entry;
 		}
 
-		result.a = texture_alpha ? (blend_color.a + 1) * tex_color.a / 256 : blend_color.a;
-		break;
-	case SCEGU_TEX_DECAL:
-		if (texture_alpha) {
-			result = ((blend_color + 1) * (255 - tex_color.a) + (tex_color + 1) * tex_color.a);
-			result /= fragment_double ? 128 : 256;
-		} else {
-			result = fragment_double ? tex_color * 2 : tex_color;
+		uint64_t hash = HashTexture(info);
+		if (hash == cached.entry->hash) {
+			cached.dirty = false;
+			cached.validated_frame = texture_frame;
+			return cached.entry->clut ? ResolveTexture(key, cached) : cached.entry;
 		}
-		result.a = blend_color.a;
-		break;
-	case SCEGU_TEX_BLEND:
-		result = ((255 - tex_color) * blend_color + tex_color * environment_texture + 255);
-		result /= fragment_double ? 128 : 256;
+		EraseTexture(key);
+	}
 
-		result.a = texture_alpha ? (blend_color.a + 1) * tex_color.a / 256 : blend_color.a;
-		break;
+	uint64_t hash = HashTexture(info);
+	std::shared_ptr<const TextureCacheEntry> entry{};
 
-	case SCEGU_TEX_REPLACE:
-		result = tex_color;
-		if (fragment_double) {
-			result *= 2;
+	auto prefetched = prefetched_textures.find(key);
+	if (prefetched != prefetched_textures.end()) {
+		if (prefetched->second.entry.get()->hash == hash) {
+			entry = prefetched->second.entry.get();
 		}
-		result.a = texture_alpha ? tex_color.a : blending.a;
-		break;
-	case SCEGU_TEX_ADD:
-		result = tex_color + blend_color;
-		if (fragment_double) {
-			result *= 2;
-		}
-		result.a = texture_alpha ? (blend_color.a + 1) * tex_color.a / 256 : blend_color.a;
-		break;
+		prefetched_textures.erase(prefetched);
 	}
 
-	return {
-		static_cast<uint8_t>(std::clamp(result.a, 0, 255)),
-		static_cast<uint8_t>(std::clamp(result.b, 0, 255)),
-		static_cast<uint8_t>(std::clamp(result.g, 0, 255)),
-		static_cast<uint8_t>(std::clamp(result.r, 0, 255)) };
+	if (!entry) {
+		auto decoded = std::make_shared<TextureCacheEntry>(DecodeTexture(info));
+		decoded->hash = hash;
+		entry = decoded;
+	}
+
+	auto& cached = InsertTexture(key, info.texture.buffer, GetTextureSize(info), entry);
+	return entry->clut ? ResolveTexture(key, cached) : entry;
 }
 
-Color SoftwareRenderer::FilterTexture(uint8_t filter, glm::vec2 uv, const std::vector<Color>& tex_data) {
-	auto& texture = textures[0];
+// Bakes the current CLUT into a copy of an indexed texture, unless the texture keeps switching CLUTs
+std::shared_ptr<const TextureCacheEntry> SoftwareRenderer::ResolveTexture(uint64_t key, CachedTexture& indexed) {
+	uint64_t clut_state[] = { key, clut_hash, static_cast<uint64_t>(clut_format | clut_shift << 8 | clut_mask << 16) | static_cast<uint64_t>(clut_offset) << 24 };
+	uint64_t clut_key = HashMemory(clut_state, sizeof(clut_state));
 
-	switch (filter) {
-	case SCEGU_NEAREST: {
-		int x = static_cast<int>(uv.x * texture.width * 256) >> 8;
-		int y = static_cast<int>(uv.y * texture.height * 256) >> 8;
+	if (indexed.clut_frame != texture_frame) {
+		indexed.clut_frame = texture_frame;
+		indexed.clut_switches = 0;
+	}
+	if (indexed.clut_key != clut_key) {
+		indexed.clut_key = clut_key;
+		indexed.clut_switches++;
+	}
 
-		return GetTexel(x, y, tex_data);
+	auto indices = indexed.entry;
+	if (indexed.clut_switches > CLUT_VARIANT_MAX_SWITCHES) {
+		return indices;
 	}
-	case SCEGU_LINEAR: {
-		int base_x = static_cast<int>(uv.x * texture.width * 256) - 128;
-		int base_y = static_cast<int>(uv.y * texture.height * 256) - 128;
 
-		int x0 = base_x >> 8;
-		int frac_u = base_x >> 4 & 0xF;
-		int y0 = base_y >> 8;
-		int frac_v = base_y >> 4 & 0xF;
+	// Variants carry the hash of the indices they were built from, so they go stale together with them
+	auto it = texture_cache.find(clut_key);
+	if (it != texture_cache.end()) {
+		if (it->second->entry->hash == indices->hash) {
+			texture_lru.splice(texture_lru.begin(), texture_lru, it->second);
+			return it->second->entry;
+		}
+		EraseTexture(clut_key);
+	}
 
-		int x1 = x0 + 1;
-		int y1 = y0 + 1;
-		
-		Color t0 = GetTexel(x0, y0, tex_data);
-		auto c00 = glm::ivec4(t0.r, t0.g, t0.b, t0.a);
-		Color t1 = GetTexel(x1, y0, tex_data);
-		auto c10 = glm::ivec4(t1.r, t1.g, t1.b, t1.a);
-		Color t2 = GetTexel(x0, y1, tex_data);
-		auto c01 = glm::ivec4(t2.r, t2.g, t2.b, t2.a);
-		Color t3 = GetTexel(x1, y1, tex_data);
-		auto c11 = glm::ivec4(t3.r, t3.g, t3.b, t3.a);
+	alignas(16) uint32_t palette[512];
+	DecodeCLUT(clut.data(), clut_format, palette);
 
-		auto c0 = c00 * (0x10 - frac_u) + c10 * frac_u;
-		auto c1 = c01 * (0x10 - frac_u) + c11 * frac_u;
-		auto result = (c0 * (0x10 - frac_v) + c1 * frac_v) >> 8;
-		return { 
-			static_cast<uint8_t>(std::clamp(result.a, 0, 255)),
-			static_cast<uint8_t>(std::clamp(result.b, 0, 255)),
-			static_cast<uint8_t>(std::clamp(result.g, 0, 255)),
-			static_cast<uint8_t>(std::clamp(result.r, 0, 255)) };
+	auto resolved = std::make_shared<TextureCacheEntry>();
+	resolved->clut = false;
+	resolved->size = indices->size;
+	resolved->hash = indices->hash;
+	resolved->data.resize(indices->data.size());
+	ResolveCLUT(reinterpret_cast<const uint32_t*>(indices->data.data()), palette, reinterpret_cast<uint32_t*>(resolved->data.data()),
+		indices->data.size(), clut_shift, clut_mask, clut_offset & (clut_format == SCEGU_PF8888 ? 0xFF : 0x1FF));
+
+	InsertTexture(clut_key, 0, 0, resolved);
+	return resolved;
+}
+
+CachedTexture& SoftwareRenderer::InsertTexture(uint64_t key, uint32_t addr, uint32_t source_size, std::shared_ptr<const TextureCacheEntry> entry) {
+	texture_cache_size += entry->data.size() * sizeof(Color);
+	texture_lru.push_front({ key, addr, source_size, texture_frame, false, std::move(entry) });
+	texture_cache[key] = texture_lru.begin();
+
+	// Evicted entries stay alive for as long as a binned primitive still references them
+	while (texture_cache_size > TEXTURE_CACHE_MAX_SIZE && texture_lru.size() > 1) {
+		EraseTexture(texture_lru.back().key);
 	}
-	default:
-		spdlog::error("SoftwareRenderer: texel filter not implemented {}", filter);
-		return {};
+	return texture_lru.front();
+}
+
+void SoftwareRenderer::EraseTexture(uint64_t key) {
+	auto it = texture_cache.find(key);
+	if (it != texture_cache.end()) {
+		texture_cache_size -= it->second->entry->data.size() * sizeof(Color);
+		texture_lru.erase(it->second);
+		texture_cache.erase(it);
 	}
 }
 
-TextureCacheEntry SoftwareRenderer::DecodeTexture() {
-	auto& texture = textures[0];
-	if (texture_cache.contains(texture.buffer)) {
-		auto& cache = texture_cache[texture.buffer];
-		cache.unused_frames = 0;
-		return cache;
+template <typename T>
+static void DecodeDXT(const TextureInfo& info, const uint8_t* buffer, void (*decode)(const T*, uint32_t*, int), uint32_t* dst) {
+	auto& texture = info.texture;
+	for (uint32_t y = 0; y < texture.height; y += 4) {
+		const T* block = reinterpret_cast<const T*>(buffer) + (y / 4) * (texture.pitch / 4);
+		for (uint32_t x = 0; x < texture.width; x += 4, block++) {
+			uint32_t* out = &dst[y * texture.width + x];
+			if (x + 4 <= texture.width && y + 4 <= texture.height) {
+				decode(block, out, texture.width);
+				continue;
+			}
+
+			// Blocks hanging over the texture edge are decoded aside and cropped
+			uint32_t texels[16];
+			decode(block, texels, 4);
+			for (uint32_t by = 0; by < std::min(4u, texture.height - y); by++) {
+				for (uint32_t bx = 0; bx < std::min(4u, texture.width - x); bx++) {
+					out[by * texture.width + bx] = texels[by * 4 + bx];
+				}
+			}
+		}
 	}
+}
+
+TextureCacheEntry SoftwareRenderer::DecodeTexture(const TextureInfo& info) {
+	auto& texture = info.texture;
 
 	TextureCacheEntry cache{};
 	cache.size = texture.width * texture.height;
 	cache.data.resize(cache.size);
 
 	auto psp = PSP::GetInstance();
-	switch (texture_format) {
+	auto buffer = reinterpret_cast<const uint8_t*>(psp->VirtualToPhysical(texture.buffer));
+	if (!buffer) {
+		spdlog::error("SoftwareRenderer: invalid texture address {:x}", texture.buffer);
+		return cache;
+	}
+
+	uint32_t pitch = texture.pitch * GetTextureBits(info.format) / 8;
+	std::vector<uint8_t> unswizzled{};
+	if (info.swizzling && info.format < SCEGU_PFDXT1) {
+		// Only whole blocks that are inside of memory get unswizzled
+		uint32_t height = std::min(GetTextureSize(info) / std::max(pitch, 1u), (texture.height + 7) & ~7u) & ~7u;
+		unswizzled.resize(pitch * ((texture.height + 7) & ~7u));
+		UnswizzleTexture(buffer, unswizzled.data(), pitch, height);
+		buffer = unswizzled.data();
+	}
+
+	auto dst = reinterpret_cast<uint32_t*>(cache.data.data());
+	switch (info.format) {
 	case SCEGU_PF5650:
+		for (uint32_t y = 0; y < texture.height; y++) {
+			Decode5650(reinterpret_cast<const uint16_t*>(buffer + y * pitch), dst + y * texture.width, texture.width);
+		}
+		break;
 	case SCEGU_PF5551:
-	case SCEGU_PF4444: {
-		uint16_t* buffer = reinterpret_cast<uint16_t*>(psp->VirtualToPhysical(texture.buffer));
-		for (int y = 0; y < texture.height; y++) {
-			for (int x = 0; x < texture.width; x++) {
-				uint16_t color = buffer[y * texture.pitch + x];
-				if (texture_format == SCEGU_PF5650) {
-					cache.data[y * texture.width + x] = BGR565ToABGR8888(color);
-				} else if (texture_format == SCEGU_PF5551) {
-					cache.data[y * texture.width + x] = ABGR1555ToABGR8888(color);
-				} else if (texture_format == SCEGU_PF4444) {
-					cache.data[y * texture.width + x] = ABGR4444ToABGR8888(color);
-				}
-			}
+		for (uint32_t y = 0; y < texture.height; y++) {
+			Decode5551(reinterpret_cast<const uint16_t*>(buffer + y * pitch), dst + y * texture.width, texture.width);
 		}
 		break;
-	}
-	case SCEGU_PF8888: {
-		uint32_t* buffer = reinterpret_cast<uint32_t*>(psp->VirtualToPhysical(texture.buffer));
-		for (int y = 0; y < texture.height; y++) {
-			memcpy(&cache.data.data()[y * texture.width], &buffer[y * texture.pitch], texture.width * 4);
+	case SCEGU_PF4444:
+		for (uint32_t y = 0; y < texture.height; y++) {
+			Decode4444(reinterpret_cast<const uint16_t*>(buffer + y * pitch), dst + y * texture.width, texture.width);
 		}
 		break;
-	}
-	case SCEGU_PFIDX4: {
-		cache.clut = true;
-		uint8_t* buffer = reinterpret_cast<uint8_t*>(psp->VirtualToPhysical(texture.buffer));
-		for (int y = 0; y < texture.height; y++) {
-			int texture_index = y * texture.width;
-			int clut_index = y * texture.pitch / 2;
-			for (int x = 0; x < texture.width; x += 2, clut_index++) {
-				uint8_t value = buffer[clut_index];
-				cache.data[texture_index + x] = value & 0xF;
-				if ((x + 1) < texture.width) {
-					cache.data[texture_index + x + 1] = value >> 4;
-				}
-			}
+	case SCEGU_PF8888:
+		for (uint32_t y = 0; y < texture.height; y++) {
+			memcpy(dst + y * texture.width, buffer + y * pitch, texture.width * 4);
 		}
 		break;
-	}
-	case SCEGU_PFIDX8: {
+	case SCEGU_PFIDX4:
 		cache.clut = true;
-		uint8_t* buffer = reinterpret_cast<uint8_t*>(psp->VirtualToPhysical(texture.buffer));
-		for (int y = 0; y < texture.height; y++) {
-			int texture_index = y * texture.width;
-			int clut_index = y * texture.pitch;
-			for (int x = 0; x < texture.width; x++) {
-				uint8_t index = buffer[clut_index + x];
-				cache.data[texture_index + x] = index;
-			}
+		for (uint32_t y = 0; y < texture.height; y++) {
+			ExpandIndex4(buffer + y * pitch, dst + y * texture.width, texture.width);
 		}
 		break;
-	}
-	case SCEGU_PFIDX32: {
+	case SCEGU_PFIDX8:
 		cache.clut = true;
-		uint32_t* buffer = reinterpret_cast<uint32_t*>(psp->VirtualToPhysical(texture.buffer));
-		for (int y = 0; y < texture.height; y++) {
-			int texture_index = y * texture.width;
-			int clut_index = y * texture.pitch;
-			for (int x = 0; x < texture.width; x++) {
-				uint32_t index = buffer[clut_index + x];
-				cache.data[texture_index + x] = index;
-			}
+		for (uint32_t y = 0; y < texture.height; y++) {
+			ExpandIndex8(buffer + y * pitch, dst + y * texture.width, texture.width);
 		}
 		break;
-	}
-	case SCEGU_PFDXT1: {
-		const DXT1Block* block_start = reinterpret_cast<DXT1Block*>(psp->VirtualToPhysical(texture.buffer));
-		for (int y = 0; y < texture.height; y += 4) {
-			const DXT1Block* block = block_start + (y / 4) * (texture.pitch / 4);
-			for (int x = 0; x < texture.width; x += 4) {
-				Color* dst = &cache.data.data()[y * texture.width + x];
-
-				glm::ivec4 colors[4];
-				DecodeDXTColors(block, colors, false);
-				WriteDXT1(block, colors, dst, texture.pitch);
-				block++;
-			}
+	case SCEGU_PFIDX16:
+		cache.clut = true;
+		for (uint32_t y = 0; y < texture.height; y++) {
+			ExpandIndex16(reinterpret_cast<const uint16_t*>(buffer + y * pitch), dst + y * texture.width, texture.width);
 		}
 		break;
-	}
-	case SCEGU_PFDXT3: {
-		const DXT3Block* block_start = reinterpret_cast<DXT3Block*>(psp->VirtualToPhysical(texture.buffer));
-		for (int y = 0; y < texture.height; y += 4) {
-			const DXT3Block* block = block_start + (y / 4) * (texture.pitch / 4);
-			for (int x = 0; x < texture.width; x += 4) {
-				Color* dst = &cache.data.data()[y * texture.width + x];
-
-				glm::ivec4 colors[4];
-				DecodeDXTColors(&block->color, colors, true);
-				WriteDXT3(block, colors, dst, texture.pitch);
-				block++;
-			}
+	case SCEGU_PFIDX32:
+		cache.clut = true;
+		for (uint32_t y = 0; y < texture.height; y++) {
+			memcpy(dst + y * texture.width, buffer + y * pitch, texture.width * 4);
 		}
 		break;
-	}
-	case SCEGU_PFDXT5: {
-		const DXT5Block* block_start = reinterpret_cast<DXT5Block*>(psp->VirtualToPhysical(texture.buffer));
-		for (int y = 0; y < texture.height; y += 4) {
-			const DXT5Block* block = block_start + (y / 4) * (texture.pitch / 4);
-			for (int x = 0; x < texture.width; x += 4) {
-				Color* dst = &cache.data.data()[y * texture.width + x];
-
-				glm::ivec4 colors[4];
-				DecodeDXTColors(&block->color, colors, true);
-				WriteDXT5(block, colors, dst, texture.pitch);
-				block++;
-			}
-		}
+	case SCEGU_PFDXT1:
+		DecodeDXT(info, buffer, DecodeDXT1, dst);
+		break;
+	case SCEGU_PFDXT3:
+		DecodeDXT(info, buffer, DecodeDXT3, dst);
+		break;
+	case SCEGU_PFDXT5:
+		DecodeDXT(info, buffer, DecodeDXT5, dst);
 		break;
-	}
 	default:
-		spdlog::error("SoftwareRenderer: unknown texture format {}", texture_format);
+		spdlog::error("SoftwareRenderer: unknown texture format {}", info.format);
 	}
-	//texture_cache[texture.buffer] = cache;
 
 	return cache;
 }
\ No newline at end of file
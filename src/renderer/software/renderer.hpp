@@ -1,76 +1,289 @@
 #pragma once
 
 #include <algorithm>
+#include <deque>
+#include <emmintrin.h>
+#include <list>
+#include <memory>
 #include <unordered_map>
 
 #include "../renderer.hpp"
+#include "../texturedecoder.hpp"
 
-struct DXT1Block {
-	uint8_t lines[4];
-	uint16_t color1;
-	uint16_t color2;
+constexpr auto TILE_SIZE = 32;
+constexpr auto TILE_COUNT_X = 512 / TILE_SIZE;
+constexpr auto TILE_COUNT_Y = 512 / TILE_SIZE;
+constexpr auto MAX_BINNED_PRIMITIVES = 65536;
+
+// Triangle positions are snapped to the GE's 1/16 pixel grid
+constexpr auto SUBPIXEL_SCALE = 16;
+constexpr auto MAX_COORDINATE = 16384;
+
+// Lines are stepped with this many fraction bits, enough that the error over the longest line stays below a pixel
+constexpr auto LINE_FRACTION_BITS = 20;
+
+// 16-bit rectangle spans are widened to 32 bits this many pixels at a time
+constexpr auto SPAN_CHUNK_SIZE = 64;
+
+constexpr auto FRAGMENT_PIPELINE_COUNT = 512;
+constexpr auto FRAGMENT_STATISTICS_FRAMES = 600;
+constexpr auto FRAGMENT_STATISTICS_TOP = 5;
+
+enum RectangleMode {
+	RECTANGLE_GENERIC = 0,
+	RECTANGLE_FILL = 1,
+	RECTANGLE_COPY = 2,
+	RECTANGLE_BLEND = 3
 };
 
-struct DXT3Block {
-	DXT1Block color;
-	uint16_t alpha_lines[4];
+enum ShadeMode {
+	SHADE_FLAT = 0,
+	SHADE_GOURAUD = 1,
+	SHADE_TEXTURE = 2,
+	SHADE_TEXTURE_CLUT = 3
 };
 
-struct DXT5Block {
-	DXT1Block color;
-	uint32_t alpha_data2;
-	uint16_t alpha_data1;
-	uint8_t alpha1;
-	uint8_t alpha2;
+// Depth bounds are kept per tile and for the 8x8 blocks inside of it
+constexpr auto DEPTH_BLOCK_SIZE = 8;
+constexpr auto DEPTH_BLOCKS_PER_TILE = TILE_SIZE / DEPTH_BLOCK_SIZE;
+
+enum DepthCoverage {
+	DEPTH_REJECT = 0,
+	DEPTH_PARTIAL = 1,
+	DEPTH_ACCEPT = 2
 };
 
+// Decoded textures are kept by least recent use until their texels exceed this many bytes
+constexpr auto TEXTURE_CACHE_MAX_SIZE = 32 * 1024 * 1024;
+
+// A texture drawn with more CLUTs than this in one frame is sampled through the CLUT instead of resolved per CLUT
+constexpr auto CLUT_VARIANT_MAX_SWITCHES = 4;
+
 struct TextureCacheEntry {
 	bool clut;
-	int	unused_frames;
 	uint32_t size;
+	uint64_t hash;
 	std::vector<Color> data;
 };
 
+// Source range and validation state of a decoded texture, the entry itself is shared with raster states still using it
+struct CachedTexture {
+	uint64_t key;
+	uint32_t addr;
+	uint32_t source_size;
+	int validated_frame;
+	bool dirty;
+	std::shared_ptr<const TextureCacheEntry> entry;
+
+	uint64_t clut_key;
+	int clut_frame;
+	int clut_switches;
+};
+
+struct PrefetchedTexture {
+	int unused_frames;
+	std::shared_future<std::shared_ptr<const TextureCacheEntry>> entry;
+};
+
+// The first bits select the specialized rasterizer, the rest only separate states in the statistics
+union FragmentKey {
+	uint32_t full;
+	struct {
+		uint32_t depth_test : 1;
+		uint32_t shade_mode : 2;
+		uint32_t alpha_test : 1;
+		uint32_t blend : 1;
+		uint32_t depth_write : 1;
+		uint32_t range_test : 1;
+		uint32_t pixel_format : 2;
+		uint32_t depth_func : 3;
+		uint32_t alpha_func : 3;
+		uint32_t blend_operation : 3;
+		uint32_t blend_source : 4;
+		uint32_t blend_destination : 4;
+		uint32_t texture_function : 3;
+	};
+};
+
+// Every depth value of the area lies within min and max, writes only widen the range unless they cover the whole area
+struct DepthBounds {
+	uint16_t min;
+	uint16_t max;
+};
+
+struct DepthTile {
+	bool valid;
+	DepthBounds bounds;
+	std::array<DepthBounds, DEPTH_BLOCKS_PER_TILE * DEPTH_BLOCKS_PER_TILE> blocks;
+};
+
+class SoftwareRenderer;
+struct BinnedPrimitive;
+struct RasterState;
+
+// Per-pixel stages picked from the render state once per batch, so the fragment loops call them without switching on it
+using CompareFunction = bool (*)(int src, int dst);
+using QuadCompareFunction = __m128i (*)(__m128i src, __m128i dst);
+using TextureSampler = Color (*)(const RasterState& state, glm::vec2 uv);
+using TextureFunction = Color (*)(const RasterState& state, Color texture, Color blending);
+using BlendFunction = Color (*)(const RasterState& state, Color src, Color dest);
+using BlendFactor = glm::ivec4 (*)(glm::ivec4 color, glm::ivec4 src, glm::ivec4 dest, glm::ivec4 fix);
+
+using PrimitivePipeline = void (SoftwareRenderer::*)(const BinnedPrimitive& primitive, glm::ivec2 min, glm::ivec2 max);
+
+struct FragmentPipeline {
+	PrimitivePipeline rasterize_triangle;
+	PrimitivePipeline rasterize_line;
+	uint64_t primitive_count;
+};
+
+// Everything rasterization reads, captured once per batch so binned primitives can be drawn after the registers changed
+struct RasterState {
+	uint8_t* frame_buffer;
+	uint16_t* depth_buffer;
+	uint32_t fbw;
+	uint16_t zbw;
+	uint8_t pixel_format;
+
+	// 4x4 offsets added before 16-bit pixels are truncated, indexed by (y & 3) * 4 + (x & 3)
+	bool dither;
+	std::array<int8_t, 16> dither_matrix;
+
+	bool through;
+	bool clear_mode;
+	uint16_t min_z;
+	uint16_t max_z;
+	bool depth_test;
+	uint8_t depth_test_func;
+	bool depth_write;
+	bool gouraud_shading;
+	CompareFunction depth_compare;
+	QuadCompareFunction depth_compare_quad;
+
+	bool use_texture;
+	Texture texture;
+	std::shared_ptr<const TextureCacheEntry> texture_data;
+	bool u_clamp;
+	bool v_clamp;
+	uint8_t texture_function;
+	bool texture_alpha;
+	bool fragment_double;
+	glm::ivec4 environment_texture;
+	// Indexed by the primitive's filter & 1, the mipmap filters sample the base level
+	std::array<TextureSampler, 2> samplers;
+	TextureFunction texture_stage;
+
+	std::array<Color, 512> clut;
+	uint8_t clut_format;
+	uint8_t clut_shift;
+	uint8_t clut_mask;
+	uint16_t clut_offset;
+	uint16_t clut_base;
+
+	bool alpha_test;
+	uint8_t alpha_test_func;
+	uint8_t alpha_test_ref;
+	uint8_t alpha_test_mask;
+	CompareFunction alpha_compare;
+
+	bool blend;
+	uint8_t blend_operation;
+	uint8_t blend_source;
+	uint8_t blend_destination;
+	glm::ivec4 blend_afix;
+	glm::ivec4 blend_bfix;
+	BlendFunction blend_stage;
+	BlendFactor blend_factor_a;
+	BlendFactor blend_factor_b;
+
+	FragmentPipeline* pipeline;
+};
+
+// Primitive after setup, min and max are its scissored bounds. Rectangles and lines only use the first two vertices, points the first
+struct BinnedPrimitive {
+	uint8_t primitive_type;
+	uint8_t filter;
+	uint8_t rectangle_mode;
+	glm::ivec2 min;
+	glm::ivec2 max;
+	Vertex vertices[3];
+	const RasterState* state;
+};
+
 class SoftwareRenderer : public Renderer {
 public:
-	SoftwareRenderer();
+	SoftwareRenderer(bool tiled, bool headless);
 	~SoftwareRenderer();
 
 	void Frame();
 	void Resize(int width, int height) {}
-	void RenderFramebufferChange() {}
+	void RenderFramebufferChange();
 	void SetFrameBuffer(uint32_t frame_buffer, int frame_width, int pixel_format);
-	void DrawPoint(Vertex point) {}
-	void DrawLine(Vertex start, Vertex end) {}
-	void DrawLineStrip(std::vector<Vertex> vertices) {}
+	bool ReadFrame(std::vector<uint8_t>& pixels, uint32_t& width, uint32_t& height);
+	void DrawBatch(const PrimitiveBatch& batch);
+	void DrawPoint(Vertex point);
+	void DrawLine(Vertex start, Vertex end);
 	void DrawRectangle(Vertex start, Vertex end);
 	void DrawTriangle(Vertex v0, Vertex v1, Vertex v2);
-	void DrawTriangleStrip(std::vector<Vertex> vertices);
-	void DrawTriangleFan(std::vector<Vertex> vertices);
 	void ClearTextureCache();
 	void ClearTextureCache(uint32_t addr, uint32_t size);
-	void FlushRender() {}
+	void SyncMemory(uint32_t addr, uint32_t size);
+	void FlushRender();
+	void PrefetchTexture(const TextureInfo& info);
+	void CLoad(uint32_t opcode);
 
-	void DecodeDXTColors(const DXT1Block* block, glm::ivec4 palette[4], bool skip_alpha);
-	void WriteDXT1(const DXT1Block* block, glm::ivec4 palette[4], Color* dst, int pitch);
-	void WriteDXT3(const DXT3Block* block, glm::ivec4 palette[4], Color* dst, int pitch);
-	void WriteDXT5(const DXT5Block* block, glm::ivec4 palette[4], Color* dst, int pitch);
+	std::shared_ptr<const TextureCacheEntry> GetTexture();
+	std::shared_ptr<const TextureCacheEntry> ResolveTexture(uint64_t key, CachedTexture& indexed);
+	CachedTexture& InsertTexture(uint64_t key, uint32_t addr, uint32_t source_size, std::shared_ptr<const TextureCacheEntry> entry);
+	void EraseTexture(uint64_t key);
+	TextureCacheEntry DecodeTexture(const TextureInfo& info);
 
-	bool Test(uint8_t test, int src, int dst);
-	Color GetTexel(int x, int y, const std::vector<Color>& tex_data);
-
-	Color Blend(Color src, Color dest);
-	Color BlendTexture(Color texture, Color blending);
-	Color FilterTexture(uint8_t filter, glm::vec2 uv, const std::vector<Color>& tex_data);
-	Color GetCLUT(uint32_t index);
-	TextureCacheEntry DecodeTexture();
+	RasterState CaptureRasterState(std::shared_ptr<const TextureCacheEntry> texture_data);
+	void BinPrimitive(const BinnedPrimitive& primitive);
+	void RasterizePrimitive(const BinnedPrimitive& primitive, glm::ivec2 min, glm::ivec2 max);
+	uint8_t GetRectangleMode(const RasterState& state, const Vertex& start, const Vertex& end, glm::ivec2 size, uint8_t filter);
+	void RasterizeRectangle(const BinnedPrimitive& primitive, glm::ivec2 min, glm::ivec2 max);
+	template <uint8_t PIXEL_FORMAT>
+	void RasterizeRectangleGeneric(const BinnedPrimitive& primitive, glm::ivec2 min, glm::ivec2 max);
+	void RasterizeRectangleSpans(const BinnedPrimitive& primitive, glm::ivec2 min, glm::ivec2 max);
+	template <bool DEPTH_TEST, uint8_t SHADE_MODE, bool ALPHA_TEST, bool BLEND, bool DEPTH_WRITE, bool RANGE_TEST, uint8_t PIXEL_FORMAT>
+	void RasterizeTriangle(const BinnedPrimitive& primitive, glm::ivec2 min, glm::ivec2 max);
+	template <bool DEPTH_TEST, uint8_t SHADE_MODE, bool ALPHA_TEST, bool BLEND, bool DEPTH_WRITE, bool RANGE_TEST, uint8_t PIXEL_FORMAT>
+	void RasterizeLine(const BinnedPrimitive& primitive, glm::ivec2 min, glm::ivec2 max);
+	template <uint8_t SHADE_MODE, bool ALPHA_TEST, bool BLEND, bool DEPTH_WRITE, uint8_t PIXEL_FORMAT>
+	void ShadeFragment(const RasterState& state, uint8_t filter, int x, int y, uint16_t z, Color color, glm::vec2 uv);
+	DepthTile* GetDepthTile(const RasterState& state, int tile_x, int tile_y);
+	void UpdateDepthBounds(glm::ivec2 min, glm::ivec2 max, uint16_t z_min, uint16_t z_max, bool overwrite);
+	void InvalidateDepthTiles();
+	bool OverlapsDepthTiles(uint32_t addr, uint32_t size) const;
+	FragmentPipeline* GetFragmentPipeline(FragmentKey key);
+	void LogFragmentStatistics();
 private:
 	SDL_PixelFormat frame_format = SDL_PIXELFORMAT_UNKNOWN;
 	uint32_t frame_buffer = 0;
 	int frame_width = 0;
+	uint64_t frame_hash = 0;
+
+	std::list<CachedTexture> texture_lru{};
+	std::unordered_map<uint64_t, std::list<CachedTexture>::iterator> texture_cache{};
+	size_t texture_cache_size = 0;
+	int texture_frame = 0;
+	uint64_t clut_hash = 0;
+	std::unordered_map<uint64_t, PrefetchedTexture> prefetched_textures{};
+
+	bool tiled = true;
+	std::deque<RasterState> raster_states{};
+	std::vector<BinnedPrimitive> binned_primitives{};
+	std::array<std::vector<uint32_t>, TILE_COUNT_X * TILE_COUNT_Y> tile_bins{};
+
+	std::array<DepthTile, TILE_COUNT_X * TILE_COUNT_Y> depth_tiles{};
+	uint32_t depth_tiles_addr = 0;
+	uint16_t depth_tiles_zbw = 0;
 
-	std::unordered_map<uint32_t, TextureCacheEntry> texture_cache{};
+	std::unordered_map<uint32_t, FragmentPipeline> fragment_pipelines{};
+	int statistics_frames = 0;
 
 	SDL_Renderer* renderer = nullptr;
 	SDL_Texture* texture = nullptr;
+	SDL_Surface* headless_surface = nullptr;
 };
\ No newline at end of file
@@ -0,0 +1,443 @@
+#include "renderer.hpp"
+
+#include <emmintrin.h>
+#include <spdlog/spdlog.h>
+#include <glm/gtc/type_ptr.hpp>
+
+#include "../psp.hpp"
+
+enum PatchPrimitive {
+	PATCH_TRIANGLES = 0,
+	PATCH_LINES = 1,
+	PATCH_POINTS = 2
+};
+
+// Control point offset, cubic basis weights and their derivatives of one tessellated row or column
+struct PatchWeights {
+	int index;
+	float param;
+	float weights[4];
+	float derivatives[4];
+};
+
+struct PatchPoint {
+	__m128 pos;
+	__m128 uv;
+	__m128 color;
+	__m128 weights[2];
+};
+
+static std::vector<PatchWeights> GetBezierWeights(int patches, int divide) {
+	std::vector<PatchWeights> result(patches * divide + 1);
+	for (int i = 0; i < result.size(); i++) {
+		int patch = std::min(i / divide, patches - 1);
+		float t = static_cast<float>(i - patch * divide) / divide;
+		float s = 1.0f - t;
+
+		auto& weights = result[i];
+		weights.index = patch * 3;
+		weights.param = static_cast<float>(i) / divide;
+		weights.weights[0] = s * s * s;
+		weights.weights[1] = 3.0f * t * s * s;
+		weights.weights[2] = 3.0f * t * t * s;
+		weights.weights[3] = t * t * t;
+		weights.derivatives[0] = -3.0f * s * s;
+		weights.derivatives[1] = 3.0f * s * s - 6.0f * t * s;
+		weights.derivatives[2] = 6.0f * t * s - 3.0f * t * t;
+		weights.derivatives[3] = 3.0f * t * t;
+	}
+	return result;
+}
+
+// Cubic B-spline, open ends repeat the boundary knots so the curve reaches the outer control points
+static std::vector<PatchWeights> GetSplineWeights(int count, int type, int divide) {
+	int n = count - 1;
+	std::vector<float> knots(n + 5, 0.0f);
+	for (int i = 0; i < n - 1; i++) {
+		knots[i + 3] = static_cast<float>(i);
+	}
+
+	if (!(type & 1)) {
+		knots[0] = -3.0f;
+		knots[1] = -2.0f;
+		knots[2] = -1.0f;
+	}
+
+	if (!(type & 2)) {
+		knots[n + 2] = n - 1.0f;
+		knots[n + 3] = static_cast<float>(n);
+		knots[n + 4] = n + 1.0f;
+	} else {
+		knots[n + 2] = n - 2.0f;
+		knots[n + 3] = n - 2.0f;
+		knots[n + 4] = n - 2.0f;
+	}
+
+	int patches = count - 3;
+	std::vector<PatchWeights> result(patches * divide + 1);
+	for (int i = 0; i < result.size(); i++) {
+		int patch = std::min(i / divide, patches - 1);
+		float t = static_cast<float>(i) / divide;
+		auto knot = &knots[patch + 1];
+
+		float t0 = t - knot[0];
+		float t1 = t - knot[1];
+		float t2 = t - knot[2];
+		float f30 = t0 / (knot[3] - knot[0]);
+		float f41 = t1 / (knot[4] - knot[1]);
+		float f52 = t2 / (knot[5] - knot[2]);
+		float f31 = t1 / (knot[3] - knot[1]);
+		float f42 = t2 / (knot[4] - knot[2]);
+		float f32 = t2 / (knot[3] - knot[2]);
+		float d30 = 1.0f / (knot[3] - knot[0]);
+		float d41 = 1.0f / (knot[4] - knot[1]);
+		float d52 = 1.0f / (knot[5] - knot[2]);
+		float d31 = 1.0f / (knot[3] - knot[1]);
+		float d42 = 1.0f / (knot[4] - knot[2]);
+		float d32 = 1.0f / (knot[3] - knot[2]);
+
+		float a = (1.0f - f30) * (1.0f - f31);
+		float b = f31 * f41;
+		float c = (1.0f - f41) * (1.0f - f42);
+		float d = f42 * f52;
+		float da = -d30 * (1.0f - f31) - d31 * (1.0f - f30);
+		float db = d31 * f41 + f31 * d41;
+		float dc = -d41 * (1.0f - f42) - d42 * (1.0f - f41);
+		float dd = d42 * f52 + f42 * d52;
+
+		auto& weights = result[i];
+		weights.index = patch;
+		weights.param = t;
+		weights.weights[0] = a - a * f32;
+		weights.weights[1] = 1.0f - a - b + (a + b + c - 1.0f) * f32;
+		weights.weights[2] = b + (1.0f - b - c - d) * f32;
+		weights.weights[3] = d * f32;
+		weights.derivatives[0] = da * (1.0f - f32) - a * d32;
+		weights.derivatives[1] = -da - db + (da + db + dc) * f32 + (a + b + c - 1.0f) * d32;
+		weights.derivatives[2] = db - (db + dc + dd) * f32 + (1.0f - b - c - d) * d32;
+		weights.derivatives[3] = dd * f32 + d * d32;
+	}
+	return result;
+}
+
+static __m128 LoadColor(Color color) {
+	__m128i zero = _mm_setzero_si128();
+	__m128i value = _mm_cvtsi32_si128(static_cast<int>(color.abgr));
+	value = _mm_unpacklo_epi16(_mm_unpacklo_epi8(value, zero), zero);
+	return _mm_cvtepi32_ps(value);
+}
+
+static Color StoreColor(__m128 color) {
+	__m128i value = _mm_cvtps_epi32(color);
+	value = _mm_packs_epi32(value, value);
+	value = _mm_packus_epi16(value, value);
+	return Color(static_cast<uint32_t>(_mm_cvtsi128_si32(value)));
+}
+
+static PatchPoint BlendPatchPoints(const PatchPoint* points, size_t stride, const float weights[4]) {
+	PatchPoint result{ _mm_setzero_ps(), _mm_setzero_ps(), _mm_setzero_ps(), { _mm_setzero_ps(), _mm_setzero_ps() } };
+	for (int i = 0; i < 4; i++) {
+		__m128 weight = _mm_set1_ps(weights[i]);
+		auto& point = points[i * stride];
+		result.pos = _mm_add_ps(result.pos, _mm_mul_ps(point.pos, weight));
+		result.uv = _mm_add_ps(result.uv, _mm_mul_ps(point.uv, weight));
+		result.color = _mm_add_ps(result.color, _mm_mul_ps(point.color, weight));
+		result.weights[0] = _mm_add_ps(result.weights[0], _mm_mul_ps(point.weights[0], weight));
+		result.weights[1] = _mm_add_ps(result.weights[1], _mm_mul_ps(point.weights[1], weight));
+	}
+	return result;
+}
+
+static __m128 BlendPatchPositions(const PatchPoint* points, size_t stride, const float weights[4]) {
+	__m128 result = _mm_setzero_ps();
+	for (int i = 0; i < 4; i++) {
+		result = _mm_add_ps(result, _mm_mul_ps(points[i * stride].pos, _mm_set1_ps(weights[i])));
+	}
+	return result;
+}
+
+static glm::vec3 GetPatchNormal(__m128 tangent_u, __m128 tangent_v, bool reverse) {
+	alignas(16) float u[4];
+	alignas(16) float v[4];
+	_mm_store_ps(u, tangent_u);
+	_mm_store_ps(v, tangent_v);
+
+	glm::vec3 normal = glm::cross(glm::vec3(u[0], u[1], u[2]), glm::vec3(v[0], v[1], v[2]));
+	float length = glm::length(normal);
+	if (length == 0.0f) {
+		return glm::vec3(0.0f);
+	}
+	return normal / (reverse ? -length : length);
+}
+
+// Normals come from the cross product of the surface tangents and skinning weights are blended like the other
+// attributes, both are only generated when the draw needs them
+static void TessellatePatch(const std::vector<Vertex>& control_points, const std::vector<std::array<float, 8>>& control_weights,
+	int count_u, const std::vector<PatchWeights>& weights_u, const std::vector<PatchWeights>& weights_v, bool generate_uv,
+	bool generate_normals, bool reverse_normals, bool generate_weights, std::vector<Vertex>& vertices, std::vector<glm::vec3>& normals,
+	std::vector<std::array<float, 8>>& weights) {
+	std::vector<PatchPoint> points(control_points.size());
+	for (int i = 0; i < control_points.size(); i++) {
+		auto& v = control_points[i];
+		points[i].pos = _mm_loadu_ps(glm::value_ptr(v.pos));
+		points[i].uv = _mm_setr_ps(v.uv.x, v.uv.y, 0.0f, 0.0f);
+		points[i].color = LoadColor(v.color);
+		points[i].weights[0] = _mm_loadu_ps(&control_weights[i][0]);
+		points[i].weights[1] = _mm_loadu_ps(&control_weights[i][4]);
+	}
+
+	std::vector<PatchPoint> row(count_u);
+	std::vector<PatchPoint> row_tangent(generate_normals ? count_u : 0);
+	vertices.resize(weights_u.size() * weights_v.size());
+	normals.resize(generate_normals ? vertices.size() : 0);
+	weights.resize(generate_weights ? vertices.size() : 0);
+	auto out = vertices.data();
+	auto out_normal = normals.data();
+	auto out_weights = weights.data();
+	for (auto& v : weights_v) {
+		// Collapse the four contributing control rows first, so every output vertex only blends four points
+		for (int u = 0; u < count_u; u++) {
+			row[u] = BlendPatchPoints(&points[v.index * count_u + u], count_u, v.weights);
+			if (generate_normals) {
+				row_tangent[u].pos = BlendPatchPositions(&points[v.index * count_u + u], count_u, v.derivatives);
+			}
+		}
+
+		for (auto& u : weights_u) {
+			auto point = BlendPatchPoints(&row[u.index], 1, u.weights);
+			if (generate_normals) {
+				__m128 tangent_u = BlendPatchPositions(&row[u.index], 1, u.derivatives);
+				__m128 tangent_v = BlendPatchPositions(&row_tangent[u.index], 1, u.weights);
+				*out_normal++ = GetPatchNormal(tangent_u, tangent_v, reverse_normals);
+			}
+			if (generate_weights) {
+				_mm_storeu_ps(&(*out_weights)[0], point.weights[0]);
+				_mm_storeu_ps(&(*out_weights)[4], point.weights[1]);
+				out_weights++;
+			}
+
+			auto& vertex = *out++;
+			_mm_storeu_ps(glm::value_ptr(vertex.pos), point.pos);
+			vertex.pos.w = 1.0f;
+			if (generate_uv) {
+				vertex.uv = glm::vec2(u.param, v.param);
+			} else {
+				alignas(16) float uv[4];
+				_mm_store_ps(uv, point.uv);
+				vertex.uv = glm::vec2(uv[0], uv[1]);
+			}
+			vertex.color = StoreColor(point.color);
+		}
+	}
+}
+
+static void BuildPatchIndices(uint8_t primitive, int width, int height, std::vector<uint32_t>& indices) {
+	indices.clear();
+	switch (primitive) {
+	case PATCH_TRIANGLES:
+		for (int y = 0; y + 1 < height; y++) {
+			for (int x = 0; x + 1 < width; x++) {
+				uint32_t i0 = y * width + x;
+				uint32_t i1 = i0 + 1;
+				uint32_t i2 = i0 + width;
+				uint32_t i3 = i2 + 1;
+				indices.insert(indices.end(), { i0, i2, i1, i1, i2, i3 });
+			}
+		}
+		break;
+	case PATCH_LINES:
+		for (int y = 0; y < height; y++) {
+			for (int x = 0; x < width; x++) {
+				uint32_t i = y * width + x;
+				if (x + 1 < width) {
+					indices.insert(indices.end(), { i, i + 1 });
+				}
+				if (y + 1 < height) {
+					indices.insert(indices.end(), { i, i + width });
+				}
+			}
+		}
+		break;
+	default:
+		for (int i = 0; i < width * height; i++) {
+			indices.push_back(i);
+		}
+		break;
+	}
+}
+
+void Renderer::Bezier(uint32_t opcode) {
+	int count_u = opcode & 0xFF;
+	int count_v = opcode >> 8 & 0xFF;
+
+	if (position_format == FORMAT_NONE) {
+		spdlog::error("Renderer: invalid position format FORMAT_NONE");
+		return;
+	}
+
+	if (count_u < 4 || count_v < 4) {
+		spdlog::error("Renderer: invalid bezier patch size {}x{}", count_u, count_v);
+		return;
+	}
+
+	DrawPatch(opcode, count_u, count_v);
+}
+
+void Renderer::Spline(uint32_t opcode) {
+	int count_u = opcode & 0xFF;
+	int count_v = opcode >> 8 & 0xFF;
+
+	if (position_format == FORMAT_NONE) {
+		spdlog::error("Renderer: invalid position format FORMAT_NONE");
+		return;
+	}
+
+	if (count_u < 4 || count_v < 4) {
+		spdlog::error("Renderer: invalid spline patch size {}x{}", count_u, count_v);
+		return;
+	}
+
+	DrawPatch(opcode, count_u, count_v);
+}
+
+// Copies the raw control point vertices and their indices, nothing is decoded so the lookup stays cheap
+bool Renderer::ReadPatchSource(int count, std::vector<uint32_t>& indices, uint32_t& vertex_size, std::vector<uint8_t>& source) {
+	auto psp = PSP::GetInstance();
+
+	// One decode gives the stride including the alignment padding
+	uint32_t start_vaddr = vaddr;
+	float weights[8]{};
+	glm::vec3 normal{};
+	DecodeModelVertex(weights, normal);
+	vertex_size = vaddr - start_vaddr;
+	vaddr = start_vaddr;
+
+	indices.resize(count);
+	uint32_t vertex_count = count;
+	if (index_format == FORMAT_NONE) {
+		for (int i = 0; i < count; i++) {
+			indices[i] = i;
+		}
+	} else {
+		vertex_count = 0;
+		for (int i = 0; i < count; i++) {
+			uint32_t index = 0;
+			switch (index_format) {
+			case FORMAT_BYTE:
+				index = psp->ReadMemory8(iaddr);
+				iaddr += 1;
+				break;
+			case FORMAT_SHORT:
+				index = psp->ReadMemory16(iaddr);
+				iaddr += 2;
+				break;
+			case FORMAT_FLOAT:
+				index = psp->ReadMemory32(iaddr);
+				iaddr += 4;
+				break;
+			}
+			indices[i] = index;
+			vertex_count = std::max(vertex_count, index + 1);
+		}
+	}
+
+	auto memory = reinterpret_cast<const uint8_t*>(psp->VirtualToPhysical(vaddr));
+	if (!memory) {
+		spdlog::error("Renderer: invalid control point address {:x}", vaddr);
+		return false;
+	}
+
+	auto index_bytes = reinterpret_cast<const uint8_t*>(indices.data());
+	source.assign(memory, memory + static_cast<size_t>(vertex_count) * vertex_size);
+	source.insert(source.end(), index_bytes, index_bytes + indices.size() * sizeof(uint32_t));
+	return true;
+}
+
+void Renderer::DrawPatch(uint32_t opcode, int count_u, int count_v) {
+	std::vector<uint32_t> control_indices;
+	std::vector<uint8_t> source;
+	uint32_t vertex_size = 0;
+	if (!ReadPatchSource(count_u * count_v, control_indices, vertex_size, source)) {
+		return;
+	}
+
+	uint32_t start_vaddr = vaddr;
+	if (index_format == FORMAT_NONE) {
+		vaddr += count_u * count_v * vertex_size;
+	}
+
+	// Vertices are lit after tessellation, from the generated surface normals
+	bool lighting_enabled = lighting && !through;
+	bool skinning = weight_format != FORMAT_NONE && !through;
+
+	// Decoding also depends on the uv transform, the texture size in through mode and the ambient color
+	float decode_state[6] = { uv_scale.x, uv_scale.y, uv_offset.x, uv_offset.y, static_cast<float>(textures[0].width), static_cast<float>(textures[0].height) };
+	uint64_t patch_state[4] = { opcode, cmds[CMD_VTYPE], static_cast<uint64_t>(patch_divide_v << 16 | patch_divide_u << 8 |
+		lighting_enabled << 3 | patch_facing << 2 | patch_primitive), static_cast<uint64_t>(ambient_alpha) << 24 | ambient_color };
+	uint64_t state = HashMemory(decode_state, sizeof(decode_state), HashMemory(patch_state, sizeof(patch_state)));
+	uint64_t hash = HashMemory(source.data(), source.size(), state);
+
+	auto& entry = patch_cache[hash];
+	entry.unused_frames = 0;
+
+	bool valid = entry.state == state && entry.source == source;
+	if (!valid) {
+		std::vector<Vertex> control_points(control_indices.size());
+		std::vector<std::array<float, 8>> control_weights(control_indices.size());
+		for (int i = 0; i < control_indices.size(); i++) {
+			glm::vec3 normal{};
+			vaddr = start_vaddr + control_indices[i] * vertex_size;
+			control_points[i] = DecodeModelVertex(control_weights[i].data(), normal);
+		}
+		vaddr = index_format == FORMAT_NONE ? start_vaddr + count_u * count_v * vertex_size : start_vaddr;
+
+		std::vector<PatchWeights> weights_u;
+		std::vector<PatchWeights> weights_v;
+		if ((opcode >> 24) == CMD_BEZIER) {
+			weights_u = GetBezierWeights((count_u - 1) / 3, patch_divide_u);
+			weights_v = GetBezierWeights((count_v - 1) / 3, patch_divide_v);
+		} else {
+			weights_u = GetSplineWeights(count_u, opcode >> 16 & 3, patch_divide_u);
+			weights_v = GetSplineWeights(count_v, opcode >> 18 & 3, patch_divide_v);
+		}
+
+		entry.state = state;
+		entry.source = std::move(source);
+		TessellatePatch(control_points, control_weights, count_u, weights_u, weights_v, uv_format == FORMAT_NONE, lighting_enabled,
+			patch_facing, skinning, entry.vertices, entry.normals, entry.weights);
+		BuildPatchIndices(patch_primitive, weights_u.size(), weights_v.size(), entry.indices);
+	}
+
+	executed_cycles = entry.vertices.size() * 40;
+
+	// World and bone matrices change from draw to draw, so they are applied to the cached mesh
+	std::vector<Vertex> vertices = entry.vertices;
+	if (!through) {
+		std::vector<glm::vec3> normals = entry.normals;
+		for (size_t i = 0; i < vertices.size(); i++) {
+			ApplyWorldTransform(vertices[i], skinning ? entry.weights[i].data() : nullptr, lighting_enabled ? &normals[i] : nullptr);
+		}
+
+		if (lighting_enabled) {
+			LightVertices(vertices.data(), normals.data(), vertices.size());
+		}
+
+		for (auto& v : vertices) {
+			if (!TransformVertex(v)) {
+				v.pos.w = std::numeric_limits<double>::quiet_NaN();
+			}
+		}
+	}
+
+	switch (patch_primitive) {
+	case PATCH_TRIANGLES: BeginBatch(SCEGU_PRIM_TRIANGLES); break;
+	case PATCH_LINES: BeginBatch(SCEGU_PRIM_LINES); break;
+	default: BeginBatch(SCEGU_PRIM_POINTS); break;
+	}
+
+	auto& batch_vertices = batch.vertices;
+	batch_vertices.reserve(batch_vertices.size() + entry.indices.size());
+	for (auto index : entry.indices) {
+		batch_vertices.push_back(vertices[index]);
+	}
+}
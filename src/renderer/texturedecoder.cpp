@@ -0,0 +1,386 @@
+#include "texturedecoder.hpp"
+
+#include <cstring>
+#include <emmintrin.h>
+
+#include "../hle/defs.hpp"
+
+uint32_t GetTextureBits(uint8_t format) {
+	switch (format) {
+	case SCEGU_PFIDX4:
+	case SCEGU_PFDXT1:
+		return 4;
+	case SCEGU_PFIDX8:
+	case SCEGU_PFDXT3:
+	case SCEGU_PFDXT5:
+		return 8;
+	case SCEGU_PF5650:
+	case SCEGU_PF5551:
+	case SCEGU_PF4444:
+	case SCEGU_PFIDX16:
+		return 16;
+	default:
+		return 32;
+	}
+}
+
+// Widens 5 and 6 bit channels by repeating their top bits, so full intensity stays 0xFF
+static __m128i Expand5(__m128i channel) {
+	return _mm_or_si128(_mm_slli_epi16(channel, 3), _mm_srli_epi16(channel, 2));
+}
+
+static __m128i Expand6(__m128i channel) {
+	return _mm_or_si128(_mm_slli_epi16(channel, 2), _mm_srli_epi16(channel, 4));
+}
+
+static __m128i Expand4(__m128i channel) {
+	return _mm_or_si128(_mm_slli_epi16(channel, 4), channel);
+}
+
+// Takes eight 16-bit lanes of red | green << 8 and blue | alpha << 8
+static void StoreABGR(uint32_t* dst, __m128i rg, __m128i ba) {
+	_mm_storeu_si128(reinterpret_cast<__m128i*>(dst), _mm_unpacklo_epi16(rg, ba));
+	_mm_storeu_si128(reinterpret_cast<__m128i*>(dst + 4), _mm_unpackhi_epi16(rg, ba));
+}
+
+void Decode5650(const uint16_t* src, uint32_t* dst, int count) {
+	const __m128i mask5 = _mm_set1_epi16(0x1F);
+	const __m128i mask6 = _mm_set1_epi16(0x3F);
+	const __m128i alpha = _mm_set1_epi16(static_cast<short>(0xFF00));
+
+	int i = 0;
+	for (; i + 8 <= count; i += 8) {
+		__m128i color = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + i));
+		__m128i r = Expand5(_mm_and_si128(color, mask5));
+		__m128i g = Expand6(_mm_and_si128(_mm_srli_epi16(color, 5), mask6));
+		__m128i b = Expand5(_mm_srli_epi16(color, 11));
+		StoreABGR(dst + i, _mm_or_si128(r, _mm_slli_epi16(g, 8)), _mm_or_si128(b, alpha));
+	}
+
+	for (; i < count; i++) {
+		uint32_t r = src[i] & 0x1F;
+		uint32_t g = src[i] >> 5 & 0x3F;
+		uint32_t b = src[i] >> 11;
+		r = r << 3 | r >> 2;
+		g = g << 2 | g >> 4;
+		b = b << 3 | b >> 2;
+		dst[i] = 0xFF000000 | b << 16 | g << 8 | r;
+	}
+}
+
+void Decode5551(const uint16_t* src, uint32_t* dst, int count) {
+	const __m128i mask5 = _mm_set1_epi16(0x1F);
+	const __m128i alpha_mask = _mm_set1_epi16(static_cast<short>(0xFF00));
+
+	int i = 0;
+	for (; i + 8 <= count; i += 8) {
+		__m128i color = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + i));
+		__m128i r = Expand5(_mm_and_si128(color, mask5));
+		__m128i g = Expand5(_mm_and_si128(_mm_srli_epi16(color, 5), mask5));
+		__m128i b = Expand5(_mm_and_si128(_mm_srli_epi16(color, 10), mask5));
+		__m128i a = _mm_and_si128(_mm_srai_epi16(color, 15), alpha_mask);
+		StoreABGR(dst + i, _mm_or_si128(r, _mm_slli_epi16(g, 8)), _mm_or_si128(b, a));
+	}
+
+	for (; i < count; i++) {
+		uint32_t r = src[i] & 0x1F;
+		uint32_t g = src[i] >> 5 & 0x1F;
+		uint32_t b = src[i] >> 10 & 0x1F;
+		uint32_t a = src[i] >> 15 ? 0xFF : 0;
+		r = r << 3 | r >> 2;
+		g = g << 3 | g >> 2;
+		b = b << 3 | b >> 2;
+		dst[i] = a << 24 | b << 16 | g << 8 | r;
+	}
+}
+
+void Decode4444(const uint16_t* src, uint32_t* dst, int count) {
+	const __m128i mask4 = _mm_set1_epi16(0xF);
+
+	int i = 0;
+	for (; i + 8 <= count; i += 8) {
+		__m128i color = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + i));
+		__m128i r = Expand4(_mm_and_si128(color, mask4));
+		__m128i g = Expand4(_mm_and_si128(_mm_srli_epi16(color, 4), mask4));
+		__m128i b = Expand4(_mm_and_si128(_mm_srli_epi16(color, 8), mask4));
+		__m128i a = Expand4(_mm_srli_epi16(color, 12));
+		StoreABGR(dst + i, _mm_or_si128(r, _mm_slli_epi16(g, 8)), _mm_or_si128(b, _mm_slli_epi16(a, 8)));
+	}
+
+	for (; i < count; i++) {
+		uint32_t r = src[i] & 0xF;
+		uint32_t g = src[i] >> 4 & 0xF;
+		uint32_t b = src[i] >> 8 & 0xF;
+		uint32_t a = src[i] >> 12;
+		dst[i] = (a * 0x11) << 24 | (b * 0x11) << 16 | (g * 0x11) << 8 | r * 0x11;
+	}
+}
+
+// Adds the dither offsets to the color channels of four pixels, the saturating pack clamps them to 0-255
+static __m128i DitherPixels(__m128i pixels, const int8_t* dither) {
+	if (!dither) {
+		return pixels;
+	}
+
+	const __m128i zero = _mm_setzero_si128();
+	__m128i lo = _mm_adds_epi16(_mm_unpacklo_epi8(pixels, zero), _mm_setr_epi16(dither[0], dither[0], dither[0], 0, dither[1], dither[1], dither[1], 0));
+	__m128i hi = _mm_adds_epi16(_mm_unpackhi_epi8(pixels, zero), _mm_setr_epi16(dither[2], dither[2], dither[2], 0, dither[3], dither[3], dither[3], 0));
+	return _mm_packus_epi16(lo, hi);
+}
+
+static uint32_t DitherPixel(uint32_t pixel, const int8_t* dither, int i) {
+	if (!dither) {
+		return pixel;
+	}
+
+	int8_t offsets[4] = { dither[i & 3], 0, 0, 0 };
+	return _mm_cvtsi128_si32(DitherPixels(_mm_cvtsi32_si128(pixel), offsets));
+}
+
+// Narrows four 32-bit lanes holding 16-bit values, sign extending first keeps the signed pack from saturating
+static void StorePacked(uint16_t* dst, __m128i packed) {
+	packed = _mm_srai_epi32(_mm_slli_epi32(packed, 16), 16);
+	_mm_storel_epi64(reinterpret_cast<__m128i*>(dst), _mm_packs_epi32(packed, packed));
+}
+
+void Encode5650(const uint32_t* src, uint16_t* dst, int count, const int8_t* dither) {
+	int i = 0;
+	for (; i + 4 <= count; i += 4) {
+		__m128i color = DitherPixels(_mm_loadu_si128(reinterpret_cast<const __m128i*>(src + i)), dither);
+		__m128i r = _mm_and_si128(_mm_srli_epi32(color, 3), _mm_set1_epi32(0x001F));
+		__m128i g = _mm_and_si128(_mm_srli_epi32(color, 5), _mm_set1_epi32(0x07E0));
+		__m128i b = _mm_and_si128(_mm_srli_epi32(color, 8), _mm_set1_epi32(0xF800));
+		StorePacked(dst + i, _mm_or_si128(_mm_or_si128(r, g), b));
+	}
+
+	for (; i < count; i++) {
+		uint32_t color = DitherPixel(src[i], dither, i);
+		dst[i] = (color >> 3 & 0x001F) | (color >> 5 & 0x07E0) | (color >> 8 & 0xF800);
+	}
+}
+
+void Encode5551(const uint32_t* src, uint16_t* dst, int count, const int8_t* dither) {
+	int i = 0;
+	for (; i + 4 <= count; i += 4) {
+		__m128i color = DitherPixels(_mm_loadu_si128(reinterpret_cast<const __m128i*>(src + i)), dither);
+		__m128i r = _mm_and_si128(_mm_srli_epi32(color, 3), _mm_set1_epi32(0x001F));
+		__m128i g = _mm_and_si128(_mm_srli_epi32(color, 6), _mm_set1_epi32(0x03E0));
+		__m128i b = _mm_and_si128(_mm_srli_epi32(color, 9), _mm_set1_epi32(0x7C00));
+		__m128i a = _mm_and_si128(_mm_srli_epi32(color, 16), _mm_set1_epi32(0x8000));
+		StorePacked(dst + i, _mm_or_si128(_mm_or_si128(r, g), _mm_or_si128(b, a)));
+	}
+
+	for (; i < count; i++) {
+		uint32_t color = DitherPixel(src[i], dither, i);
+		dst[i] = (color >> 3 & 0x001F) | (color >> 6 & 0x03E0) | (color >> 9 & 0x7C00) | (color >> 16 & 0x8000);
+	}
+}
+
+void Encode4444(const uint32_t* src, uint16_t* dst, int count, const int8_t* dither) {
+	int i = 0;
+	for (; i + 4 <= count; i += 4) {
+		__m128i color = DitherPixels(_mm_loadu_si128(reinterpret_cast<const __m128i*>(src + i)), dither);
+		__m128i r = _mm_and_si128(_mm_srli_epi32(color, 4), _mm_set1_epi32(0x000F));
+		__m128i g = _mm_and_si128(_mm_srli_epi32(color, 8), _mm_set1_epi32(0x00F0));
+		__m128i b = _mm_and_si128(_mm_srli_epi32(color, 12), _mm_set1_epi32(0x0F00));
+		__m128i a = _mm_and_si128(_mm_srli_epi32(color, 16), _mm_set1_epi32(0xF000));
+		StorePacked(dst + i, _mm_or_si128(_mm_or_si128(r, g), _mm_or_si128(b, a)));
+	}
+
+	for (; i < count; i++) {
+		uint32_t color = DitherPixel(src[i], dither, i);
+		dst[i] = (color >> 4 & 0x000F) | (color >> 8 & 0x00F0) | (color >> 12 & 0x0F00) | (color >> 16 & 0xF000);
+	}
+}
+
+// Zero extends sixteen byte indices to 32 bits
+static void StoreIndices(uint32_t* dst, __m128i indices) {
+	const __m128i zero = _mm_setzero_si128();
+	__m128i lo = _mm_unpacklo_epi8(indices, zero);
+	__m128i hi = _mm_unpackhi_epi8(indices, zero);
+	_mm_storeu_si128(reinterpret_cast<__m128i*>(dst), _mm_unpacklo_epi16(lo, zero));
+	_mm_storeu_si128(reinterpret_cast<__m128i*>(dst + 4), _mm_unpackhi_epi16(lo, zero));
+	_mm_storeu_si128(reinterpret_cast<__m128i*>(dst + 8), _mm_unpacklo_epi16(hi, zero));
+	_mm_storeu_si128(reinterpret_cast<__m128i*>(dst + 12), _mm_unpackhi_epi16(hi, zero));
+}
+
+// The low nibble holds the left texel
+void ExpandIndex4(const uint8_t* src, uint32_t* dst, int count) {
+	const __m128i mask4 = _mm_set1_epi8(0xF);
+
+	int i = 0;
+	for (; i + 32 <= count; i += 32) {
+		__m128i packed = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + i / 2));
+		__m128i lo = _mm_and_si128(packed, mask4);
+		__m128i hi = _mm_and_si128(_mm_srli_epi16(packed, 4), mask4);
+		StoreIndices(dst + i, _mm_unpacklo_epi8(lo, hi));
+		StoreIndices(dst + i + 16, _mm_unpackhi_epi8(lo, hi));
+	}
+
+	for (; i < count; i++) {
+		dst[i] = src[i / 2] >> (i & 1) * 4 & 0xF;
+	}
+}
+
+void ExpandIndex8(const uint8_t* src, uint32_t* dst, int count) {
+	int i = 0;
+	for (; i + 16 <= count; i += 16) {
+		StoreIndices(dst + i, _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + i)));
+	}
+
+	for (; i < count; i++) {
+		dst[i] = src[i];
+	}
+}
+
+void ExpandIndex16(const uint16_t* src, uint32_t* dst, int count) {
+	const __m128i zero = _mm_setzero_si128();
+
+	int i = 0;
+	for (; i + 8 <= count; i += 8) {
+		__m128i indices = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + i));
+		_mm_storeu_si128(reinterpret_cast<__m128i*>(dst + i), _mm_unpacklo_epi16(indices, zero));
+		_mm_storeu_si128(reinterpret_cast<__m128i*>(dst + i + 4), _mm_unpackhi_epi16(indices, zero));
+	}
+
+	for (; i < count; i++) {
+		dst[i] = src[i];
+	}
+}
+
+void DecodeCLUT(const uint8_t* clut, uint8_t format, uint32_t* palette) {
+	auto clut16 = reinterpret_cast<const uint16_t*>(clut);
+	switch (format) {
+	case SCEGU_PF5650: Decode5650(clut16, palette, 512); break;
+	case SCEGU_PF5551: Decode5551(clut16, palette, 512); break;
+	case SCEGU_PF4444: Decode4444(clut16, palette, 512); break;
+	default:
+		memcpy(palette, clut, 256 * 4);
+		memset(palette + 256, 0, 256 * 4);
+		break;
+	}
+}
+
+// Index math runs four texels at a time, only the palette reads stay scalar since SSE2 has no gather
+void ResolveCLUT(const uint32_t* indices, const uint32_t* palette, uint32_t* dst, int count, uint8_t shift, uint8_t mask, uint32_t base) {
+	const __m128i shift_count = _mm_cvtsi32_si128(shift);
+	const __m128i mask_vector = _mm_set1_epi32(mask);
+	const __m128i base_vector = _mm_set1_epi32(base);
+
+	alignas(16) uint32_t resolved[4];
+	int i = 0;
+	for (; i + 4 <= count; i += 4) {
+		__m128i index = _mm_loadu_si128(reinterpret_cast<const __m128i*>(indices + i));
+		index = _mm_or_si128(_mm_and_si128(_mm_srl_epi32(index, shift_count), mask_vector), base_vector);
+		_mm_store_si128(reinterpret_cast<__m128i*>(resolved), index);
+		__m128i colors = _mm_setr_epi32(palette[resolved[0]], palette[resolved[1]], palette[resolved[2]], palette[resolved[3]]);
+		_mm_storeu_si128(reinterpret_cast<__m128i*>(dst + i), colors);
+	}
+
+	for (; i < count; i++) {
+		dst[i] = palette[((indices[i] >> shift) & mask) | base];
+	}
+}
+
+// Builds the four block colors at once, two per register in 16-bit lanes. Colors are stored as 565 with red on top
+static void DecodeDXTColors(const DXT1Block* block, uint32_t palette[4], bool skip_alpha) {
+	short alpha = skip_alpha ? 0 : 0xFF;
+	__m128i colors = _mm_setr_epi16(
+		block->color1 >> 8 & 0xF8, block->color1 >> 3 & 0xFC, block->color1 << 3 & 0xF8, alpha,
+		block->color2 >> 8 & 0xF8, block->color2 >> 3 & 0xFC, block->color2 << 3 & 0xF8, alpha
+	);
+	__m128i swapped = _mm_shuffle_epi32(colors, _MM_SHUFFLE(1, 0, 3, 2));
+
+	__m128i mixed;
+	if (block->color1 > block->color2) {
+		// 0x5556 / 0x10000 rounds up from a third, which is exact for sums up to 765
+		__m128i sums = _mm_add_epi16(_mm_add_epi16(colors, colors), swapped);
+		mixed = _mm_mulhi_epu16(sums, _mm_set1_epi16(0x5556));
+	} else {
+		mixed = _mm_move_epi64(_mm_srli_epi16(_mm_add_epi16(colors, swapped), 1));
+	}
+	_mm_storeu_si128(reinterpret_cast<__m128i*>(palette), _mm_packus_epi16(colors, mixed));
+}
+
+static __m128i LookupDXTLine(const uint32_t palette[4], uint8_t line) {
+	return _mm_setr_epi32(palette[line & 3], palette[line >> 2 & 3], palette[line >> 4 & 3], palette[line >> 6]);
+}
+
+void DecodeDXT1(const DXT1Block* block, uint32_t* dst, int stride) {
+	uint32_t palette[4];
+	DecodeDXTColors(block, palette, false);
+	for (int y = 0; y < 4; y++) {
+		_mm_storeu_si128(reinterpret_cast<__m128i*>(dst + y * stride), LookupDXTLine(palette, block->lines[y]));
+	}
+}
+
+void DecodeDXT3(const DXT3Block* block, uint32_t* dst, int stride) {
+	uint32_t palette[4];
+	DecodeDXTColors(&block->color, palette, true);
+	for (int y = 0; y < 4; y++) {
+		// 4-bit alpha lands in the top nibble of the alpha byte
+		int alpha_line = block->alpha_lines[y];
+		__m128i alpha = _mm_setr_epi32(alpha_line, alpha_line >> 4, alpha_line >> 8, alpha_line >> 12);
+		alpha = _mm_slli_epi32(alpha, 28);
+
+		__m128i color = LookupDXTLine(palette, block->color.lines[y]);
+		_mm_storeu_si128(reinterpret_cast<__m128i*>(dst + y * stride), _mm_or_si128(color, alpha));
+	}
+}
+
+void DecodeDXT5(const DXT5Block* block, uint32_t* dst, int stride) {
+	uint32_t palette[4];
+	DecodeDXTColors(&block->color, palette, true);
+
+	uint32_t alpha_table[8]{};
+	alpha_table[0] = block->alpha1;
+	alpha_table[1] = block->alpha2;
+	if (block->alpha1 > block->alpha2) {
+		for (int i = 2; i < 8; i++) {
+			int alpha1 = (block->alpha1 * ((7 - (i - 1)) << 8)) / 7;
+			int alpha2 = (block->alpha2 * ((i - 1) << 8)) / 7;
+			alpha_table[i] = (alpha1 + alpha2 + 31) >> 8;
+		}
+	} else {
+		for (int i = 2; i < 6; i++) {
+			int alpha1 = (block->alpha1 * ((5 - (i - 1)) << 8)) / 5;
+			int alpha2 = (block->alpha2 * ((i - 1) << 8)) / 5;
+			alpha_table[i] = (alpha1 + alpha2 + 31) >> 8;
+		}
+		alpha_table[6] = 0;
+		alpha_table[7] = 255;
+	}
+
+	// 3-bit alpha indices, 12 bits per line
+	uint64_t all_alpha = (static_cast<uint64_t>(block->alpha_data1) << 32) | block->alpha_data2;
+	for (int y = 0; y < 4; y++) {
+		uint32_t alpha_line = all_alpha >> (12 * y);
+		__m128i alpha = _mm_setr_epi32(
+			alpha_table[alpha_line & 7],
+			alpha_table[alpha_line >> 3 & 7],
+			alpha_table[alpha_line >> 6 & 7],
+			alpha_table[alpha_line >> 9 & 7]
+		);
+		alpha = _mm_slli_epi32(alpha, 24);
+
+		__m128i color = LookupDXTLine(palette, block->color.lines[y]);
+		_mm_storeu_si128(reinterpret_cast<__m128i*>(dst + y * stride), _mm_or_si128(color, alpha));
+	}
+}
+
+// Swizzled memory is a sequence of 16 byte x 8 row blocks, left to right and then top to bottom
+void UnswizzleTexture(const uint8_t* src, uint8_t* dst, uint32_t pitch, uint32_t height) {
+	uint32_t block_count_x = pitch / 16;
+	uint32_t block_count_y = (height + 7) / 8;
+
+	auto block = reinterpret_cast<const __m128i*>(src);
+	for (uint32_t by = 0; by < block_count_y; by++) {
+		uint8_t* block_row = dst + by * pitch * 8;
+		for (uint32_t bx = 0; bx < block_count_x; bx++) {
+			uint8_t* out = block_row + bx * 16;
+			for (int n = 0; n < 8; n++) {
+				_mm_storeu_si128(reinterpret_cast<__m128i*>(out + n * pitch), _mm_loadu_si128(block++));
+			}
+		}
+	}
+}
@@ -0,0 +1,49 @@
+#pragma once
+
+#include <cstdint>
+
+struct DXT1Block {
+	uint8_t lines[4];
+	uint16_t color1;
+	uint16_t color2;
+};
+
+struct DXT3Block {
+	DXT1Block color;
+	uint16_t alpha_lines[4];
+};
+
+struct DXT5Block {
+	DXT1Block color;
+	uint32_t alpha_data2;
+	uint16_t alpha_data1;
+	uint8_t alpha1;
+	uint8_t alpha2;
+};
+
+uint32_t GetTextureBits(uint8_t format);
+
+// Row converters, the output is always ABGR8888 or one 32-bit CLUT index per texel
+void Decode5650(const uint16_t* src, uint32_t* dst, int count);
+void Decode5551(const uint16_t* src, uint32_t* dst, int count);
+void Decode4444(const uint16_t* src, uint32_t* dst, int count);
+void ExpandIndex4(const uint8_t* src, uint32_t* dst, int count);
+void ExpandIndex8(const uint8_t* src, uint32_t* dst, int count);
+void ExpandIndex16(const uint16_t* src, uint32_t* dst, int count);
+
+// Packs ABGR8888 back into 16-bit framebuffer texels. Dither holds the offsets for four consecutive pixels or is null
+void Encode5650(const uint32_t* src, uint16_t* dst, int count, const int8_t* dither);
+void Encode5551(const uint32_t* src, uint16_t* dst, int count, const int8_t* dither);
+void Encode4444(const uint32_t* src, uint16_t* dst, int count, const int8_t* dither);
+
+// Converts a loaded CLUT to 512 ABGR8888 entries, 32-bit CLUTs only fill the first 256
+void DecodeCLUT(const uint8_t* clut, uint8_t format, uint32_t* palette);
+void ResolveCLUT(const uint32_t* indices, const uint32_t* palette, uint32_t* dst, int count, uint8_t shift, uint8_t mask, uint32_t base);
+
+// Decode one 4x4 block, stride is in texels
+void DecodeDXT1(const DXT1Block* block, uint32_t* dst, int stride);
+void DecodeDXT3(const DXT3Block* block, uint32_t* dst, int stride);
+void DecodeDXT5(const DXT5Block* block, uint32_t* dst, int stride);
+
+// Pitch is in bytes, dst has to hold the height rounded up to whole 8 row blocks
+void UnswizzleTexture(const uint8_t* src, uint8_t* dst, uint32_t pitch, uint32_t height);
@@ -0,0 +1,101 @@
+#include "workerpool.hpp"
+
+#include <algorithm>
+#include <atomic>
+
+WorkerPool::WorkerPool(int thread_count) {
+	// Leave one core to the emulation thread
+	if (thread_count <= 0) {
+		thread_count = std::max(static_cast<int>(std::thread::hardware_concurrency()) - 1, 1);
+	}
+
+	for (int i = 0; i < thread_count; i++) {
+		threads.emplace_back(&WorkerPool::WorkerLoop, this);
+	}
+}
+
+WorkerPool::~WorkerPool() {
+	{
+		std::lock_guard lock(mutex);
+		stopping = true;
+	}
+	condition.notify_all();
+
+	for (auto& thread : threads) {
+		thread.join();
+	}
+}
+
+// Spreads the indices over the pool and the calling thread, returns once every index has been processed
+void WorkerPool::ParallelFor(int count, const std::function<void(int)>& function) {
+	struct Loop {
+		std::function<void(int)> function;
+		int count;
+		std::atomic<int> next{ 0 };
+		std::atomic<int> done{ 0 };
+	};
+
+	// Helpers that only start after the loop is over find no index left, so they never touch the function
+	auto loop = std::make_shared<Loop>();
+	loop->function = function;
+	loop->count = count;
+	auto run = [loop] {
+		int index;
+		while ((index = loop->next.fetch_add(1)) < loop->count) {
+			loop->function(index);
+			if (loop->done.fetch_add(1) + 1 == loop->count) {
+				loop->done.notify_all();
+			}
+		}
+	};
+
+	int helper_count = std::min<int>(threads.size(), count - 1);
+	if (helper_count > 0) {
+		// Queued in front, the emulation thread is blocked on this while other jobs can wait
+		{
+			std::lock_guard lock(mutex);
+			for (int i = 0; i < helper_count; i++) {
+				jobs.push_front(run);
+			}
+		}
+		condition.notify_all();
+	}
+
+	run();
+
+	int done;
+	while ((done = loop->done.load()) < count) {
+		loop->done.wait(done);
+	}
+}
+
+void WorkerPool::Wait() {
+	std::unique_lock lock(mutex);
+	idle_condition.wait(lock, [this] { return jobs.empty() && active_jobs == 0; });
+}
+
+void WorkerPool::WorkerLoop() {
+	while (true) {
+		std::function<void()> job;
+		{
+			std::unique_lock lock(mutex);
+			condition.wait(lock, [this] { return stopping || !jobs.empty(); });
+			if (jobs.empty()) {
+				return;
+			}
+
+			job = std::move(jobs.front());
+			jobs.pop_front();
+			active_jobs++;
+		}
+		job();
+
+		{
+			std::lock_guard lock(mutex);
+			active_jobs--;
+			if (jobs.empty() && active_jobs == 0) {
+				idle_condition.notify_all();
+			}
+		}
+	}
+}
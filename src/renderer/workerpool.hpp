@@ -0,0 +1,43 @@
+#pragma once
+
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+class WorkerPool {
+public:
+	WorkerPool(int thread_count = 0);
+	~WorkerPool();
+
+	int GetThreadCount() const { return threads.size(); }
+	void ParallelFor(int count, const std::function<void(int)>& function);
+	// Blocks until every queued job has finished, owners call it before destroying what the jobs use
+	void Wait();
+
+	template <typename F>
+	std::future<std::invoke_result_t<F>> Submit(F&& function) {
+		auto task = std::make_shared<std::packaged_task<std::invoke_result_t<F>()>>(std::forward<F>(function));
+		auto future = task->get_future();
+		{
+			std::lock_guard lock(mutex);
+			jobs.push_back([task] { (*task)(); });
+		}
+		condition.notify_one();
+		return future;
+	}
+private:
+	void WorkerLoop();
+
+	std::vector<std::thread> threads;
+	std::deque<std::function<void()>> jobs;
+	std::mutex mutex;
+	std::condition_variable condition;
+	std::condition_variable idle_condition;
+	int active_jobs = 0;
+	bool stopping = false;
+};